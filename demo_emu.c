@@ -0,0 +1,361 @@
+// SPDX-License-Identifier: MIT or GPL-2.0-only
+
+/*
+ * Run one memory backed ublk target over ublksrv_emu, which stands in
+ * for ublk_drv, so the library datapath can be verified and measured
+ * without the kernel module.
+ *
+ * Data written is verified after being read back, then random 4k IO is
+ * run for the specified seconds and IOPS is reported.
+ */
+
+#include <config.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <getopt.h>
+#include <errno.h>
+#include <error.h>
+#include <string.h>
+#include <time.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "ublksrv.h"
+#include "ublksrv_utils.h"
+#include "ublksrv_emu.h"
+
+#define EMU_DEV_SIZE	(64ULL << 20)
+#define EMU_BS		4096
+
+struct demo_queue_info {
+	const struct ublksrv_dev *dev;
+	int qid;
+	pthread_t thread;
+};
+
+struct demo_rq {
+	char *buf;
+	unsigned long long sector;
+	unsigned op;
+	int res;
+};
+
+static char *mem_backing;
+static unsigned long long nr_done;
+static unsigned nr_inflight;
+static bool verify_failed;
+
+static void *demo_emu_io_handler_fn(void *data)
+{
+	struct demo_queue_info *info = (struct demo_queue_info *)data;
+	const struct ublksrv_queue *q;
+
+	q = ublksrv_queue_init(info->dev, info->qid, NULL);
+	if (!q) {
+		fprintf(stderr, "queue %d init failed\n", info->qid);
+		return NULL;
+	}
+
+	while (ublksrv_process_io(q) >= 0)
+		;
+
+	ublksrv_queue_deinit(q);
+	return NULL;
+}
+
+static int demo_emu_init_tgt(struct ublksrv_dev *dev, int type, int argc,
+		char *argv[])
+{
+	const struct ublksrv_ctrl_dev_info *info =
+		ublksrv_ctrl_get_dev_info(ublksrv_get_ctrl_dev(dev));
+
+	dev->tgt.dev_size = EMU_DEV_SIZE;
+	dev->tgt.tgt_ring_depth = info->queue_depth;
+	dev->tgt.nr_fds = 0;
+
+	return 0;
+}
+
+static int demo_emu_handle_io_async(const struct ublksrv_queue *q,
+		const struct ublk_io_data *data)
+{
+	const struct ublksrv_io_desc *iod = data->iod;
+	unsigned len = iod->nr_sectors << 9;
+	char *mem = mem_backing + (iod->start_sector << 9);
+	int fd = q->dev->tgt.fds[0];
+	bool user_copy = ublksrv_queue_state(q) & UBLKSRV_USER_COPY;
+	void *buf = ublksrv_queue_get_io_buf(q, data->tag);
+	int res = len;
+
+	switch (ublksrv_get_op(iod)) {
+	case UBLK_IO_OP_READ:
+		if (user_copy) {
+			if (pwrite(fd, mem, len, ublk_pos(q->q_id, data->tag, 0)) != len)
+				res = -EIO;
+		} else
+			memcpy(buf, mem, len);
+		break;
+	case UBLK_IO_OP_WRITE:
+		if (user_copy) {
+			if (pread(fd, mem, len, ublk_pos(q->q_id, data->tag, 0)) != len)
+				res = -EIO;
+		} else
+			memcpy(mem, buf, len);
+		break;
+	default:
+		res = -EINVAL;
+	}
+
+	ublksrv_complete_io(q, data->tag, res);
+
+	return 0;
+}
+
+static struct ublksrv_tgt_type demo_emu_tgt_type = {
+	.name	=  "demo_emu",
+	.init_tgt = demo_emu_init_tgt,
+	.handle_io_async = demo_emu_handle_io_async,
+};
+
+static void demo_emu_fill(char *buf, unsigned long long sector, unsigned len)
+{
+	unsigned i;
+
+	for (i = 0; i < len; i += sizeof(unsigned long long))
+		*(unsigned long long *)&buf[i] = sector + i;
+}
+
+static void demo_emu_done(struct ublksrv_emu *emu, int q_id, int tag,
+		int res, void *rq_data)
+{
+	struct demo_rq *rq = (struct demo_rq *)rq_data;
+
+	rq->res = res;
+	nr_done++;
+	nr_inflight--;
+
+	if (rq->op == UBLK_IO_OP_READ && res == EMU_BS) {
+		char expected[EMU_BS];
+
+		demo_emu_fill(expected, rq->sector, EMU_BS);
+		if (memcmp(expected, rq->buf, EMU_BS)) {
+			fprintf(stderr, "q %d tag %d sector %llu data mismatch\n",
+					q_id, tag, rq->sector);
+			verify_failed = true;
+		}
+	} else if (res != EMU_BS) {
+		fprintf(stderr, "q %d tag %d failed %d\n", q_id, tag, res);
+		verify_failed = true;
+	}
+	rq->op = -1U;
+}
+
+/* issue one request, and reap completions until it is accepted */
+static int demo_emu_issue(struct ublksrv_emu *emu, struct demo_rq *rq,
+		int q_id, unsigned op, unsigned long long sector)
+{
+	int ret;
+
+	rq->op = op;
+	rq->sector = sector;
+	if (op == UBLK_IO_OP_WRITE)
+		demo_emu_fill(rq->buf, sector, EMU_BS);
+
+	while ((ret = ublksrv_emu_queue_rq(emu, q_id, op, sector,
+					EMU_BS >> 9, rq->buf, rq)) == -EBUSY) {
+		ublksrv_emu_submit(emu);
+		if (ublksrv_emu_reap(emu, 100) < 0)
+			return -ENODEV;
+	}
+	if (ret >= 0)
+		nr_inflight++;
+	return ret < 0 ? ret : 0;
+}
+
+static void demo_emu_drain(struct ublksrv_emu *emu)
+{
+	ublksrv_emu_submit(emu);
+	while (nr_inflight)
+		ublksrv_emu_reap(emu, 100);
+}
+
+/* find one request slot which isn't inflight */
+static struct demo_rq *demo_emu_get_rq(struct ublksrv_emu *emu,
+		struct demo_rq *rqs, int nr_rqs)
+{
+	int i;
+
+	while (true) {
+		for (i = 0; i < nr_rqs; i++)
+			if (rqs[i].op == -1U)
+				return &rqs[i];
+		ublksrv_emu_submit(emu);
+		ublksrv_emu_reap(emu, 100);
+	}
+}
+
+static int demo_emu_run(struct ublksrv_emu *emu, int nr_queues, int depth,
+		int seconds)
+{
+	unsigned long long nr_sectors = EMU_DEV_SIZE >> 9;
+	unsigned long long sector, start_done;
+	int nr_rqs = nr_queues * depth;
+	struct demo_rq *rqs;
+	struct timespec start, now;
+	int i, q = 0, ret = 0;
+	double secs;
+
+	rqs = (struct demo_rq *)calloc(nr_rqs, sizeof(*rqs));
+	for (i = 0; i < nr_rqs; i++) {
+		rqs[i].buf = (char *)aligned_alloc(EMU_BS, EMU_BS);
+		rqs[i].op = -1U;
+	}
+
+	/* write the whole device, then read it back for verifying data */
+	for (sector = 0; sector < nr_sectors && !ret; sector += EMU_BS >> 9) {
+		ret = demo_emu_issue(emu, demo_emu_get_rq(emu, rqs, nr_rqs),
+				q, UBLK_IO_OP_WRITE, sector);
+		q = (q + 1) % nr_queues;
+	}
+	demo_emu_drain(emu);
+	for (sector = 0; sector < nr_sectors && !ret; sector += EMU_BS >> 9) {
+		ret = demo_emu_issue(emu, demo_emu_get_rq(emu, rqs, nr_rqs),
+				q, UBLK_IO_OP_READ, sector);
+		q = (q + 1) % nr_queues;
+	}
+	demo_emu_drain(emu);
+
+	if (ret || verify_failed) {
+		fprintf(stderr, "verify failed %d\n", ret);
+		ret = -EIO;
+		goto out;
+	}
+	printf("verify: %llu MB written and read back\n", EMU_DEV_SIZE >> 20);
+
+	start_done = nr_done;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	do {
+		for (i = 0; i < 256 && !ret; i++) {
+			sector = (random() % (nr_sectors / (EMU_BS >> 9))) *
+				(EMU_BS >> 9);
+			ret = demo_emu_issue(emu,
+					demo_emu_get_rq(emu, rqs, nr_rqs), q,
+					UBLK_IO_OP_READ, sector);
+			q = (q + 1) % nr_queues;
+		}
+		clock_gettime(CLOCK_MONOTONIC, &now);
+	} while (!ret && now.tv_sec - start.tv_sec < seconds);
+	demo_emu_drain(emu);
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	secs = (now.tv_sec - start.tv_sec) +
+		(now.tv_nsec - start.tv_nsec) / 1e9;
+	printf("randread: %llu ios in %.2fs, %.0f IOPS\n",
+			nr_done - start_done, secs,
+			(nr_done - start_done) / secs);
+	if (verify_failed)
+		ret = -EIO;
+out:
+	for (i = 0; i < nr_rqs; i++)
+		free(rqs[i].buf);
+	free(rqs);
+	return ret;
+}
+
+static void demo_emu_usage(const char *prog)
+{
+	printf("%s [-q nr_queues] [-d depth] [-t seconds] [--batch] "
+			"[--user_copy] [--need_get_data]\n", prog);
+}
+
+int main(int argc, char *argv[])
+{
+	struct ublksrv_dev_data data = {
+		.dev_id = -1,
+		.max_io_buf_bytes = DEF_BUF_SIZE,
+		.nr_hw_queues = 2,
+		.queue_depth = 64,
+		.tgt_type = "demo_emu",
+		.tgt_ops = &demo_emu_tgt_type,
+		.flags = 0,
+	};
+	static const struct option longopts[] = {
+		{ "queues",		1,	NULL, 'q' },
+		{ "depth",		1,	NULL, 'd' },
+		{ "time",		1,	NULL, 't' },
+		{ "batch",		0,	NULL, 'b' },
+		{ "user_copy",		0,	NULL, 'u' },
+		{ "need_get_data",	0,	NULL, 'g' },
+		{ "help",		0,	NULL, 'h' },
+		{ NULL }
+	};
+	struct demo_queue_info *info_array;
+	const struct ublksrv_dev *dev;
+	struct ublksrv_emu *emu;
+	int opt, i, ret, seconds = 2;
+
+	while ((opt = getopt_long(argc, argv, "q:d:t:bugh",
+				  longopts, NULL)) != -1) {
+		switch (opt) {
+		case 'q':
+			data.nr_hw_queues = strtol(optarg, NULL, 10);
+			break;
+		case 'd':
+			data.queue_depth = strtol(optarg, NULL, 10);
+			break;
+		case 't':
+			seconds = strtol(optarg, NULL, 10);
+			break;
+		case 'b':
+			data.flags |= UBLK_F_BATCH_IO;
+			break;
+		case 'u':
+			data.flags |= UBLK_F_USER_COPY;
+			break;
+		case 'g':
+			data.flags |= UBLK_F_NEED_GET_DATA;
+			break;
+		default:
+			demo_emu_usage(argv[0]);
+			return opt == 'h' ? EXIT_SUCCESS : EXIT_FAILURE;
+		}
+	}
+
+	mem_backing = (char *)calloc(1, EMU_DEV_SIZE);
+	if (!mem_backing)
+		error(EXIT_FAILURE, ENOMEM, "alloc backing memory");
+
+	emu = ublksrv_emu_init(&data, demo_emu_done);
+	if (!emu)
+		error(EXIT_FAILURE, ENODEV, "ublksrv_emu_init");
+
+	dev = ublksrv_dev_init(ublksrv_emu_get_ctrl_dev(emu));
+	if (!dev)
+		error(EXIT_FAILURE, ENODEV, "ublksrv_dev_init");
+
+	info_array = (struct demo_queue_info *)calloc(data.nr_hw_queues,
+			sizeof(struct demo_queue_info));
+	for (i = 0; i < data.nr_hw_queues; i++) {
+		info_array[i].dev = dev;
+		info_array[i].qid = i;
+		pthread_create(&info_array[i].thread, NULL,
+				demo_emu_io_handler_fn, &info_array[i]);
+	}
+
+	ret = demo_emu_run(emu, data.nr_hw_queues, data.queue_depth, seconds);
+
+	/* abort fetched commands, and wait until all queues are gone */
+	ublksrv_emu_stop(emu);
+	while (ublksrv_emu_reap(emu, 100) != -ENODEV)
+		;
+	for (i = 0; i < data.nr_hw_queues; i++)
+		pthread_join(info_array[i].thread, NULL);
+
+	ublksrv_dev_deinit(dev);
+	ublksrv_emu_deinit(emu);
+	free(info_array);
+	free(mem_backing);
+
+	return ret ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -16,6 +16,7 @@
 #include <sys/ioctl.h>
 #include <sys/types.h>
 #include <unistd.h>
+#include <time.h>
 
 #include <linux/falloc.h>
 
@@ -26,6 +27,18 @@
 static bool use_aio = 0;
 static int backing_fd = -1;
 
+/*
+ * In zero copy mode, low bits of user_data tag buffer register/unregister
+ * cqe of the request, and the request is completed after its buffer is
+ * unregistered.
+ */
+#define DEMO_ZC_UNREG	1UL
+#define DEMO_ZC_REG	2UL
+#define DEMO_ZC_MASK	(DEMO_ZC_UNREG | DEMO_ZC_REG)
+
+/* updated by aio context, and reported when the device is stopped */
+static unsigned long long nr_ios, nr_bytes;
+
 static struct ublksrv_aio_ctx *aio_ctx = NULL;
 static pthread_t io_thread;
 struct demo_queue_info {
@@ -71,6 +84,65 @@ static void queue_fallocate_async(struct io_uring_sqe *sqe,
 			req->io.nr_sectors << 9);
 }
 
+static bool demo_zc_rw(struct ublksrv_aio_ctx *ctx,
+		const struct ublksrv_aio *req)
+{
+	unsigned op = ublksrv_get_op(&req->io);
+
+	return ublksrv_aio_zero_copy(ctx) && req->fd >= 0 &&
+		(op == UBLK_IO_OP_READ || op == UBLK_IO_OP_WRITE);
+}
+
+static void demo_account_io(const struct ublksrv_aio *req)
+{
+	if (req->res > 0) {
+		nr_ios += 1;
+		nr_bytes += req->res;
+	}
+}
+
+/*
+ * register request pages to our ring, and unregister them after the
+ * fixed buffer IO is done, the unregister is hard linked, so it is run
+ * even though the IO fails
+ */
+static int queue_zc_rw_async(struct ublksrv_aio_ctx *ctx,
+		struct io_uring *ring, struct ublksrv_aio *req,
+		unsigned op)
+{
+	const struct ublksrv_io_desc *iod = &req->io;
+	unsigned buf_idx = ublksrv_aio_zc_buf_index(ctx, req);
+	struct io_uring_sqe *sqe[3];
+	int i;
+
+	if (io_uring_sq_space_left(ring) < 3) {
+		fprintf(stderr, "%s: uring run out of sqe\n", __func__);
+		return -ENOMEM;
+	}
+	for (i = 0; i < 3; i++)
+		sqe[i] = io_uring_get_sqe(ring);
+
+	ublksrv_aio_prep_buf_reg(ctx, sqe[0], req, true);
+	sqe[0]->flags |= IOSQE_CQE_SKIP_SUCCESS | IOSQE_IO_LINK;
+	io_uring_sqe_set_data64(sqe[0], (unsigned long)req | DEMO_ZC_REG);
+
+	if (op == UBLK_IO_OP_READ)
+		io_uring_prep_read_fixed(sqe[1], req->fd, NULL,
+				iod->nr_sectors << 9, iod->start_sector << 9,
+				buf_idx);
+	else
+		io_uring_prep_write_fixed(sqe[1], req->fd, NULL,
+				iod->nr_sectors << 9, iod->start_sector << 9,
+				buf_idx);
+	sqe[1]->flags |= IOSQE_IO_HARDLINK;
+	io_uring_sqe_set_data(sqe[1], req);
+
+	ublksrv_aio_prep_buf_reg(ctx, sqe[2], req, false);
+	io_uring_sqe_set_data64(sqe[2], (unsigned long)req | DEMO_ZC_UNREG);
+
+	return 0;
+}
+
 int async_io_submitter(struct ublksrv_aio_ctx *ctx,
 		struct ublksrv_aio *req)
 {
@@ -80,6 +152,9 @@ int async_io_submitter(struct ublksrv_aio_ctx *ctx,
 	unsigned op = ublksrv_get_op(iod);
 	struct io_uring_sqe *sqe;
 
+	if (demo_zc_rw(ctx, req))
+		return queue_zc_rw_async(ctx, ring, req, op);
+
 	sqe = io_uring_get_sqe(ring);
 	if (!sqe) {
 		fprintf(stderr, "%s: uring run out of sqe\n", __func__);
@@ -160,9 +235,14 @@ static int io_submit_worker(struct ublksrv_aio_ctx *ctx,
 	/* simulate null target */
 	if (req->fd < 0)
 		req->res = req->io.nr_sectors << 9;
-	else
-		return sync_io_submitter(ctx, req);
+	else {
+		int ret = sync_io_submitter(ctx, req);
+
+		if (ret < 0)
+			return ret;
+	}
 
+	demo_account_io(req);
 	return 1;
 }
 
@@ -194,14 +274,30 @@ static int reap_uring(struct ublksrv_aio_ctx *ctx, struct aio_list *list, int
 	int count = 0;
 
 	io_uring_for_each_cqe(r, head, cqe) {
-		if (cqe->user_data) {
-			struct ublksrv_aio *req = (struct ublksrv_aio *)
-				cqe->user_data;
-
+		unsigned long zc = cqe->user_data & DEMO_ZC_MASK;
+		struct ublksrv_aio *req = (struct ublksrv_aio *)
+			(cqe->user_data & ~DEMO_ZC_MASK);
+
+		if (zc == DEMO_ZC_REG) {
+			/* the linked IO is failed with -ECANCELED */
+			fprintf(stderr, "%s: register buffer of %x failed %d\n",
+					__func__, req->id, cqe->res);
+		} else if (zc == DEMO_ZC_UNREG) {
+			if (req->res == -EAGAIN)
+				async_io_submitter(ctx, req);
+			else {
+				demo_account_io(req);
+				aio_list_add(list, req);
+			}
+		} else if (req && demo_zc_rw(ctx, req)) {
+			/* completed after the buffer is unregistered */
+			req->res = cqe->res;
+		} else if (req) {
 			if (cqe->res == -EAGAIN)
 				async_io_submitter(ctx, req);
 			else {
 				req->res = cqe->res;
+				demo_account_io(req);
 				aio_list_add(list, req);
 			}
 		} else {
@@ -229,7 +325,9 @@ static void *demo_event_uring_io_handler_fn(void *data)
 	int ret;
 	int ctx_efd = ublksrv_aio_get_efd(ctx);
 
-	qd = info->queue_depth * info->nr_hw_queues * 2;
+	/* each zero copy IO takes register, rw and unregister sqes */
+	qd = info->queue_depth * info->nr_hw_queues *
+		(ublksrv_aio_zero_copy(ctx) ? 3 : 2);
 
 	io_uring_queue_init(qd, &ring, 0);
 	ret = io_uring_register_eventfd(&ring, ctx_efd);
@@ -239,10 +337,20 @@ static void *demo_event_uring_io_handler_fn(void *data)
 		return NULL;
 	}
 
+	if (ublksrv_aio_zero_copy(ctx)) {
+		ret = ublksrv_aio_register_zc_bufs(ctx, &ring);
+		if (ret) {
+			fprintf(stderr, "ublk dev %d fails to register buffers %d\n",
+					dev_id, ret);
+			return NULL;
+		}
+	}
+
 	ublksrv_aio_set_ctx_data(ctx, (void *)&ring);
 
-	fprintf(stdout, "ublk dev %d aio(io_uring submitter) context started tid %d\n",
-			dev_id, ublksrv_gettid());
+	fprintf(stdout, "ublk dev %d aio(io_uring submitter%s) context started tid %d\n",
+			dev_id, ublksrv_aio_zero_copy(ctx) ? ", zero copy" : "",
+			ublksrv_gettid());
 
 	queue_event(ctx);
 	io_uring_submit_and_wait(&ring, 0);
@@ -382,6 +490,8 @@ static int demo_event_io_handler(struct ublksrv_ctrl_dev *ctrl_dev)
 	const struct ublksrv_dev *dev;
 	struct demo_queue_info *info_array;
 	void *thread_ret;
+	struct timespec start, end;
+	double secs;
 
 	info_array = (struct demo_queue_info *)
 		calloc(sizeof(struct demo_queue_info), dinfo->nr_hw_queues);
@@ -427,6 +537,7 @@ static int demo_event_io_handler(struct ublksrv_ctrl_dev *ctrl_dev)
 
 	ublksrv_ctrl_get_info(ctrl_dev);
 	ublk_ctrl_dump(ctrl_dev);
+	clock_gettime(CLOCK_MONOTONIC, &start);
 
 	/* wait until we are terminated */
 	for (i = 0; i < dinfo->nr_hw_queues; i++) {
@@ -436,6 +547,13 @@ static int demo_event_io_handler(struct ublksrv_ctrl_dev *ctrl_dev)
 	pthread_join(io_thread, &thread_ret);
 	ublksrv_aio_ctx_deinit(aio_ctx);
 
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	secs = (end.tv_sec - start.tv_sec) +
+		(end.tv_nsec - start.tv_nsec) / 1e9;
+	fprintf(stdout, "dev %d: %llu ios, %llu MB in %.2fs, %.0f IOPS %.1f MB/s\n",
+			dev_id, nr_ios, nr_bytes >> 20, secs, nr_ios / secs,
+			(nr_bytes >> 20) / secs);
+
 fail:
 	ublksrv_dev_deinit(dev);
 
@@ -524,6 +642,7 @@ int main(int argc, char *argv[])
 		{ "need_get_data",	1,	NULL, 'g' },
 		{ "backing_file",	1,	NULL, 'f' },
 		{ "use_aio",		1,	NULL, 'a' },
+		{ "zero_copy",		0,	NULL, 'z' },
 		{ NULL }
 	};
 	struct ublksrv_dev_data data = {
@@ -537,9 +656,10 @@ int main(int argc, char *argv[])
 		.flags = 0,
 	};
 	struct ublksrv_ctrl_dev *dev;
+	bool zero_copy = false;
 	int ret, opt;
 
-	while ((opt = getopt_long(argc, argv, "f:ga",
+	while ((opt = getopt_long(argc, argv, "f:gaz",
 				  longopts, NULL)) != -1) {
 		switch (opt) {
 		case 'g':
@@ -553,12 +673,24 @@ int main(int argc, char *argv[])
 		case 'a':
 			use_aio = true;
 			break;
+		case 'z':
+			zero_copy = true;
+			break;
 		}
 	}
 
 	if (backing_fd < 0)
 		use_aio = false;
 
+	/* request buffer is registered to the io_uring of aio context */
+	if (zero_copy) {
+		if (!use_aio)
+			error(EXIT_FAILURE, EINVAL,
+				"zero copy requires --use_aio and --backing_file");
+		data.flags |= UBLK_F_SUPPORT_ZERO_COPY |
+			UBLK_F_BUF_REG_OFF_DAEMON;
+	}
+
 	if (signal(SIGTERM, sig_handler) == SIG_ERR)
 		error(EXIT_FAILURE, errno, "signal");
 	if (signal(SIGINT, sig_handler) == SIG_ERR)
@@ -0,0 +1,400 @@
+// SPDX-License-Identifier: MIT or GPL-2.0-only
+
+/*
+ * Minimal NBD server on unix socket for verifying the shared memory data
+ * plane of ublk-nbd(--shm)
+ *
+ * One file is exported, and each connection is served by one thread.
+ * NBD_OPT_UBLK_SHM is accepted unless --no_shm is given: the memfd
+ * passed with the option header is mapped, then data of READ & WRITE
+ * is transferred between the file and the memfd directly, and only
+ * request & reply headers go through the socket. Requests without the
+ * extension are served too, so one server covers both data paths.
+ */
+
+#include <config.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <getopt.h>
+#include <errno.h>
+#include <error.h>
+#include <string.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/un.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <linux/types.h>
+
+#include "cliserv.h"
+
+#define MAX_OPT_LEN	4096
+#define MAX_IO_LEN	(32U << 20)
+
+struct demo_nbd {
+	int fd;			/* exported file */
+	__u64 size;
+	bool no_shm;
+};
+
+struct demo_nbd_conn {
+	const struct demo_nbd *nbd;
+	int sock;
+	char *shm;
+	size_t shm_size;
+};
+
+static int demo_nbd_opt_reply(int sock, __u32 opt, __u32 type,
+		const void *data, __u32 len)
+{
+	struct {
+		__u64 magic;
+		__u32 opt;
+		__u32 type;
+		__u32 len;
+	} __attribute__((packed)) rep = {
+		htonll(rep_magic), htonl(opt), htonl(type), htonl(len),
+	};
+
+	if (writeit(sock, &rep, sizeof(rep)))
+		return -1;
+	return len ? writeit(sock, (void *)data, len) : 0;
+}
+
+/* option header is read by recvmsg(), so the memfd passed with it is got */
+static int demo_nbd_read_opt(int sock, __u32 *opt, __u32 *len, int *fd)
+{
+	struct {
+		__u64 magic;
+		__u32 opt;
+		__u32 len;
+	} __attribute__((packed)) hdr;
+	union {
+		char buf[CMSG_SPACE(sizeof(int))];
+		struct cmsghdr align;
+	} u;
+	struct iovec iov = { .iov_base = &hdr, .iov_len = sizeof(hdr) };
+	struct msghdr msg = {
+		.msg_iov = &iov,
+		.msg_iovlen = 1,
+		.msg_control = u.buf,
+		.msg_controllen = sizeof(u.buf),
+	};
+	struct cmsghdr *cmsg;
+	ssize_t ret;
+
+	*fd = -1;
+	ret = recvmsg(sock, &msg, MSG_WAITALL | MSG_CMSG_CLOEXEC);
+	if (ret != sizeof(hdr))
+		return -1;
+	for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg))
+		if (cmsg->cmsg_level == SOL_SOCKET &&
+				cmsg->cmsg_type == SCM_RIGHTS)
+			memcpy(fd, CMSG_DATA(cmsg), sizeof(int));
+
+	if (ntohll(hdr.magic) != opts_magic)
+		return -1;
+	*opt = ntohl(hdr.opt);
+	*len = ntohl(hdr.len);
+	return 0;
+}
+
+static __u32 demo_nbd_map_shm(struct demo_nbd_conn *c, const char *data,
+		__u32 len, int fd)
+{
+	struct nbd_shm_opt opt;
+	struct stat st;
+	size_t size;
+	void *base;
+
+	if (len != sizeof(opt) || fd < 0 || c->shm)
+		return NBD_REP_ERR_INVALID;
+	memcpy(&opt, data, sizeof(opt));
+	size = (size_t)ntohl(opt.nr_bufs) * ntohl(opt.buf_size);
+	if (ntohl(opt.flags) || !size || fstat(fd, &st) ||
+			(size_t)st.st_size < size)
+		return NBD_REP_ERR_INVALID;
+
+	base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (base == MAP_FAILED)
+		return NBD_REP_ERR_PLATFORM;
+	c->shm = base;
+	c->shm_size = size;
+	return NBD_REP_ACK;
+}
+
+/* return 1 if the transmission phase starts, 0 to go on, -1 on error */
+static int demo_nbd_handle_opt(struct demo_nbd_conn *c, bool no_zeroes)
+{
+	const __u16 tflags = NBD_FLAG_HAS_FLAGS | NBD_FLAG_SEND_FLUSH |
+		NBD_FLAG_SEND_FUA | NBD_FLAG_SEND_TRIM;
+	char data[MAX_OPT_LEN];
+	__u32 opt, len, type;
+	int fd, ret;
+
+	if (demo_nbd_read_opt(c->sock, &opt, &len, &fd))
+		return -1;
+	if (len > sizeof(data) || readit(c->sock, data, len)) {
+		if (fd >= 0)
+			close(fd);
+		return -1;
+	}
+
+	switch (opt) {
+	case NBD_OPT_UBLK_SHM:
+		type = c->nbd->no_shm ? NBD_REP_ERR_UNSUP :
+			demo_nbd_map_shm(c, data, len, fd);
+		ret = demo_nbd_opt_reply(c->sock, opt, type, NULL, 0);
+		break;
+	case NBD_OPT_EXPORT_NAME: {
+		char buf[10 + 124] = { 0 };
+		__u64 size = htonll(c->nbd->size);
+		__u16 flags = htons(tflags);
+
+		memcpy(buf, &size, sizeof(size));
+		memcpy(buf + 8, &flags, sizeof(flags));
+		ret = writeit(c->sock, buf, no_zeroes ? 10 : sizeof(buf));
+		ret = ret ? -1 : 1;
+		break;
+	}
+	case NBD_OPT_INFO:
+	case NBD_OPT_GO: {
+		char info[12];
+		__u16 itype = htons(NBD_INFO_EXPORT);
+		__u64 size = htonll(c->nbd->size);
+		__u16 flags = htons(tflags);
+
+		memcpy(info, &itype, 2);
+		memcpy(info + 2, &size, 8);
+		memcpy(info + 10, &flags, 2);
+		ret = demo_nbd_opt_reply(c->sock, opt, NBD_REP_INFO, info,
+				sizeof(info));
+		if (!ret)
+			ret = demo_nbd_opt_reply(c->sock, opt, NBD_REP_ACK,
+					NULL, 0);
+		if (!ret && opt == NBD_OPT_GO)
+			ret = 1;
+		break;
+	}
+	case NBD_OPT_ABORT:
+		demo_nbd_opt_reply(c->sock, opt, NBD_REP_ACK, NULL, 0);
+		ret = -1;
+		break;
+	default:
+		ret = demo_nbd_opt_reply(c->sock, opt, NBD_REP_ERR_UNSUP,
+				NULL, 0);
+		break;
+	}
+
+	/* memfd is mapped already, or isn't wanted */
+	if (fd >= 0)
+		close(fd);
+	return ret;
+}
+
+static int demo_nbd_handshake(struct demo_nbd_conn *c)
+{
+	char buf[18];
+	__u64 magic = htonll(opts_magic);
+	__u16 gflags = htons(NBD_FLAG_FIXED_NEWSTYLE | NBD_FLAG_NO_ZEROES);
+	__u32 cflags;
+	int ret;
+
+	memcpy(buf, INIT_PASSWD, 8);
+	memcpy(buf + 8, &magic, 8);
+	memcpy(buf + 16, &gflags, 2);
+	if (writeit(c->sock, buf, sizeof(buf)) ||
+			readit(c->sock, &cflags, sizeof(cflags)))
+		return -1;
+	cflags = ntohl(cflags);
+
+	do {
+		ret = demo_nbd_handle_opt(c, cflags & NBD_FLAG_C_NO_ZEROES);
+	} while (!ret);
+	return ret < 0 ? -1 : 0;
+}
+
+static int demo_nbd_do_io(struct demo_nbd_conn *c, __u32 type, __u64 from,
+		__u32 len, char *buf)
+{
+	__u32 cmd = type & NBD_CMD_MASK_COMMAND;
+	int fd = c->nbd->fd;
+
+	if (cmd != NBD_CMD_FLUSH && from + len > c->nbd->size)
+		return EINVAL;
+
+	switch (cmd) {
+	case NBD_CMD_READ:
+		return pread(fd, buf, len, from) == (ssize_t)len ? 0 : EIO;
+	case NBD_CMD_WRITE:
+		if (pwrite(fd, buf, len, from) != (ssize_t)len)
+			return EIO;
+		if ((type & NBD_CMD_FLAG_FUA) && fdatasync(fd))
+			return EIO;
+		return 0;
+	case NBD_CMD_FLUSH:
+		return fdatasync(fd) ? EIO : 0;
+	case NBD_CMD_TRIM:
+		fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+				from, len);
+		return 0;
+	default:
+		return EINVAL;
+	}
+}
+
+static void *demo_nbd_conn_fn(void *arg)
+{
+	struct demo_nbd_conn *c = arg;
+	char *io_buf = malloc(MAX_IO_LEN);
+	unsigned long nr_shm = 0, nr_copy = 0;
+
+	if (!io_buf || demo_nbd_handshake(c))
+		goto exit;
+
+	while (1) {
+		struct nbd_shm_request sreq;
+		struct nbd_request *req = &sreq.req;
+		struct nbd_reply rep = { .magic = htonl(NBD_REPLY_MAGIC) };
+		__u32 type, len, cmd;
+		__u64 from;
+		bool shm;
+		char *buf = io_buf;
+		int res;
+
+		if (readit(c->sock, req, sizeof(*req)))
+			break;
+		shm = ntohl(req->magic) == NBD_SHM_REQUEST_MAGIC;
+		if (!shm && ntohl(req->magic) != NBD_REQUEST_MAGIC)
+			break;
+		if (shm && (!c->shm || readit(c->sock, &sreq.offset,
+						sizeof(sreq.offset))))
+			break;
+
+		type = ntohl(req->type);
+		cmd = type & NBD_CMD_MASK_COMMAND;
+		from = ntohll(req->from);
+		len = ntohl(req->len);
+		memcpy(rep.handle, req->handle, sizeof(rep.handle));
+		if (cmd == NBD_CMD_DISC)
+			break;
+
+		if (cmd == NBD_CMD_READ || cmd == NBD_CMD_WRITE) {
+			__u64 off = shm ? ntohll(sreq.offset) : 0;
+
+			if (shm && off + len <= c->shm_size)
+				buf = c->shm + off;
+			else if (shm || len > MAX_IO_LEN)
+				break;
+		}
+
+		/* write data follows the request unless it is in memfd */
+		if (cmd == NBD_CMD_WRITE && !shm &&
+				readit(c->sock, buf, len))
+			break;
+
+		res = demo_nbd_do_io(c, type, from, len, buf);
+		rep.error = htonl(res);
+		if (writeit(c->sock, &rep, sizeof(rep)))
+			break;
+		if (cmd == NBD_CMD_READ && !shm && !res &&
+				writeit(c->sock, buf, len))
+			break;
+
+		if (cmd == NBD_CMD_READ || cmd == NBD_CMD_WRITE) {
+			if (shm)
+				nr_shm++;
+			else
+				nr_copy++;
+		}
+	}
+
+	printf("demo_nbd: connection done, %lu io via shm, %lu io via socket\n",
+			nr_shm, nr_copy);
+exit:
+	if (c->shm)
+		munmap(c->shm, c->shm_size);
+	close(c->sock);
+	free(io_buf);
+	free(c);
+	return NULL;
+}
+
+static void demo_nbd_usage(const char *prog)
+{
+	printf("%s --unix PATH --file FILE [--no_shm]\n", prog);
+}
+
+int main(int argc, char *argv[])
+{
+	static const struct option longopts[] = {
+		{ "unix",	1,	NULL, 'u' },
+		{ "file",	1,	NULL, 'f' },
+		{ "no_shm",	0,	NULL, 'n' },
+		{ "help",	0,	NULL, 'h' },
+		{ NULL }
+	};
+	struct demo_nbd nbd = { .fd = -1 };
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	const char *path = NULL, *file = NULL;
+	struct stat st;
+	int opt, lfd;
+
+	while ((opt = getopt_long(argc, argv, "u:f:nh", longopts, NULL)) != -1) {
+		switch (opt) {
+		case 'u':
+			path = optarg;
+			break;
+		case 'f':
+			file = optarg;
+			break;
+		case 'n':
+			nbd.no_shm = true;
+			break;
+		default:
+			demo_nbd_usage(argv[0]);
+			return opt == 'h' ? EXIT_SUCCESS : EXIT_FAILURE;
+		}
+	}
+	if (!path || !file || strlen(path) >= sizeof(addr.sun_path)) {
+		demo_nbd_usage(argv[0]);
+		return EXIT_FAILURE;
+	}
+	strcpy(addr.sun_path, path);
+
+	nbd.fd = open(file, O_RDWR | O_CLOEXEC);
+	if (nbd.fd < 0 || fstat(nbd.fd, &st))
+		error(EXIT_FAILURE, errno, "open %s", file);
+	nbd.size = st.st_size;
+
+	unlink(path);
+	lfd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (lfd < 0 || bind(lfd, (struct sockaddr *)&addr, sizeof(addr)) ||
+			listen(lfd, 16))
+		error(EXIT_FAILURE, errno, "listen on %s", path);
+
+	while (1) {
+		struct demo_nbd_conn *c;
+		pthread_t thread;
+		int sock = accept4(lfd, NULL, NULL, SOCK_CLOEXEC);
+
+		if (sock < 0) {
+			if (errno == EINTR)
+				continue;
+			error(EXIT_FAILURE, errno, "accept");
+		}
+		c = calloc(1, sizeof(*c));
+		if (!c)
+			error(EXIT_FAILURE, ENOMEM, "alloc connection");
+		c->nbd = &nbd;
+		c->sock = sock;
+		if (pthread_create(&thread, NULL, demo_nbd_conn_fn, c))
+			error(EXIT_FAILURE, errno, "create thread");
+		pthread_detach(thread);
+	}
+	return 0;
+}
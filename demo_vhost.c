@@ -0,0 +1,404 @@
+// SPDX-License-Identifier: MIT or GPL-2.0-only
+
+/*
+ * Minimal vhost-user-blk frontend for verifying 'ublk.TYPE vhost'
+ *
+ * It plays the role of QEMU plus guest driver: guest memory is one
+ * memfd shared with the server, one split virtqueue is set up in it,
+ * then the specified range is written and read back for verifying data.
+ * Each request carries its data in two descriptors, so scattered guest
+ * buffers are covered too.
+ */
+
+#include <config.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <getopt.h>
+#include <errno.h>
+#include <error.h>
+#include <string.h>
+#include <poll.h>
+#include <unistd.h>
+#include <endian.h>
+#include <sys/un.h>
+#include <sys/mman.h>
+#include <sys/eventfd.h>
+#include <linux/virtio_config.h>
+#include <linux/virtio_blk.h>
+
+#include "vhost_user.h"
+
+#define VRING_NUM	128
+#define NR_DESC_PER_RQ	4		/* outhdr, 2 data, status */
+#define BATCH		(VRING_NUM / NR_DESC_PER_RQ)
+#define BS		4096
+
+/* guest memory: vring, then outhdr & status, then data buffers */
+#define DESC_OFF	0
+#define AVAIL_OFF	(DESC_OFF + VRING_NUM * sizeof(struct vhost_vring_desc))
+#define USED_OFF	4096
+#define HDR_OFF		(2 * 4096)
+#define STATUS_OFF	(HDR_OFF + BATCH * sizeof(struct virtio_blk_outhdr))
+#define DATA_OFF	(4 * 4096)
+#define MEM_SIZE	(DATA_OFF + BATCH * BS)
+
+struct demo_vhost {
+	int sock;
+	int mem_fd;
+	int kick_fd;
+	int call_fd;
+	char *mem;
+	__u16 avail_idx;
+	__u16 used_idx;
+	__u64 features;
+	struct virtio_blk_config config;
+};
+
+static int demo_vhost_call(struct demo_vhost *d, __u32 request,
+		struct vhost_user_msg *msg, int *fds, int nr_fds, bool reply)
+{
+	int nr = 0, ret;
+
+	msg->request = request;
+	msg->flags = VHOST_USER_VERSION;
+	ret = vhost_user_send(d->sock, msg, fds, nr_fds);
+	if (ret || !reply)
+		return ret;
+
+	ret = vhost_user_recv(d->sock, msg, NULL, &nr);
+	if (ret)
+		return ret;
+	if (msg->request != request || !(msg->flags & VHOST_USER_REPLY_MASK))
+		return -EPROTO;
+	return 0;
+}
+
+static int demo_vhost_u64(struct demo_vhost *d, __u32 request, __u64 val,
+		int *fds, int nr_fds)
+{
+	struct vhost_user_msg msg = {
+		.size = sizeof(__u64),
+		.payload = { .u64 = val },
+	};
+
+	return demo_vhost_call(d, request, &msg, fds, nr_fds, false);
+}
+
+static int demo_vhost_state(struct demo_vhost *d, __u32 request, __u32 num)
+{
+	struct vhost_user_msg msg = {
+		.size = sizeof(struct vhost_user_vring_state),
+		.payload = { .state = { .index = 0, .num = num } },
+	};
+
+	return demo_vhost_call(d, request, &msg, NULL, 0, false);
+}
+
+static int demo_vhost_setup(struct demo_vhost *d)
+{
+	struct vhost_user_msg msg = { 0 };
+	int fds[1], ret;
+	__u64 want = (1ULL << VIRTIO_F_VERSION_1) |
+		(1ULL << VHOST_USER_F_PROTOCOL_FEATURES) |
+		(1ULL << VIRTIO_BLK_F_FLUSH) | (1ULL << VIRTIO_BLK_F_BLK_SIZE);
+
+	ret = demo_vhost_call(d, VHOST_USER_GET_FEATURES, &msg, NULL, 0, true);
+	if (ret)
+		return ret;
+	d->features = msg.payload.u64 & want;
+	if (!(d->features & (1ULL << VHOST_USER_F_PROTOCOL_FEATURES)))
+		return -EPROTO;
+
+	ret = demo_vhost_u64(d, VHOST_USER_SET_FEATURES, d->features, NULL, 0);
+	if (!ret)
+		ret = demo_vhost_call(d, VHOST_USER_GET_PROTOCOL_FEATURES, &msg,
+				NULL, 0, true);
+	if (ret)
+		return ret;
+	if (!(msg.payload.u64 & (1ULL << VHOST_USER_PROTOCOL_F_CONFIG)))
+		return -EPROTO;
+	ret = demo_vhost_u64(d, VHOST_USER_SET_PROTOCOL_FEATURES,
+			(1ULL << VHOST_USER_PROTOCOL_F_CONFIG), NULL, 0);
+	if (ret)
+		return ret;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.size = offsetof(struct vhost_user_config, region) +
+		sizeof(d->config);
+	msg.payload.config.size = sizeof(d->config);
+	ret = demo_vhost_call(d, VHOST_USER_GET_CONFIG, &msg, NULL, 0, true);
+	if (ret)
+		return ret;
+	if (msg.payload.config.size != sizeof(d->config))
+		return -EPROTO;
+	memcpy(&d->config, msg.payload.config.region, sizeof(d->config));
+
+	ret = demo_vhost_u64(d, VHOST_USER_SET_OWNER, 0, NULL, 0);
+	if (ret)
+		return ret;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.size = sizeof(struct vhost_user_memory);
+	msg.payload.memory.nregions = 1;
+	msg.payload.memory.regions[0].guest_phys_addr = 0;
+	msg.payload.memory.regions[0].memory_size = MEM_SIZE;
+	msg.payload.memory.regions[0].userspace_addr = (unsigned long)d->mem;
+	msg.payload.memory.regions[0].mmap_offset = 0;
+	fds[0] = d->mem_fd;
+	ret = demo_vhost_call(d, VHOST_USER_SET_MEM_TABLE, &msg, fds, 1, false);
+	if (!ret)
+		ret = demo_vhost_state(d, VHOST_USER_SET_VRING_NUM, VRING_NUM);
+	if (!ret)
+		ret = demo_vhost_state(d, VHOST_USER_SET_VRING_BASE, 0);
+	if (ret)
+		return ret;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.size = sizeof(struct vhost_user_vring_addr);
+	msg.payload.addr.desc_user_addr = (unsigned long)d->mem + DESC_OFF;
+	msg.payload.addr.avail_user_addr = (unsigned long)d->mem + AVAIL_OFF;
+	msg.payload.addr.used_user_addr = (unsigned long)d->mem + USED_OFF;
+	ret = demo_vhost_call(d, VHOST_USER_SET_VRING_ADDR, &msg, NULL, 0,
+			false);
+	if (ret)
+		return ret;
+
+	fds[0] = d->call_fd;
+	ret = demo_vhost_u64(d, VHOST_USER_SET_VRING_CALL, 0, fds, 1);
+	if (ret)
+		return ret;
+	fds[0] = d->kick_fd;
+	ret = demo_vhost_u64(d, VHOST_USER_SET_VRING_KICK, 0, fds, 1);
+	if (!ret)
+		ret = demo_vhost_state(d, VHOST_USER_SET_VRING_ENABLE, 1);
+	return ret;
+}
+
+static void demo_vhost_fill(char *buf, unsigned long long sector, unsigned len)
+{
+	unsigned i;
+
+	for (i = 0; i < len; i += sizeof(unsigned long long))
+		*(unsigned long long *)&buf[i] = sector + i;
+}
+
+/* queue request 'i' of this batch */
+static void demo_vhost_queue(struct demo_vhost *d, int i, __u32 type,
+		unsigned long long sector, unsigned len)
+{
+	struct vhost_vring_desc *desc = (struct vhost_vring_desc *)
+		(d->mem + DESC_OFF);
+	struct vhost_vring_avail *avail = (struct vhost_vring_avail *)
+		(d->mem + AVAIL_OFF);
+	struct virtio_blk_outhdr *hdr = (struct virtio_blk_outhdr *)
+		(d->mem + HDR_OFF) + i;
+	unsigned head = i * NR_DESC_PER_RQ;
+	__u16 data_flags = type == VIRTIO_BLK_T_IN ?
+		VHOST_VRING_DESC_F_WRITE : 0;
+	__u64 data = DATA_OFF + (__u64)i * BS;
+
+	hdr->type = htole32(type);
+	hdr->ioprio = 0;
+	hdr->sector = htole64(sector);
+	d->mem[STATUS_OFF + i] = 0xff;
+
+	desc[head].addr = htole64(HDR_OFF + i * sizeof(*hdr));
+	desc[head].len = htole32(sizeof(*hdr));
+	desc[head].flags = htole16(VHOST_VRING_DESC_F_NEXT);
+	desc[head].next = htole16(head + 1);
+
+	desc[head + 1].addr = htole64(data);
+	desc[head + 1].len = htole32(len / 2);
+	desc[head + 1].flags = htole16(data_flags | VHOST_VRING_DESC_F_NEXT);
+	desc[head + 1].next = htole16(head + 2);
+
+	desc[head + 2].addr = htole64(data + len / 2);
+	desc[head + 2].len = htole32(len - len / 2);
+	desc[head + 2].flags = htole16(data_flags | VHOST_VRING_DESC_F_NEXT);
+	desc[head + 2].next = htole16(head + 3);
+
+	desc[head + 3].addr = htole64(STATUS_OFF + i);
+	desc[head + 3].len = htole32(1);
+	desc[head + 3].flags = htole16(VHOST_VRING_DESC_F_WRITE);
+
+	avail->ring[d->avail_idx % VRING_NUM] = htole16(head);
+	d->avail_idx++;
+}
+
+/* publish queued requests, and wait until 'nr' of them are completed */
+static int demo_vhost_run(struct demo_vhost *d, int nr)
+{
+	struct vhost_vring_avail *avail = (struct vhost_vring_avail *)
+		(d->mem + AVAIL_OFF);
+	struct vhost_vring_used *used = (struct vhost_vring_used *)
+		(d->mem + USED_OFF);
+	struct pollfd pfd = { .fd = d->call_fd, .events = POLLIN };
+	eventfd_t v;
+
+	__atomic_store_n(&avail->idx, htole16(d->avail_idx), __ATOMIC_RELEASE);
+	eventfd_write(d->kick_fd, 1);
+
+	while (nr) {
+		__u16 idx = le16toh(__atomic_load_n(&used->idx,
+					__ATOMIC_ACQUIRE));
+
+		if (idx == d->used_idx) {
+			if (poll(&pfd, 1, 5000) <= 0)
+				return -ETIMEDOUT;
+			eventfd_read(d->call_fd, &v);
+			continue;
+		}
+		while (d->used_idx != idx && nr) {
+			struct vhost_vring_used_elem *e =
+				&used->ring[d->used_idx % VRING_NUM];
+			unsigned i = le32toh(e->id) / NR_DESC_PER_RQ;
+
+			if (d->mem[STATUS_OFF + i] != VIRTIO_BLK_S_OK) {
+				fprintf(stderr, "request %u failed, status %d\n",
+						i, d->mem[STATUS_OFF + i]);
+				return -EIO;
+			}
+			d->used_idx++;
+			nr--;
+		}
+	}
+	return 0;
+}
+
+static int demo_vhost_verify(struct demo_vhost *d, unsigned long long bytes)
+{
+	unsigned long long nr_sectors = bytes >> 9, sector;
+	char expected[BS];
+	int i, n, ret;
+
+	for (sector = 0; sector < nr_sectors; sector += n * (BS >> 9)) {
+		for (n = 0; n < BATCH && sector + n * (BS >> 9) < nr_sectors; n++) {
+			unsigned long long s = sector + n * (BS >> 9);
+
+			demo_vhost_fill(d->mem + DATA_OFF + n * BS, s, BS);
+			demo_vhost_queue(d, n, VIRTIO_BLK_T_OUT, s, BS);
+		}
+		ret = demo_vhost_run(d, n);
+		if (ret)
+			return ret;
+	}
+
+	if (d->features & (1ULL << VIRTIO_BLK_F_FLUSH)) {
+		demo_vhost_queue(d, 0, VIRTIO_BLK_T_FLUSH, 0, 0);
+		ret = demo_vhost_run(d, 1);
+		if (ret)
+			return ret;
+	}
+
+	for (sector = 0; sector < nr_sectors; sector += n * (BS >> 9)) {
+		for (n = 0; n < BATCH && sector + n * (BS >> 9) < nr_sectors; n++) {
+			memset(d->mem + DATA_OFF + n * BS, 0, BS);
+			demo_vhost_queue(d, n, VIRTIO_BLK_T_IN,
+					sector + n * (BS >> 9), BS);
+		}
+		ret = demo_vhost_run(d, n);
+		if (ret)
+			return ret;
+
+		for (i = 0; i < n; i++) {
+			unsigned long long s = sector + i * (BS >> 9);
+
+			demo_vhost_fill(expected, s, BS);
+			if (memcmp(expected, d->mem + DATA_OFF + i * BS, BS)) {
+				fprintf(stderr, "sector %llu data mismatch\n", s);
+				return -EIO;
+			}
+		}
+	}
+	return 0;
+}
+
+static void demo_vhost_usage(const char *prog)
+{
+	printf("%s --socket PATH [--size MB]\n", prog);
+}
+
+int main(int argc, char *argv[])
+{
+	static const struct option longopts[] = {
+		{ "socket",	1,	NULL, 's' },
+		{ "size",	1,	NULL, 'S' },
+		{ "help",	0,	NULL, 'h' },
+		{ NULL }
+	};
+	struct demo_vhost d = { .sock = -1 };
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	unsigned long long bytes = 16ULL << 20, capacity;
+	struct vhost_user_msg msg = { 0 };
+	const char *path = NULL;
+	int opt, ret;
+
+	while ((opt = getopt_long(argc, argv, "s:S:h", longopts, NULL)) != -1) {
+		switch (opt) {
+		case 's':
+			path = optarg;
+			break;
+		case 'S':
+			bytes = strtoull(optarg, NULL, 10) << 20;
+			break;
+		default:
+			demo_vhost_usage(argv[0]);
+			return opt == 'h' ? EXIT_SUCCESS : EXIT_FAILURE;
+		}
+	}
+	if (!path || strlen(path) >= sizeof(addr.sun_path)) {
+		demo_vhost_usage(argv[0]);
+		return EXIT_FAILURE;
+	}
+	strcpy(addr.sun_path, path);
+
+	d.mem_fd = memfd_create("demo_vhost", MFD_CLOEXEC);
+	if (d.mem_fd < 0 || ftruncate(d.mem_fd, MEM_SIZE))
+		error(EXIT_FAILURE, errno, "memfd");
+	d.mem = mmap(NULL, MEM_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED,
+			d.mem_fd, 0);
+	if (d.mem == MAP_FAILED)
+		error(EXIT_FAILURE, errno, "mmap guest memory");
+	d.kick_fd = eventfd(0, EFD_CLOEXEC);
+	d.call_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (d.kick_fd < 0 || d.call_fd < 0)
+		error(EXIT_FAILURE, errno, "eventfd");
+
+	d.sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (d.sock < 0 || connect(d.sock, (struct sockaddr *)&addr,
+				sizeof(addr)) < 0)
+		error(EXIT_FAILURE, errno, "connect %s", path);
+
+	ret = demo_vhost_setup(&d);
+	if (ret)
+		error(EXIT_FAILURE, -ret, "vhost-user setup");
+
+	capacity = le64toh(d.config.capacity) << 9;
+	if (bytes > capacity)
+		bytes = capacity;
+	bytes &= ~(unsigned long long)(BS - 1);
+	printf("vhost: capacity %llu MB, num_queues %u\n", capacity >> 20,
+			le16toh(d.config.num_queues));
+
+	ret = demo_vhost_verify(&d, bytes);
+	if (!ret)
+		printf("verify: %llu MB written and read back\n", bytes >> 20);
+	else
+		fprintf(stderr, "verify failed %d\n", ret);
+
+	/* stop the vring, and the server drains it before replying */
+	msg.size = sizeof(struct vhost_user_vring_state);
+	if (demo_vhost_call(&d, VHOST_USER_GET_VRING_BASE, &msg, NULL, 0, true))
+		ret = -EPROTO;
+	else if (msg.payload.state.num != d.avail_idx)
+		ret = -EPROTO;
+
+	close(d.sock);
+	munmap(d.mem, MEM_SIZE);
+	close(d.mem_fd);
+	close(d.kick_fd);
+	close(d.call_fd);
+
+	return ret ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -46,6 +46,21 @@ extern "C" {
  */
 #define UBLKSRV_F_NEED_POLL		(1UL << 2)
 
+/*
+ * Sample cycles spent in each phase of ublksrv_process_io() per IO, see
+ * ublksrv_dev_get_queue_prof()
+ */
+#define UBLKSRV_F_CPU_PROF		(1UL << 3)
+
+/*
+ * Throughput mode: under load, the queue waits a bit for more cqes before
+ * handling them, so that one io_uring_enter() covers more IOs. How many
+ * cqes to wait for grows with load and falls back to 1 when load drops,
+ * and the extra wait is capped by UBLKSRV_WAIT_BATCH_USEC.
+ */
+#define UBLKSRV_F_WAIT_BATCH		(1UL << 4)
+#define UBLKSRV_WAIT_BATCH_USEC		50
+
 struct io_uring;
 struct io_uring_cqe;
 struct ublksrv_aio_ctx;
@@ -100,6 +115,43 @@ struct ublk_io_data {
 #define UBLKSRV_AUTO_ZC 	(1U << 5)
 #define UBLKSRV_QUEUE_POLL	(1U << 6)
 #define UBLKSRV_QUEUE_BATCH_IO	(1U << 7)
+#define UBLKSRV_QUEUE_WAIT_BATCH	(1U << 8)
+
+/* phases of ublksrv_process_io() accounted by UBLKSRV_F_CPU_PROF */
+enum ublksrv_prof_phase {
+	/* submit sqes and wait for cqes in io_uring_enter(), idle included */
+	UBLKSRV_PROF_SUBMIT_WAIT,
+	/* walk CQ ring and notify aio contexts */
+	UBLKSRV_PROF_REAP,
+	/* library's handling of each cqe, target callbacks excluded */
+	UBLKSRV_PROF_DISPATCH,
+	/* ->handle_io_async(), ->tgt_io_done() and ->handle_event() */
+	UBLKSRV_PROF_TARGET,
+	/* ->handle_io_background() */
+	UBLKSRV_PROF_BACKGROUND,
+	UBLKSRV_PROF_NR_PHASES,
+};
+
+/**
+ * Per-queue cycles accounting, enabled by UBLKSRV_F_CPU_PROF
+ *
+ * Only one of every 2^UBLKSRV_PROF_SAMPLE_SHIFT ublksrv_process_io() calls
+ * is sampled, so cycles per IO of each phase is cycles[phase] / nr_ios.
+ * Cycles are read from TSC on x86, and they are nanoseconds on other
+ * architectures.
+ */
+struct ublksrv_queue_prof {
+	/** how many ublksrv_process_io() calls are sampled */
+	unsigned long long nr_loops;
+
+	/** how many ios are handled in sampled calls */
+	unsigned long long nr_ios;
+
+	/** cycles spent in each phase of sampled calls */
+	unsigned long long cycles[UBLKSRV_PROF_NR_PHASES];
+} __attribute__((aligned(64)));
+
+#define UBLKSRV_PROF_SAMPLE_SHIFT	4
 
 /**
  * ublksrv_queue is 1:1 mapping with ublk driver's blk-mq queue, and
@@ -175,7 +227,20 @@ struct ublksrv_tgt_info {
 	 */
 	unsigned int iowq_max_workers[2];
 
-	unsigned long reserved[4];
+	/**
+	 * bytes of integrity buffer for each io, target has to set it
+	 * before queues are setup if UBLK_F_INTEGRITY is enabled
+	 */
+	unsigned long integrity_buf_size;
+
+	/**
+	 * extra io_uring setup flags of queue ring, such as
+	 * IORING_SETUP_SQE128 | IORING_SETUP_CQE32 for NVMe passthrough
+	 * uring_cmd on target io
+	 */
+	unsigned long ring_flags;
+
+	unsigned long reserved[2];
 };
 
 /**
@@ -341,7 +406,17 @@ struct ublksrv_tgt_type {
 	/** deinit queue data, counter pair of ->init_queue */
 	void (*deinit_queue)(const struct ublksrv_queue *);
 
-	unsigned long reserved[5];
+	/**
+	 * data path flags(UBLK_F_SUPPORT_ZERO_COPY, UBLK_F_AUTO_BUF_REG,
+	 * UBLK_F_USER_COPY and UBLK_F_BATCH_IO) supported by this target,
+	 * `--datapath=auto` only picks flags from this mask.
+	 *
+	 * Optional, copy mode is always supported. These flags are below
+	 * bit 32, so one reserved slot is enough on 32-bit too.
+	 */
+	unsigned long datapath_flags;
+
+	unsigned long reserved[4];
 };
 
 /*
@@ -396,6 +471,12 @@ static inline __u64 ublk_pos(__u16 q_id, __u16 tag, __u32 offset)
 		(((__u64)tag) << UBLK_TAG_OFF) | (__u64)offset);
 }
 
+/* position for copying integrity data of the io from/to /dev/ublkcN */
+static inline __u64 ublk_integrity_pos(__u16 q_id, __u16 tag, __u32 offset)
+{
+	return ublk_pos(q_id, tag, offset) | UBLKSRV_IO_INTEGRITY_FLAG;
+}
+
 /**
  * \defgroup ctrl_dev control device API
  *
@@ -470,6 +551,21 @@ extern int ublksrv_ctrl_del_dev_async(struct ublksrv_ctrl_dev *dev);
  */
 extern int ublksrv_ctrl_get_info(struct ublksrv_ctrl_dev *dev);
 
+/**
+ * Retrieve ublk device info for many devices concurrently
+ *
+ * All commands are issued through the io_uring of devs[0], so only that
+ * ring is used; the others just provide the device id & flags.
+ *
+ * @param devs array of ublksrv control device instances
+ * @param nr number of devices in the array
+ * @param res per-device result, same meaning as ublksrv_ctrl_get_info()
+ * @return 0 if every command was issued, -errno otherwise, and then
+ * devices which aren't completed have -EAGAIN in @res
+ */
+extern int ublksrv_ctrl_get_info_batch(struct ublksrv_ctrl_dev *devs[],
+		int nr, int res[]);
+
 /**
  * Stop the specified ublk device by sending command to ublk control device
  *
@@ -808,6 +904,28 @@ extern int ublk_json_write_queue_info(const struct ublksrv_ctrl_dev *dev,
 extern int ublksrv_json_read_queue_info(const char *jbuf, int qid,
 		unsigned *tid, char *affinity_buf, int len);
 
+/**
+ * Serialize cycles accounting of one queue to json buffer
+ *
+ * @param dev the ublksrv control device instance
+ * @param qid queue id
+ * @param prof counters retrieved by ublksrv_dev_get_queue_prof()
+ */
+extern int ublk_json_write_queue_prof(const struct ublksrv_ctrl_dev *dev,
+		unsigned int qid, const struct ublksrv_queue_prof *prof);
+
+/**
+ * Deserialize cycles accounting of one queue from json buffer
+ *
+ * Return -ENOENT if the queue isn't profiled.
+ *
+ * @param jbuf json buffer
+ * @param qid queue id
+ * @param prof for storing the parsed counters
+ */
+extern int ublksrv_json_read_queue_prof(const char *jbuf, int qid,
+		struct ublksrv_queue_prof *prof);
+
 /**
  * Deserialize json buffer to target data
  *
@@ -1072,6 +1190,19 @@ extern const struct ublk_io_data *ublksrv_queue_get_io_data(
  */
 extern void *ublksrv_queue_get_io_buf(const struct ublksrv_queue *q, int tag);
 
+/**
+ * Return pre-allocated integrity buffer
+ *
+ * The buffer is allocated only if UBLK_F_INTEGRITY is enabled and
+ * target sets ublksrv_tgt_info.integrity_buf_size.
+ *
+ * @param q the ublksrv queue instance
+ * @param tag tag for this io
+ * @return pre-allocated integrity buffer for this io
+ */
+extern void *ublksrv_queue_get_integrity_buf(const struct ublksrv_queue *q,
+		int tag);
+
 /**
  * Return current queue state
  *
@@ -1131,6 +1262,27 @@ extern int ublksrv_queue_unconsumed_cqes(const struct ublksrv_queue *q);
 extern int ublksrv_queue_handled_event(const struct ublksrv_queue *q);
 extern int ublksrv_queue_send_event(const struct ublksrv_queue *q);
 
+/**
+ * Retrieve cycles accounting of one queue
+ *
+ * Return -EINVAL if UBLKSRV_F_CPU_PROF isn't set. It is fine to call it
+ * from any context, even after the queue is deinitialized, and the
+ * returned counters may be a bit stale.
+ *
+ * @param dev the ublksrv device instance
+ * @param q_id queue id
+ * @param prof for storing the retrieved counters
+ */
+extern int ublksrv_dev_get_queue_prof(const struct ublksrv_dev *dev, int q_id,
+		struct ublksrv_queue_prof *prof);
+
+/**
+ * Return name of one phase in struct ublksrv_queue_prof
+ *
+ * @param phase UBLKSRV_PROF_*
+ */
+extern const char *ublksrv_prof_phase_name(int phase);
+
 /**
  * Return the specified queue instance by ublksrv device and qid
  *
@@ -1166,6 +1318,20 @@ extern int ublksrv_process_io(const struct ublksrv_queue *q);
  */
 extern int ublksrv_complete_io(const struct ublksrv_queue *q, unsigned tag, int res);
 
+/**
+ * Complete one UBLK_IO_OP_ZONE_APPEND io, and pass the sector where the
+ * data is written back to ublk driver
+ *
+ * Zoned device depends on UBLK_F_USER_COPY, and batch IO isn't supported.
+ *
+ * @param q the ublksrv queue instance
+ * @param tag the io to be completed
+ * @param res io result
+ * @param lba start sector of the appended data
+ */
+extern int ublksrv_complete_zone_append(const struct ublksrv_queue *q,
+		unsigned tag, int res, __u64 lba);
+
 /**
  * Increment target IO inflight counter.
  *
@@ -14,6 +14,8 @@ extern "C" {
 
 struct ublksrv_aio_ctx;
 struct ublksrv_aio;
+struct io_uring;
+struct io_uring_sqe;
 
 /*
  * return value:
@@ -137,6 +139,54 @@ void *ublksrv_aio_get_ctx_data(struct ublksrv_aio_ctx *ctx);
 bool ublksrv_aio_ctx_dead(struct ublksrv_aio_ctx *ctx);
 const struct ublksrv_dev *ublksrv_aio_get_dev(struct ublksrv_aio_ctx *ctx);
 
+/*
+ * Zero copy in aio context
+ *
+ * If the device is added with UBLK_F_SUPPORT_ZERO_COPY and
+ * UBLK_F_BUF_REG_OFF_DAEMON, the request pages can be registered to the
+ * io_uring of aio context, then fixed buffer IO can be issued to backend
+ * from this ring directly:
+ *
+ * 	register(IOSQE_IO_LINK) -> READ/WRITE_FIXED(IOSQE_IO_LINK) -> unregister
+ *
+ * ublksrv_aio_register_zc_bufs() has to be called on the ring before
+ * issuing any register command, and the buffer index of each request is
+ * returned from ublksrv_aio_zc_buf_index().
+ */
+bool ublksrv_aio_zero_copy(const struct ublksrv_aio_ctx *ctx);
+
+/**
+ * Reserve sparse buffer table in aio context's io_uring for holding
+ * pages of all inflight requests
+ *
+ * @param ctx the aio context
+ * @param ring io_uring owned by the aio context
+ */
+int ublksrv_aio_register_zc_bufs(struct ublksrv_aio_ctx *ctx,
+		struct io_uring *ring);
+
+/**
+ * Return buffer index of this request in aio context's io_uring
+ *
+ * @param ctx the aio context
+ * @param req the aio request
+ */
+unsigned ublksrv_aio_zc_buf_index(const struct ublksrv_aio_ctx *ctx,
+		const struct ublksrv_aio *req);
+
+/**
+ * Prepare UBLK_U_IO_REGISTER_IO_BUF or UBLK_U_IO_UNREGISTER_IO_BUF for
+ * the request, user_data and sqe flags are left to caller
+ *
+ * @param ctx the aio context
+ * @param sqe sqe from aio context's io_uring
+ * @param req the aio request
+ * @param reg true for register, false for unregister
+ */
+void ublksrv_aio_prep_buf_reg(const struct ublksrv_aio_ctx *ctx,
+		struct io_uring_sqe *sqe, const struct ublksrv_aio *req,
+		bool reg);
+
 #ifdef __cplusplus
 }
 #endif
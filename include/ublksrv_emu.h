@@ -0,0 +1,146 @@
+// SPDX-License-Identifier: MIT or LGPL-2.1-only
+
+#ifndef UBLKSRV_EMU_INC_H
+#define UBLKSRV_EMU_INC_H
+
+/*
+ * Userspace stand-in for ublk_drv
+ *
+ * ublksrv_emu implements the /dev/ublkcN side of the io command contract
+ * in userspace, so the whole ublksrv datapath(queue setup, FETCH_REQ,
+ * COMMIT_AND_FETCH_REQ, NEED_GET_DATA, batch PREP/FETCH/COMMIT, user copy
+ * and abort on stop) can be driven and measured without the kernel
+ * module, refer to demo_emu.c for how to use these APIs.
+ *
+ * The char device is modelled by one sparse memfd: the iod array of
+ * each queue lives at UBLKSRV_CMD_BUF_OFFSET, and user copy buffers
+ * live at ublk_pos(), so the library mmap() and target pread()/pwrite()
+ * just work. Completions of io commands are posted to the queue's
+ * io_uring via IORING_OP_MSG_RING, so the queue sees exactly the same
+ * cqe stream as from ublk_drv.
+ *
+ * All ublksrv_emu_* APIs except for ublksrv_emu_init() and
+ * ublksrv_emu_deinit() have to be called from one single pthread, which
+ * plays the role of block layer and ublk_drv. Zero copy and auto buffer
+ * register can't be emulated.
+ */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct ublksrv_emu;
+struct ublksrv_ctrl_dev;
+struct ublksrv_dev_data;
+struct iovec;
+
+/*
+ * Called when the request queued via ublksrv_emu_queue_rq() is completed
+ * by ublk server, @res is the committed result
+ */
+typedef void (ublksrv_emu_done_fn)(struct ublksrv_emu *emu, int q_id,
+		int tag, int res, void *rq_data);
+
+/**
+ * Create one emulated ublk device
+ *
+ * @param data device setting, same with ublksrv_ctrl_init()
+ * @param done request completion callback
+ *
+ * The returned emulator owns one control device which is ready for
+ * ublksrv_dev_init(), and the device state is UBLK_S_DEV_LIVE.
+ */
+struct ublksrv_emu *ublksrv_emu_init(struct ublksrv_dev_data *data,
+		ublksrv_emu_done_fn *done);
+
+/**
+ * Release the emulator and its control device, all queues have to be
+ * deinitialized and ublksrv_dev_deinit() has to be called before.
+ */
+void ublksrv_emu_deinit(struct ublksrv_emu *emu);
+
+/**
+ * Return the control device for ublksrv_dev_init()
+ *
+ * @param emu the emulator
+ */
+struct ublksrv_ctrl_dev *ublksrv_emu_get_ctrl_dev(const struct ublksrv_emu *emu);
+
+/**
+ * Return one fd which becomes readable when ublk server issues io
+ * commands, so the emulator can be driven from caller's event loop by
+ * calling ublksrv_emu_reap() with zero timeout.
+ *
+ * @param emu the emulator
+ */
+int ublksrv_emu_get_fd(const struct ublksrv_emu *emu);
+
+/**
+ * Queue one request to ublk server
+ *
+ * @param emu the emulator
+ * @param q_id hw queue index
+ * @param op UBLK_IO_OP_*
+ * @param start_sector start sector of this request
+ * @param nr_sectors number of sectors
+ * @param buf data buffer, filled for READ when the request is done
+ * @param rq_data caller data passed to the completion callback
+ *
+ * Return the allocated tag, or -EBUSY if no tag is fetched by the
+ * queue, or -ENODEV if the emulator is stopped. The request is
+ * dispatched by ublksrv_emu_submit().
+ */
+int ublksrv_emu_queue_rq(struct ublksrv_emu *emu, int q_id, unsigned op,
+		unsigned long long start_sector, unsigned nr_sectors,
+		void *buf, void *rq_data);
+
+/**
+ * Queue one request whose data is described by iovec
+ *
+ * @param emu the emulator
+ * @param q_id hw queue index
+ * @param op UBLK_IO_OP_*
+ * @param start_sector start sector of this request
+ * @param nr_sectors number of sectors
+ * @param iov data buffers, which cover at least nr_sectors
+ * @param nr_iov number of iovec
+ * @param rq_data caller data passed to the completion callback
+ *
+ * Same with ublksrv_emu_queue_rq(), and @iov has to be kept until the
+ * request is completed.
+ */
+int ublksrv_emu_queue_rq_iov(struct ublksrv_emu *emu, int q_id, unsigned op,
+		unsigned long long start_sector, unsigned nr_sectors,
+		const struct iovec *iov, int nr_iov, void *rq_data);
+
+/**
+ * Dispatch all queued requests to ublk server
+ *
+ * @param emu the emulator
+ */
+int ublksrv_emu_submit(struct ublksrv_emu *emu);
+
+/**
+ * Handle io commands issued from ublk server, and complete requests
+ *
+ * @param emu the emulator
+ * @param timeout_ms how long to wait for io commands, -1 means forever
+ *
+ * Return how many requests are completed, or -ENODEV after the emulator
+ * is stopped and all queues are deinitialized.
+ */
+int ublksrv_emu_reap(struct ublksrv_emu *emu, int timeout_ms);
+
+/**
+ * Stop the emulated device, which is like UBLK_CMD_STOP_DEV: all fetched
+ * io commands are aborted, so ublksrv_process_io() returns -ENODEV
+ * after queued requests are completed.
+ *
+ * @param emu the emulator
+ */
+void ublksrv_emu_stop(struct ublksrv_emu *emu);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
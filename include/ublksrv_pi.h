@@ -0,0 +1,137 @@
+// SPDX-License-Identifier: MIT or LGPL-2.1-only
+
+#ifndef UBLKSRV_PI_INC_H
+#define UBLKSRV_PI_INC_H
+
+/*
+ * Protection information(T10 PI) helpers for UBLK_F_INTEGRITY device
+ *
+ * Integrity metadata of each request is copied from/to /dev/ublkcN at
+ * ublk_integrity_pos(), and the PI tuple of each integrity interval is
+ * stored in the interval's metadata at 'pi_offset'. The layout is described
+ * by 'struct ublk_param_integrity', which is passed to the helpers below
+ * directly.
+ *
+ * Guard tags are computed with PCLMULQDQ folding on x86_64 if the cpu
+ * supports it, otherwise with lookup table.
+ *
+ * CRC32C is provided too for digests of network transport, it uses the
+ * SSE4.2 crc32 instruction on x86_64 if the cpu supports it.
+ */
+
+#include <stddef.h>
+#include "ublk_cmd.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#ifndef LBMD_PI_CAP_INTEGRITY
+#define LBMD_PI_CAP_INTEGRITY		(1 << 0)
+#define LBMD_PI_CAP_REFTAG		(1 << 1)
+#endif
+
+#ifndef LBMD_PI_CSUM_NONE
+#define LBMD_PI_CSUM_NONE		0
+#define LBMD_PI_CSUM_IP			1
+#define LBMD_PI_CSUM_CRC16_T10DIF	2
+#define LBMD_PI_CSUM_CRC64_NVME		4
+#endif
+
+/* app tag which disables checking of the interval */
+#define UBLKSRV_PI_APP_ESCAPE		0xffff
+
+/** 8 bytes T10 PI tuple with CRC16 guard, fields are big endian */
+struct ublksrv_t10_pi_tuple {
+	__u16 guard_tag;
+	__u16 app_tag;
+	__u32 ref_tag;
+};
+
+/** 16 bytes NVMe PI tuple with CRC64 guard, fields are big endian */
+struct ublksrv_crc64_pi_tuple {
+	__u64 guard_tag;
+	__u16 app_tag;
+	__u8 ref_tag[6];
+};
+
+/**
+ * CRC16 with T10 DIF polynomial 0x8bb7
+ *
+ * @param crc crc of previous data, 0 for the first call
+ * @param buf data buffer
+ * @param len data length in bytes
+ */
+extern __u16 ublksrv_crc16_t10dif(__u16 crc, const void *buf, size_t len);
+
+/**
+ * CRC64 with NVMe polynomial 0xad93d23594c93659
+ *
+ * @param crc crc of previous data, 0 for the first call
+ * @param buf data buffer
+ * @param len data length in bytes
+ */
+extern __u64 ublksrv_crc64_nvme(__u64 crc, const void *buf, size_t len);
+
+/**
+ * CRC32C with Castagnoli polynomial 0x1edc6f41, as used by iSCSI and
+ * NVMe/TCP digests
+ *
+ * @param crc crc of previous data, 0 for the first call
+ * @param buf data buffer
+ * @param len data length in bytes
+ */
+extern __u32 ublksrv_crc32c(__u32 crc, const void *buf, size_t len);
+
+/**
+ * Size of PI tuple for the checksum type, 0 for unsupported type
+ *
+ * @param csum_type LBMD_PI_CSUM_*
+ */
+extern unsigned ublksrv_pi_tuple_size(unsigned csum_type);
+
+/**
+ * Bytes of integrity metadata for 'len' bytes of data
+ *
+ * @param p integrity parameter of the device
+ * @param len data length in bytes
+ */
+static inline unsigned ublksrv_pi_meta_len(const struct ublk_param_integrity *p,
+		unsigned len)
+{
+	return (len >> p->interval_exp) * p->metadata_size;
+}
+
+/**
+ * Fill PI tuple for each interval of 'data'
+ *
+ * @param p integrity parameter of the device
+ * @param data data buffer
+ * @param meta integrity metadata buffer
+ * @param len data length in bytes
+ * @param seed reference tag of the first interval, which is usually
+ * 	the start sector in unit of integrity interval
+ */
+extern void ublksrv_pi_generate(const struct ublk_param_integrity *p,
+		const void *data, void *meta, unsigned len, __u64 seed);
+
+/**
+ * Verify PI tuple of each interval of 'data'
+ *
+ * Interval with escape app tag isn't checked.
+ *
+ * @param p integrity parameter of the device
+ * @param data data buffer
+ * @param meta integrity metadata buffer
+ * @param len data length in bytes
+ * @param seed reference tag of the first interval
+ * @return 0 if all intervals are good, -EILSEQ if guard or reference
+ * 	tag mismatches, which is reported as BLK_STS_PROTECTION
+ */
+extern int ublksrv_pi_verify(const struct ublk_param_integrity *p,
+		const void *data, const void *meta, unsigned len, __u64 seed);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
@@ -18,6 +18,10 @@
 #include <sys/eventfd.h>
 #include <sys/epoll.h>
 #include <poll.h>
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
 
 #include "ublk_cmd.h"
 #include "ublksrv_utils.h"
@@ -73,6 +77,9 @@ struct ublksrv_queue_batch {
 	__u16 cmd_flags;			/* Flags for batch commands */
 };
 
+struct ublksrv_emu;
+struct ublksrv_emu_queue;
+
 /* todo: relace the hardcode name with /dev/char/maj:min */
 #ifdef UBLKC_PREFIX
 #define	UBLKC_DEV	UBLKC_PREFIX "/ublkc"
@@ -129,11 +136,16 @@ struct ublksrv_ctrl_dev {
 	cpu_set_t *queues_cpuset;
 
 	void *private_data;
+
+	/* only set for device created by ublksrv_emu_init() */
+	struct ublksrv_emu *emu;
 	unsigned long reserved[3];
 };
 
 struct ublk_io {
 	char *buf_addr;
+	/* only allocated for UBLK_F_INTEGRITY */
+	char *integrity_buf;
 
 #define UBLKSRV_NEED_FETCH_RQ		(1UL << 0)
 #define UBLKSRV_NEED_COMMIT_RQ_COMP	(1UL << 1)
@@ -144,6 +156,9 @@ struct ublk_io {
 	/* result is updated after all target ios are done */
 	unsigned int result;
 
+	/* sector written by UBLK_IO_OP_ZONE_APPEND, passed via cmd->addr */
+	__u64 zone_append_lba;
+
 	struct ublk_io_data  data;
 };
 
@@ -205,6 +220,21 @@ struct _ublksrv_queue {
 	/* Batch IO support - only used when UBLK_F_BATCH_IO is set */
 	struct ublksrv_queue_batch batch;
 
+	/* io commands are handled by ublksrv_emu if it is set */
+	struct ublksrv_emu_queue *emu;
+
+	/* cycles accounting, only set for UBLKSRV_F_CPU_PROF */
+	struct ublksrv_queue_prof *prof;
+	unsigned prof_loop;
+	bool prof_on;
+	/* cycles of handling cqes and of target callbacks in this loop */
+	unsigned long long prof_cqe, prof_tgt;
+
+	/* how many cqes to wait for, only for UBLKSRV_QUEUE_WAIT_BATCH */
+	unsigned wait_nr;
+	/* io_uring supports IORING_FEAT_MIN_TIMEOUT */
+	bool min_timeout;
+
 	unsigned long reserved[4];
 
 	struct ublk_io ios[0];
@@ -227,6 +257,9 @@ struct _ublksrv_dev {
 	int	cq_depth;
 	int	pad;
 
+	/* per-queue cycles accounting for UBLKSRV_F_CPU_PROF */
+	struct ublksrv_queue_prof *prof;
+
 	/* reserved isn't necessary any more */
 	unsigned long reserved[3];
 };
@@ -326,6 +359,47 @@ static inline void ublksrv_batch_add_complete(struct _ublksrv_queue *q,
 	cb->done++;
 }
 
+static inline unsigned long long ublksrv_cycles(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	return __rdtsc();
+#else
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#endif
+}
+
+/* called before target callback, which is accounted if the loop is sampled */
+static inline unsigned long long ublksrv_prof_tgt_start(
+		const struct _ublksrv_queue *q)
+{
+	return q->prof_on ? ublksrv_cycles() : 0;
+}
+
+static inline void ublksrv_prof_tgt_end(struct _ublksrv_queue *q,
+		unsigned long long start, bool is_io)
+{
+	if (q->prof_on) {
+		q->prof_tgt += ublksrv_cycles() - start;
+		q->prof->nr_ios += is_io;
+	}
+}
+
+struct ublksrv_ctrl_dev *__ublksrv_ctrl_alloc(struct ublksrv_dev_data *data,
+		bool recover, int ctrl_fd);
+
+/* Userspace ublk_drv emulation (implemented in ublksrv_emu.c) */
+int ublksrv_emu_cdev_fd(const struct ublksrv_emu *emu);
+int ublksrv_emu_attach_queue(struct ublksrv_emu *emu, struct _ublksrv_queue *q);
+void ublksrv_emu_detach_queue(struct _ublksrv_queue *q);
+int ublksrv_emu_queue_cmd(struct _ublksrv_queue *q, unsigned cmd_op,
+		unsigned tag, __u64 addr, int result, __u64 user_data);
+int ublksrv_emu_queue_batch_cmd(struct _ublksrv_queue *q, unsigned cmd_op,
+		const void *buf, unsigned len, unsigned short nr_elem,
+		__u64 user_data);
+
 /*
  * bit63: target io, bit62: internal data.
  *
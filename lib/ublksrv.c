@@ -173,6 +173,15 @@ static inline int ublksrv_queue_io_cmd(struct _ublksrv_queue *q,
 	else if (io->flags & UBLKSRV_NEED_FETCH_RQ)
 		cmd_op = UBLK_IO_FETCH_REQ;
 
+	if (q->emu) {
+		if (ublksrv_emu_queue_cmd(q, cmd_op, tag,
+				ublksrv_queue_use_buf(q) ? (__u64)io->buf_addr : 0,
+				io->result,
+				build_user_data(tag, _IOC_NR(cmd_op), 0, 0)))
+			return -1;
+		goto queued;
+	}
+
 	sqe = ublksrv_alloc_sqe(&q->ring);
 	if (!sqe) {
 		ublk_err("%s: run out of sqe %d, tag %d\n",
@@ -197,8 +206,11 @@ static inline int ublksrv_queue_io_cmd(struct _ublksrv_queue *q,
 	cmd->tag	= tag;
 	if (ublksrv_queue_use_buf(q))
 		cmd->addr	= (__u64)io->buf_addr;
-	else
-		cmd->addr	= 0;
+	else {
+		/* zoned device depends on user copy */
+		cmd->addr	= io->zone_append_lba;
+		io->zone_append_lba = 0;
+	}
 	cmd->q_id	= q->q_id;
 
 	if (q->state & UBLKSRV_AUTO_ZC)
@@ -207,6 +219,7 @@ static inline int ublksrv_queue_io_cmd(struct _ublksrv_queue *q,
 	user_data = build_user_data(tag, _IOC_NR(cmd_op), 0, 0);
 	io_uring_sqe_set_data64(sqe, user_data);
 
+queued:
 	io->flags = 0;
 
 	q->cmd_inflight += 1;
@@ -234,6 +247,16 @@ int ublksrv_complete_io(const struct ublksrv_queue *tq, unsigned tag, int res)
 	return ublksrv_queue_io_cmd(q, io, tag);
 }
 
+int ublksrv_complete_zone_append(const struct ublksrv_queue *tq, unsigned tag,
+		int res, __u64 lba)
+{
+	struct _ublksrv_queue *q = tq_to_local(tq);
+
+	if (res >= 0)
+		q->ios[tag].zone_append_lba = lba;
+	return ublksrv_complete_io(tq, tag, res);
+}
+
 void ublksrv_queue_inc_tgt_io_inflight(const struct ublksrv_queue *tq)
 {
 	struct _ublksrv_queue *q = tq_to_local(tq);
@@ -412,6 +435,9 @@ void ublksrv_queue_deinit(const struct ublksrv_queue *tq)
 	if (q->dev->tgt.ops->deinit_queue)
 		q->dev->tgt.ops->deinit_queue(tq);
 
+	if (q->emu)
+		ublksrv_emu_detach_queue(q);
+
 	if (q->epollfd >= 0)
 		close(q->epollfd);
 	while (q->epoll_callbacks) {
@@ -449,6 +475,7 @@ void ublksrv_queue_deinit(const struct ublksrv_queue *tq)
 				free(q->ios[i].buf_addr);
 			q->ios[i].buf_addr = NULL;
 		}
+		free(q->ios[i].integrity_buf);
 		free(q->ios[i].data.private_data);
 	}
 	q->dev->__queues[q->q_id] = NULL;
@@ -735,6 +762,10 @@ const struct ublksrv_queue *ublksrv_queue_init_flags(const struct ublksrv_dev *t
 
 	q->tgt_ops = dev->tgt.ops;	//cache ops for fast path
 	q->dev = dev;
+	q->emu = NULL;
+	q->prof = dev->prof ? &dev->prof[q_id] : NULL;
+	q->prof_loop = 0;
+	q->prof_on = false;
 	if (ctrl_dev->dev_info.flags & UBLK_F_CMD_IOCTL_ENCODE)
 		q->state = UBLKSRV_QUEUE_IOCTL_OP;
 	else
@@ -750,6 +781,10 @@ const struct ublksrv_queue *ublksrv_queue_init_flags(const struct ublksrv_dev *t
 		q->state |= UBLKSRV_QUEUE_POLL;
 	if (ctrl_dev->dev_info.flags & UBLK_F_BATCH_IO)
 		q->state |= UBLKSRV_QUEUE_BATCH_IO;
+	if (ctrl_dev->dev_info.ublksrv_flags & UBLKSRV_F_WAIT_BATCH)
+		q->state |= UBLKSRV_QUEUE_WAIT_BATCH;
+	q->wait_nr = 1;
+	q->min_timeout = false;
 	q->q_id = q_id;
 	/* FIXME: depth has to be PO 2 */
 	q->q_depth = depth;
@@ -771,11 +806,22 @@ const struct ublksrv_queue *ublksrv_queue_init_flags(const struct ublksrv_dev *t
 	io_buf_size = ctrl_dev->dev_info.max_io_buf_bytes;
 	for (i = 0; i < nr_ios; i++) {
 		q->ios[i].buf_addr = NULL;
+		q->ios[i].integrity_buf = NULL;
 
 		/* extra ios needn't to allocate io buffer */
 		if (i >= q->q_depth)
 			goto skip_alloc_buf;
 
+		if ((ctrl_dev->dev_info.flags & UBLK_F_INTEGRITY) &&
+				dev->tgt.integrity_buf_size &&
+				posix_memalign((void **)&q->ios[i].integrity_buf,
+					getpagesize(),
+					dev->tgt.integrity_buf_size)) {
+			ublk_err("ublk dev %d queue %d io %d alloc integrity buf failed",
+					q->dev->ctrl_dev->dev_info.dev_id, q->q_id, i);
+			goto fail;
+		}
+
 		if (!ublksrv_queue_alloc_buf(q))
 			goto skip_alloc_buf;
 
@@ -808,7 +854,7 @@ skip_alloc_buf:
 		//ublk_assert(io_data_size ^ (unsigned long)q->ios[i].data.private_data);
 	}
 
-	ublksrv_setup_ring_params(&p, cq_depth, flags);
+	ublksrv_setup_ring_params(&p, cq_depth, flags | dev->tgt.ring_flags);
 	ret = io_uring_queue_init_params(ring_depth, &q->ring, &p);
 	if (ret < 0) {
 		ublk_err("ublk dev %d queue %d setup io_uring failed %d",
@@ -817,6 +863,9 @@ skip_alloc_buf:
 	}
 
 	q->ring_ptr = &q->ring;
+#if defined(HAVE_LIBURING_MIN_TIMEOUT) && defined(IORING_FEAT_MIN_TIMEOUT)
+	q->min_timeout = !!(p.features & IORING_FEAT_MIN_TIMEOUT);
+#endif
 
 	ret = io_uring_register_files(&q->ring, dev->tgt.fds,
 			dev->tgt.nr_fds + 1);
@@ -838,6 +887,15 @@ skip_alloc_buf:
 
 	io_uring_register_ring_fd(&q->ring);
 
+	if (ctrl_dev->emu) {
+		ret = ublksrv_emu_attach_queue(ctrl_dev->emu, q);
+		if (ret) {
+			ublk_err("ublk dev %d queue %d attach emulator failed %d\n",
+				ctrl_dev->dev_info.dev_id, q->q_id, ret);
+			goto fail;
+		}
+	}
+
 	/* Allocate batch IO buffers if batch mode is enabled */
 	if (ublksrv_queue_batch_io(q)) {
 		ublk_dbg(UBLK_DBG_QUEUE, "ublk dev %d queue %d allocating batch bufs\n",
@@ -945,6 +1003,7 @@ void ublksrv_dev_deinit(const struct ublksrv_dev *tdev)
 
 	ublksrv_tgt_deinit(dev);
 	free(dev->thread);
+	free(dev->prof);
 
 	if (dev->cdev_fd >= 0) {
 		close(dev->cdev_fd);
@@ -972,7 +1031,7 @@ const struct ublksrv_dev *ublksrv_dev_init(const struct ublksrv_ctrl_dev *ctrl_d
 	snprintf(buf, 64, "%s%d", UBLKC_DEV, dev_id);
 
 	/* retry if udev opens our char device at the same time */
-	while (true) {
+	while (!ctrl_dev->emu) {
 		ret = open(buf, O_RDWR | O_NONBLOCK);
 		if (ret >= 0)
 			break;
@@ -985,9 +1044,33 @@ const struct ublksrv_dev *ublksrv_dev_init(const struct ublksrv_ctrl_dev *ctrl_d
 		usleep(50000);
 	}
 
+	/* the emulated char device is one memfd */
+	if (ctrl_dev->emu) {
+		ret = dup(ublksrv_emu_cdev_fd(ctrl_dev->emu));
+		if (ret < 0) {
+			ublk_err("can't dup emulated %s: %s\n", buf,
+					strerror(errno));
+			goto fail;
+		}
+	}
+
 	dev->cdev_fd = ret;
 	tgt->fds[0] = dev->cdev_fd;
 
+	if (ctrl_dev->dev_info.ublksrv_flags & UBLKSRV_F_CPU_PROF) {
+		size_t sz = sizeof(struct ublksrv_queue_prof) *
+			ctrl_dev->dev_info.nr_hw_queues;
+
+		if (posix_memalign((void **)&dev->prof,
+					sizeof(struct ublksrv_queue_prof), sz)) {
+			ublk_err("can't allocate cycles accounting for dev %d\n",
+					dev_id);
+			dev->prof = NULL;
+			goto fail;
+		}
+		memset(dev->prof, 0, sz);
+	}
+
 	ret = ublksrv_tgt_init(dev, ctrl_dev->tgt_type, ctrl_dev->tgt_ops,
 			ctrl_dev->tgt_argc, ctrl_dev->tgt_argv);
 	if (ret) {
@@ -1016,7 +1099,8 @@ static inline void ublksrv_handle_tgt_cqe(struct _ublksrv_queue *q,
 {
 	unsigned tag = user_data_to_tag(cqe->user_data);
 
-	if (cqe->res < 0 && cqe->res != -EAGAIN) {
+	/* -ETIME is the expiry of a timeout sqe used by target */
+	if (cqe->res < 0 && cqe->res != -EAGAIN && cqe->res != -ETIME) {
 		ublk_err("%s: failed tgt io: res %d qid %u tag %u, cmd_op %u\n",
 			__func__, cqe->res, q->q_id,
 			user_data_to_tag(cqe->user_data),
@@ -1026,17 +1110,25 @@ static inline void ublksrv_handle_tgt_cqe(struct _ublksrv_queue *q,
 	if (is_internal_io(cqe->user_data)) {
 		switch ((cqe->user_data >> 16) & 0xff) {
 		case UBLK_IO_OP_EVENTFD:
-			if (q->tgt_ops->handle_event)
+			if (q->tgt_ops->handle_event) {
+				unsigned long long t = ublksrv_prof_tgt_start(q);
+
 				q->tgt_ops->handle_event(local_to_tq(q));
+				ublksrv_prof_tgt_end(q, t, false);
+			}
 			return;
 		case UBLK_IO_OP_EPOLLFD:
 			ublkdrv_process_epollfd(q, cqe);
 			return;
 		}
 	} else {
-		if (q->tgt_ops->tgt_io_done)
+		if (q->tgt_ops->tgt_io_done) {
+			unsigned long long t = ublksrv_prof_tgt_start(q);
+
 			q->tgt_ops->tgt_io_done(local_to_tq(q),
 					&q->ios[tag].data, cqe);
+			ublksrv_prof_tgt_end(q, t, false);
+		}
 	}
 }
 
@@ -1082,8 +1174,11 @@ static void ublksrv_handle_cqe(struct io_uring *r,
 	 * daemon can poll on both two rings.
 	 */
 	if (cqe->res == UBLK_IO_RES_OK) {
+		unsigned long long t = ublksrv_prof_tgt_start(q);
+
 		//ublk_assert(tag < q->q_depth);
 		q->tgt_ops->handle_io_async(local_to_tq(q), &io->data);
+		ublksrv_prof_tgt_end(q, t, true);
 	} else if (cqe->res == UBLK_IO_RES_NEED_GET_DATA) {
 		io->flags |= UBLKSRV_NEED_GET_DATA | UBLKSRV_IO_FREE;
 		ublksrv_queue_io_cmd(q, io, tag);
@@ -1100,17 +1195,90 @@ static void ublksrv_handle_cqe(struct io_uring *r,
 	}
 }
 
+/*
+ * Reap cqes in batch, so that per-tag state of the following cqes can be
+ * prefetched in two stages before dispatching: ublk_io and iod first,
+ * then io private data, whose address is read from ublk_io.
+ */
+#define UBLKSRV_REAP_BATCH	32
+#define UBLKSRV_PREFETCH_DIST	4
+
+static inline struct ublk_io *ublksrv_cqe_to_io(const struct _ublksrv_queue *q,
+		const struct io_uring_cqe *cqe)
+{
+	__u64 user_data = cqe->user_data;
+	unsigned tag = user_data_to_tag(user_data);
+
+	if (is_internal_io(user_data))
+		return NULL;
+
+	if (is_target_io(user_data)) {
+		if (tag >= q->q_depth + q->dev->tgt.extra_ios)
+			return NULL;
+	} else if (tag >= q->q_depth || ublksrv_queue_batch_io(q))
+		/* tag of batch command is buffer index */
+		return NULL;
+
+	return (struct ublk_io *)&q->ios[tag];
+}
+
+static inline void ublksrv_prefetch_io(const struct _ublksrv_queue *q,
+		const struct io_uring_cqe *cqe)
+{
+	struct ublk_io *io = ublksrv_cqe_to_io(q, cqe);
+
+	if (io) {
+		unsigned tag = user_data_to_tag(cqe->user_data);
+
+		__builtin_prefetch(io, 1);
+		if (tag < q->q_depth)
+			__builtin_prefetch(ublksrv_get_iod(q, tag));
+	}
+}
+
+static inline void ublksrv_prefetch_io_data(const struct _ublksrv_queue *q,
+		const struct io_uring_cqe *cqe)
+{
+	struct ublk_io *io = ublksrv_cqe_to_io(q, cqe);
+
+	if (io)
+		__builtin_prefetch(io->data.private_data, 1);
+}
+
 static int ublksrv_reap_events_uring(struct io_uring *r)
 {
-	struct io_uring_cqe *cqe;
-	unsigned head;
+	struct _ublksrv_queue *q = container_of(r, struct _ublksrv_queue, ring);
+	struct io_uring_cqe *cqes[UBLKSRV_REAP_BATCH];
+	unsigned nr, i;
 	int count = 0;
 
-	io_uring_for_each_cqe(r, head, cqe) {
-		ublksrv_handle_cqe(r, cqe, NULL);
-		count += 1;
-	}
-	io_uring_cq_advance(r, count);
+	do {
+		nr = io_uring_peek_batch_cqe(r, cqes, UBLKSRV_REAP_BATCH);
+
+		for (i = 0; i < nr && i < 2 * UBLKSRV_PREFETCH_DIST; i++)
+			ublksrv_prefetch_io(q, cqes[i]);
+		for (i = 0; i < nr && i < UBLKSRV_PREFETCH_DIST; i++)
+			ublksrv_prefetch_io_data(q, cqes[i]);
+
+		for (i = 0; i < nr; i++) {
+			if (i + 2 * UBLKSRV_PREFETCH_DIST < nr)
+				ublksrv_prefetch_io(q,
+					cqes[i + 2 * UBLKSRV_PREFETCH_DIST]);
+			if (i + UBLKSRV_PREFETCH_DIST < nr)
+				ublksrv_prefetch_io_data(q,
+					cqes[i + UBLKSRV_PREFETCH_DIST]);
+
+			if (q->prof_on) {
+				unsigned long long t = ublksrv_cycles();
+
+				ublksrv_handle_cqe(r, cqes[i], NULL);
+				q->prof_cqe += ublksrv_cycles() - t;
+			} else
+				ublksrv_handle_cqe(r, cqes[i], NULL);
+		}
+		io_uring_cq_advance(r, nr);
+		count += nr;
+	} while (nr == UBLKSRV_REAP_BATCH);
 
 	return count;
 }
@@ -1176,6 +1344,85 @@ static void ublksrv_submit_aio_batch(struct _ublksrv_queue *q)
 	}
 }
 
+/* sample one of every 2^UBLKSRV_PROF_SAMPLE_SHIFT loops */
+static inline unsigned long long ublksrv_prof_loop_start(
+		struct _ublksrv_queue *q)
+{
+	q->prof_on = !(++q->prof_loop &
+			((1U << UBLKSRV_PROF_SAMPLE_SHIFT) - 1));
+	if (!q->prof_on)
+		return 0;
+
+	q->prof->nr_loops++;
+	q->prof_cqe = q->prof_tgt = 0;
+	return ublksrv_cycles();
+}
+
+/* account cycles since *start to @phase, and start the next phase */
+static inline void ublksrv_prof_stamp(struct _ublksrv_queue *q,
+		int phase, unsigned long long *start)
+{
+	unsigned long long now;
+
+	if (!q->prof_on)
+		return;
+
+	now = ublksrv_cycles();
+	q->prof->cycles[phase] += now - *start;
+	*start = now;
+
+	/* split cqe handling from reap into dispatch and target */
+	if (phase == UBLKSRV_PROF_REAP) {
+		q->prof->cycles[UBLKSRV_PROF_REAP] -= q->prof_cqe;
+		q->prof->cycles[UBLKSRV_PROF_DISPATCH] +=
+			q->prof_cqe - q->prof_tgt;
+		q->prof->cycles[UBLKSRV_PROF_TARGET] += q->prof_tgt;
+	}
+}
+
+/*
+ * Wait for q->wait_nr cqes, but no longer than UBLKSRV_WAIT_BATCH_USEC
+ * once there is any cqe.
+ *
+ * With IORING_FEAT_MIN_TIMEOUT, the kernel keeps waiting with the idle
+ * timeout if nothing comes in the min wait. Otherwise the wait is cut
+ * at UBLKSRV_WAIT_BATCH_USEC unconditionally, and the following empty
+ * reap brings wait_nr back to 1.
+ */
+static int ublksrv_wait_batch(struct _ublksrv_queue *q,
+		struct __kernel_timespec *tsp)
+{
+	struct __kernel_timespec ts = {
+		.tv_sec = 0,
+		.tv_nsec = UBLKSRV_WAIT_BATCH_USEC * 1000,
+	};
+	struct io_uring_cqe *cqe;
+
+#ifdef HAVE_LIBURING_MIN_TIMEOUT
+	if (q->min_timeout)
+		return io_uring_submit_and_wait_min_timeout(&q->ring, &cqe,
+				q->wait_nr, tsp, UBLKSRV_WAIT_BATCH_USEC, NULL);
+#endif
+	return io_uring_submit_and_wait_timeout(&q->ring, &cqe, q->wait_nr,
+			&ts, NULL);
+}
+
+/*
+ * Wait for more cqes if the last wait returned with plenty of them, and
+ * back off as soon as one wait can't collect wait_nr cqes.
+ */
+static inline void ublksrv_adjust_wait_nr(struct _ublksrv_queue *q,
+		int reapped)
+{
+	unsigned max_wait_nr = q->q_depth / 4 ? q->q_depth / 4 : 1;
+
+	if (reapped >= 2 * (int)q->wait_nr && q->wait_nr < max_wait_nr)
+		q->wait_nr = q->wait_nr * 2 < max_wait_nr ?
+			q->wait_nr * 2 : max_wait_nr;
+	else if (reapped < (int)q->wait_nr)
+		q->wait_nr = q->wait_nr / 2 ? q->wait_nr / 2 : 1;
+}
+
 int ublksrv_process_io(const struct ublksrv_queue *tq)
 {
 	struct _ublksrv_queue *q = tq_to_local(tq);
@@ -1189,6 +1436,8 @@ int ublksrv_process_io(const struct ublksrv_queue *tq)
 	struct io_uring_cqe *cqe;
 	unsigned wait_nr = ((q->state & UBLKSRV_QUEUE_POLL) &&
 			    q->tgt_io_inflight) ? 0 : 1;
+	unsigned long long t = 0;
+	bool batch_wait = wait_nr && q->wait_nr > 1;
 
 	ublk_dbg(UBLK_DBG_QUEUE, "dev%d-q%d: to_submit %d inflight %u/%u stopping %d\n",
 				q->dev->ctrl_dev->dev_info.dev_id,
@@ -1199,19 +1448,32 @@ int ublksrv_process_io(const struct ublksrv_queue *tq)
 	if (__ublksrv_queue_is_done(q))
 		return -ENODEV;
 
+	if (q->prof)
+		t = ublksrv_prof_loop_start(q);
+
 	/* Submit any pending batch commits before io_uring submit */
 	if (ublksrv_queue_batch_io(q))
 		ublksrv_batch_submit_commit(q);
 
-	ret = io_uring_submit_and_wait_timeout(&q->ring, &cqe, wait_nr, tsp, NULL);
+	if (batch_wait)
+		ret = ublksrv_wait_batch(q, tsp);
+	else
+		ret = io_uring_submit_and_wait_timeout(&q->ring, &cqe,
+				wait_nr, tsp, NULL);
+	ublksrv_prof_stamp(q, UBLKSRV_PROF_SUBMIT_WAIT, &t);
 
 	ublksrv_reset_aio_batch(q);
 	reapped = ublksrv_reap_events_uring(&q->ring);
 	ublksrv_submit_aio_batch(q);
+	if (q->state & UBLKSRV_QUEUE_WAIT_BATCH)
+		ublksrv_adjust_wait_nr(q, reapped);
+	ublksrv_prof_stamp(q, UBLKSRV_PROF_REAP, &t);
 
 	if (q->tgt_ops->handle_io_background)
 		q->tgt_ops->handle_io_background(local_to_tq(q),
 				io_uring_sq_ready(&q->ring));
+	ublksrv_prof_stamp(q, UBLKSRV_PROF_BACKGROUND, &t);
+	q->prof_on = false;
 
 	ublk_dbg(UBLK_DBG_QUEUE, "submit result %d, reapped %d stop %d idle %d",
 			ret, reapped, (q->state & UBLKSRV_QUEUE_STOPPING),
@@ -1220,7 +1482,8 @@ int ublksrv_process_io(const struct ublksrv_queue *tq)
 	if ((q->state & UBLKSRV_QUEUE_STOPPING))
 		ublksrv_kill_eventfd(q);
 	else {
-		if (ret == -ETIME && reapped == 0 &&
+		/* batch wait may time out in UBLKSRV_WAIT_BATCH_USEC */
+		if (ret == -ETIME && reapped == 0 && !batch_wait &&
 				!io_uring_sq_ready(&q->ring))
 			ublksrv_queue_idle_enter(q);
 		else
@@ -1230,6 +1493,34 @@ int ublksrv_process_io(const struct ublksrv_queue *tq)
 	return reapped;
 }
 
+int ublksrv_dev_get_queue_prof(const struct ublksrv_dev *tdev, int q_id,
+		struct ublksrv_queue_prof *prof)
+{
+	const struct _ublksrv_dev *dev = tdev_to_local(tdev);
+
+	if (!dev->prof || q_id < 0 ||
+			q_id >= dev->ctrl_dev->dev_info.nr_hw_queues)
+		return -EINVAL;
+
+	*prof = dev->prof[q_id];
+	return 0;
+}
+
+const char *ublksrv_prof_phase_name(int phase)
+{
+	static const char *names[UBLKSRV_PROF_NR_PHASES] = {
+		[UBLKSRV_PROF_SUBMIT_WAIT] = "submit_wait",
+		[UBLKSRV_PROF_REAP] = "reap",
+		[UBLKSRV_PROF_DISPATCH] = "dispatch",
+		[UBLKSRV_PROF_TARGET] = "target",
+		[UBLKSRV_PROF_BACKGROUND] = "background",
+	};
+
+	if (phase < 0 || phase >= UBLKSRV_PROF_NR_PHASES)
+		return "unknown";
+	return names[phase];
+}
+
 const struct ublksrv_queue *ublksrv_get_queue(const struct ublksrv_dev *dev,
 		int q_id)
 {
@@ -1299,6 +1590,15 @@ void *ublksrv_queue_get_io_buf(const struct ublksrv_queue *tq, int tag)
 	return NULL;
 }
 
+void *ublksrv_queue_get_integrity_buf(const struct ublksrv_queue *tq, int tag)
+{
+	struct _ublksrv_queue *q = tq_to_local(tq);
+
+	if (tag < q->q_depth)
+		return q->ios[tag].integrity_buf;
+	return NULL;
+}
+
 /*
  * The default io_uring cq depth equals to queue depth plus
  * .tgt_ring_depth, which is usually enough for typical ublk targets,
@@ -119,6 +119,15 @@ struct ublksrv_aio_ctx *ublksrv_aio_ctx_init(const struct ublksrv_dev *dev,
 	if (!(tdev_to_local(dev)->ctrl_dev->dev_info.ublksrv_flags & UBLKSRV_F_NEED_EVENTFD))
 		return NULL;
 
+	/* request buffer can't be registered from aio context otherwise */
+	if ((tdev_to_local(dev)->ctrl_dev->dev_info.flags &
+			(UBLK_F_SUPPORT_ZERO_COPY | UBLK_F_BUF_REG_OFF_DAEMON)) ==
+			UBLK_F_SUPPORT_ZERO_COPY) {
+		ublk_err("%s: zero copy requires UBLK_F_BUF_REG_OFF_DAEMON\n",
+				__func__);
+		return NULL;
+	}
+
 	ctx = calloc(1, sizeof(*ctx));
 	if (!ctx)
 		return NULL;
@@ -266,3 +275,50 @@ const struct ublksrv_dev *ublksrv_aio_get_dev(struct ublksrv_aio_ctx *ctx)
 {
 	return ctx->dev;
 }
+
+bool ublksrv_aio_zero_copy(const struct ublksrv_aio_ctx *ctx)
+{
+	return tdev_to_local(ctx->dev)->ctrl_dev->dev_info.flags &
+		UBLK_F_SUPPORT_ZERO_COPY;
+}
+
+int ublksrv_aio_register_zc_bufs(struct ublksrv_aio_ctx *ctx,
+		struct io_uring *ring)
+{
+	const struct ublksrv_ctrl_dev_info *info =
+		&tdev_to_local(ctx->dev)->ctrl_dev->dev_info;
+
+	if (!ublksrv_aio_zero_copy(ctx))
+		return -EINVAL;
+
+	return io_uring_register_buffers_sparse(ring,
+			info->nr_hw_queues * info->queue_depth);
+}
+
+unsigned ublksrv_aio_zc_buf_index(const struct ublksrv_aio_ctx *ctx,
+		const struct ublksrv_aio *req)
+{
+	const struct ublksrv_ctrl_dev_info *info =
+		&tdev_to_local(ctx->dev)->ctrl_dev->dev_info;
+
+	return ublksrv_aio_qid(req->id) * info->queue_depth +
+		ublksrv_aio_tag(req->id);
+}
+
+void ublksrv_aio_prep_buf_reg(const struct ublksrv_aio_ctx *ctx,
+		struct io_uring_sqe *sqe, const struct ublksrv_aio *req,
+		bool reg)
+{
+	struct ublksrv_io_cmd *cmd = (struct ublksrv_io_cmd *)
+		ublksrv_get_sqe_cmd(sqe);
+
+	io_uring_prep_read(sqe, tdev_to_local(ctx->dev)->cdev_fd, 0, 0, 0);
+	sqe->opcode = IORING_OP_URING_CMD;
+	sqe->flags = 0;
+	ublksrv_set_sqe_cmd_op(sqe, reg ? UBLK_U_IO_REGISTER_IO_BUF :
+			UBLK_U_IO_UNREGISTER_IO_BUF);
+
+	cmd->q_id = ublksrv_aio_qid(req->id);
+	cmd->tag = ublksrv_aio_tag(req->id);
+	cmd->addr = ublksrv_aio_zc_buf_index(ctx, req);
+}
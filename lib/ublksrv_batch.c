@@ -175,21 +175,31 @@ void ublksrv_batch_free_bufs(struct _ublksrv_queue *q)
 
 /*
  * Common helper for issuing PREP or COMMIT batch commands.
- * Returns the allocated SQE, or NULL on failure.
+ * Returns 0 on success, or -1 if no SQE is available.
  */
-static struct io_uring_sqe *ublksrv_batch_io_cmd(struct _ublksrv_queue *q,
-						 unsigned int cmd_op,
-						 void *buf,
-						 unsigned short buf_idx,
-						 unsigned short nr_elem)
+static int ublksrv_batch_io_cmd(struct _ublksrv_queue *q,
+				unsigned int cmd_op,
+				void *buf,
+				unsigned short buf_idx,
+				unsigned short nr_elem)
 {
 	struct ublksrv_queue_batch *b = &q->batch;
 	struct io_uring_sqe *sqe;
 	struct ublk_batch_io *cmd;
 
+	if (q->emu) {
+		if (ublksrv_emu_queue_batch_cmd(q, cmd_op, buf,
+				b->commit_buf_elem_size * nr_elem, nr_elem,
+				build_batch_user_data(buf_idx, _IOC_NR(cmd_op),
+					nr_elem)))
+			return -1;
+		q->cmd_inflight++;
+		return 0;
+	}
+
 	sqe = ublksrv_alloc_sqe(&q->ring);
 	if (!sqe)
-		return NULL;
+		return -1;
 
 	cmd = (struct ublk_batch_io *)ublksrv_get_sqe_cmd(sqe);
 
@@ -212,7 +222,7 @@ static struct io_uring_sqe *ublksrv_batch_io_cmd(struct _ublksrv_queue *q,
 
 	q->cmd_inflight++;
 
-	return sqe;
+	return 0;
 }
 
 /* Issue UBLK_U_IO_PREP_IO_CMDS - one-time setup */
@@ -237,7 +247,7 @@ static int ublksrv_batch_queue_prep_io_cmds(struct _ublksrv_queue *q)
 			elem->buf_addr = (__u64)q->ios[i].buf_addr;
 	}
 
-	if (!ublksrv_batch_io_cmd(q, UBLK_U_IO_PREP_IO_CMDS, cb->buf, 0, nr_elem)) {
+	if (ublksrv_batch_io_cmd(q, UBLK_U_IO_PREP_IO_CMDS, cb->buf, 0, nr_elem)) {
 		ublk_err("%s: run out of sqe qid %d\n", __func__, q->q_id);
 		return -1;
 	}
@@ -260,6 +270,15 @@ static void ublksrv_batch_queue_fetch(struct _ublksrv_queue *q, int buf_idx)
 	io_uring_buf_ring_add(fb->br, fb->fetch_buf, fb->fetch_buf_size, 0, 0, 0);
 	io_uring_buf_ring_advance(fb->br, 1);
 
+	if (q->emu) {
+		if (ublksrv_emu_queue_batch_cmd(q, UBLK_U_IO_FETCH_IO_CMDS,
+				fb->fetch_buf, fb->fetch_buf_size, nr_elem,
+				build_batch_user_data(buf_idx,
+					_IOC_NR(UBLK_U_IO_FETCH_IO_CMDS), nr_elem)))
+			return;
+		goto queued;
+	}
+
 	sqe = ublksrv_alloc_sqe(&q->ring);
 	if (!sqe) {
 		ublk_err("%s: run out of sqe qid %d\n", __func__, q->q_id);
@@ -285,6 +304,7 @@ static void ublksrv_batch_queue_fetch(struct _ublksrv_queue *q, int buf_idx)
 	io_uring_sqe_set_data64(sqe, build_batch_user_data(buf_idx,
 		_IOC_NR(UBLK_U_IO_FETCH_IO_CMDS), nr_elem));
 
+queued:
 	q->cmd_inflight++;
 	fb->fetch_buf_off = 0;
 
@@ -318,8 +338,8 @@ void ublksrv_batch_submit_commit(struct _ublksrv_queue *q)
 	if (nr_elem == 0)
 		return;
 
-	if (!ublksrv_batch_io_cmd(q, UBLK_U_IO_COMMIT_IO_CMDS, cb->buf,
-				  b->cur_commit_buf, nr_elem)) {
+	if (ublksrv_batch_io_cmd(q, UBLK_U_IO_COMMIT_IO_CMDS, cb->buf,
+				 b->cur_commit_buf, nr_elem)) {
 		ublk_err("%s: run out of sqe qid %d\n", __func__, q->q_id);
 		return;
 	}
@@ -353,6 +373,7 @@ static void ublksrv_batch_handle_fetch_cqe(struct _ublksrv_queue *q,
 	for (i = start; i < end; i += 2) {
 		unsigned short tag = *(unsigned short *)
 			((char *)fb->fetch_buf + i);
+		unsigned long long t;
 
 		if (tag >= q->q_depth) {
 			ublk_err("%s: qid %d invalid tag %u\n",
@@ -360,7 +381,9 @@ static void ublksrv_batch_handle_fetch_cqe(struct _ublksrv_queue *q,
 			continue;
 		}
 
+		t = ublksrv_prof_tgt_start(q);
 		q->tgt_ops->handle_io_async(local_to_tq(q), &q->ios[tag].data);
+		ublksrv_prof_tgt_end(q, t, true);
 	}
 
 	fb->fetch_buf_off = end;
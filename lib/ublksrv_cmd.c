@@ -159,7 +159,12 @@ void ublksrv_ctrl_deinit(struct ublksrv_ctrl_dev *dev)
 	free(dev);
 }
 
-struct ublksrv_ctrl_dev *__ublksrv_ctrl_init(struct ublksrv_dev_data *data, bool recover)
+/*
+ * Allocate control device with the opened control fd, which is -1 for
+ * device emulated by ublksrv_emu
+ */
+struct ublksrv_ctrl_dev *__ublksrv_ctrl_alloc(struct ublksrv_dev_data *data,
+		bool recover, int ctrl_fd)
 {
 	struct io_uring_params p;
 	struct ublksrv_ctrl_dev *dev = (struct ublksrv_ctrl_dev *)calloc(1,
@@ -167,12 +172,7 @@ struct ublksrv_ctrl_dev *__ublksrv_ctrl_init(struct ublksrv_dev_data *data, bool
 	struct ublksrv_ctrl_dev_info *info = &dev->dev_info;
 	int ret;
 
-	dev->ctrl_fd = open(CTRL_DEV, O_RDWR);
-	if (dev->ctrl_fd < 0) {
-		fprintf(stderr, "control dev %s can't be opened: %m\n", CTRL_DEV);
-		free(dev);
-		return NULL;
-	}
+	dev->ctrl_fd = ctrl_fd;
 
 	/* -1 means we ask ublk driver to allocate one free to us */
 	info->dev_id = data->dev_id;
@@ -208,6 +208,22 @@ struct ublksrv_ctrl_dev *__ublksrv_ctrl_init(struct ublksrv_dev_data *data, bool
 	return dev;
 }
 
+struct ublksrv_ctrl_dev *__ublksrv_ctrl_init(struct ublksrv_dev_data *data, bool recover)
+{
+	struct ublksrv_ctrl_dev *dev;
+	int fd = open(CTRL_DEV, O_RDWR);
+
+	if (fd < 0) {
+		fprintf(stderr, "control dev %s can't be opened: %m\n", CTRL_DEV);
+		return NULL;
+	}
+
+	dev = __ublksrv_ctrl_alloc(data, recover, fd);
+	if (!dev)
+		close(fd);
+	return dev;
+}
+
 struct ublksrv_ctrl_dev *ublksrv_ctrl_init(struct ublksrv_dev_data *data)
 {
 	return __ublksrv_ctrl_init(data, false);
@@ -447,6 +463,106 @@ int ublksrv_ctrl_get_info(struct ublksrv_ctrl_dev *dev)
 	return ret;
 }
 
+/*
+ * Retrieve info of many devices at once: GET_DEV_INFO2 for every device is
+ * queued on devs[0]'s ring and completed concurrently, so the control path
+ * round trip is paid once per ring-full instead of once per device. The
+ * rings of the other devices aren't touched.
+ *
+ * Any device whose batched command fails is retried via the synchronous
+ * ublksrv_ctrl_get_info(), which covers old drivers without ioctl encoding
+ * or GET_DEV_INFO2.
+ */
+int ublksrv_ctrl_get_info_batch(struct ublksrv_ctrl_dev *devs[], int nr,
+		int res[])
+{
+	const unsigned buf_sz = UBLKC_PATH_MAX + sizeof(struct ublksrv_ctrl_dev_info);
+	struct io_uring *ring;
+	char *bufs;
+	int next = 0, inflight = 0;
+	int i, ret, err = 0;
+
+	if (nr <= 0)
+		return 0;
+
+	ring = &devs[0]->ring;
+	bufs = calloc(nr, buf_sz);
+	if (!bufs)
+		return -ENOMEM;
+
+	for (i = 0; i < nr; i++)
+		res[i] = -EAGAIN;
+
+	while ((!err && next < nr) || inflight) {
+		struct io_uring_cqe *cqe;
+		unsigned head, count = 0;
+
+		while (!err && next < nr) {
+			struct ublksrv_ctrl_dev *dev = devs[next];
+			char *buf = &bufs[next * buf_sz];
+			struct ublksrv_ctrl_cmd_data data = {
+				.cmd_op	= UBLK_U_CMD_GET_DEV_INFO2,
+				.flags	= CTRL_CMD_HAS_BUF | CTRL_CMD_HAS_DATA |
+					CTRL_CMD_NO_TRANS,
+				.dev_path_len = UBLKC_PATH_MAX,
+				.addr = (__u64)buf,
+				.len = buf_sz,
+			};
+			struct io_uring_sqe *sqe = io_uring_get_sqe(ring);
+
+			if (!sqe)
+				break;
+			snprintf(buf, UBLKC_PATH_MAX, "%s%d", UBLKC_DEV,
+					dev->dev_info.dev_id);
+			ublksrv_ctrl_init_cmd(dev, sqe, &data);
+			io_uring_sqe_set_data64(sqe, next);
+			next++;
+			inflight++;
+		}
+
+		do {
+			ret = io_uring_submit_and_wait(ring, 1);
+		} while (ret == -EINTR);
+
+		io_uring_for_each_cqe(ring, head, cqe) {
+			int idx = cqe->user_data;
+
+			res[idx] = cqe->res;
+			if (cqe->res >= 0)
+				memcpy(&devs[idx]->dev_info,
+						&bufs[idx * buf_sz + UBLKC_PATH_MAX],
+						sizeof(devs[idx]->dev_info));
+			count++;
+		}
+		io_uring_cq_advance(ring, count);
+		inflight -= count;
+
+		if (ret < 0) {
+			fprintf(stderr, "uring submit_and_wait ret %d\n", ret);
+			/*
+			 * commands in flight or left in SQ still point to
+			 * bufs, so leak it if they can't be reaped any more
+			 */
+			if (err && !count)
+				return err;
+			/* stop queueing, and reap what is in flight */
+			err = ret;
+		}
+	}
+	free(bufs);
+
+	/* don't retry on the ring which fails */
+	if (err)
+		return err;
+
+	for (i = 0; i < nr; i++) {
+		if (res[i] < 0)
+			res[i] = ublksrv_ctrl_get_info(devs[i]);
+	}
+
+	return 0;
+}
+
 /*
  * Stop the ublksrv device:
  *
@@ -557,13 +673,26 @@ void ublksrv_ctrl_dump(struct ublksrv_ctrl_dev *dev, const char *jbuf)
 		char buf[4096];
 
 		for(i = 0; i < info->nr_hw_queues; i++) {
+			struct ublksrv_queue_prof prof;
 			unsigned tid;
+			int j;
 
 			ublksrv_json_read_queue_info(jbuf, i, &tid, buf, sizeof(buf));
 			/* try to retrieve queue pthread's affinity directly */
 			ublksrv_fill_q_thread_affinity(tid, buf, sizeof(buf));
 			printf("\tqueue %u: tid %d affinity(%s)\n",
 					i, tid, buf);
+
+			if (!ublksrv_json_read_queue_prof(jbuf, i, &prof) &&
+					prof.nr_ios) {
+				printf("\t\tcycles/io(%llu ios sampled):",
+						prof.nr_ios);
+				for (j = 0; j < UBLKSRV_PROF_NR_PHASES; j++)
+					printf(" %s %llu",
+						ublksrv_prof_phase_name(j),
+						prof.cycles[j] / prof.nr_ios);
+				printf("\n");
+			}
 		}
 
 		ublksrv_json_read_target_info(jbuf, buf, 512);
@@ -0,0 +1,868 @@
+// SPDX-License-Identifier: MIT or LGPL-2.1-only
+
+/*
+ * Userspace stand-in for ublk_drv, see ublksrv_emu.h
+ *
+ * Two sides are involved:
+ *
+ * - queue side: ublksrv_queue_io_cmd() and the batch helpers call
+ *   ublksrv_emu_queue_cmd()/ublksrv_emu_queue_batch_cmd() instead of
+ *   issuing uring_cmd to /dev/ublkcN. Commands are added to the per-queue
+ *   command list, and the emulator is woken up via eventfd.
+ *
+ * - emulator side: one single pthread consumes io commands, dispatches
+ *   requests by writing iod and posting cqe to the queue's io_uring via
+ *   IORING_OP_MSG_RING, and completes requests when they are committed.
+ */
+
+#include <config.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+
+#include "ublksrv_priv.h"
+#include "ublksrv_emu.h"
+
+/* fake io command op for each element of batch PREP/COMMIT */
+#define UBLK_EMU_OP_PREP_ELEM	0xf0
+#define UBLK_EMU_OP_COMMIT_ELEM	0xf1
+
+struct ublksrv_emu_cmd {
+	__u64 user_data;	/* for completing this io command */
+	__u64 addr;
+	__s32 result;
+	__u16 tag;
+	__u8  op;		/* _IOC_NR() of the io command */
+	__u8  pad;
+};
+
+enum {
+	EMU_TAG_IDLE,		/* not fetched by ublk server */
+	EMU_TAG_FETCHED,	/* fetched, can be allocated for new request */
+	EMU_TAG_BUSY,		/* request is dispatched to ublk server */
+};
+
+struct ublksrv_emu_rq {
+	const struct iovec *iov;
+	int nr_iov;
+	struct iovec buf;	/* for ublksrv_emu_queue_rq() */
+	void *rq_data;
+	__u64 user_data;	/* io command which will deliver this tag */
+	__u64 buf_addr;		/* io buffer of ublk server in copy mode */
+	unsigned char state;
+};
+
+/* armed multishot UBLK_U_IO_FETCH_IO_CMDS */
+struct ublksrv_emu_fetch {
+	__u64 user_data;
+	char *buf;
+	unsigned size;
+	unsigned off;
+	bool armed;
+};
+
+struct ublksrv_emu_queue {
+	/* shared with queue pthread, protected by lock */
+	pthread_spinlock_t lock;
+	struct ublksrv_emu_cmd *cmds;
+	unsigned nr_cmds;
+	int ring_fd;		/* -1 if the queue isn't attached */
+
+	/* only touched from emulator context */
+	struct ublksrv_emu_cmd *cmds_done;
+	unsigned max_cmds;
+	int q_id;
+	struct ublksrv_io_desc *iods;
+	struct ublksrv_emu_rq *rqs;
+	unsigned short *free_tags;
+	unsigned nr_free;
+	/* batch mode: dispatched tags which aren't posted to fetch buffer */
+	unsigned short *ready_tags;
+	unsigned nr_ready;
+	struct ublksrv_emu_fetch fetch[UBLK_BATCH_NR_FETCH_BUFS];
+};
+
+struct ublksrv_emu {
+	struct ublksrv_ctrl_dev *ctrl_dev;
+	ublksrv_emu_done_fn *done;
+
+	/* fake /dev/ublkcN */
+	int cdev_fd;
+	void *cmd_buf;
+	size_t cmd_buf_size;
+
+	/* wakeup emulator when io command is queued */
+	int efd;
+
+	/* for posting cqe to queue io_uring */
+	struct io_uring ring;
+
+	unsigned long flags;
+	int nr_queues;
+	int q_depth;
+	int nr_attached;
+	bool stopping;
+
+	struct ublksrv_emu_queue queues[0];
+};
+
+/* has to be same with queue_max_cmd_buf_sz() of ublksrv.c */
+static size_t ublksrv_emu_queue_cmd_buf_sz(void)
+{
+	unsigned int page_sz = getpagesize();
+
+	return round_up(UBLK_MAX_QUEUE_DEPTH * sizeof(struct ublksrv_io_desc),
+			page_sz);
+}
+
+static inline bool ublksrv_emu_batch(const struct ublksrv_emu *emu)
+{
+	return !!(emu->flags & UBLK_F_BATCH_IO);
+}
+
+static inline bool ublksrv_emu_user_copy(const struct ublksrv_emu *emu)
+{
+	return !!(emu->flags & UBLK_F_USER_COPY);
+}
+
+/*
+ * Called in queue pthread context
+ */
+static void ublksrv_emu_kick(struct ublksrv_emu *emu)
+{
+	__u64 data = 1;
+
+	if (write(emu->efd, &data, sizeof(data)) != sizeof(data))
+		ublk_err("%s: write eventfd failed\n", __func__);
+}
+
+static int ublksrv_emu_add_cmds(struct _ublksrv_queue *q,
+		const struct ublksrv_emu_cmd *cmds, unsigned nr)
+{
+	struct ublksrv_emu_queue *eq = q->emu;
+	struct ublksrv_emu *emu = q->dev->ctrl_dev->emu;
+	bool kick;
+
+	pthread_spin_lock(&eq->lock);
+	if (eq->nr_cmds + nr > eq->max_cmds) {
+		pthread_spin_unlock(&eq->lock);
+		ublk_err("%s: qid %d too many io commands %u/%u\n",
+				__func__, q->q_id, eq->nr_cmds, nr);
+		return -EBUSY;
+	}
+	kick = !eq->nr_cmds;
+	memcpy(&eq->cmds[eq->nr_cmds], cmds, nr * sizeof(*cmds));
+	eq->nr_cmds += nr;
+	pthread_spin_unlock(&eq->lock);
+
+	if (kick)
+		ublksrv_emu_kick(emu);
+	return 0;
+}
+
+int ublksrv_emu_queue_cmd(struct _ublksrv_queue *q, unsigned cmd_op,
+		unsigned tag, __u64 addr, int result, __u64 user_data)
+{
+	struct ublksrv_emu_cmd cmd = {
+		.user_data	= user_data,
+		.addr		= addr,
+		.result		= result,
+		.tag		= (__u16)tag,
+		.op		= (__u8)_IOC_NR(cmd_op),
+	};
+
+	return ublksrv_emu_add_cmds(q, &cmd, 1);
+}
+
+int ublksrv_emu_queue_batch_cmd(struct _ublksrv_queue *q, unsigned cmd_op,
+		const void *buf, unsigned len, unsigned short nr_elem,
+		__u64 user_data)
+{
+	struct ublksrv_emu_cmd *cmds;
+	unsigned elem_bytes = q->batch.commit_buf_elem_size;
+	unsigned op = _IOC_NR(cmd_op);
+	int i, ret;
+
+	/* FETCH_IO_CMDS is just armed, and completed in multishot way */
+	if (op == _IOC_NR(UBLK_U_IO_FETCH_IO_CMDS)) {
+		struct ublksrv_emu_cmd cmd = {
+			.user_data	= user_data,
+			.addr		= (__u64)buf,
+			.result		= (__s32)len,
+			.op		= (__u8)op,
+		};
+
+		return ublksrv_emu_add_cmds(q, &cmd, 1);
+	}
+
+	/*
+	 * Consume the element buffer now, so it can be reused by ublk
+	 * server once this command is completed
+	 */
+	cmds = (struct ublksrv_emu_cmd *)calloc(nr_elem + 1, sizeof(*cmds));
+	if (!cmds)
+		return -ENOMEM;
+
+	for (i = 0; i < nr_elem; i++) {
+		const struct ublk_batch_elem *elem = (const struct ublk_batch_elem *)
+			((const char *)buf + i * elem_bytes);
+
+		cmds[i].tag = elem->tag;
+		cmds[i].result = elem->result;
+		cmds[i].addr = elem_bytes >= sizeof(*elem) ? elem->buf_addr : 0;
+		cmds[i].op = op == _IOC_NR(UBLK_U_IO_PREP_IO_CMDS) ?
+			UBLK_EMU_OP_PREP_ELEM : UBLK_EMU_OP_COMMIT_ELEM;
+	}
+	cmds[nr_elem].user_data = user_data;
+	cmds[nr_elem].result = op == _IOC_NR(UBLK_U_IO_PREP_IO_CMDS) ? 0 :
+		(__s32)(elem_bytes * nr_elem);
+	cmds[nr_elem].op = (__u8)op;
+
+	ret = ublksrv_emu_add_cmds(q, cmds, nr_elem + 1);
+	free(cmds);
+	return ret;
+}
+
+int ublksrv_emu_cdev_fd(const struct ublksrv_emu *emu)
+{
+	return emu->cdev_fd;
+}
+
+int ublksrv_emu_attach_queue(struct ublksrv_emu *emu, struct _ublksrv_queue *q)
+{
+	struct ublksrv_emu_queue *eq = &emu->queues[q->q_id];
+
+	if (q->state & (UBLKSRV_ZERO_COPY | UBLKSRV_AUTO_ZC))
+		return -EOPNOTSUPP;
+
+	pthread_spin_lock(&eq->lock);
+	eq->ring_fd = q->ring.ring_fd;
+	pthread_spin_unlock(&eq->lock);
+
+	__atomic_add_fetch(&emu->nr_attached, 1, __ATOMIC_SEQ_CST);
+	q->emu = eq;
+
+	return 0;
+}
+
+void ublksrv_emu_detach_queue(struct _ublksrv_queue *q)
+{
+	struct ublksrv_emu *emu = q->dev->ctrl_dev->emu;
+	struct ublksrv_emu_queue *eq = q->emu;
+
+	pthread_spin_lock(&eq->lock);
+	eq->ring_fd = -1;
+	pthread_spin_unlock(&eq->lock);
+
+	__atomic_sub_fetch(&emu->nr_attached, 1, __ATOMIC_SEQ_CST);
+	q->emu = NULL;
+
+	/* so that emulator can figure out that this queue is gone */
+	ublksrv_emu_kick(emu);
+}
+
+/*
+ * Called in emulator context
+ */
+static int ublksrv_emu_queue_ring_fd(struct ublksrv_emu_queue *eq)
+{
+	int fd;
+
+	pthread_spin_lock(&eq->lock);
+	fd = eq->ring_fd;
+	pthread_spin_unlock(&eq->lock);
+
+	return fd;
+}
+
+static void ublksrv_emu_post(struct ublksrv_emu *emu,
+		struct ublksrv_emu_queue *eq, __u64 user_data, int res,
+		unsigned cqe_flags)
+{
+	int ring_fd = ublksrv_emu_queue_ring_fd(eq);
+	struct io_uring_sqe *sqe;
+
+	if (ring_fd < 0)
+		return;
+
+	sqe = ublksrv_alloc_sqe(&emu->ring);
+	if (!sqe) {
+		ublk_err("%s: qid %d run out of sqe\n", __func__, eq->q_id);
+		return;
+	}
+
+	if (cqe_flags)
+		io_uring_prep_msg_ring_cqe_flags(sqe, ring_fd, (unsigned)res,
+				user_data, 0, cqe_flags);
+	else
+		io_uring_prep_msg_ring(sqe, ring_fd, (unsigned)res,
+				user_data, 0);
+	sqe->flags |= IOSQE_CQE_SKIP_SUCCESS;
+	io_uring_sqe_set_data64(sqe, user_data);
+}
+
+static unsigned ublksrv_emu_rq_bytes(const struct ublksrv_io_desc *iod)
+{
+	return iod->nr_sectors << 9;
+}
+
+/* copy 'len' bytes between request iovec and io buffer of ublk server */
+static int ublksrv_emu_copy(struct ublksrv_emu *emu,
+		struct ublksrv_emu_queue *eq, int tag, unsigned len,
+		bool to_server)
+{
+	const struct ublksrv_emu_rq *rq = &eq->rqs[tag];
+	unsigned off = 0;
+	int i;
+
+	if (!ublksrv_emu_user_copy(emu) && !rq->buf_addr)
+		return -EFAULT;
+
+	for (i = 0; i < rq->nr_iov && off < len; i++) {
+		void *base = rq->iov[i].iov_base;
+		unsigned bytes = rq->iov[i].iov_len;
+
+		if (bytes > len - off)
+			bytes = len - off;
+
+		if (ublksrv_emu_user_copy(emu)) {
+			__u64 pos = ublk_pos(eq->q_id, tag, off);
+			ssize_t ret = to_server ?
+				pwrite(emu->cdev_fd, base, bytes, pos) :
+				pread(emu->cdev_fd, base, bytes, pos);
+
+			if (ret != bytes)
+				return -EIO;
+		} else if (to_server)
+			memcpy((char *)rq->buf_addr + off, base, bytes);
+		else
+			memcpy(base, (char *)rq->buf_addr + off, bytes);
+		off += bytes;
+	}
+
+	return off == len ? 0 : -EFAULT;
+}
+
+/* write data is visible to ublk server before the request is dispatched */
+static int ublksrv_emu_copy_to_server(struct ublksrv_emu *emu,
+		struct ublksrv_emu_queue *eq, int tag)
+{
+	return ublksrv_emu_copy(emu, eq, tag,
+			ublksrv_emu_rq_bytes(&eq->iods[tag]), true);
+}
+
+static void ublksrv_emu_copy_from_server(struct ublksrv_emu *emu,
+		struct ublksrv_emu_queue *eq, int tag, int res)
+{
+	unsigned len = ublksrv_emu_rq_bytes(&eq->iods[tag]);
+
+	if ((unsigned)res < len)
+		len = res;
+
+	if (ublksrv_emu_copy(emu, eq, tag, len, false))
+		ublk_err("%s: qid %d tag %d copy failed\n",
+				__func__, eq->q_id, tag);
+}
+
+static void ublksrv_emu_tag_fetched(struct ublksrv_emu *emu,
+		struct ublksrv_emu_queue *eq, int tag, __u64 user_data)
+{
+	struct ublksrv_emu_rq *rq = &eq->rqs[tag];
+
+	if (emu->stopping) {
+		rq->state = EMU_TAG_IDLE;
+		if (!ublksrv_emu_batch(emu))
+			ublksrv_emu_post(emu, eq, user_data, UBLK_IO_RES_ABORT, 0);
+		return;
+	}
+
+	rq->user_data = user_data;
+	rq->state = EMU_TAG_FETCHED;
+	eq->free_tags[eq->nr_free++] = tag;
+}
+
+static int ublksrv_emu_complete_rq(struct ublksrv_emu *emu,
+		struct ublksrv_emu_queue *eq, int tag, int res)
+{
+	struct ublksrv_emu_rq *rq = &eq->rqs[tag];
+
+	if (rq->state != EMU_TAG_BUSY) {
+		ublk_err("%s: qid %d tag %d isn't inflight\n",
+				__func__, eq->q_id, tag);
+		return 0;
+	}
+
+	if (ublksrv_get_op(&eq->iods[tag]) == UBLK_IO_OP_READ && res > 0)
+		ublksrv_emu_copy_from_server(emu, eq, tag, res);
+
+	rq->state = EMU_TAG_IDLE;
+	emu->done(emu, eq->q_id, tag, res, rq->rq_data);
+
+	return 1;
+}
+
+static int ublksrv_emu_handle_cmd(struct ublksrv_emu *emu,
+		struct ublksrv_emu_queue *eq, const struct ublksrv_emu_cmd *cmd)
+{
+	unsigned tag = cmd->tag;
+	int done = 0;
+
+	switch (cmd->op) {
+	case _IOC_NR(UBLK_U_IO_PREP_IO_CMDS):
+	case _IOC_NR(UBLK_U_IO_COMMIT_IO_CMDS):
+		ublksrv_emu_post(emu, eq, cmd->user_data, cmd->result, 0);
+		return 0;
+	case _IOC_NR(UBLK_U_IO_FETCH_IO_CMDS): {
+		unsigned idx = user_data_to_tag(cmd->user_data);
+		struct ublksrv_emu_fetch *f;
+
+		if (idx >= UBLK_BATCH_NR_FETCH_BUFS)
+			return -EINVAL;
+		if (emu->stopping) {
+			ublksrv_emu_post(emu, eq, cmd->user_data, -ENODEV, 0);
+			return 0;
+		}
+		f = &eq->fetch[idx];
+		f->user_data = cmd->user_data;
+		f->buf = (char *)cmd->addr;
+		f->size = cmd->result;
+		f->off = 0;
+		f->armed = true;
+		return 0;
+	}
+	}
+
+	if (tag >= (unsigned)emu->q_depth) {
+		ublk_err("%s: qid %d invalid tag %u op %x\n",
+				__func__, eq->q_id, tag, cmd->op);
+		return -EINVAL;
+	}
+
+	switch (cmd->op) {
+	case _IOC_NR(UBLK_IO_COMMIT_AND_FETCH_REQ):
+		done = ublksrv_emu_complete_rq(emu, eq, tag, cmd->result);
+		/* fall through */
+	case _IOC_NR(UBLK_IO_FETCH_REQ):
+		eq->rqs[tag].buf_addr = cmd->addr;
+		ublksrv_emu_tag_fetched(emu, eq, tag, cmd->user_data);
+		break;
+	case _IOC_NR(UBLK_IO_NEED_GET_DATA):
+		eq->rqs[tag].buf_addr = cmd->addr;
+		eq->rqs[tag].user_data = cmd->user_data;
+		ublksrv_emu_post(emu, eq, cmd->user_data,
+				ublksrv_emu_copy_to_server(emu, eq, tag) ?
+				UBLK_IO_RES_ABORT : UBLK_IO_RES_OK, 0);
+		break;
+	case UBLK_EMU_OP_COMMIT_ELEM:
+		done = ublksrv_emu_complete_rq(emu, eq, tag, cmd->result);
+		/* fall through */
+	case UBLK_EMU_OP_PREP_ELEM:
+		if (cmd->addr)
+			eq->rqs[tag].buf_addr = cmd->addr;
+		ublksrv_emu_tag_fetched(emu, eq, tag, 0);
+		break;
+	default:
+		ublk_err("%s: qid %d unknown io command %x\n",
+				__func__, eq->q_id, cmd->op);
+		return -EINVAL;
+	}
+
+	return done;
+}
+
+static int ublksrv_emu_handle_cmds(struct ublksrv_emu *emu,
+		struct ublksrv_emu_queue *eq)
+{
+	struct ublksrv_emu_cmd *cmds;
+	unsigned i, nr;
+	int done = 0;
+
+	pthread_spin_lock(&eq->lock);
+	cmds = eq->cmds;
+	nr = eq->nr_cmds;
+	eq->cmds = eq->cmds_done;
+	eq->nr_cmds = 0;
+	pthread_spin_unlock(&eq->lock);
+	eq->cmds_done = cmds;
+
+	for (i = 0; i < nr; i++) {
+		int ret = ublksrv_emu_handle_cmd(emu, eq, &cmds[i]);
+
+		if (ret > 0)
+			done += ret;
+	}
+
+	return done;
+}
+
+/* fill tags into the armed fetch buffer, and post the multishot cqe */
+static void ublksrv_emu_post_ready_tags(struct ublksrv_emu *emu,
+		struct ublksrv_emu_queue *eq)
+{
+	unsigned posted = 0;
+	int i;
+
+	for (i = 0; i < UBLK_BATCH_NR_FETCH_BUFS && posted < eq->nr_ready; i++) {
+		struct ublksrv_emu_fetch *f = &eq->fetch[i];
+		unsigned nr, bytes;
+
+		if (!f->armed)
+			continue;
+
+		nr = (f->size - f->off) / 2;
+		if (nr > eq->nr_ready - posted)
+			nr = eq->nr_ready - posted;
+		bytes = nr * 2;
+
+		memcpy(f->buf + f->off, &eq->ready_tags[posted], bytes);
+		f->off += bytes;
+		posted += nr;
+
+		/* multishot is terminated once the buffer is used up */
+		if (f->size - f->off < 2) {
+			f->armed = false;
+			ublksrv_emu_post(emu, eq, f->user_data, bytes, 0);
+		} else
+			ublksrv_emu_post(emu, eq, f->user_data, bytes,
+					IORING_CQE_F_MORE);
+	}
+
+	eq->nr_ready -= posted;
+	if (eq->nr_ready)
+		memmove(eq->ready_tags, &eq->ready_tags[posted],
+				eq->nr_ready * sizeof(eq->ready_tags[0]));
+}
+
+/* 'iov' is NULL if data is in one buffer */
+static int __ublksrv_emu_queue_rq(struct ublksrv_emu *emu, int q_id,
+		unsigned op, unsigned long long start_sector,
+		unsigned nr_sectors, const struct iovec *iov, int nr_iov,
+		void *buf, void *rq_data)
+{
+	struct ublksrv_emu_queue *eq;
+	struct ublksrv_io_desc *iod;
+	struct ublksrv_emu_rq *rq;
+	int tag, res = UBLK_IO_RES_OK;
+
+	if (q_id < 0 || q_id >= emu->nr_queues)
+		return -EINVAL;
+	if (emu->stopping)
+		return -ENODEV;
+	/* discard & write zeroes don't carry data */
+	if ((op == UBLK_IO_OP_READ || op == UBLK_IO_OP_WRITE) &&
+			(nr_sectors << 9) > emu->ctrl_dev->dev_info.max_io_buf_bytes)
+		return -EINVAL;
+
+	eq = &emu->queues[q_id];
+	if (!eq->nr_free)
+		return -EBUSY;
+
+	tag = eq->free_tags[--eq->nr_free];
+	rq = &eq->rqs[tag];
+	if (iov == NULL) {
+		rq->buf.iov_base = buf;
+		rq->buf.iov_len = nr_sectors << 9;
+		iov = &rq->buf;
+		nr_iov = 1;
+	}
+	rq->iov = iov;
+	rq->nr_iov = nr_iov;
+	rq->rq_data = rq_data;
+	rq->state = EMU_TAG_BUSY;
+
+	iod = &eq->iods[tag];
+	iod->op_flags = op;
+	iod->nr_sectors = nr_sectors;
+	iod->start_sector = start_sector;
+	iod->addr = ublksrv_emu_user_copy(emu) ? 0 : rq->buf_addr;
+
+	if (op == UBLK_IO_OP_WRITE) {
+		if ((emu->flags & UBLK_F_NEED_GET_DATA) &&
+				!ublksrv_emu_user_copy(emu) &&
+				!ublksrv_emu_batch(emu))
+			res = UBLK_IO_RES_NEED_GET_DATA;
+		else if (ublksrv_emu_copy_to_server(emu, eq, tag)) {
+			rq->state = EMU_TAG_FETCHED;
+			eq->free_tags[eq->nr_free++] = tag;
+			return -EFAULT;
+		}
+	}
+
+	if (ublksrv_emu_batch(emu))
+		eq->ready_tags[eq->nr_ready++] = tag;
+	else
+		ublksrv_emu_post(emu, eq, rq->user_data, res, 0);
+
+	return tag;
+}
+
+int ublksrv_emu_queue_rq(struct ublksrv_emu *emu, int q_id, unsigned op,
+		unsigned long long start_sector, unsigned nr_sectors,
+		void *buf, void *rq_data)
+{
+	return __ublksrv_emu_queue_rq(emu, q_id, op, start_sector,
+			nr_sectors, NULL, 0, buf, rq_data);
+}
+
+int ublksrv_emu_queue_rq_iov(struct ublksrv_emu *emu, int q_id, unsigned op,
+		unsigned long long start_sector, unsigned nr_sectors,
+		const struct iovec *iov, int nr_iov, void *rq_data)
+{
+	if (!iov || nr_iov <= 0)
+		return -EINVAL;
+	return __ublksrv_emu_queue_rq(emu, q_id, op, start_sector,
+			nr_sectors, iov, nr_iov, NULL, rq_data);
+}
+
+int ublksrv_emu_submit(struct ublksrv_emu *emu)
+{
+	struct io_uring_cqe *cqe;
+	unsigned head, cnt = 0;
+	int i, ret;
+
+	if (ublksrv_emu_batch(emu)) {
+		for (i = 0; i < emu->nr_queues; i++)
+			if (emu->queues[i].nr_ready)
+				ublksrv_emu_post_ready_tags(emu,
+						&emu->queues[i]);
+	}
+
+	ret = io_uring_submit(&emu->ring);
+
+	/* only failed MSG_RING generates cqe */
+	io_uring_for_each_cqe(&emu->ring, head, cqe) {
+		ublk_err("%s: post cqe (tag %u op %x) failed %d\n",
+				__func__, user_data_to_tag(cqe->user_data),
+				user_data_to_op(cqe->user_data), cqe->res);
+		cnt++;
+	}
+	io_uring_cq_advance(&emu->ring, cnt);
+
+	return ret;
+}
+
+int ublksrv_emu_reap(struct ublksrv_emu *emu, int timeout_ms)
+{
+	struct pollfd pfd = {
+		.fd	= emu->efd,
+		.events	= POLLIN,
+	};
+	__u64 data;
+	int i, done = 0;
+
+	if (timeout_ms && poll(&pfd, 1, timeout_ms) < 0 && errno != EINTR)
+		return -errno;
+
+	/* clear eventfd before handling commands, so no wakeup is lost */
+	if (read(emu->efd, &data, sizeof(data)) < 0 && errno != EAGAIN)
+		return -errno;
+
+	for (i = 0; i < emu->nr_queues; i++)
+		done += ublksrv_emu_handle_cmds(emu, &emu->queues[i]);
+
+	ublksrv_emu_submit(emu);
+
+	if (!done && emu->stopping &&
+			!__atomic_load_n(&emu->nr_attached, __ATOMIC_SEQ_CST))
+		return -ENODEV;
+
+	return done;
+}
+
+void ublksrv_emu_stop(struct ublksrv_emu *emu)
+{
+	int i, j;
+
+	if (emu->stopping)
+		return;
+
+	/* deliver what is dispatched already before aborting fetch */
+	ublksrv_emu_submit(emu);
+
+	emu->stopping = true;
+	emu->ctrl_dev->dev_info.state = UBLK_S_DEV_DEAD;
+
+	for (i = 0; i < emu->nr_queues; i++) {
+		struct ublksrv_emu_queue *eq = &emu->queues[i];
+
+		while (eq->nr_free) {
+			int tag = eq->free_tags[--eq->nr_free];
+
+			eq->rqs[tag].state = EMU_TAG_IDLE;
+			if (!ublksrv_emu_batch(emu))
+				ublksrv_emu_post(emu, eq, eq->rqs[tag].user_data,
+						UBLK_IO_RES_ABORT, 0);
+		}
+
+		for (j = 0; j < UBLK_BATCH_NR_FETCH_BUFS; j++) {
+			struct ublksrv_emu_fetch *f = &eq->fetch[j];
+
+			if (!f->armed)
+				continue;
+			f->armed = false;
+			ublksrv_emu_post(emu, eq, f->user_data, -ENODEV, 0);
+		}
+	}
+
+	ublksrv_emu_submit(emu);
+}
+
+struct ublksrv_ctrl_dev *ublksrv_emu_get_ctrl_dev(const struct ublksrv_emu *emu)
+{
+	return emu->ctrl_dev;
+}
+
+int ublksrv_emu_get_fd(const struct ublksrv_emu *emu)
+{
+	return emu->efd;
+}
+
+static int ublksrv_emu_init_queue(struct ublksrv_emu *emu, int q_id)
+{
+	struct ublksrv_emu_queue *eq = &emu->queues[q_id];
+	int depth = emu->q_depth;
+
+	pthread_spin_init(&eq->lock, PTHREAD_PROCESS_PRIVATE);
+	eq->ring_fd = -1;
+	eq->q_id = q_id;
+	eq->iods = (struct ublksrv_io_desc *)((char *)emu->cmd_buf +
+			q_id * ublksrv_emu_queue_cmd_buf_sz());
+
+	/*
+	 * Each tag has at most one io command or batch element in the
+	 * list, and each batch command takes one more entry
+	 */
+	eq->max_cmds = depth * 2 + UBLK_BATCH_NR_FETCH_BUFS + 1;
+	eq->cmds = (struct ublksrv_emu_cmd *)calloc(eq->max_cmds,
+			sizeof(struct ublksrv_emu_cmd));
+	eq->cmds_done = (struct ublksrv_emu_cmd *)calloc(eq->max_cmds,
+			sizeof(struct ublksrv_emu_cmd));
+	eq->rqs = (struct ublksrv_emu_rq *)calloc(depth,
+			sizeof(struct ublksrv_emu_rq));
+	eq->free_tags = (unsigned short *)calloc(depth, sizeof(unsigned short));
+	eq->ready_tags = (unsigned short *)calloc(depth, sizeof(unsigned short));
+
+	if (!eq->cmds || !eq->cmds_done || !eq->rqs || !eq->free_tags ||
+			!eq->ready_tags)
+		return -ENOMEM;
+	return 0;
+}
+
+static void ublksrv_emu_deinit_queue(struct ublksrv_emu_queue *eq)
+{
+	free(eq->cmds);
+	free(eq->cmds_done);
+	free(eq->rqs);
+	free(eq->free_tags);
+	free(eq->ready_tags);
+}
+
+void ublksrv_emu_deinit(struct ublksrv_emu *emu)
+{
+	int i;
+
+	if (emu->ctrl_dev)
+		ublksrv_ctrl_deinit(emu->ctrl_dev);
+
+	for (i = 0; i < emu->nr_queues; i++)
+		ublksrv_emu_deinit_queue(&emu->queues[i]);
+
+	if (emu->ring.ring_fd > 0)
+		io_uring_queue_exit(&emu->ring);
+	if (emu->efd >= 0)
+		close(emu->efd);
+	if (emu->cmd_buf)
+		munmap(emu->cmd_buf, emu->cmd_buf_size);
+	if (emu->cdev_fd >= 0)
+		close(emu->cdev_fd);
+	free(emu);
+}
+
+struct ublksrv_emu *ublksrv_emu_init(struct ublksrv_dev_data *data,
+		ublksrv_emu_done_fn *done)
+{
+	struct ublksrv_ctrl_dev_info *info;
+	struct ublksrv_emu *emu;
+	int i, ret;
+
+	if (!done || !data->nr_hw_queues ||
+			data->nr_hw_queues > MAX_NR_HW_QUEUES ||
+			!data->queue_depth ||
+			data->queue_depth > UBLK_MAX_QUEUE_DEPTH ||
+			data->max_io_buf_bytes > UBLK_IO_BUF_BITS_MASK + 1) {
+		ublk_err("%s: invalid device setting\n", __func__);
+		return NULL;
+	}
+
+	if (data->flags & (UBLK_F_SUPPORT_ZERO_COPY | UBLK_F_AUTO_BUF_REG)) {
+		ublk_err("%s: zero copy can't be emulated\n", __func__);
+		return NULL;
+	}
+
+	emu = (struct ublksrv_emu *)calloc(1, sizeof(*emu) +
+			data->nr_hw_queues * sizeof(struct ublksrv_emu_queue));
+	if (!emu)
+		return NULL;
+
+	emu->done = done;
+	emu->flags = data->flags;
+	emu->nr_queues = data->nr_hw_queues;
+	emu->q_depth = data->queue_depth;
+	emu->efd = -1;
+	emu->ring.ring_fd = -1;
+
+	/* sparse file covers both io cmd buffer and user copy space */
+	emu->cdev_fd = memfd_create("ublkc-emu", MFD_CLOEXEC);
+	if (emu->cdev_fd < 0) {
+		ublk_err("%s: memfd_create failed %s\n", __func__,
+				strerror(errno));
+		goto fail;
+	}
+	if (ftruncate(emu->cdev_fd, UBLKSRV_IO_BUF_OFFSET +
+				UBLKSRV_IO_BUF_TOTAL_SIZE)) {
+		ublk_err("%s: ftruncate failed %s\n", __func__,
+				strerror(errno));
+		goto fail;
+	}
+
+	emu->cmd_buf_size = ublksrv_emu_queue_cmd_buf_sz() * emu->nr_queues;
+	emu->cmd_buf = mmap(NULL, emu->cmd_buf_size, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, emu->cdev_fd,
+			UBLKSRV_CMD_BUF_OFFSET);
+	if (emu->cmd_buf == MAP_FAILED) {
+		emu->cmd_buf = NULL;
+		ublk_err("%s: map io cmd buffer failed\n", __func__);
+		goto fail;
+	}
+
+	emu->efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (emu->efd < 0)
+		goto fail;
+
+	ret = io_uring_queue_init(emu->q_depth, &emu->ring, 0);
+	if (ret < 0) {
+		emu->ring.ring_fd = -1;
+		ublk_err("%s: setup io_uring failed %d\n", __func__, ret);
+		goto fail;
+	}
+
+	for (i = 0; i < emu->nr_queues; i++) {
+		if (ublksrv_emu_init_queue(emu, i))
+			goto fail;
+	}
+
+	emu->ctrl_dev = __ublksrv_ctrl_alloc(data, false, -1);
+	if (!emu->ctrl_dev)
+		goto fail;
+
+	emu->ctrl_dev->emu = emu;
+	info = &emu->ctrl_dev->dev_info;
+	if (data->dev_id < 0)
+		info->dev_id = 0;
+	info->state = UBLK_S_DEV_LIVE;
+	info->ublksrv_pid = getpid();
+
+	return emu;
+fail:
+	ublksrv_emu_deinit(emu);
+	return NULL;
+}
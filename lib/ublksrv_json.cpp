@@ -549,6 +549,69 @@ int ublksrv_json_read_queue_info(const char *jbuf, int qid, unsigned *tid,
 	return -EINVAL;
 }
 
+static int ublksrv_json_write_queue_prof(char *jbuf, int len, int qid,
+		const struct ublksrv_queue_prof *prof)
+{
+	json j, pj;
+	char name[16];
+	int i;
+
+	parse_json(j, jbuf);
+
+	snprintf(name, 16, "%d", qid);
+
+	pj["nr_loops"] = prof->nr_loops;
+	pj["nr_ios"] = prof->nr_ios;
+	for (i = 0; i < UBLKSRV_PROF_NR_PHASES; i++)
+		pj[ublksrv_prof_phase_name(i)] = prof->cycles[i];
+	j["queues"][std::string(name)]["prof"] = pj;
+
+	return dump_json_to_buf(j, jbuf, len);
+}
+
+int ublk_json_write_queue_prof(const struct ublksrv_ctrl_dev *cdev,
+		unsigned int qid, const struct ublksrv_queue_prof *prof)
+{
+	struct ublksrv_tgt_jbuf *j = ublksrv_tgt_get_jbuf(cdev);
+	int ret = 0;
+
+	if (!j)
+		return -EINVAL;
+
+	pthread_mutex_lock(&j->lock);
+	do {
+		ret = ublksrv_json_write_queue_prof(j->jbuf, j->jbuf_size,
+				qid, prof);
+	} while (ret < 0 && tgt_realloc_jbuf(j));
+	pthread_mutex_unlock(&j->lock);
+
+	return ret;
+}
+
+int ublksrv_json_read_queue_prof(const char *jbuf, int qid,
+		struct ublksrv_queue_prof *prof)
+{
+	json j;
+	char name[16];
+	int i;
+
+	parse_json(j, jbuf);
+
+	snprintf(name, 16, "%d", qid);
+
+	if (!j.contains("queues") || !j["queues"].contains(name) ||
+			!j["queues"][name].contains("prof"))
+		return -ENOENT;
+
+	auto pj = j["queues"][name]["prof"];
+
+	prof->nr_loops = pj["nr_loops"];
+	prof->nr_ios = pj["nr_ios"];
+	for (i = 0; i < UBLKSRV_PROF_NR_PHASES; i++)
+		prof->cycles[i] = pj.value(ublksrv_prof_phase_name(i), 0ULL);
+	return 0;
+}
+
 void ublksrv_json_dump(const char *jbuf)
 {
 	auto j = json::parse(jbuf);
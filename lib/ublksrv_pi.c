@@ -0,0 +1,407 @@
+// SPDX-License-Identifier: MIT or LGPL-2.1-only
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <errno.h>
+#include <endian.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "ublksrv_pi.h"
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#define UBLKSRV_PI_CLMUL
+#endif
+
+#define CRC16_T10DIF_POLY	0x8bb7
+#define CRC64_NVME_POLY		0xad93d23594c93659ULL
+/* CRC64 NVMe is reflected, so bit reversed polynomial is used by table */
+#define CRC64_NVME_POLY_REV	0x9a6c9329ac4bc9b5ULL
+/* reflected Castagnoli polynomial */
+#define CRC32C_POLY_REV		0x82f63b78
+
+static __u16 crc16_table[256];
+static __u32 crc32c_table[256];
+static __u64 crc64_table[256];
+static pthread_once_t pi_init_once = PTHREAD_ONCE_INIT;
+
+#ifdef UBLKSRV_PI_CLMUL
+/*
+ * Constants for folding 128bit 'X = H * x^64 + L' forward by 'D' bits:
+ *
+ * 	X * x^D = H * (x^(D + 64) mod P) + L * (x^D mod P)
+ *
+ * which is congruent with X * x^D modulo P, and the result still fits in
+ * 128bit, so the whole buffer is folded into 128bit, then the remainder is
+ * computed by lookup table. Folding by 512 bits is used for running four
+ * independent folding streams for hiding PCLMULQDQ latency.
+ *
+ * For reflected CRC64, the product of two reflected 64bit values is shifted
+ * by one bit, which is compensated by using x^(D - 1) and x^(D + 63).
+ *
+ * [0] is multiplied with the low 64bit lane, [1] with the high lane.
+ */
+static __u64 crc16_fold_128[2], crc16_fold_512[2];
+static __u64 crc64_fold_128[2], crc64_fold_512[2];
+static bool pi_has_clmul;
+static bool pi_has_sse42;
+#endif
+
+/* x^n mod P, normal bit order */
+static __u64 crc16_xpow(unsigned n)
+{
+	__u32 r = 1;
+
+	while (n--) {
+		r <<= 1;
+		if (r & 0x10000)
+			r ^= 0x10000 | CRC16_T10DIF_POLY;
+	}
+	return r;
+}
+
+static __u64 bitrev64(__u64 v)
+{
+	__u64 r = 0;
+	int i;
+
+	for (i = 0; i < 64; i++)
+		if (v & (1ULL << i))
+			r |= 1ULL << (63 - i);
+	return r;
+}
+
+/* x^n mod P, reflected bit order */
+static __u64 crc64_xpow_rev(unsigned n)
+{
+	__u64 r = 1;
+
+	while (n--) {
+		bool carry = r >> 63;
+
+		r <<= 1;
+		if (carry)
+			r ^= CRC64_NVME_POLY;
+	}
+	return bitrev64(r);
+}
+
+static void ublksrv_pi_init(void)
+{
+	int i, j;
+
+	for (i = 0; i < 256; i++) {
+		__u16 c16 = i << 8;
+		__u32 c32 = i;
+		__u64 c64 = i;
+
+		for (j = 0; j < 8; j++) {
+			c16 = (c16 & 0x8000) ? (c16 << 1) ^ CRC16_T10DIF_POLY :
+				c16 << 1;
+			c32 = (c32 & 1) ? (c32 >> 1) ^ CRC32C_POLY_REV :
+				c32 >> 1;
+			c64 = (c64 & 1) ? (c64 >> 1) ^ CRC64_NVME_POLY_REV :
+				c64 >> 1;
+		}
+		crc16_table[i] = c16;
+		crc32c_table[i] = c32;
+		crc64_table[i] = c64;
+	}
+
+#ifdef UBLKSRV_PI_CLMUL
+	crc16_fold_128[0] = crc16_xpow(128);
+	crc16_fold_128[1] = crc16_xpow(128 + 64);
+	crc16_fold_512[0] = crc16_xpow(512);
+	crc16_fold_512[1] = crc16_xpow(512 + 64);
+
+	crc64_fold_128[0] = crc64_xpow_rev(128 + 63);
+	crc64_fold_128[1] = crc64_xpow_rev(128 - 1);
+	crc64_fold_512[0] = crc64_xpow_rev(512 + 63);
+	crc64_fold_512[1] = crc64_xpow_rev(512 - 1);
+
+	__builtin_cpu_init();
+	pi_has_clmul = __builtin_cpu_supports("pclmul") &&
+		__builtin_cpu_supports("ssse3");
+	pi_has_sse42 = __builtin_cpu_supports("sse4.2");
+#endif
+}
+
+static __u16 crc16_table_update(__u16 crc, const __u8 *p, size_t len)
+{
+	while (len--)
+		crc = (crc << 8) ^ crc16_table[((crc >> 8) ^ *p++) & 0xff];
+	return crc;
+}
+
+static __u32 crc32c_table_update(__u32 crc, const __u8 *p, size_t len)
+{
+	while (len--)
+		crc = (crc >> 8) ^ crc32c_table[(crc ^ *p++) & 0xff];
+	return crc;
+}
+
+static __u64 crc64_table_update(__u64 crc, const __u8 *p, size_t len)
+{
+	while (len--)
+		crc = (crc >> 8) ^ crc64_table[(crc ^ *p++) & 0xff];
+	return crc;
+}
+
+#ifdef UBLKSRV_PI_CLMUL
+#define PI_CLMUL_TARGET __attribute__((target("pclmul,ssse3")))
+
+static inline PI_CLMUL_TARGET __m128i pi_fold(__m128i x, __m128i k)
+{
+	return _mm_xor_si128(_mm_clmulepi64_si128(x, k, 0x00),
+			_mm_clmulepi64_si128(x, k, 0x11));
+}
+
+/*
+ * Fold 'len' bytes(len >= 16) into 16 bytes stored in 'out', 'init' is
+ * xor-ed into the first block. 'bswap' is for CRC in normal bit order,
+ * in which the first byte is the highest degree.
+ */
+static PI_CLMUL_TARGET void pi_clmul_fold(const __u8 *p, size_t len,
+		__m128i init, const __u64 *k128, const __u64 *k512,
+		bool bswap, __u8 *out)
+{
+	const __m128i shuf = _mm_set_epi8(0, 1, 2, 3, 4, 5, 6, 7,
+			8, 9, 10, 11, 12, 13, 14, 15);
+	const __m128i kf1 = _mm_set_epi64x(k128[1], k128[0]);
+	const __m128i kf4 = _mm_set_epi64x(k512[1], k512[0]);
+	__m128i x;
+
+#define PI_LOAD(ptr)	(bswap ? _mm_shuffle_epi8(_mm_loadu_si128( \
+		(const __m128i *)(ptr)), shuf) : \
+		_mm_loadu_si128((const __m128i *)(ptr)))
+
+	x = _mm_xor_si128(PI_LOAD(p), init);
+	if (len >= 128) {
+		__m128i x1 = PI_LOAD(p + 16);
+		__m128i x2 = PI_LOAD(p + 32);
+		__m128i x3 = PI_LOAD(p + 48);
+
+		p += 64;
+		len -= 64;
+		while (len >= 64) {
+			x = _mm_xor_si128(pi_fold(x, kf4), PI_LOAD(p));
+			x1 = _mm_xor_si128(pi_fold(x1, kf4), PI_LOAD(p + 16));
+			x2 = _mm_xor_si128(pi_fold(x2, kf4), PI_LOAD(p + 32));
+			x3 = _mm_xor_si128(pi_fold(x3, kf4), PI_LOAD(p + 48));
+			p += 64;
+			len -= 64;
+		}
+		x = _mm_xor_si128(pi_fold(x, kf1), x1);
+		x = _mm_xor_si128(pi_fold(x, kf1), x2);
+		x = _mm_xor_si128(pi_fold(x, kf1), x3);
+	} else {
+		p += 16;
+		len -= 16;
+	}
+
+	while (len >= 16) {
+		x = _mm_xor_si128(pi_fold(x, kf1), PI_LOAD(p));
+		p += 16;
+		len -= 16;
+	}
+#undef PI_LOAD
+
+	if (bswap)
+		x = _mm_shuffle_epi8(x, shuf);
+	_mm_storeu_si128((__m128i *)out, x);
+}
+
+/* crc32 instruction computes reflected CRC32C without inversion */
+static __attribute__((target("sse4.2"))) __u32 crc32c_sse42_update(__u32 crc,
+		const __u8 *p, size_t len)
+{
+	__u64 c = crc;
+
+	while (len && ((unsigned long)p & 7)) {
+		c = _mm_crc32_u8((__u32)c, *p++);
+		len--;
+	}
+	while (len >= 8) {
+		__u64 v;
+
+		memcpy(&v, p, 8);
+		c = _mm_crc32_u64(c, v);
+		p += 8;
+		len -= 8;
+	}
+	while (len--)
+		c = _mm_crc32_u8((__u32)c, *p++);
+	return (__u32)c;
+}
+#endif
+
+__u16 ublksrv_crc16_t10dif(__u16 crc, const void *buf, size_t len)
+{
+	const __u8 *p = (const __u8 *)buf;
+
+	pthread_once(&pi_init_once, ublksrv_pi_init);
+#ifdef UBLKSRV_PI_CLMUL
+	if (pi_has_clmul && len >= 16) {
+		__u8 rem[16];
+		size_t folded = len & ~15UL;
+
+		pi_clmul_fold(p, folded, _mm_set_epi64x((__u64)crc << 48, 0),
+				crc16_fold_128, crc16_fold_512, true, rem);
+		crc = crc16_table_update(0, rem, 16);
+		p += folded;
+		len -= folded;
+	}
+#endif
+	return crc16_table_update(crc, p, len);
+}
+
+__u64 ublksrv_crc64_nvme(__u64 crc, const void *buf, size_t len)
+{
+	const __u8 *p = (const __u8 *)buf;
+
+	pthread_once(&pi_init_once, ublksrv_pi_init);
+	crc = ~crc;
+#ifdef UBLKSRV_PI_CLMUL
+	if (pi_has_clmul && len >= 16) {
+		__u8 rem[16];
+		size_t folded = len & ~15UL;
+
+		pi_clmul_fold(p, folded, _mm_set_epi64x(0, crc),
+				crc64_fold_128, crc64_fold_512, false, rem);
+		crc = crc64_table_update(0, rem, 16);
+		p += folded;
+		len -= folded;
+	}
+#endif
+	return ~crc64_table_update(crc, p, len);
+}
+
+__u32 ublksrv_crc32c(__u32 crc, const void *buf, size_t len)
+{
+	const __u8 *p = (const __u8 *)buf;
+
+	pthread_once(&pi_init_once, ublksrv_pi_init);
+	crc = ~crc;
+#ifdef UBLKSRV_PI_CLMUL
+	if (pi_has_sse42)
+		return ~crc32c_sse42_update(crc, p, len);
+#endif
+	return ~crc32c_table_update(crc, p, len);
+}
+
+unsigned ublksrv_pi_tuple_size(unsigned csum_type)
+{
+	switch (csum_type) {
+	case LBMD_PI_CSUM_CRC16_T10DIF:
+		return sizeof(struct ublksrv_t10_pi_tuple);
+	case LBMD_PI_CSUM_CRC64_NVME:
+		return sizeof(struct ublksrv_crc64_pi_tuple);
+	default:
+		return 0;
+	}
+}
+
+/* guard covers interval data and metadata bytes ahead of PI tuple */
+static __u64 ublksrv_pi_guard(const struct ublk_param_integrity *p,
+		const __u8 *data, const __u8 *meta)
+{
+	unsigned interval = 1U << p->interval_exp;
+
+	if (p->csum_type == LBMD_PI_CSUM_CRC16_T10DIF) {
+		__u16 crc = ublksrv_crc16_t10dif(0, data, interval);
+
+		return ublksrv_crc16_t10dif(crc, meta, p->pi_offset);
+	} else {
+		__u64 crc = ublksrv_crc64_nvme(0, data, interval);
+
+		return ublksrv_crc64_nvme(crc, meta, p->pi_offset);
+	}
+}
+
+static inline __u64 ublksrv_pi_ref48(const struct ublksrv_crc64_pi_tuple *pi)
+{
+	__u64 ref = 0;
+	int i;
+
+	for (i = 0; i < 6; i++)
+		ref = (ref << 8) | pi->ref_tag[i];
+	return ref;
+}
+
+void ublksrv_pi_generate(const struct ublk_param_integrity *p,
+		const void *data, void *meta, unsigned len, __u64 seed)
+{
+	const unsigned interval = 1U << p->interval_exp;
+	const bool ref = p->flags & LBMD_PI_CAP_REFTAG;
+	const __u8 *d = (const __u8 *)data;
+	__u8 *m = (__u8 *)meta;
+	unsigned off;
+
+	for (off = 0; off < len; off += interval, seed++,
+			m += p->metadata_size) {
+		__u64 guard = ublksrv_pi_guard(p, d + off, m);
+
+		if (p->csum_type == LBMD_PI_CSUM_CRC16_T10DIF) {
+			struct ublksrv_t10_pi_tuple pi = {
+				.guard_tag = htobe16(guard),
+				.app_tag = 0,
+				.ref_tag = ref ? htobe32(seed) : 0,
+			};
+
+			memcpy(m + p->pi_offset, &pi, sizeof(pi));
+		} else if (p->csum_type == LBMD_PI_CSUM_CRC64_NVME) {
+			struct ublksrv_crc64_pi_tuple pi = {
+				.guard_tag = htobe64(guard),
+				.app_tag = 0,
+			};
+			int i;
+
+			for (i = 0; ref && i < 6; i++)
+				pi.ref_tag[i] = seed >> (8 * (5 - i));
+			memcpy(m + p->pi_offset, &pi, sizeof(pi));
+		}
+	}
+}
+
+int ublksrv_pi_verify(const struct ublk_param_integrity *p,
+		const void *data, const void *meta, unsigned len, __u64 seed)
+{
+	const unsigned interval = 1U << p->interval_exp;
+	const bool ref = p->flags & LBMD_PI_CAP_REFTAG;
+	const __u8 *d = (const __u8 *)data;
+	const __u8 *m = (const __u8 *)meta;
+	unsigned off;
+
+	for (off = 0; off < len; off += interval, seed++,
+			m += p->metadata_size) {
+		if (p->csum_type == LBMD_PI_CSUM_CRC16_T10DIF) {
+			struct ublksrv_t10_pi_tuple pi;
+
+			memcpy(&pi, m + p->pi_offset, sizeof(pi));
+			if (pi.app_tag == UBLKSRV_PI_APP_ESCAPE)
+				continue;
+			if (ref && be32toh(pi.ref_tag) != (__u32)seed)
+				return -EILSEQ;
+			if (be16toh(pi.guard_tag) !=
+					(__u16)ublksrv_pi_guard(p, d + off, m))
+				return -EILSEQ;
+		} else if (p->csum_type == LBMD_PI_CSUM_CRC64_NVME) {
+			struct ublksrv_crc64_pi_tuple pi;
+
+			memcpy(&pi, m + p->pi_offset, sizeof(pi));
+			if (pi.app_tag == UBLKSRV_PI_APP_ESCAPE)
+				continue;
+			if (ref && ublksrv_pi_ref48(&pi) !=
+					(seed & ((1ULL << 48) - 1)))
+				return -EILSEQ;
+			if (be64toh(pi.guard_tag) !=
+					ublksrv_pi_guard(p, d + off, m))
+				return -EILSEQ;
+		}
+	}
+	return 0;
+}
@@ -0,0 +1,593 @@
+// SPDX-License-Identifier: MIT or GPL-2.0-only
+
+/*
+ * Microbenchmark of libublksrv hot path primitives, built and run by
+ * `make bench`.
+ *
+ * Each case is run in two variants:
+ *
+ * - warm: the case is called back to back, so code and data stay in cache
+ *
+ * - cold: the whole cache hierarchy is trashed by writing one buffer which
+ *   is bigger than LLC before every single call, so the cost of pulling
+ *   the involved queue/io/ring state into cache is visible
+ *
+ * Cost is reported as ns/op and cycles/op, one op is one tag, one aio or
+ * one coroutine, see ->ops_per_call. Cycles are TSC cycles, which tick at
+ * fixed rate and don't follow the core frequency.
+ */
+
+#include <config.h>
+#include <stdio.h>
+#include <getopt.h>
+#include <time.h>
+#include <atomic>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define MB_HAVE_TSC	1
+#endif
+
+#include "ublksrv_priv.h"
+#include "ublksrv_tgt.h"
+#include "ublksrv_pi.h"
+
+#define MB_DEPTH		128
+#define MB_AIO_BATCH		32
+#define MB_RING_DEPTH		32
+#define MB_FLUSH_SIZE		(64U << 20)
+#define MB_PI_INTERVALS		32
+
+struct mb_ctx {
+	struct _ublksrv_queue *q;
+	struct ublk_io_tgt *io_tgt;
+	__u64 *user_data;
+
+	/* aio handoff */
+	struct ublksrv_aio *aios;
+	struct ublksrv_aio_list fwd, back;
+	std::atomic<bool> stop;
+	pthread_t thread;
+
+	/* sqe allocation */
+	struct io_uring ring;
+	bool ring_ready;
+
+	/* PI generation, one op is one 4k interval */
+	struct ublk_param_integrity pi;
+	char *pi_data;
+	char *pi_meta;
+};
+
+struct mb_case {
+	const char *name;
+	unsigned ops_per_call;
+	int (*setup)(struct mb_ctx *ctx);
+	void (*run)(struct mb_ctx *ctx, unsigned long long nr_calls);
+	void (*teardown)(struct mb_ctx *ctx);
+};
+
+/* keep results alive, so compiler can't drop the measured code */
+static volatile unsigned long long mb_sink;
+static unsigned long long mb_handled;
+static char *mb_flush_buf;
+
+static inline unsigned long long mb_now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static inline unsigned long long mb_cycles(void)
+{
+#ifdef MB_HAVE_TSC
+	return __rdtsc();
+#else
+	return 0;
+#endif
+}
+
+static void mb_flush_cache(void)
+{
+	unsigned i;
+
+	for (i = 0; i < MB_FLUSH_SIZE; i += 64)
+		mb_flush_buf[i]++;
+}
+
+/* fake queue which is good enough for the batch helpers */
+static struct _ublksrv_queue *mb_alloc_queue(void)
+{
+	struct _ublksrv_queue *q;
+	int i;
+
+	q = (struct _ublksrv_queue *)calloc(1, sizeof(*q) +
+			MB_DEPTH * sizeof(struct ublk_io));
+	if (!q)
+		return NULL;
+	q->q_depth = MB_DEPTH;
+	for (i = 0; i < MB_DEPTH; i++) {
+		q->ios[i].buf_addr = (char *)(4096UL * (i + 1));
+		q->ios[i].data.tag = i;
+	}
+	return q;
+}
+
+static int mb_user_data_setup(struct mb_ctx *ctx)
+{
+	ctx->user_data = (__u64 *)calloc(MB_DEPTH, sizeof(__u64));
+	return ctx->user_data ? 0 : -ENOMEM;
+}
+
+static void mb_user_data_run(struct mb_ctx *ctx, unsigned long long nr)
+{
+	unsigned long long i, sum = 0;
+
+	for (i = 0; i < nr; i++) {
+		unsigned tag = i & (MB_DEPTH - 1);
+		__u64 data;
+
+		ctx->user_data[tag] = build_user_data(tag, i & 0xff,
+				i & 0xffff, 1);
+		data = ctx->user_data[(tag * 7) & (MB_DEPTH - 1)];
+		sum += user_data_to_tag(data) + user_data_to_op(data) +
+			user_data_to_tgt_data(data);
+	}
+	mb_sink = sum;
+}
+
+static void mb_user_data_teardown(struct mb_ctx *ctx)
+{
+	free(ctx->user_data);
+}
+
+static int mb_batch_setup(struct mb_ctx *ctx)
+{
+	struct ublksrv_queue_batch *b;
+	int i;
+
+	ctx->q = mb_alloc_queue();
+	if (!ctx->q)
+		return -ENOMEM;
+
+	/* copy mode, so every element carries buffer address */
+	b = &ctx->q->batch;
+	b->commit_buf_elem_size = sizeof(struct ublk_batch_elem);
+	b->commit_buf_size = MB_DEPTH * b->commit_buf_elem_size;
+	b->commit_buf_mem = calloc(UBLK_BATCH_NR_COMMIT_BUFS,
+			b->commit_buf_size);
+	if (!b->commit_buf_mem)
+		return -ENOMEM;
+	for (i = 0; i < UBLK_BATCH_NR_COMMIT_BUFS; i++) {
+		b->commit_bufs[i].buf = (char *)b->commit_buf_mem +
+			i * b->commit_buf_size;
+		b->commit_bufs[i].count = MB_DEPTH;
+	}
+	return 0;
+}
+
+/* one call fills one whole commit buffer, then swaps like submit_commit */
+static void mb_batch_add_complete_run(struct mb_ctx *ctx,
+		unsigned long long nr)
+{
+	struct _ublksrv_queue *q = ctx->q;
+	struct ublksrv_queue_batch *b = &q->batch;
+	unsigned long long i;
+	unsigned tag;
+
+	for (i = 0; i < nr; i++) {
+		for (tag = 0; tag < MB_DEPTH; tag++)
+			ublksrv_batch_add_complete(q, tag, 4096);
+		b->cur_commit_buf = 1 - b->cur_commit_buf;
+		b->commit_bufs[b->cur_commit_buf].done = 0;
+	}
+}
+
+static int mb_noop_handle_io(const struct ublksrv_queue *q,
+		const struct ublk_io_data *data)
+{
+	mb_handled += data->tag;
+	return 0;
+}
+
+static const struct ublksrv_tgt_type mb_tgt_type = {
+	.handle_io_async = mb_noop_handle_io,
+	.name = "microbench",
+};
+
+static int mb_fetch_setup(struct mb_ctx *ctx)
+{
+	struct batch_fetch_buf *fb;
+	unsigned short *tags;
+	int i, ret;
+
+	ret = mb_batch_setup(ctx);
+	if (ret)
+		return ret;
+
+	ctx->q->tgt_ops = &mb_tgt_type;
+	fb = &ctx->q->batch.fetch_bufs[0];
+	fb->fetch_buf_size = MB_DEPTH * 2;
+	fb->fetch_buf = calloc(1, fb->fetch_buf_size);
+	if (!fb->fetch_buf)
+		return -ENOMEM;
+
+	/* tags are returned in random order by the driver */
+	tags = (unsigned short *)fb->fetch_buf;
+	for (i = 0; i < MB_DEPTH; i++)
+		tags[i] = (i * 37) & (MB_DEPTH - 1);
+	return 0;
+}
+
+/* one call is one multishot fetch cqe carrying all tags */
+static void mb_fetch_run(struct mb_ctx *ctx, unsigned long long nr)
+{
+	struct _ublksrv_queue *q = ctx->q;
+	struct io_uring_cqe cqe = {
+		.user_data = build_user_data(0,
+				_IOC_NR(UBLK_U_IO_FETCH_IO_CMDS), MB_DEPTH, 0),
+		.res = MB_DEPTH * 2,
+		.flags = IORING_CQE_F_MORE,
+	};
+	unsigned long long i;
+
+	for (i = 0; i < nr; i++) {
+		q->batch.fetch_bufs[0].fetch_buf_off = 0;
+		ublksrv_batch_handle_cqe(q, &cqe,
+				_IOC_NR(UBLK_U_IO_FETCH_IO_CMDS));
+	}
+}
+
+static void mb_batch_teardown(struct mb_ctx *ctx)
+{
+	if (!ctx->q)
+		return;
+	free(ctx->q->batch.fetch_bufs[0].fetch_buf);
+	free(ctx->q->batch.commit_buf_mem);
+	free(ctx->q);
+}
+
+/* bounce every aio back to the main thread, like aio ctx does */
+static void *mb_aio_peer_fn(void *data)
+{
+	struct mb_ctx *ctx = (struct mb_ctx *)data;
+	struct aio_list al;
+
+	aio_list_init(&al);
+	while (!ctx->stop.load(std::memory_order_relaxed)) {
+		pthread_spin_lock(&ctx->fwd.lock);
+		aio_list_splice(&ctx->fwd.list, &al);
+		pthread_spin_unlock(&ctx->fwd.lock);
+
+		if (aio_list_empty(&al))
+			continue;
+
+		pthread_spin_lock(&ctx->back.lock);
+		aio_list_splice(&al, &ctx->back.list);
+		pthread_spin_unlock(&ctx->back.lock);
+	}
+	return NULL;
+}
+
+static int mb_aio_setup(struct mb_ctx *ctx)
+{
+	ctx->aios = (struct ublksrv_aio *)calloc(MB_AIO_BATCH,
+			sizeof(struct ublksrv_aio));
+	if (!ctx->aios)
+		return -ENOMEM;
+	ublksrv_aio_init_list(&ctx->fwd);
+	ublksrv_aio_init_list(&ctx->back);
+	ctx->stop = false;
+	if (pthread_create(&ctx->thread, NULL, mb_aio_peer_fn, ctx)) {
+		free(ctx->aios);
+		ctx->aios = NULL;
+		return -EAGAIN;
+	}
+	return 0;
+}
+
+/* one call hands MB_AIO_BATCH aios to the peer and gets them back */
+static void mb_aio_run(struct mb_ctx *ctx, unsigned long long nr)
+{
+	unsigned long long i;
+	struct aio_list al;
+	int j;
+
+	aio_list_init(&al);
+	for (i = 0; i < nr; i++) {
+		for (j = 0; j < MB_AIO_BATCH; j++)
+			aio_list_add(&al, &ctx->aios[j]);
+
+		pthread_spin_lock(&ctx->fwd.lock);
+		aio_list_splice(&al, &ctx->fwd.list);
+		pthread_spin_unlock(&ctx->fwd.lock);
+
+		do {
+			pthread_spin_lock(&ctx->back.lock);
+			aio_list_splice(&ctx->back.list, &al);
+			pthread_spin_unlock(&ctx->back.lock);
+		} while (aio_list_empty(&al));
+
+		/* the peer may hand back one partial batch */
+		for (j = 0; j < MB_AIO_BATCH; ) {
+			struct ublksrv_aio *io = aio_list_pop(&al);
+
+			if (io) {
+				j++;
+				continue;
+			}
+			pthread_spin_lock(&ctx->back.lock);
+			aio_list_splice(&ctx->back.list, &al);
+			pthread_spin_unlock(&ctx->back.lock);
+		}
+	}
+}
+
+static void mb_aio_teardown(struct mb_ctx *ctx)
+{
+	if (!ctx->aios)
+		return;
+	ctx->stop = true;
+	pthread_join(ctx->thread, NULL);
+	free(ctx->aios);
+}
+
+static co_io_job mb_co_io_job(struct ublk_io_tgt *io, int tag)
+{
+	co_await__suspend_always(tag);
+
+	mb_handled += io->tgt_io_cqe ? 1 : 0;
+}
+
+static int mb_co_setup(struct mb_ctx *ctx)
+{
+	ctx->io_tgt = (struct ublk_io_tgt *)calloc(MB_DEPTH,
+			sizeof(struct ublk_io_tgt));
+	return ctx->io_tgt ? 0 : -ENOMEM;
+}
+
+/*
+ * Same with targets: the coroutine is created from ->handle_io_async(),
+ * suspended for target io, and resumed to completion from the cqe
+ */
+static void mb_co_run(struct mb_ctx *ctx, unsigned long long nr)
+{
+	unsigned long long i;
+
+	for (i = 0; i < nr; i++) {
+		int tag = i & (MB_DEPTH - 1);
+		struct ublk_io_tgt *io = &ctx->io_tgt[tag];
+
+		io->co = mb_co_io_job(io, tag);
+		io->co.resume();
+	}
+}
+
+static void mb_co_teardown(struct mb_ctx *ctx)
+{
+	free(ctx->io_tgt);
+}
+
+static int mb_sqe_setup(struct mb_ctx *ctx)
+{
+	int ret;
+
+	ctx->q = mb_alloc_queue();
+	if (!ctx->q)
+		return -ENOMEM;
+
+	ret = io_uring_queue_init(MB_RING_DEPTH, &ctx->ring, 0);
+	if (ret)
+		return ret;
+	ctx->ring_ready = true;
+	ctx->q->ring_ptr = &ctx->ring;
+	return 0;
+}
+
+/*
+ * Three sqes per call like loop's write with fsync, so SQ runs full
+ * every ~10 calls and ublk_queue_alloc_sqes() has to submit
+ */
+static void mb_sqe_run(struct mb_ctx *ctx, unsigned long long nr)
+{
+	const struct ublksrv_queue *q = local_to_tq(ctx->q);
+	struct io_uring_sqe *sqes[3];
+	unsigned long long i;
+	int j, cnt;
+
+	for (i = 0; i < nr; i++) {
+		cnt = ublk_queue_alloc_sqes(q, sqes, 3);
+		for (j = 0; j < cnt; j++) {
+			io_uring_prep_nop(sqes[j]);
+			sqes[j]->flags |= IOSQE_CQE_SKIP_SUCCESS;
+		}
+		io_uring_cq_advance(&ctx->ring, io_uring_cq_ready(&ctx->ring));
+	}
+}
+
+static void mb_sqe_teardown(struct mb_ctx *ctx)
+{
+	if (ctx->ring_ready) {
+		io_uring_submit_and_wait(&ctx->ring, 0);
+		io_uring_queue_exit(&ctx->ring);
+	}
+	free(ctx->q);
+}
+
+static int mb_pi_setup(struct mb_ctx *ctx, unsigned csum_type)
+{
+	unsigned i;
+
+	ctx->pi.flags = LBMD_PI_CAP_INTEGRITY | LBMD_PI_CAP_REFTAG;
+	ctx->pi.interval_exp = 12;
+	ctx->pi.csum_type = csum_type;
+	ctx->pi.metadata_size = ublksrv_pi_tuple_size(csum_type);
+
+	ctx->pi_data = (char *)malloc(MB_PI_INTERVALS << 12);
+	ctx->pi_meta = (char *)malloc(MB_PI_INTERVALS * 16);
+	if (!ctx->pi_data || !ctx->pi_meta)
+		return -ENOMEM;
+	for (i = 0; i < MB_PI_INTERVALS << 12; i++)
+		ctx->pi_data[i] = i * 31;
+	return 0;
+}
+
+static int mb_pi_crc16_setup(struct mb_ctx *ctx)
+{
+	return mb_pi_setup(ctx, LBMD_PI_CSUM_CRC16_T10DIF);
+}
+
+static int mb_pi_crc64_setup(struct mb_ctx *ctx)
+{
+	return mb_pi_setup(ctx, LBMD_PI_CSUM_CRC64_NVME);
+}
+
+static void mb_pi_run(struct mb_ctx *ctx, unsigned long long nr)
+{
+	unsigned long long i;
+
+	for (i = 0; i < nr; i++)
+		ublksrv_pi_generate(&ctx->pi, ctx->pi_data, ctx->pi_meta,
+				MB_PI_INTERVALS << 12, i);
+	mb_sink = ctx->pi_meta[0];
+}
+
+static void mb_pi_teardown(struct mb_ctx *ctx)
+{
+	free(ctx->pi_data);
+	free(ctx->pi_meta);
+}
+
+static const struct mb_case mb_cases[] = {
+	{ "user_data_encode_decode", 1, mb_user_data_setup,
+		mb_user_data_run, mb_user_data_teardown },
+	{ "batch_add_complete", MB_DEPTH, mb_batch_setup,
+		mb_batch_add_complete_run, mb_batch_teardown },
+	{ "batch_fetch_tag_decode", MB_DEPTH, mb_fetch_setup,
+		mb_fetch_run, mb_batch_teardown },
+	{ "aio_list_handoff", MB_AIO_BATCH, mb_aio_setup,
+		mb_aio_run, mb_aio_teardown },
+	{ "co_io_job_create_resume", 1, mb_co_setup,
+		mb_co_run, mb_co_teardown },
+	{ "queue_alloc_sqes", 1, mb_sqe_setup,
+		mb_sqe_run, mb_sqe_teardown },
+	{ "pi_generate_crc16", MB_PI_INTERVALS, mb_pi_crc16_setup,
+		mb_pi_run, mb_pi_teardown },
+	{ "pi_generate_crc64", MB_PI_INTERVALS, mb_pi_crc64_setup,
+		mb_pi_run, mb_pi_teardown },
+};
+#define MB_NR_CASES	(int)(sizeof(mb_cases) / sizeof(mb_cases[0]))
+
+static void mb_report(const char *name, const char *variant,
+		unsigned long long ops, unsigned long long ns,
+		unsigned long long cycles)
+{
+	if (!ops)
+		return;
+#ifdef MB_HAVE_TSC
+	printf("%-26s %-5s %12llu ops %10.2f ns/op %10.2f cycles/op\n",
+			name, variant, ops, (double)ns / ops,
+			(double)cycles / ops);
+#else
+	printf("%-26s %-5s %12llu ops %10.2f ns/op %10s cycles/op\n",
+			name, variant, ops, (double)ns / ops, "-");
+#endif
+}
+
+static int mb_run_case(const struct mb_case *c, unsigned long long nr_ops,
+		unsigned cold_rounds)
+{
+	unsigned long long nr_calls = nr_ops / c->ops_per_call + 1;
+	unsigned long long ns, cycles, t0, c0;
+	struct mb_ctx *ctx = new mb_ctx();
+	unsigned i;
+	int ret;
+
+	ret = c->setup(ctx);
+	if (ret) {
+		fprintf(stderr, "%s: setup failed %d, skipped\n", c->name, ret);
+		goto out;
+	}
+
+	/* warm up, then measure back to back calls */
+	c->run(ctx, nr_calls / 10 + 1);
+	t0 = mb_now_ns();
+	c0 = mb_cycles();
+	c->run(ctx, nr_calls);
+	cycles = mb_cycles() - c0;
+	ns = mb_now_ns() - t0;
+	mb_report(c->name, "warm", nr_calls * c->ops_per_call, ns, cycles);
+
+	ns = cycles = 0;
+	for (i = 0; i < cold_rounds; i++) {
+		mb_flush_cache();
+		t0 = mb_now_ns();
+		c0 = mb_cycles();
+		c->run(ctx, 1);
+		cycles += mb_cycles() - c0;
+		ns += mb_now_ns() - t0;
+	}
+	mb_report(c->name, "cold", (unsigned long long)cold_rounds *
+			c->ops_per_call, ns, cycles);
+out:
+	c->teardown(ctx);
+	delete ctx;
+	return ret;
+}
+
+static void mb_usage(const char *prog)
+{
+	printf("%s [-n nr_ops] [-c cold_rounds] [-l] [case ...]\n", prog);
+}
+
+int main(int argc, char *argv[])
+{
+	static const struct option longopts[] = {
+		{ "nr_ops",		1,	NULL, 'n' },
+		{ "cold_rounds",	1,	NULL, 'c' },
+		{ "list",		0,	NULL, 'l' },
+		{ "help",		0,	NULL, 'h' },
+		{ NULL }
+	};
+	unsigned long long nr_ops = 10000000;
+	unsigned cold_rounds = 200;
+	int opt, i, j, ret = 0;
+
+	while ((opt = getopt_long(argc, argv, "n:c:lh",
+				  longopts, NULL)) != -1) {
+		switch (opt) {
+		case 'n':
+			nr_ops = strtoull(optarg, NULL, 10);
+			break;
+		case 'c':
+			cold_rounds = strtoul(optarg, NULL, 10);
+			break;
+		case 'l':
+			for (i = 0; i < MB_NR_CASES; i++)
+				printf("%s\n", mb_cases[i].name);
+			return EXIT_SUCCESS;
+		default:
+			mb_usage(argv[0]);
+			return opt == 'h' ? EXIT_SUCCESS : EXIT_FAILURE;
+		}
+	}
+
+	mb_flush_buf = (char *)malloc(MB_FLUSH_SIZE);
+	if (!mb_flush_buf)
+		return EXIT_FAILURE;
+	memset(mb_flush_buf, 0, MB_FLUSH_SIZE);
+
+	for (i = 0; i < MB_NR_CASES; i++) {
+		bool selected = optind >= argc;
+
+		for (j = optind; j < argc; j++)
+			if (!strcmp(argv[j], mb_cases[i].name))
+				selected = true;
+		if (selected && mb_run_case(&mb_cases[i], nr_ops, cold_rounds))
+			ret = EXIT_FAILURE;
+	}
+
+	free(mb_flush_buf);
+	return ret;
+}
@@ -157,6 +157,220 @@ static inline enum io_uring_op ublk_to_uring_fs_op(
 
 int ublksrv_main(const struct ublksrv_tgt_type *tgt_type, int argc, char *argv[]);
 
+/* layers stacked over the target in its own daemon, see ublksrv_stack.cpp */
+#define UBLKSRV_STACK_MAX_LAYERS	4
+
+struct ublksrv_stack_layer {
+	const char *name;
+
+	/* op in user_data of sqes issued by the layer, 0 if it has none */
+	unsigned char op;
+
+	/* max sqes issued by the layer for each io */
+	unsigned char sqes_per_io;
+
+	/*
+	 * Parse layer options and store them in json, or load them from
+	 * json when recovering. Called after the target is initialized.
+	 */
+	int (*setup)(struct ublksrv_dev *dev, int argc, char *argv[]);
+	void (*cleanup)(const struct ublksrv_dev *dev);
+
+	int (*init_queue)(const struct ublksrv_queue *q);
+	void (*deinit_queue)(const struct ublksrv_queue *q);
+
+	/*
+	 * io from the upper layer: pass it down by ublksrv_stack_submit(),
+	 * or finish it by ublksrv_tgt_complete_io()
+	 */
+	void (*handle_io)(const struct ublksrv_queue *q,
+			const struct ublk_io_data *data);
+
+	/* cqe of sqe issued by this layer */
+	void (*io_done)(const struct ublksrv_queue *q, int tag,
+			const struct io_uring_cqe *cqe);
+
+	/*
+	 * io passed down is finished by lower layers: complete it by
+	 * ublksrv_tgt_complete_io(), or submit it again. NULL means that
+	 * 'res' is passed up as it is.
+	 */
+	void (*lower_done)(const struct ublksrv_queue *q, int tag, int res);
+
+	void (*usage)(void);
+};
+
+extern const struct ublksrv_stack_layer ublksrv_delay_layer;
+extern const struct ublksrv_stack_layer ublksrv_verify_layer;
+
+const struct ublksrv_tgt_type *ublksrv_stack_wrap(
+		const struct ublksrv_tgt_type *inner);
+
+/*
+ * Called before ublksrv_main() by targets which take io only from the io
+ * data passed in or ublksrv_tgt_get_io_data(), and finish io only by
+ * ublksrv_tgt_complete_io(), so that layers can see io completion.
+ */
+void ublksrv_stack_register_backend(const struct ublksrv_tgt_type *tgt_type);
+
+/*
+ * Pass io to the lower layer or the target, 'data' can carry one iod of
+ * the layer for remapping io or using its own buffer, and both have to
+ * be kept until the io is finished. The tag is kept in all layers, and
+ * 'data' has to keep tag and private_data of the io data passed in,
+ * since the target keeps its per-io state there.
+ */
+void ublksrv_stack_submit(const struct ublksrv_queue *q,
+		const struct ublk_io_data *data);
+
+/* finish io in the current layer or target, replaces ublksrv_complete_io() */
+void ublksrv_tgt_complete_io(const struct ublksrv_queue *q, int tag, int res);
+
+/* io data passed to the layer or target which owns the io now */
+const struct ublk_io_data *ublksrv_tgt_get_io_data(
+		const struct ublksrv_queue *q, int tag);
+
+/* '-t delay --inner TYPE' is served by ublk.TYPE */
+const char *ublksrv_delay_inner_type(int argc, char *argv[]);
+
+/* what remote targets do with io which misses its deadline */
+enum {
+	UBLKSRV_TMO_FAIL,	/* complete io with -ETIMEDOUT */
+	UBLKSRV_TMO_RETRY,	/* send io again, fail it after 'retries' */
+};
+
+struct ublksrv_io_timeout {
+	unsigned int ms;	/* deadline of each io, 0 means none */
+	unsigned int policy;
+	unsigned int retries;
+};
+
+/*
+ * Parse --io_timeout, --timeout_policy and --io_retries and store them
+ * in json, or read them back from json when recovering.
+ */
+int ublksrv_tgt_parse_io_timeout(const struct ublksrv_ctrl_dev *cdev,
+		int argc, char *argv[], struct ublksrv_io_timeout *tmo);
+void ublksrv_tgt_io_timeout_usage(void);
+
+/*
+ * Socket busy poll of network targets: receive completions are polled
+ * from NAPI in the queue thread instead of waiting for softirq & wakeup.
+ */
+struct ublksrv_busy_poll {
+	unsigned int usecs;	/* busy poll timeout, 0 means disabled */
+	unsigned int budget;	/* packets of each poll, 0: from queue depth */
+};
+
+/*
+ * Parse --busy_poll and --busy_poll_budget and store them in json, or
+ * read them back from json when recovering.
+ */
+int ublksrv_tgt_parse_busy_poll(const struct ublksrv_ctrl_dev *cdev,
+		int argc, char *argv[], struct ublksrv_busy_poll *bp);
+void ublksrv_tgt_busy_poll_usage(void);
+
+/*
+ * Prefer busy poll on socket 'fd' of one queue with 'depth' inflight io
+ * at most, failure is only logged since busy poll is an optimization.
+ */
+void ublksrv_tgt_busy_poll_sock(int fd, const struct ublksrv_busy_poll *bp,
+		unsigned int depth);
+
+/* register queue ring for NAPI busy poll, called from ->init_queue() */
+void ublksrv_tgt_busy_poll_queue(const struct ublksrv_queue *q,
+		const struct ublksrv_busy_poll *bp);
+
+/* op of deadline tick, don't overlap with ops used by targets */
+#define UBLKSRV_TICK_OP		0xfd
+
+/*
+ * Deadlines are checked by one per-queue tick instead of one timer per
+ * io, so expiry is detected within 1/4 of the deadline.
+ */
+struct ublksrv_tick {
+	struct __kernel_timespec ts;
+	bool armed;
+};
+
+static inline unsigned long long ublksrv_tgt_now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*
+ * Queue the next tick if it isn't queued yet, its cqe is delivered to
+ * ->tgt_io_done() of 'tag' with op UBLKSRV_TICK_OP, and the caller has
+ * to clear ->armed then.
+ */
+static inline void ublksrv_tgt_arm_tick(const struct ublksrv_queue *q,
+		struct ublksrv_tick *tick, const struct ublksrv_io_timeout *tmo,
+		unsigned tag)
+{
+	unsigned long long ns = tmo->ms * 1000000ULL / 4;
+	struct io_uring_sqe *sqe[1];
+
+	if (tick->armed || !tmo->ms || !ublk_queue_alloc_sqes(q, sqe, 1))
+		return;
+
+	if (ns < 1000000)
+		ns = 1000000;
+	tick->ts.tv_sec = ns / 1000000000ULL;
+	tick->ts.tv_nsec = ns % 1000000000ULL;
+	io_uring_prep_timeout(sqe[0], &tick->ts, 0, 0);
+	sqe[0]->user_data = build_user_data(tag, UBLKSRV_TICK_OP, 0, 1);
+	tick->armed = true;
+}
+
+/* persistent local read cache of remote targets, see ublksrv_cache.cpp */
+struct ublksrv_cache;
+
+/* op of cache read, don't overlap with ops used by targets */
+#define UBLKSRV_CACHE_OP	0xfc
+
+/*
+ * Parse --cache, --cache_size, --cache_chunk_kb, --cache_mode and
+ * --cache_policy and store them in json, nothing to do when recovering.
+ */
+int ublksrv_cache_parse(const struct ublksrv_ctrl_dev *cdev,
+		int argc, char *argv[]);
+void ublksrv_cache_usage(void);
+
+/*
+ * Open the cache stored in json after ->dev_size is set, and reload it
+ * if it was written for the same backend 'id'. '*cachep' is NULL if no
+ * cache is configured. The target has to reserve queue_depth more sqes
+ * for cache reads.
+ */
+int ublksrv_cache_open(struct ublksrv_dev *dev, const char *id,
+		struct ublksrv_cache **cachep);
+void ublksrv_cache_close(struct ublksrv_cache *cache);
+
+/*
+ * Called at the beginning of ->handle_io_async(), return true if the io
+ * is served from cache, then target doesn't handle it.
+ */
+bool ublksrv_cache_handle_io(struct ublksrv_cache *cache,
+		const struct ublksrv_queue *q, const struct ublk_io_data *data);
+
+/* called at the beginning of ->tgt_io_done(), true if cqe is consumed */
+bool ublksrv_cache_io_done(struct ublksrv_cache *cache,
+		const struct ublksrv_queue *q, const struct io_uring_cqe *cqe);
+
+/* replaces ublksrv_complete_io() for io handled by target */
+void ublksrv_cache_complete_io(struct ublksrv_cache *cache,
+		const struct ublksrv_queue *q, int tag, int res);
+
+/*
+ * Export the target over vhost-user-blk on one unix socket instead of
+ * adding one ublk disk, see ublksrv_vhost.cpp
+ */
+int ublksrv_cmd_vhost(const struct ublksrv_tgt_type *tgt_type, int argc,
+		char *argv[]);
+
 static inline unsigned short ublk_cmd_op_nr(unsigned int op)
 {
 	return _IOC_NR(op);
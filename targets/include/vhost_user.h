@@ -0,0 +1,249 @@
+// SPDX-License-Identifier: MIT or GPL-2.0-only
+#ifndef UBLK_VHOST_USER_H
+#define UBLK_VHOST_USER_H
+
+/*
+ * vhost-user message definitions, only what vhost-user-blk needs
+ *
+ * Shared by the server in ublksrv_vhost.cpp and the frontend stand-in
+ * demo_vhost.c, refer to docs/interop/vhost-user.rst of QEMU.
+ */
+
+#include <stddef.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <linux/types.h>
+
+enum {
+	VHOST_USER_GET_FEATURES = 1,
+	VHOST_USER_SET_FEATURES = 2,
+	VHOST_USER_SET_OWNER = 3,
+	VHOST_USER_RESET_OWNER = 4,
+	VHOST_USER_SET_MEM_TABLE = 5,
+	VHOST_USER_SET_VRING_NUM = 8,
+	VHOST_USER_SET_VRING_ADDR = 9,
+	VHOST_USER_SET_VRING_BASE = 10,
+	VHOST_USER_GET_VRING_BASE = 11,
+	VHOST_USER_SET_VRING_KICK = 12,
+	VHOST_USER_SET_VRING_CALL = 13,
+	VHOST_USER_SET_VRING_ERR = 14,
+	VHOST_USER_GET_PROTOCOL_FEATURES = 15,
+	VHOST_USER_SET_PROTOCOL_FEATURES = 16,
+	VHOST_USER_GET_QUEUE_NUM = 17,
+	VHOST_USER_SET_VRING_ENABLE = 18,
+	VHOST_USER_GET_CONFIG = 24,
+	VHOST_USER_SET_CONFIG = 25,
+};
+
+#define VHOST_USER_VERSION		0x1
+#define VHOST_USER_VERSION_MASK		0x3
+#define VHOST_USER_REPLY_MASK		(1U << 2)
+#define VHOST_USER_NEED_REPLY_MASK	(1U << 3)
+
+#define VHOST_USER_F_PROTOCOL_FEATURES	30
+
+#define VHOST_USER_PROTOCOL_F_MQ	0
+#define VHOST_USER_PROTOCOL_F_REPLY_ACK	3
+#define VHOST_USER_PROTOCOL_F_CONFIG	9
+
+/* u64 payload of SET_VRING_KICK/CALL/ERR */
+#define VHOST_USER_VRING_IDX_MASK	0xff
+#define VHOST_USER_VRING_NOFD_MASK	(1ULL << 8)
+
+#define VHOST_USER_MAX_RAM_SLOTS	8
+#define VHOST_USER_MAX_CONFIG_SIZE	256
+
+struct vhost_user_vring_state {
+	__u32 index;
+	__u32 num;
+};
+
+struct vhost_user_vring_addr {
+	__u32 index;
+	__u32 flags;
+	__u64 desc_user_addr;
+	__u64 used_user_addr;
+	__u64 avail_user_addr;
+	__u64 log_guest_addr;
+};
+
+struct vhost_user_mem_region {
+	__u64 guest_phys_addr;
+	__u64 memory_size;
+	__u64 userspace_addr;
+	__u64 mmap_offset;
+};
+
+struct vhost_user_memory {
+	__u32 nregions;
+	__u32 padding;
+	struct vhost_user_mem_region regions[VHOST_USER_MAX_RAM_SLOTS];
+};
+
+struct vhost_user_config {
+	__u32 offset;
+	__u32 size;
+	__u32 flags;
+	__u8 region[VHOST_USER_MAX_CONFIG_SIZE];
+};
+
+/*
+ * Payload follows the 12 bytes header on the wire, it is kept aligned in
+ * memory and sent/received as one separate iovec.
+ */
+struct vhost_user_msg {
+	__u32 request;
+	__u32 flags;
+	__u32 size;
+	union {
+		__u64 u64;
+		struct vhost_user_vring_state state;
+		struct vhost_user_vring_addr addr;
+		struct vhost_user_memory memory;
+		struct vhost_user_config config;
+	} payload;
+};
+
+#define VHOST_USER_HDR_SIZE	(3 * sizeof(__u32))
+
+/* split virtqueue layout, all fields are little endian */
+#define VHOST_VRING_DESC_F_NEXT		1
+#define VHOST_VRING_DESC_F_WRITE	2
+#define VHOST_VRING_DESC_F_INDIRECT	4
+#define VHOST_VRING_AVAIL_F_NO_INTERRUPT	1
+#define VHOST_RING_F_INDIRECT_DESC	28
+
+struct vhost_vring_desc {
+	__u64 addr;
+	__u32 len;
+	__u16 flags;
+	__u16 next;
+};
+
+struct vhost_vring_avail {
+	__u16 flags;
+	__u16 idx;
+	__u16 ring[];
+};
+
+struct vhost_vring_used_elem {
+	__u32 id;
+	__u32 len;
+};
+
+struct vhost_vring_used {
+	__u16 flags;
+	__u16 idx;
+	struct vhost_vring_used_elem ring[];
+};
+
+/* send one message with its payload, and 'fds' as SCM_RIGHTS */
+static inline int vhost_user_send(int sock, const struct vhost_user_msg *msg,
+		const int *fds, int nr_fds)
+{
+	char control[CMSG_SPACE(sizeof(int) * VHOST_USER_MAX_RAM_SLOTS)];
+	struct iovec iov[2] = {
+		{
+			.iov_base = (void *)msg,
+			.iov_len = VHOST_USER_HDR_SIZE,
+		}, {
+			.iov_base = (void *)&msg->payload,
+			.iov_len = msg->size,
+		},
+	};
+	struct msghdr mh = {
+		.msg_iov = iov,
+		.msg_iovlen = msg->size ? 2U : 1U,
+	};
+	ssize_t ret;
+
+	if (nr_fds > VHOST_USER_MAX_RAM_SLOTS || msg->size > sizeof(msg->payload))
+		return -EINVAL;
+
+	if (nr_fds) {
+		struct cmsghdr *cmsg;
+
+		memset(control, 0, sizeof(control));
+		mh.msg_control = control;
+		mh.msg_controllen = CMSG_SPACE(sizeof(int) * nr_fds);
+		cmsg = CMSG_FIRSTHDR(&mh);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(int) * nr_fds);
+		memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * nr_fds);
+	}
+
+	do {
+		ret = sendmsg(sock, &mh, MSG_NOSIGNAL);
+	} while (ret < 0 && errno == EINTR);
+
+	if (ret < 0)
+		return -errno;
+	return (size_t)ret == VHOST_USER_HDR_SIZE + msg->size ? 0 : -EIO;
+}
+
+/*
+ * Receive one message, fds passed with it are stored to 'fds', and
+ * '*nr_fds' is updated with how many are received. Return -ECONNRESET
+ * if the peer is gone.
+ */
+static inline int vhost_user_recv(int sock, struct vhost_user_msg *msg,
+		int *fds, int *nr_fds)
+{
+	char control[CMSG_SPACE(sizeof(int) * VHOST_USER_MAX_RAM_SLOTS)];
+	struct iovec iov = {
+		.iov_base = msg,
+		.iov_len = VHOST_USER_HDR_SIZE,
+	};
+	struct msghdr mh = {
+		.msg_iov = &iov,
+		.msg_iovlen = 1,
+		.msg_control = control,
+		.msg_controllen = sizeof(control),
+	};
+	struct cmsghdr *cmsg;
+	ssize_t ret;
+	int max_fds = *nr_fds;
+
+	*nr_fds = 0;
+	do {
+		ret = recvmsg(sock, &mh, MSG_CMSG_CLOEXEC | MSG_WAITALL);
+	} while (ret < 0 && errno == EINTR);
+	if (ret < 0)
+		return -errno;
+	if ((size_t)ret != VHOST_USER_HDR_SIZE)
+		return -ECONNRESET;
+
+	for (cmsg = CMSG_FIRSTHDR(&mh); cmsg; cmsg = CMSG_NXTHDR(&mh, cmsg)) {
+		int i, n, fd;
+
+		if (cmsg->cmsg_level != SOL_SOCKET ||
+				cmsg->cmsg_type != SCM_RIGHTS)
+			continue;
+		n = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+		for (i = 0; i < n; i++) {
+			memcpy(&fd, CMSG_DATA(cmsg) + i * sizeof(int),
+					sizeof(int));
+			if (*nr_fds < max_fds)
+				fds[(*nr_fds)++] = fd;
+			else
+				close(fd);
+		}
+	}
+
+	if (msg->size > sizeof(msg->payload))
+		return -EPROTO;
+	if (!msg->size)
+		return 0;
+
+	do {
+		ret = recv(sock, &msg->payload, msg->size, MSG_WAITALL);
+	} while (ret < 0 && errno == EINTR);
+	if (ret < 0)
+		return -errno;
+	return (size_t)ret == msg->size ? 0 : -ECONNRESET;
+}
+
+#endif
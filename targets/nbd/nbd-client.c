@@ -301,6 +301,57 @@ static void parse_sizes(char *buf, uint64_t *size, uint16_t *flags) {
 	printf("\n");
 }
 
+/*
+ * Offer io buffers in memfd to the server, the fd is passed with the
+ * option header. Return true if the server takes them.
+ */
+static bool send_opt_shm(int sock, const struct nbd_shm_opt *shm, int shm_fd) {
+	struct {
+		uint64_t magic;
+		uint32_t opt;
+		uint32_t datasize;
+	} __attribute__((packed)) header = {
+		ntohll(opts_magic),
+		ntohl(NBD_OPT_UBLK_SHM),
+		ntohl(sizeof(*shm)),
+	};
+	struct nbd_shm_opt opt = {
+		.flags = htonl(shm->flags),
+		.nr_bufs = htonl(shm->nr_bufs),
+		.buf_size = htonl(shm->buf_size),
+	};
+	struct iovec iov[2] = {
+		{ .iov_base = &header, .iov_len = sizeof(header) },
+		{ .iov_base = &opt, .iov_len = sizeof(opt) },
+	};
+	union {
+		char buf[CMSG_SPACE(sizeof(int))];
+		struct cmsghdr align;
+	} u;
+	struct msghdr msg = {
+		.msg_iov = iov,
+		.msg_iovlen = 2,
+		.msg_control = u.buf,
+		.msg_controllen = sizeof(u.buf),
+	};
+	struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+	struct reply *rep;
+	bool ok;
+
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+	memcpy(CMSG_DATA(cmsg), &shm_fd, sizeof(int));
+
+	if (sendmsg(sock, &msg, MSG_NOSIGNAL) != sizeof(header) + sizeof(opt))
+		err("Failed to send NBD_OPT_UBLK_SHM: %m");
+
+	rep = read_reply(sock);
+	ok = rep->opt == NBD_OPT_UBLK_SHM && rep->reply_type == NBD_REP_ACK;
+	free(rep);
+	return ok;
+}
+
 static void send_opt_exportname(int sock, u64 *rsize64, uint16_t *flags,
 		bool can_opt_go, char* name, uint16_t global_flags) {
 	send_request(sock, NBD_OPT_EXPORT_NAME, -1, name);
@@ -316,10 +367,15 @@ static void send_opt_exportname(int sock, u64 *rsize64, uint16_t *flags,
 }
 
 
-void negotiate(int *sockp, u64 *rsize64, uint16_t *flags, char* name,
+/*
+ * Return true if io buffers in 'shm_fd' are taken by the server, then
+ * requests have to be sent as nbd_shm_request.
+ */
+int negotiate(int *sockp, u64 *rsize64, uint16_t *flags, char* name,
 		uint32_t needed_flags, uint32_t client_flags, uint32_t do_opts,
 		char *certfile, char *keyfile, char *cacertfile,
-		char *tlshostname, bool tls, bool can_opt_go) {
+		char *tlshostname, bool tls, bool can_opt_go,
+		const struct nbd_shm_opt *shm, int shm_fd) {
 	u64 magic;
 	uint16_t tmp;
 	uint16_t global_flags;
@@ -453,10 +509,15 @@ void negotiate(int *sockp, u64 *rsize64, uint16_t *flags, char* name,
 	}
 
 	struct reply *rep = NULL;
-	
+	bool shm_ok = false;
+
+	/* has to be done before the transmission phase */
+	if (shm)
+		shm_ok = send_opt_shm(sock, shm, shm_fd);
+
 	if(!can_opt_go) {
 		send_opt_exportname(sock, rsize64, flags, can_opt_go, name, global_flags);
-		return;
+		return shm_ok;
 	}
 
 	send_info_request(sock, NBD_OPT_GO, 0, NULL, name);
@@ -471,7 +532,7 @@ void negotiate(int *sockp, u64 *rsize64, uint16_t *flags, char* name,
 					 * fall back to NBD_OPT_EXPORT_NAME */
 					send_opt_exportname(sock, rsize64, flags, can_opt_go, name, global_flags);
 					free(rep);
-					return;
+					return shm_ok;
 				case NBD_REP_ERR_POLICY:
 					if(rep->datasize > 0) {
 						char errstr[1024];
@@ -515,4 +576,5 @@ void negotiate(int *sockp, u64 *rsize64, uint16_t *flags, char* name,
 		}
 	} while(rep->reply_type != NBD_REP_ACK);
 	free(rep);
+	return shm_ok;
 }
@@ -107,12 +107,37 @@ struct nbd_reply {
 	char handle[8];		/* handle you got from request	*/
 };
 
+/*
+ * ublk extension for servers on the same host, not part of NBD protocol.
+ *
+ * io buffers of one connection are in one memfd, which is passed by
+ * SCM_RIGHTS together with header of NBD_OPT_UBLK_SHM. If the server
+ * replies NBD_REP_ACK, every request of this connection is sent as
+ * nbd_shm_request, and data of READ & WRITE stays in the memfd at
+ * 'offset' instead of following the request or reply. Servers without
+ * this extension reply NBD_REP_ERR_UNSUP and drop the fd.
+ */
+#define NBD_OPT_UBLK_SHM	0x75626c6b	/* 'ublk' */
+#define NBD_SHM_REQUEST_MAGIC	0x25609555
+
+struct nbd_shm_opt {
+	uint32_t flags;		/* 0 */
+	uint32_t nr_bufs;
+	uint32_t buf_size;	/* memfd size is nr_bufs * buf_size */
+} __attribute__ ((packed));
+
+struct nbd_shm_request {
+	struct nbd_request req;
+	uint64_t offset;	/* of READ & WRITE data in memfd */
+} __attribute__ ((packed));
+
 extern int opennet(const char *name, const char* portstr, int sdp);
 extern int openunix(const char *path);
-extern void negotiate(int *sockp, u64 *rsize64, uint16_t *flags, char* name,
+extern int negotiate(int *sockp, u64 *rsize64, uint16_t *flags, char* name,
 		uint32_t needed_flags, uint32_t client_flags, uint32_t do_opts,
 		char *certfile, char *keyfile, char *cacertfile,
-		char *tlshostname, bool tls, bool can_opt_go);
+		char *tlshostname, bool tls, bool can_opt_go,
+		const struct nbd_shm_opt *shm, int shm_fd);
 
 #ifdef __cplusplus
 }
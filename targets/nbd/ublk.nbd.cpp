@@ -2,6 +2,7 @@
 
 #include <config.h>
 #include <vector>
+#include <sys/mman.h>
 #include "ublksrv_tgt.h"
 #include "ublksrv_tgt_endian.h"
 #include "cliserv.h"
@@ -33,6 +34,14 @@
 struct nbd_tgt_data {
 	bool unix_sock;
 	bool use_send_zc;
+	bool use_shm;
+	struct ublksrv_io_timeout tmo;
+	struct ublksrv_busy_poll bp;
+	struct ublksrv_cache *cache;
+
+	/* io buffers of each queue in memfd shared with server */
+	char **shm_base;
+	size_t shm_size;
 };
 
 #ifndef HAVE_LIBURING_SEND_ZC
@@ -48,6 +57,9 @@ struct nbd_queue_data {
 	unsigned short use_unix_sock:1;
 	unsigned short need_handle_recv:1;
 	unsigned short chain_active:1;
+	unsigned short need_handle_tick:1;
+	unsigned short dead:1;		/* socket is shut down after stall */
+	unsigned short use_shm:1;	/* data is in memfd shared with server */
 
 	unsigned int chained_send_ios;
 
@@ -59,14 +71,41 @@ struct nbd_queue_data {
 	 */
 	std::vector <const struct ublk_io_data *> next_chain;
 
+	struct ublksrv_io_timeout tmo;
+	struct ublksrv_tick tick;
+	struct ublksrv_cache *cache;
+
+	/*
+	 * Handles of io which missed deadline, and bytes of read data
+	 * following each reply. The late reply is dropped when it comes,
+	 * and its data is drained into 'drain_buf'.
+	 */
+	std::vector<std::pair<u64, unsigned>> expired;
+	void *drain_buf;
+	unsigned int drain_len;
+
+	char *shm_base;
+
 	struct io_uring_sqe *last_send_sqe;
 	struct nbd_reply reply;
 	struct io_uring_cqe recv_cqe;
 };
 
+enum {
+	NBD_IO_IDLE,
+	NBD_IO_QUEUED,		/* in next_chain */
+	NBD_IO_SENT,		/* waiting for reply */
+	NBD_IO_RECV,		/* receiving read data */
+};
+
 struct nbd_io_data {
 	unsigned int cmd_cookie;
 	unsigned int done;	//for handling partial recv
+
+	unsigned char state;
+	unsigned char retries;
+	unsigned short sends;	/* send sqes not completed */
+	unsigned long long deadline;
 };
 
 static inline struct nbd_queue_data *
@@ -183,7 +222,8 @@ static int nbd_queue_req(const struct ublksrv_queue *q,
 	 * because request can be reused.
 	 */
 	sqe[0]->user_data = build_user_data(data->tag, ublk_op, ublk_op ==
-			UBLK_IO_OP_WRITE ? data->iod->nr_sectors : 0, 1);
+			UBLK_IO_OP_WRITE && !q_data->use_shm ?
+			data->iod->nr_sectors : 0, 1);
 	io_uring_sqe_set_flags(sqe[0], /*IOSQE_CQE_SKIP_SUCCESS |*/
 			IOSQE_FIXED_FILE | IOSQE_IO_LINK);
 	q_data->last_send_sqe = sqe[0];
@@ -203,24 +243,28 @@ static co_io_job __nbd_handle_io_async(const struct ublksrv_queue *q,
 		const struct ublk_io_data *data, struct ublk_io_tgt *io)
 {
 	int ret = -EIO;
-	struct nbd_request req = {.magic = htonl(NBD_REQUEST_MAGIC),};
 	struct nbd_queue_data *q_data = nbd_get_queue_data(q);
+	struct nbd_shm_request req = {.req = {.magic = htonl(q_data->use_shm ?
+			NBD_SHM_REQUEST_MAGIC : NBD_REQUEST_MAGIC),},};
 	struct nbd_io_data *nbd_data = io_tgt_to_nbd_data(io);
 	int type = req_to_nbd_cmd_type(data->iod);
 	unsigned op = ublksrv_get_op(data->iod);
 	struct iovec iov[2] = {
 		[0] = {
 			.iov_base = (void *)&req,
-			.iov_len = sizeof(req),
+			.iov_len = q_data->use_shm ? sizeof(req) :
+				sizeof(req.req),
 		},
 		[1] = {
 			.iov_base = (void *)data->iod->addr,
 			.iov_len = data->iod->nr_sectors << 9,
 		},
 	};
+	/* data stays in memfd if it is shared with server */
 	struct msghdr msg = {
 		.msg_iov = iov,
-		.msg_iovlen = (op == UBLK_IO_OP_WRITE) ? 2UL : 1UL,
+		.msg_iovlen = (op == UBLK_IO_OP_WRITE && !q_data->use_shm) ?
+			2UL : 1UL,
 	};
 
 	if (type == -1)
@@ -228,7 +272,10 @@ static co_io_job __nbd_handle_io_async(const struct ublksrv_queue *q,
 
 	nbd_data->cmd_cookie += 1;
 
-	__nbd_build_req(q, data, nbd_data, type, &req);
+	if (q_data->use_shm)
+		req.offset = cpu_to_be64(data->iod->addr -
+				(u64)q_data->shm_base);
+	__nbd_build_req(q, data, nbd_data, type, &req.req);
 	q_data->in_flight_ios += 1;
 
 	nbd_data->done = 0;
@@ -237,23 +284,57 @@ again:
 	ret = nbd_queue_req(q, data, &msg);
 	if (ret < 0)
 		goto fail;
+	nbd_data->sends += 1;
+	nbd_data->state = NBD_IO_SENT;
 
 	co_await__suspend_always(data->tag);
 	if (io->tgt_io_cqe->res == -EAGAIN)
 		goto again;
+	/* deadline is missed, send it again with new handle */
+	if (io->tgt_io_cqe->res == -ETIME) {
+		nbd_data->cmd_cookie += 1;
+		__nbd_build_req(q, data, nbd_data, type, &req.req);
+		goto again;
+	}
 	ret = io->tgt_io_cqe->res;
 fail:
+	nbd_data->state = NBD_IO_IDLE;
 	if (ret < 0)
 		nbd_err("%s: err %d\n", __func__, ret);
 	else
 		ret += nbd_data->done;
-	ublksrv_complete_io(q, data->tag, ret);
+	ublksrv_cache_complete_io(q_data->cache, q, data->tag, ret);
 	q_data->in_flight_ios -= 1;
 	NBD_IO_DBG("%s: tag %d res %d\n", __func__, data->tag, ret);
 
 	co_return;
 }
 
+static void nbd_expire_handle(const struct ublksrv_queue *q,
+		struct nbd_queue_data *q_data, const struct ublk_io_data *data,
+		const struct nbd_io_data *nbd_data)
+{
+	unsigned len = ublksrv_get_op(data->iod) == UBLK_IO_OP_READ ?
+		data->iod->nr_sectors << 9 : 0;
+
+	q_data->expired.push_back({nbd_cmd_handle(q, data, nbd_data), len});
+}
+
+/* reply of one expired io is received, set bytes to drain */
+static bool nbd_drop_expired(struct nbd_queue_data *q_data, u64 handle)
+{
+	for (auto it = q_data->expired.begin(); it != q_data->expired.end();
+			++it) {
+		if (it->first != handle)
+			continue;
+		/* no data follows error reply */
+		q_data->drain_len = ntohl(q_data->reply.error) ? 0 : it->second;
+		q_data->expired.erase(it);
+		return true;
+	}
+	return false;
+}
+
 static int nbd_handle_recv_reply(const struct ublksrv_queue *q,
 		struct nbd_io_data *nbd_data,
 		const struct io_uring_cqe *cqe,
@@ -267,6 +348,10 @@ static int nbd_handle_recv_reply(const struct ublksrv_queue *q,
 	unsigned ublk_op;
 	int ret = -EINVAL;
 
+	/* recv is woken up by shutdown() after the socket is given up */
+	if (q_data->dead)
+		return -ENOTCONN;
+
 	if (cqe->res < 0) {
 		nbd_err("%s %d: reply cqe %d\n", __func__,
 				__LINE__, cqe->res);
@@ -295,6 +380,9 @@ static int nbd_handle_recv_reply(const struct ublksrv_queue *q,
 	ublk_assert(cqe->res + nbd_data->done == sizeof(struct nbd_reply));
 
 	memcpy(&handle, q_data->reply.handle, sizeof(handle));
+	if (!q_data->expired.empty() && nbd_drop_expired(q_data, handle))
+		return 2;
+
 	tag = nbd_handle_to_tag(handle);
 	hwq = ublk_unique_tag_to_hwq(tag);
 	tag = ublk_unique_tag_to_tag(tag);
@@ -311,7 +399,7 @@ static int nbd_handle_recv_reply(const struct ublksrv_queue *q,
 		goto fail;
 	}
 
-	data = ublksrv_queue_get_io_data(q, tag);
+	data = ublksrv_tgt_get_io_data(q, tag);
 	io = __ublk_get_io_tgt_data(data);
 	nbd_data = io_tgt_to_nbd_data(io);
 	if (nbd_data->cmd_cookie != nbd_handle_to_cookie(handle)) {
@@ -321,8 +409,10 @@ static int nbd_handle_recv_reply(const struct ublksrv_queue *q,
 		goto fail;
 	}
 
+	/* read data follows reply unless it is in memfd already */
 	ublk_op = ublksrv_get_op(data->iod);
-	if (ublk_op == UBLK_IO_OP_READ) {
+	if (ublk_op == UBLK_IO_OP_READ && !q_data->use_shm) {
+		nbd_data->state = NBD_IO_RECV;
 		*io_data = data;
 		return 1;
 	} else {
@@ -335,7 +425,8 @@ static int nbd_handle_recv_reply(const struct ublksrv_queue *q,
 		if (err) {
 			fake_cqe.res = -EIO;
 		} else {
-			if (ublk_op == UBLK_IO_OP_WRITE)
+			if (ublk_op == UBLK_IO_OP_WRITE ||
+					ublk_op == UBLK_IO_OP_READ)
 				fake_cqe.res = data->iod->nr_sectors << 9;
 			else
 				fake_cqe.res = 0;
@@ -443,6 +534,7 @@ static co_io_job __nbd_handle_recv(const struct ublksrv_queue *q,
 	struct nbd_queue_data *q_data = nbd_get_queue_data(q);
 	int fd = q->dev->tgt.fds[q->q_id + 1];
 	unsigned int len;
+	void *buf;
 	u64 cqe_buf[2] = {0};
 	struct io_uring_cqe *fake_cqe = (struct io_uring_cqe *)cqe_buf;
 
@@ -470,13 +562,18 @@ handle_recv:
 		ret = nbd_handle_recv_reply(q, nbd_data, io->tgt_io_cqe, &io_data);
 		if (ret < 0)
 			break;
-		if (!ret)
+		if (!ret || (ret == 2 && !q_data->drain_len))
 			continue;
 read_io:
-		ublk_assert(io_data != NULL);
-
-		len = io_data->iod->nr_sectors << 9;
-		ret = nbd_do_recv(q, nbd_data, fd, (void *)io_data->iod->addr, len);
+		/* io_data is NULL when draining data of expired read */
+		if (io_data) {
+			len = io_data->iod->nr_sectors << 9;
+			buf = (void *)io_data->iod->addr;
+		} else {
+			len = q_data->drain_len;
+			buf = q_data->drain_buf;
+		}
+		ret = nbd_do_recv(q, nbd_data, fd, buf, len);
 		if (ret == (int)len) {
 			nbd_data->done = ret;
 			fake_cqe->res = 0;
@@ -487,13 +584,17 @@ read_io:
 
 		/* still wait on recv coroutine context */
 		co_await__suspend_always(data->tag);
+		if (q_data->dead)
+			break;
 
 		ret = io->tgt_io_cqe->res;
 		if (ret == -EAGAIN)
 			goto read_io;
 
 handle_read_io:
-		__nbd_resume_read_req(io_data, io->tgt_io_cqe, nbd_data->done);
+		if (io_data)
+			__nbd_resume_read_req(io_data, io->tgt_io_cqe,
+					nbd_data->done);
 	}
 	q_data->recv_started = 0;
 	co_return;
@@ -510,14 +611,31 @@ static int nbd_handle_io_async(const struct ublksrv_queue *q,
 {
 	struct ublk_io_tgt *io = __ublk_get_io_tgt_data(data);
 	struct nbd_queue_data *q_data = nbd_get_queue_data(q);
+	struct nbd_io_data *nbd_data = io_tgt_to_nbd_data(io);
+
+	if (ublksrv_cache_handle_io(q_data->cache, q, data))
+		return 0;
+
+	/* fail fast after the connection is given up */
+	if (q_data->dead) {
+		ublksrv_cache_complete_io(q_data->cache, q, data->tag,
+				-ENOTCONN);
+		return 0;
+	}
+
+	nbd_data->retries = 0;
+	if (q_data->tmo.ms)
+		nbd_data->deadline = ublksrv_tgt_now_ns() +
+			q_data->tmo.ms * 1000000ULL;
 
 	/*
 	 * Put the io in the queue and submit them after
 	 * the current chain becomes idle.
 	 */
-	if (nbd_send_chain_busy(q_data))
+	if (nbd_send_chain_busy(q_data)) {
+		nbd_data->state = NBD_IO_QUEUED;
 		q_data->next_chain.push_back(data);
-	else
+	} else
 		io->co = __nbd_handle_io_async(q, data, io);
 
 	return 0;
@@ -536,8 +654,14 @@ static void nbd_send_req_done(const struct ublksrv_queue *q,
 	unsigned ublk_op = user_data_to_op(cqe->user_data);
 	int tag = user_data_to_tag(cqe->user_data);
 	unsigned int nr_sects = user_data_to_tgt_data(cqe->user_data);
+	unsigned hdr_len = q_data->use_shm ? sizeof(struct nbd_shm_request) :
+		sizeof(struct nbd_request);
 	unsigned total;
 
+	/* buffer of send_zc is released by the notification */
+	if (!(cqe->flags & IORING_CQE_F_MORE))
+		io_tgt_to_nbd_data(__ublk_get_io_tgt_data(data))->sends -= 1;
+
 	/* nothing to do for send_zc notification */
 	if (cqe->flags & IORING_CQE_F_NOTIF)
 		return;
@@ -559,10 +683,7 @@ static void nbd_send_req_done(const struct ublksrv_queue *q,
 	 * We have set MSG_WAITALL, so short send shouldn't be possible,
 	 * but just warn in case of io_uring regression
 	 */
-	if (ublk_op == UBLK_IO_OP_WRITE)
-		total = sizeof(nbd_request) + (nr_sects << 9);
-	else
-		total = sizeof(nbd_request);
+	total = hdr_len + (nr_sects << 9);
 	if (cqe->res < (int)total)
 		nbd_err("%s: short send/receive tag %d op %d %llx, len %u written %u cqe flags %x\n",
 				__func__, tag, ublk_op, cqe->user_data,
@@ -575,6 +696,17 @@ static void nbd_tgt_io_done(const struct ublksrv_queue *q,
 {
 	int tag = user_data_to_tag(cqe->user_data);
 
+	if (ublksrv_cache_io_done(nbd_get_queue_data(q)->cache, q, cqe))
+		return;
+
+	if (user_data_to_op(cqe->user_data) == UBLKSRV_TICK_OP) {
+		struct nbd_queue_data *q_data = nbd_get_queue_data(q);
+
+		q_data->tick.armed = false;
+		q_data->need_handle_tick = 1;
+		return;
+	}
+
 	ublk_assert(tag == data->tag);
 #if NBD_DEBUG_CQE == 1
 	struct nbd_queue_data *q_data = nbd_get_queue_data(q);
@@ -616,6 +748,7 @@ static void nbd_handle_send_bg(const struct ublksrv_queue *q,
 			struct ublk_io_tgt *io = __ublk_get_io_tgt_data(data);
 
 			ublk_assert(data->tag < q->q_depth);
+			io_tgt_to_nbd_data(io)->state = NBD_IO_IDLE;
 			io->co = __nbd_handle_io_async(q, data, io);
 		}
 
@@ -627,10 +760,87 @@ static void nbd_handle_send_bg(const struct ublksrv_queue *q,
 	}
 }
 
+/*
+ * Socket of one queue is stuck if any send misses deadline, then it is
+ * shut down, and all io of this queue fails from now on. Otherwise the
+ * expired io is failed or sent again, and its late reply is dropped.
+ */
+static void nbd_handle_deadline(const struct ublksrv_queue *q,
+		struct nbd_queue_data *q_data)
+{
+	unsigned long long now = ublksrv_tgt_now_ns();
+	std::vector<const struct ublk_io_data *> &ios = q_data->next_chain;
+	u64 cqe_buf[2] = {0};
+	struct io_uring_cqe *fake_cqe = (struct io_uring_cqe *)cqe_buf;
+	int tag;
+
+	for (auto it = ios.begin(); it != ios.end(); ) {
+		auto data = *it;
+		struct nbd_io_data *nbd_data =
+			io_tgt_to_nbd_data(__ublk_get_io_tgt_data(data));
+
+		if (!q_data->dead && nbd_data->deadline > now) {
+			++it;
+			continue;
+		}
+		nbd_data->state = NBD_IO_IDLE;
+		ublksrv_cache_complete_io(q_data->cache, q, data->tag,
+				q_data->dead ? -ENOTCONN : -ETIMEDOUT);
+		it = ios.erase(it);
+	}
+
+	for (tag = 0; tag < q->q_depth; tag++) {
+		const struct ublk_io_data *data =
+			ublksrv_queue_get_io_data(q, tag);
+		struct ublk_io_tgt *io = __ublk_get_io_tgt_data(data);
+		struct nbd_io_data *nbd_data = io_tgt_to_nbd_data(io);
+
+		/* recv coroutine owns io whose read data is being received */
+		if (nbd_data->state != NBD_IO_SENT &&
+				!(nbd_data->state == NBD_IO_RECV &&
+					q_data->dead && !q_data->recv_started))
+			continue;
+		if (!q_data->dead && nbd_data->deadline > now)
+			continue;
+
+		/* the io may carry iod of one stacked layer */
+		data = ublksrv_tgt_get_io_data(q, tag);
+
+		/* the buffer is still referenced by send */
+		if (nbd_data->sends) {
+			if (!q_data->dead) {
+				nbd_err("%s: qid %d tag %d send stalls, give up connection\n",
+						__func__, q->q_id, tag);
+				shutdown(q->dev->tgt.fds[q->q_id + 1], SHUT_RDWR);
+				q_data->dead = 1;
+			}
+			continue;
+		}
+
+		if (q_data->dead) {
+			fake_cqe->res = -ENOTCONN;
+		} else if (q_data->tmo.policy == UBLKSRV_TMO_RETRY &&
+				nbd_data->retries < q_data->tmo.retries) {
+			/* resend can't cut in the submitted chain */
+			if (nbd_send_chain_busy(q_data))
+				continue;
+			nbd_expire_handle(q, q_data, data, nbd_data);
+			nbd_data->retries += 1;
+			nbd_data->deadline = now + q_data->tmo.ms * 1000000ULL;
+			fake_cqe->res = -ETIME;
+		} else {
+			nbd_expire_handle(q, q_data, data, nbd_data);
+			fake_cqe->res = -ETIMEDOUT;
+		}
+		io->tgt_io_cqe = fake_cqe;
+		io->co.resume();
+	}
+}
+
 static void nbd_handle_recv_bg(const struct ublksrv_queue *q,
 		struct nbd_queue_data *q_data)
 {
-	if (q_data->in_flight_ios && !q_data->recv_started) {
+	if (q_data->in_flight_ios && !q_data->recv_started && !q_data->dead) {
 		const struct ublk_io_data *data =
 			ublksrv_queue_get_io_data(q, q->q_depth);
 		struct ublk_io_tgt *io = __ublk_get_io_tgt_data(data);
@@ -677,6 +887,11 @@ static void nbd_handle_io_bg(const struct ublksrv_queue *q, int nr_queued_io)
 				q_data->recv_started,
 				nr_queued_io);
 
+	if (q_data->need_handle_tick) {
+		q_data->need_handle_tick = 0;
+		nbd_handle_deadline(q, q_data);
+	}
+
 	nbd_handle_send_bg(q, q_data);
 
 	/*
@@ -704,6 +919,11 @@ static void nbd_handle_io_bg(const struct ublksrv_queue *q, int nr_queued_io)
 				__func__, q_data->in_flight_ios,
 				q_data->chained_send_ios);
 
+	/* tick can't cut in send SQE chain either */
+	if (q_data->in_flight_ios || !q_data->next_chain.empty())
+		ublksrv_tgt_arm_tick(q, &q_data->tick, &q_data->tmo,
+				q->q_depth);
+
 	/*
 	 * This chain is going to be submitted to kernel because
 	 * ->handle_io_background() is the last thing before calling
@@ -727,8 +947,25 @@ static int nbd_init_queue(const struct ublksrv_queue *q,
 	data->use_send_zc = ddata->unix_sock ? false : ddata->use_send_zc;
 	data->use_unix_sock = ddata->unix_sock;
 	data->recv_started = 0;
+	data->tmo = ddata->tmo;
+	data->cache = ddata->cache;
+	data->use_shm = ddata->use_shm;
+	data->shm_base = ddata->use_shm ? ddata->shm_base[q->q_id] : NULL;
+	if (!ddata->unix_sock)
+		ublksrv_tgt_busy_poll_queue(q, &ddata->bp);
 	//nbd_err("%s send zc %d\n", __func__, data->use_send_zc);
 
+	if (data->tmo.ms) {
+		const struct ublksrv_ctrl_dev_info *info =
+			ublksrv_ctrl_get_dev_info(ublksrv_get_ctrl_dev(q->dev));
+
+		data->drain_buf = malloc(info->max_io_buf_bytes);
+		if (!data->drain_buf) {
+			free(data);
+			return -ENOMEM;
+		}
+	}
+
 	*queue_data_ptr = (void *)data;
 	return 0;
 }
@@ -737,17 +974,91 @@ static void nbd_deinit_queue(const struct ublksrv_queue *q)
 {
 	struct nbd_queue_data *data = nbd_get_queue_data(q);
 
+	free(data->drain_buf);
 	free(data);
 }
 
+/*
+ * io buffers are allocated before ->init_queue(), and they come from
+ * the memfd of this queue if the server takes it
+ */
+static void *nbd_alloc_io_buf(const struct ublksrv_queue *q, int tag,
+		int size)
+{
+	const struct nbd_tgt_data *ddata =
+		(const struct nbd_tgt_data *)q->dev->tgt.tgt_data;
+	void *buf;
+
+	if (ddata->use_shm)
+		return ddata->shm_base[q->q_id] + (size_t)tag * size;
+
+	if (posix_memalign(&buf, getpagesize(), size))
+		return NULL;
+	return buf;
+}
+
+static void nbd_free_io_buf(const struct ublksrv_queue *q, void *buf,
+		int tag)
+{
+	const struct nbd_tgt_data *ddata =
+		(const struct nbd_tgt_data *)q->dev->tgt.tgt_data;
+
+	/* memfd is unmapped in nbd_deinit_tgt() */
+	if (!ddata->use_shm)
+		free(buf);
+}
+
+static void nbd_shm_unmap(struct nbd_tgt_data *data, int nr_queues)
+{
+	int i;
+
+	if (!data->shm_base)
+		return;
+	for (i = 0; i < nr_queues; i++)
+		if (data->shm_base[i])
+			munmap(data->shm_base[i], data->shm_size);
+	free(data->shm_base);
+	data->shm_base = NULL;
+	data->use_shm = false;
+}
+
+/* io buffers of queue 'q_id' in one memfd, which is shared with server */
+static int nbd_shm_create(struct nbd_tgt_data *data,
+		const struct ublksrv_ctrl_dev_info *info, int q_id)
+{
+	char name[32];
+	void *base;
+	int fd;
+
+	snprintf(name, sizeof(name), "ublk-nbd-%d-%d", info->dev_id, q_id);
+	fd = memfd_create(name, MFD_CLOEXEC);
+	if (fd < 0)
+		return -errno;
+	if (ftruncate(fd, data->shm_size)) {
+		close(fd);
+		return -errno;
+	}
+	base = mmap(NULL, data->shm_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+			fd, 0);
+	if (base == MAP_FAILED) {
+		close(fd);
+		return -errno;
+	}
+	data->shm_base[q_id] = (char *)base;
+	return fd;
+}
+
 static void nbd_deinit_tgt(const struct ublksrv_dev *dev)
 {
 	const struct ublksrv_tgt_info *tgt = &dev->tgt;
 	const struct ublksrv_ctrl_dev_info *info =
 		ublksrv_ctrl_get_dev_info(ublksrv_get_ctrl_dev(dev));
+	struct nbd_tgt_data *data = (struct nbd_tgt_data *)tgt->tgt_data;
 	int i;
 
-	free(tgt->tgt_data);
+	ublksrv_cache_close(data->cache);
+	nbd_shm_unmap(data, info->nr_hw_queues);
+	free(data);
 
 	for (i = 0; i < info->nr_hw_queues; i++) {
 		int fd = tgt->fds[i + 1];
@@ -783,8 +1094,14 @@ static int nbd_setup_tgt(struct ublksrv_dev *dev, int type,
 	char *tlshostname = NULL;
 	bool tls = false;
 
-	unsigned long send_zc = 0;
-
+	unsigned long send_zc = 0, shm = 0;
+	struct nbd_shm_opt shm_opt = {
+		.flags = 0,
+		.nr_bufs = info->queue_depth,
+		.buf_size = info->max_io_buf_bytes,
+	};
+	char cache_id[3 * NBD_MAX_NAME];
+	int ret;
 
 	if (info->flags & UBLK_F_USER_COPY)
 		return -EINVAL;
@@ -793,28 +1110,74 @@ static int nbd_setup_tgt(struct ublksrv_dev *dev, int type,
 	ublk_json_read_target_str_info(cdev, "unix", unix_path);
 	ublk_json_read_target_str_info(cdev, "export_name", exp_name);
 	ublk_json_read_target_ulong_info(cdev, "send_zc", &send_zc);
+	ublk_json_read_target_ulong_info(cdev, "shm", &shm);
+
+	if (shm) {
+		/* late reply could write to buffer of new io */
+		if (!strlen(unix_path) || data->tmo.ms) {
+			ublk_err("%s: shm needs --unix and no --io_timeout\n",
+					__func__);
+			return -EINVAL;
+		}
+		data->shm_size = (size_t)info->queue_depth *
+			info->max_io_buf_bytes;
+		data->shm_base = (char **)calloc(info->nr_hw_queues,
+				sizeof(char *));
+		if (!data->shm_base)
+			return -ENOMEM;
+		data->use_shm = true;
+	}
 
 	NBD_HS_DBG("%s: host %s unix %s exp_name %s send_zc: %lu\n", __func__,
 			host_name, unix_path, exp_name, send_zc);
 	for (i = 0; i < info->nr_hw_queues; i++) {
-		int sock;
+		int sock, shm_fd = -1;
 		unsigned int opts = 0;
+		bool shm_ok;
 
 		if (strlen(unix_path))
 			sock = openunix(unix_path);
 		else
 			sock = opennet(host_name, port, false);
 
-		if (sock >= 0)
-			negotiate(&sock, &size64, flags, exp_name,
-					needed_flags, cflags, opts, certfile,
-					keyfile, cacertfile, tlshostname, tls,
-					can_opt_go);
-		else {
+		if (sock < 0) {
 			ublk_err("%s: open socket failed %d\n", __func__, sock);
 			return sock;
 		}
 
+		if (data->use_shm) {
+			shm_fd = nbd_shm_create(data, info, i);
+			if (shm_fd < 0) {
+				close(sock);
+				return shm_fd;
+			}
+		}
+		shm_ok = negotiate(&sock, &size64, flags, exp_name,
+				needed_flags, cflags, opts, certfile,
+				keyfile, cacertfile, tlshostname, tls,
+				can_opt_go, data->use_shm ? &shm_opt : NULL,
+				shm_fd);
+		/* the server has its own reference now */
+		if (shm_fd >= 0)
+			close(shm_fd);
+
+		/* all queues share memory with server, or none does */
+		if (data->use_shm && !shm_ok) {
+			if (i) {
+				ublk_err("%s: qid %d shm is refused\n",
+						__func__, i);
+				close(sock);
+				return -EPROTO;
+			}
+			ublk_log("%s: server doesn't support shm, copy data via socket\n",
+					__func__);
+			nbd_shm_unmap(data, info->nr_hw_queues);
+		}
+
+		/* unix socket has no NAPI */
+		if (!strlen(unix_path))
+			ublksrv_tgt_busy_poll_sock(sock, &data->bp,
+					info->queue_depth);
 		tgt->fds[i + 1] = sock;
 		NBD_HS_DBG("%s:qid %d %s-%s size %luMB flags %x sock %d\n",
 				__func__, i, host_name, port,
@@ -830,6 +1193,8 @@ static int nbd_setup_tgt(struct ublksrv_dev *dev, int type,
 	 * especially we use IORING_SETUP_SQE128
 	 */
 	tgt->tgt_ring_depth = info->queue_depth + 1;
+	if (data->tmo.ms)
+		tgt->tgt_ring_depth += 1;	//deadline tick
 	tgt->nr_fds = info->nr_hw_queues;
 	tgt->extra_ios = 1;	//one extra slot for receiving nbd reply
 	data->unix_sock = strlen(unix_path) > 0 ? true : false;
@@ -838,10 +1203,22 @@ static int nbd_setup_tgt(struct ublksrv_dev *dev, int type,
 	tgt->io_data_size = sizeof(struct ublk_io_tgt) +
 		sizeof(struct nbd_io_data);
 
-	ublksrv_dev_set_cq_depth(dev, 2 * tgt->tgt_ring_depth);
-
 	if (info->flags & (UBLK_F_SUPPORT_ZERO_COPY | UBLK_F_AUTO_BUF_REG))
 		return -EINVAL;
+
+	if (strlen(unix_path))
+		snprintf(cache_id, sizeof(cache_id), "nbd+unix:///%s?socket=%s",
+				exp_name, unix_path);
+	else
+		snprintf(cache_id, sizeof(cache_id), "nbd://%s:%s/%s",
+				host_name, port, exp_name);
+	ret = ublksrv_cache_open(dev, cache_id, &data->cache);
+	if (ret)
+		return ret;
+	if (data->cache)
+		tgt->tgt_ring_depth += info->queue_depth;	//cache reads
+
+	ublksrv_dev_set_cq_depth(dev, 2 * tgt->tgt_ring_depth);
 	return 0;
 }
 
@@ -873,8 +1250,19 @@ static void nbd_parse_flags(struct ublk_params *p, uint16_t flags, uint32_t bs)
 static int nbd_recover_tgt(struct ublksrv_dev *dev, int type)
 {
 	uint16_t flags = 0;
+	struct nbd_tgt_data *data = (struct nbd_tgt_data *)
+		calloc(sizeof(struct nbd_tgt_data), 1);
+	int ret;
 
-	dev->tgt.tgt_data = calloc(sizeof(struct nbd_tgt_data), 1);
+	dev->tgt.tgt_data = data;
+	ret = ublksrv_tgt_parse_io_timeout(ublksrv_get_ctrl_dev(dev), 0, NULL,
+			&data->tmo);
+	if (ret)
+		return ret;
+	ret = ublksrv_tgt_parse_busy_poll(ublksrv_get_ctrl_dev(dev), 0, NULL,
+			&data->bp);
+	if (ret)
+		return ret;
 
 	return nbd_setup_tgt(dev, type, &flags);
 }
@@ -884,12 +1272,14 @@ static int nbd_init_tgt(struct ublksrv_dev *dev, int type, int argc,
 {
 	int send_zc = 0;
 	int read_only = 0;
+	int shm = 0;
 	static const struct option nbd_longopts[] = {
 		{ "host",	required_argument, 0, 0},
 		{ "unix",	required_argument, 0, 0},
 		{ "export_name",	required_argument, 0, 0},
 		{ "send_zc",  0,  &send_zc, 1},
 		{ "read_only",  0,  &read_only, 1},
+		{ "shm",  0,  &shm, 1},
 		{ NULL }
 	};
 	const struct ublksrv_ctrl_dev *cdev = ublksrv_get_ctrl_dev(dev);
@@ -940,9 +1330,22 @@ static int nbd_init_tgt(struct ublksrv_dev *dev, int type, int argc,
 	ublk_json_write_tgt_str(cdev, "unix", unix_path);
 	ublk_json_write_tgt_str(cdev, "export_name", exp_name);
 	ublk_json_write_tgt_long(cdev, "send_zc", send_zc);
+	ublk_json_write_tgt_long(cdev, "shm", shm);
 
 	tgt->tgt_data = calloc(sizeof(struct nbd_tgt_data), 1);
 
+	ret = ublksrv_tgt_parse_io_timeout(cdev, argc, argv,
+			&((struct nbd_tgt_data *)tgt->tgt_data)->tmo);
+	if (ret)
+		return ret;
+	ret = ublksrv_tgt_parse_busy_poll(cdev, argc, argv,
+			&((struct nbd_tgt_data *)tgt->tgt_data)->bp);
+	if (ret)
+		return ret;
+	ret = ublksrv_cache_parse(cdev, argc, argv);
+	if (ret)
+		return ret;
+
 	ret = nbd_setup_tgt(dev, type, &flags);
 	if (ret)
 		return ret;
@@ -971,7 +1374,10 @@ static int nbd_init_tgt(struct ublksrv_dev *dev, int type, int argc,
 
 static void nbd_cmd_usage()
 {
-	printf("\t--host=$HOST [--port=$PORT] | --unix=$UNIX_PATH\n");
+	printf("\t--host=$HOST [--port=$PORT] | --unix=$UNIX_PATH [--shm]\n");
+	ublksrv_tgt_io_timeout_usage();
+	ublksrv_tgt_busy_poll_usage();
+	ublksrv_cache_usage();
 }
 
 static const struct ublksrv_tgt_type  nbd_tgt_type = {
@@ -981,12 +1387,16 @@ static const struct ublksrv_tgt_type  nbd_tgt_type = {
 	.usage_for_add = nbd_cmd_usage,
 	.init_tgt = nbd_init_tgt,
 	.deinit_tgt = nbd_deinit_tgt,
+	.alloc_io_buf = nbd_alloc_io_buf,
+	.free_io_buf = nbd_free_io_buf,
 	.name	=  "nbd",
 	.init_queue = nbd_init_queue,
 	.deinit_queue = nbd_deinit_queue,
+	.datapath_flags = UBLK_F_BATCH_IO,
 };
 
 int main(int argc, char *argv[])
 {
+	ublksrv_stack_register_backend(&nbd_tgt_type);
 	return ublksrv_main(&nbd_tgt_type, argc, argv);
 }
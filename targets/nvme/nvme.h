@@ -45,10 +45,16 @@
 #define NVME_CMD_FLUSH          0x00
 #define NVME_CMD_WRITE          0x01
 #define NVME_CMD_READ           0x02
+#define NVME_CMD_WRITE_ZEROES   0x08
 #define NVME_CMD_DSM            0x09  /* Dataset Management (discard/deallocate) */
 
+/* Controller ONCS (Optional NVM Command Support) */
+#define NVME_CTRL_ONCS_DSM		(1 << 2)
+#define NVME_CTRL_ONCS_WRITE_ZEROES	(1 << 3)
+
 /* Command Flags */
 #define NVME_RW_FUA             (1 << 14)
+#define NVME_WZ_DEAC            (1 << 9)   /* Write Zeroes deallocate */
 
 /* SGL Descriptor Types (upper 4 bits of type field) */
 #define NVME_SGL_FMT_DATA_DESC		0x00
@@ -0,0 +1,186 @@
+// SPDX-License-Identifier: MIT or GPL-2.0-only
+
+#ifndef UBLK_NVME_TCP_H
+#define UBLK_NVME_TCP_H
+
+/*
+ * NVMe over Fabrics and NVMe/TCP transport definitions used by the host
+ * side in ublk.nvmetcp.cpp, refer to NVMe over Fabrics and NVMe/TCP
+ * Transport specifications. All fields are little endian.
+ */
+
+#include <linux/types.h>
+#include "nvme.h"
+
+#define NVME_TCP_DEFAULT_PORT	"4420"
+
+/* NVMe Fabrics command */
+#define NVME_FABRICS_COMMAND	0x7f
+
+#define NVMF_FCTYPE_PROP_SET	0x00
+#define NVMF_FCTYPE_CONNECT	0x01
+#define NVMF_FCTYPE_PROP_GET	0x04
+
+#define NVMF_NQN_SIZE		223
+#define NVMF_NQN_FIELD_LEN	256
+
+/* admin queue depth, and Connect of the admin queue needs cntlid 0xffff */
+#define NVMF_AQ_DEPTH		32
+#define NVMF_CNTLID_DYNAMIC	0xffff
+
+#define NVME_ADMIN_SET_FEATURES	0x09
+#define NVME_FEAT_NUM_QUEUES	0x07
+
+/* property attrib of 8 bytes register, such as CAP */
+#define NVMF_PROP_ATTR_8B	1
+
+#define NVME_CAP_MQES(cap)	((cap) & 0xffff)
+#define NVME_CAP_TIMEOUT(cap)	(((cap) >> 24) & 0xff)
+
+/* sgl descriptor of in-capsule data and data transferred by transport */
+#define NVME_SGL_FMT_OFFSET		0x01
+#define NVME_SGL_FMT_TRANSPORT_A	0x0a
+#define NVME_TRANSPORT_SGL_DATA_DESC	0x05
+
+#define NVME_SC_MASK		0x7ff
+
+struct nvmf_connect_command {
+	__u8	opcode;
+	__u8	resv1;
+	__u16	command_id;
+	__u8	fctype;
+	__u8	resv2[19];
+	struct nvme_sgl_desc dptr;
+	__le16	recfmt;
+	__le16	qid;
+	__le16	sqsize;
+	__u8	cattr;
+	__u8	resv3;
+	__le32	kato;
+	__u8	resv4[12];
+};
+
+struct nvmf_connect_data {
+	__u8	hostid[16];
+	__le16	cntlid;
+	char	resv4[238];
+	char	subsysnqn[NVMF_NQN_FIELD_LEN];
+	char	hostnqn[NVMF_NQN_FIELD_LEN];
+	char	resv5[256];
+};
+
+struct nvmf_property_get_command {
+	__u8	opcode;
+	__u8	resv1;
+	__u16	command_id;
+	__u8	fctype;
+	__u8	resv2[35];
+	__u8	attrib;
+	__u8	resv3[3];
+	__le32	offset;
+	__u8	resv4[16];
+};
+
+struct nvmf_property_set_command {
+	__u8	opcode;
+	__u8	resv1;
+	__u16	command_id;
+	__u8	fctype;
+	__u8	resv2[35];
+	__u8	attrib;
+	__u8	resv3[3];
+	__le32	offset;
+	__le64	value;
+	__u8	resv4[8];
+};
+
+/* NVMe/TCP PDU types */
+enum {
+	NVME_TCP_PDU_ICREQ	= 0x00,
+	NVME_TCP_PDU_ICRESP	= 0x01,
+	NVME_TCP_PDU_H2C_TERM	= 0x02,
+	NVME_TCP_PDU_C2H_TERM	= 0x03,
+	NVME_TCP_PDU_CMD	= 0x04,
+	NVME_TCP_PDU_RSP	= 0x05,
+	NVME_TCP_PDU_H2C_DATA	= 0x06,
+	NVME_TCP_PDU_C2H_DATA	= 0x07,
+	NVME_TCP_PDU_R2T	= 0x09,
+};
+
+/* flags of PDU common header */
+#define NVME_TCP_F_HDGST		(1 << 0)
+#define NVME_TCP_F_DDGST		(1 << 1)
+#define NVME_TCP_F_DATA_LAST		(1 << 2)
+#define NVME_TCP_F_DATA_SUCCESS		(1 << 3)
+
+/* 'dgst' of ICReq/ICResp */
+#define NVME_TCP_HDR_DIGEST_ENABLE	(1 << 0)
+#define NVME_TCP_DATA_DIGEST_ENABLE	(1 << 1)
+
+#define NVME_TCP_PFV_1_0		0
+#define NVME_TCP_DIGEST_LEN		4
+
+struct nvme_tcp_hdr {
+	__u8	type;
+	__u8	flags;
+	__u8	hlen;
+	__u8	pdo;
+	__le32	plen;
+};
+
+struct nvme_tcp_icreq_pdu {
+	struct nvme_tcp_hdr hdr;
+	__le16	pfv;
+	__u8	hpda;
+	__u8	digest;
+	__le32	maxr2t;
+	__u8	rsvd2[112];
+};
+
+struct nvme_tcp_icresp_pdu {
+	struct nvme_tcp_hdr hdr;
+	__le16	pfv;
+	__u8	cpda;
+	__u8	digest;
+	__le32	maxdata;
+	__u8	rsvd[112];
+};
+
+struct nvme_tcp_term_pdu {
+	struct nvme_tcp_hdr hdr;
+	__le16	fes;
+	__le16	feil;
+	__le16	feiu;
+	__u8	rsvd[10];
+};
+
+struct nvme_tcp_cmd_pdu {
+	struct nvme_tcp_hdr hdr;
+	struct nvme_common_command cmd;
+};
+
+struct nvme_tcp_rsp_pdu {
+	struct nvme_tcp_hdr hdr;
+	struct nvme_completion cqe;
+};
+
+struct nvme_tcp_r2t_pdu {
+	struct nvme_tcp_hdr hdr;
+	__u16	command_id;
+	__u16	ttag;
+	__le32	r2t_offset;
+	__le32	r2t_length;
+	__u8	rsvd[4];
+};
+
+/* both H2CData and C2HData */
+struct nvme_tcp_data_pdu {
+	struct nvme_tcp_hdr hdr;
+	__u16	command_id;
+	__u16	ttag;
+	__le32	data_offset;
+	__le32	data_length;
+	__u8	rsvd[4];
+};
+
+#endif /* UBLK_NVME_TCP_H */
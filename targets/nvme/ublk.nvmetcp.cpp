@@ -0,0 +1,1663 @@
+// SPDX-License-Identifier: MIT or GPL-2.0-only
+
+/*
+ * NVMe/TCP initiator target
+ *
+ * The NVMe/TCP host protocol is implemented on the per-queue io_uring
+ * directly, and no kernel nvme-tcp driver is involved. One TCP connection
+ * carrying one NVMe I/O queue is opened for each ublk queue, so commands
+ * and data of one ublk queue are handled in its own queue thread only.
+ * The admin queue on one more connection is only used at setup for
+ * Connect, enabling the controller and Identify, and keep alive is
+ * disabled, so nothing is sent on it after setup.
+ *
+ * Writes not bigger than in-capsule data size of the controller are sent
+ * with the command capsule, and bigger writes are sent by H2CData PDUs
+ * after R2T is received. PDUs of one queue are gathered into one sendmsg,
+ * and only one sendmsg is in flight, so PDUs never interleave in the
+ * stream.
+ *
+ * The stream is received by one multishot recv with provided buffer ring,
+ * and parsed into PDUs, data of C2HData is copied to io buffer from the
+ * provided buffer. Header and data digests are CRC32C computed by
+ * ublksrv_crc32c().
+ *
+ * Usage:
+ *     ublk add -t nvmetcp --host 127.0.0.1 --subnqn $NQN [--hdr_digest]
+ */
+
+#include <config.h>
+#include <vector>
+#include <algorithm>
+#include <endian.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/random.h>
+
+#include "ublksrv_tgt.h"
+#include "ublksrv_pi.h"
+#include "nvme_tcp.h"
+
+#define NVMETCP_RECV_OP		0x80
+#define NVMETCP_SEND_OP		0x81
+
+/* provided buffers of multishot recv, one buffer group in each queue ring */
+#define NVMETCP_BGID		0x4e54
+#define NVMETCP_NR_BUFS		64
+#define NVMETCP_BUF_SIZE	(32 << 10)
+
+/* sendmsg() takes at most UIO_MAXIOV iovecs */
+#define NVMETCP_MAX_IOV		1024
+
+/* all PDUs sent by controller after ICResp have 24 bytes header */
+#define NVMETCP_HLEN		sizeof(struct nvme_tcp_data_pdu)
+
+static_assert(sizeof(struct nvme_common_command) == 64, "bad sqe size");
+static_assert(sizeof(struct nvmf_connect_command) == 64, "bad connect size");
+static_assert(sizeof(struct nvmf_property_get_command) == 64, "bad prop size");
+static_assert(sizeof(struct nvmf_property_set_command) == 64, "bad prop size");
+static_assert(sizeof(struct nvme_identify) == 64, "bad identify size");
+static_assert(sizeof(struct nvmf_connect_data) == 1024, "bad connect data");
+static_assert(sizeof(struct nvme_tcp_icreq_pdu) == 128, "bad icreq size");
+static_assert(sizeof(struct nvme_tcp_rsp_pdu) == NVMETCP_HLEN, "bad rsp size");
+static_assert(sizeof(struct nvme_tcp_r2t_pdu) == NVMETCP_HLEN, "bad r2t size");
+static_assert(offsetof(struct nvme_id_ctrl, ioccsz) == 1792, "bad id_ctrl");
+
+struct nvmetcp_tgt_data {
+	char host[NI_MAXHOST];
+	char port[NI_MAXSERV];
+	char subnqn[NVMF_NQN_FIELD_LEN];
+	char hostnqn[NVMF_NQN_FIELD_LEN];
+	__u8 hostid[16];
+	__u32 nsid;
+	struct ublksrv_busy_poll bp;
+
+	/* digests asked for, then the ones enabled by controller */
+	bool hdgst;
+	bool ddgst;
+
+	int admin_fd;
+	__u16 cntlid;
+	__u16 oncs;
+	__u8 vwc;
+	__u8 mdts;
+	unsigned lba_shift;
+	unsigned inline_bytes;	/* in-capsule data size of io queue */
+	unsigned maxh2cdata;
+	__u64 nsze;
+};
+
+/* connection at setup, commands are issued synchronously */
+struct nvmetcp_conn {
+	int fd;
+	bool hdgst;
+	bool ddgst;
+	unsigned maxh2cdata;
+	__u16 cid;
+};
+
+/* one H2CData PDU with its digests */
+struct nvmetcp_h2c {
+	struct nvme_tcp_data_pdu pdu;
+	__le32 hdgst;
+	__le32 ddgst;
+};
+
+enum {
+	NVMETCP_RX_CH,		/* common header */
+	NVMETCP_RX_HDR,		/* the rest of header and header digest */
+	NVMETCP_RX_PAD,
+	NVMETCP_RX_DATA,
+	NVMETCP_RX_DDGST,
+};
+
+struct nvmetcp_queue_data {
+	unsigned short hdgst:1;
+	unsigned short ddgst:1;
+	unsigned short recv_armed:1;
+	unsigned short send_busy:1;
+	unsigned short dead:1;		/* connection is lost */
+
+	const struct nvmetcp_tgt_data *tdata;
+	unsigned maxh2cdata;
+
+	/*
+	 * PDUs queued for the next sendmsg, and PDUs being sent, in which
+	 * 'tx_idx' is the first iovec not sent yet.
+	 */
+	std::vector<struct iovec> tx_next;
+	std::vector<struct iovec> tx;
+	unsigned tx_idx;
+	struct msghdr tx_msg;
+
+	/* H2CData PDUs of each tag */
+	struct nvmetcp_h2c *h2c;
+	unsigned nr_h2c;
+
+	/* provided buffers of multishot recv */
+	struct io_uring_buf_ring *br;
+	char *bufs;
+
+	/* the PDU being received */
+	unsigned rx_state;
+	unsigned rx_len;	/* bytes of the current state */
+	unsigned rx_done;
+	union {
+		struct nvme_tcp_hdr hdr;
+		struct nvme_tcp_rsp_pdu rsp;
+		struct nvme_tcp_r2t_pdu r2t;
+		struct nvme_tcp_data_pdu data;
+		char buf[NVMETCP_HLEN + NVME_TCP_DIGEST_LEN];
+	} rx_pdu;
+	int rx_tag;
+	__u8 rx_flags;
+	char *rx_buf;		/* where data of C2HData is copied to */
+	unsigned rx_data_len;
+	__u32 rx_crc;
+	__le32 rx_ddgst;
+};
+
+enum {
+	NVMETCP_IO_IDLE,
+	NVMETCP_IO_SENT,	/* waiting for response */
+};
+
+struct nvmetcp_io_data {
+	/* command capsule, header digest has to follow it */
+	struct nvme_tcp_cmd_pdu pdu;
+	__le32 hdgst;
+	__le32 ddgst;
+	struct nvme_dsm_range dsm;
+	unsigned char state;
+};
+static_assert(offsetof(struct nvmetcp_io_data, hdgst) ==
+		sizeof(struct nvme_tcp_cmd_pdu), "hdgst doesn't follow pdu");
+
+static inline struct nvmetcp_queue_data *
+nvmetcp_get_queue_data(const struct ublksrv_queue *q)
+{
+	return (struct nvmetcp_queue_data *)q->private_data;
+}
+
+static inline struct nvmetcp_io_data *
+io_tgt_to_nvmetcp_data(const struct ublk_io_tgt *io)
+{
+	return (struct nvmetcp_io_data *)(io + 1);
+}
+
+static inline unsigned nvmf_tcp_hdr_size(unsigned hlen, bool hdgst)
+{
+	return hlen + (hdgst ? NVME_TCP_DIGEST_LEN : 0);
+}
+
+/*
+ * Fill PDU common header for 'dlen' bytes of data, header digest is
+ * filled by nvmf_tcp_set_hdgst() after the whole header is built.
+ */
+static void nvmf_tcp_init_hdr(struct nvme_tcp_hdr *hdr, __u8 type,
+		__u8 hlen, unsigned dlen, bool hdgst, bool ddgst)
+{
+	unsigned hsize = nvmf_tcp_hdr_size(hlen, hdgst);
+
+	hdr->type = type;
+	hdr->flags = hdgst ? NVME_TCP_F_HDGST : 0;
+	hdr->hlen = hlen;
+	hdr->pdo = dlen ? hsize : 0;
+	if (dlen && ddgst) {
+		hdr->flags |= NVME_TCP_F_DDGST;
+		dlen += NVME_TCP_DIGEST_LEN;
+	}
+	hdr->plen = htole32(hsize + dlen);
+}
+
+static void nvmf_tcp_set_hdgst(struct nvme_tcp_hdr *hdr)
+{
+	__le32 dgst;
+
+	if (!(hdr->flags & NVME_TCP_F_HDGST))
+		return;
+	dgst = htole32(ublksrv_crc32c(0, hdr, hdr->hlen));
+	memcpy((char *)hdr + hdr->hlen, &dgst, sizeof(dgst));
+}
+
+static bool nvmf_tcp_hdgst_ok(const struct nvme_tcp_hdr *hdr)
+{
+	__le32 dgst;
+
+	memcpy(&dgst, (const char *)hdr + hdr->hlen, sizeof(dgst));
+	return le32toh(dgst) == ublksrv_crc32c(0, hdr, hdr->hlen);
+}
+
+/* data is either in capsule, or transferred by C2HData or R2T */
+static void nvmf_tcp_set_sgl(struct nvme_common_command *c, unsigned len,
+		bool in_capsule)
+{
+	struct nvme_sgl_desc *sgl = (struct nvme_sgl_desc *)&c->prp1;
+
+	c->flags = NVME_CMD_SGL_METABUF;
+	sgl->addr = 0;
+	sgl->length = htole32(len);
+	if (in_capsule)
+		sgl->type = (NVME_SGL_FMT_DATA_DESC << 4) |
+			NVME_SGL_FMT_OFFSET;
+	else
+		sgl->type = (NVME_TRANSPORT_SGL_DATA_DESC << 4) |
+			NVME_SGL_FMT_TRANSPORT_A;
+}
+
+/* setup helpers over blocking socket */
+static int nvmf_tcp_send_all(int fd, struct iovec *iov, int nr)
+{
+	while (nr) {
+		struct msghdr msg = {};
+		ssize_t ret;
+
+		msg.msg_iov = iov;
+		msg.msg_iovlen = nr;
+		ret = sendmsg(fd, &msg, MSG_NOSIGNAL);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret < 0)
+			return -errno;
+
+		while (nr && (size_t)ret >= iov->iov_len) {
+			ret -= iov->iov_len;
+			iov++;
+			nr--;
+		}
+		if (nr) {
+			iov->iov_base = (char *)iov->iov_base + ret;
+			iov->iov_len -= ret;
+		}
+	}
+	return 0;
+}
+
+static int nvmf_tcp_recv_all(int fd, void *buf, unsigned len)
+{
+	unsigned done = 0;
+
+	while (done < len) {
+		ssize_t ret = recv(fd, (char *)buf + done, len - done,
+				MSG_WAITALL);
+
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret < 0)
+			return -errno;
+		if (ret == 0)
+			return -ECONNRESET;
+		done += ret;
+	}
+	return 0;
+}
+
+static int nvmf_tcp_open_sock(const char *host, const char *port)
+{
+	struct addrinfo hints = {}, *res, *ai;
+	int fd = -1, one = 1, ret;
+
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	ret = getaddrinfo(host, port, &hints, &res);
+	if (ret) {
+		ublk_err("%s: resolve %s:%s failed: %s\n", __func__, host,
+				port, gai_strerror(ret));
+		return -EHOSTUNREACH;
+	}
+
+	for (ai = res; ai; ai = ai->ai_next) {
+		fd = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC,
+				ai->ai_protocol);
+		if (fd < 0)
+			continue;
+		if (!connect(fd, ai->ai_addr, ai->ai_addrlen))
+			break;
+		close(fd);
+		fd = -1;
+	}
+	freeaddrinfo(res);
+
+	if (fd < 0) {
+		ublk_err("%s: connect %s:%s failed\n", __func__, host, port);
+		return -ECONNREFUSED;
+	}
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	return fd;
+}
+
+static int nvmf_tcp_icreq(struct nvmetcp_conn *c, bool hdgst, bool ddgst)
+{
+	struct nvme_tcp_icreq_pdu req = {};
+	struct nvme_tcp_icresp_pdu resp;
+	struct iovec iov = {
+		.iov_base = &req,
+		.iov_len = sizeof(req),
+	};
+	int ret;
+
+	req.hdr.type = NVME_TCP_PDU_ICREQ;
+	req.hdr.hlen = sizeof(req);
+	req.hdr.plen = htole32(sizeof(req));
+	req.pfv = htole16(NVME_TCP_PFV_1_0);
+	/* no padding before C2HData data, and one R2T per command */
+	req.hpda = 0;
+	req.maxr2t = 0;
+	if (hdgst)
+		req.digest |= NVME_TCP_HDR_DIGEST_ENABLE;
+	if (ddgst)
+		req.digest |= NVME_TCP_DATA_DIGEST_ENABLE;
+
+	ret = nvmf_tcp_send_all(c->fd, &iov, 1);
+	if (ret)
+		return ret;
+	ret = nvmf_tcp_recv_all(c->fd, &resp, sizeof(resp));
+	if (ret)
+		return ret;
+
+	if (resp.hdr.type != NVME_TCP_PDU_ICRESP ||
+			resp.hdr.hlen != sizeof(resp) ||
+			le32toh(resp.hdr.plen) != sizeof(resp) ||
+			le16toh(resp.pfv) != NVME_TCP_PFV_1_0) {
+		ublk_err("%s: bad ICResp type %u hlen %u pfv %u\n", __func__,
+				resp.hdr.type, resp.hdr.hlen,
+				le16toh(resp.pfv));
+		return -EPROTO;
+	}
+
+	/* H2CData data is never padded, same with linux nvme-tcp host */
+	if (resp.cpda) {
+		ublk_err("%s: cpda %u isn't supported\n", __func__, resp.cpda);
+		return -EOPNOTSUPP;
+	}
+
+	c->hdgst = !!(resp.digest & NVME_TCP_HDR_DIGEST_ENABLE);
+	c->ddgst = !!(resp.digest & NVME_TCP_DATA_DIGEST_ENABLE);
+	c->maxh2cdata = le32toh(resp.maxdata);
+	if (c->maxh2cdata < 4096 || c->maxh2cdata % 4) {
+		ublk_err("%s: bad maxh2cdata %u\n", __func__, c->maxh2cdata);
+		return -EPROTO;
+	}
+	if (c->hdgst != hdgst || c->ddgst != ddgst)
+		ublk_log("%s: controller enables header digest %d data digest %d\n",
+				__func__, c->hdgst, c->ddgst);
+	return 0;
+}
+
+static int nvmf_tcp_sync_recv_data(struct nvmetcp_conn *c,
+		const struct nvme_tcp_data_pdu *pdu, unsigned hsize,
+		void *out, unsigned out_len)
+{
+	unsigned off = le32toh(pdu->data_offset);
+	unsigned len = le32toh(pdu->data_length);
+	char pad[256];
+	__le32 dgst;
+	int ret;
+
+	if (pdu->hdr.pdo < hsize || !len || (__u64)off + len > out_len)
+		return -EPROTO;
+
+	ret = nvmf_tcp_recv_all(c->fd, pad, pdu->hdr.pdo - hsize);
+	if (ret)
+		return ret;
+	ret = nvmf_tcp_recv_all(c->fd, (char *)out + off, len);
+	if (ret)
+		return ret;
+	if (!(pdu->hdr.flags & NVME_TCP_F_DDGST))
+		return 0;
+
+	ret = nvmf_tcp_recv_all(c->fd, &dgst, sizeof(dgst));
+	if (ret)
+		return ret;
+	if (le32toh(dgst) != ublksrv_crc32c(0, (char *)out + off, len))
+		return -EBADMSG;
+	return 0;
+}
+
+/*
+ * Issue one command at setup and wait for its response, 'in' is sent as
+ * in-capsule data, and data returned by C2HData is stored to 'out'. The
+ * first two dwords of completion are stored to '*result'.
+ */
+static int nvmf_tcp_sync_cmd(struct nvmetcp_conn *c,
+		const struct nvme_common_command *cmd,
+		const void *in, unsigned in_len,
+		void *out, unsigned out_len, __u64 *result)
+{
+	struct {
+		struct nvme_tcp_cmd_pdu pdu;
+		__le32 hdgst;
+	} cap = {};
+	union {
+		struct nvme_tcp_hdr hdr;
+		struct nvme_tcp_rsp_pdu rsp;
+		struct nvme_tcp_data_pdu data;
+		struct nvme_tcp_term_pdu term;
+		char buf[NVMETCP_HLEN + NVME_TCP_DIGEST_LEN];
+	} rx;
+	struct iovec iov[3];
+	__le32 ddgst;
+	int nr = 0, ret;
+
+	cap.pdu.cmd = *cmd;
+	cap.pdu.cmd.cid = htole16(c->cid++);
+	nvmf_tcp_set_sgl(&cap.pdu.cmd, in_len ? in_len : out_len, in_len);
+	nvmf_tcp_init_hdr(&cap.pdu.hdr, NVME_TCP_PDU_CMD, sizeof(cap.pdu),
+			in_len, c->hdgst, c->ddgst);
+	nvmf_tcp_set_hdgst(&cap.pdu.hdr);
+
+	iov[nr++] = { &cap, nvmf_tcp_hdr_size(sizeof(cap.pdu), c->hdgst) };
+	if (in_len) {
+		iov[nr++] = { (void *)in, in_len };
+		if (c->ddgst) {
+			ddgst = htole32(ublksrv_crc32c(0, in, in_len));
+			iov[nr++] = { &ddgst, sizeof(ddgst) };
+		}
+	}
+	ret = nvmf_tcp_send_all(c->fd, iov, nr);
+	if (ret)
+		return ret;
+
+	while (true) {
+		unsigned hsize;
+
+		ret = nvmf_tcp_recv_all(c->fd, &rx.hdr, sizeof(rx.hdr));
+		if (ret)
+			return ret;
+		if (rx.hdr.hlen != NVMETCP_HLEN)
+			return -EPROTO;
+		hsize = nvmf_tcp_hdr_size(rx.hdr.hlen,
+				rx.hdr.flags & NVME_TCP_F_HDGST);
+		ret = nvmf_tcp_recv_all(c->fd, rx.buf + sizeof(rx.hdr),
+				hsize - sizeof(rx.hdr));
+		if (ret)
+			return ret;
+		if ((rx.hdr.flags & NVME_TCP_F_HDGST) &&
+				!nvmf_tcp_hdgst_ok(&rx.hdr))
+			return -EBADMSG;
+
+		switch (rx.hdr.type) {
+		case NVME_TCP_PDU_RSP: {
+			__u16 status = le16toh(rx.rsp.cqe.status) >> 1;
+
+			if (result)
+				*result = le32toh(rx.rsp.cqe.result) |
+					(__u64)le32toh(rx.rsp.cqe.rsvd) << 32;
+			if (status) {
+				ublk_err("%s: opcode %x failed, status %x\n",
+						__func__, cmd->opcode,
+						status & NVME_SC_MASK);
+				return -EREMOTEIO;
+			}
+			return 0;
+		}
+		case NVME_TCP_PDU_C2H_DATA:
+			ret = nvmf_tcp_sync_recv_data(c, &rx.data, hsize, out,
+					out_len);
+			if (ret)
+				return ret;
+			/* no response follows */
+			if (rx.hdr.flags & NVME_TCP_F_DATA_SUCCESS) {
+				if (result)
+					*result = 0;
+				return 0;
+			}
+			break;
+		case NVME_TCP_PDU_C2H_TERM:
+			ublk_err("%s: terminated by controller, fes %x\n",
+					__func__, le16toh(rx.term.fes));
+			return -ECONNRESET;
+		default:
+			return -EPROTO;
+		}
+	}
+}
+
+static int nvmf_tcp_prop_get(struct nvmetcp_conn *c, __u32 off, bool wide,
+		__u64 *val)
+{
+	struct nvmf_property_get_command cmd = {};
+
+	cmd.opcode = NVME_FABRICS_COMMAND;
+	cmd.fctype = NVMF_FCTYPE_PROP_GET;
+	cmd.attrib = wide ? NVMF_PROP_ATTR_8B : 0;
+	cmd.offset = htole32(off);
+	return nvmf_tcp_sync_cmd(c, (const struct nvme_common_command *)&cmd,
+			NULL, 0, NULL, 0, val);
+}
+
+static int nvmf_tcp_prop_set(struct nvmetcp_conn *c, __u32 off, __u32 val)
+{
+	struct nvmf_property_set_command cmd = {};
+
+	cmd.opcode = NVME_FABRICS_COMMAND;
+	cmd.fctype = NVMF_FCTYPE_PROP_SET;
+	cmd.offset = htole32(off);
+	cmd.value = htole64(val);
+	return nvmf_tcp_sync_cmd(c, (const struct nvme_common_command *)&cmd,
+			NULL, 0, NULL, 0, NULL);
+}
+
+static int nvmf_tcp_identify(struct nvmetcp_conn *c, __u32 nsid, __u32 cns,
+		void *buf)
+{
+	struct nvme_identify cmd = {};
+
+	cmd.opcode = NVME_ADMIN_IDENTIFY;
+	cmd.nsid = htole32(nsid);
+	cmd.cns = htole32(cns);
+	return nvmf_tcp_sync_cmd(c, (const struct nvme_common_command *)&cmd,
+			NULL, 0, buf, 4096, NULL);
+}
+
+/* open one connection and Connect queue 'qid' of 'sqsize'(0's based) */
+static int nvmetcp_connect_queue(struct nvmetcp_tgt_data *tdata,
+		struct nvmetcp_conn *c, __u16 qid, __u16 sqsize)
+{
+	struct nvmf_connect_command cmd = {};
+	struct nvmf_connect_data cd = {};
+	__u64 result;
+	int ret;
+
+	c->fd = nvmf_tcp_open_sock(tdata->host, tdata->port);
+	if (c->fd < 0)
+		return c->fd;
+	c->cid = 0;
+
+	ret = nvmf_tcp_icreq(c, tdata->hdgst, tdata->ddgst);
+	if (ret)
+		goto fail;
+
+	cmd.opcode = NVME_FABRICS_COMMAND;
+	cmd.fctype = NVMF_FCTYPE_CONNECT;
+	cmd.qid = htole16(qid);
+	cmd.sqsize = htole16(sqsize);
+	/* keep alive is disabled, so admin queue is idle after setup */
+	cmd.kato = 0;
+
+	memcpy(cd.hostid, tdata->hostid, sizeof(cd.hostid));
+	cd.cntlid = htole16(qid ? tdata->cntlid : NVMF_CNTLID_DYNAMIC);
+	snprintf(cd.subsysnqn, sizeof(cd.subsysnqn), "%s", tdata->subnqn);
+	snprintf(cd.hostnqn, sizeof(cd.hostnqn), "%s", tdata->hostnqn);
+
+	ret = nvmf_tcp_sync_cmd(c, (const struct nvme_common_command *)&cmd,
+			&cd, sizeof(cd), NULL, 0, &result);
+	if (ret) {
+		ublk_err("%s: connect qid %u of %s failed %d\n", __func__,
+				qid, tdata->subnqn, ret);
+		goto fail;
+	}
+	if (!qid)
+		tdata->cntlid = result & 0xffff;
+	return 0;
+fail:
+	close(c->fd);
+	c->fd = -1;
+	return ret;
+}
+
+static int nvmetcp_enable_ctrl(struct nvmetcp_conn *c, __u64 *cap)
+{
+	unsigned wait_ms, t;
+	__u64 csts = 0;
+	int ret;
+
+	ret = nvmf_tcp_prop_get(c, NVME_REG_CAP, true, cap);
+	if (ret)
+		return ret;
+	ret = nvmf_tcp_prop_set(c, NVME_REG_CC, NVME_CC_ENABLE |
+			NVME_CC_CSS_NVM | NVME_CC_MPS_4K | NVME_CC_IOSQES |
+			NVME_CC_IOCQES);
+	if (ret)
+		return ret;
+
+	/* CAP.TO is in unit of 500ms */
+	wait_ms = std::max(1U, (unsigned)NVME_CAP_TIMEOUT(*cap)) * 500;
+	for (t = 0; t < wait_ms; t += 10) {
+		ret = nvmf_tcp_prop_get(c, NVME_REG_CSTS, false, &csts);
+		if (ret)
+			return ret;
+		if (csts & NVME_CSTS_RDY)
+			return 0;
+		usleep(10000);
+	}
+	ublk_err("%s: controller isn't ready, csts %llx\n", __func__,
+			(unsigned long long)csts);
+	return -ETIMEDOUT;
+}
+
+/*
+ * Connect admin queue, enable the controller, ask for io queues and read
+ * everything needed for ublk parameters.
+ */
+static int nvmetcp_setup_admin(struct nvmetcp_tgt_data *tdata,
+		unsigned nr_queues, unsigned depth)
+{
+	struct nvme_common_command cmd = {};
+	struct nvmetcp_conn c;
+	struct nvme_id_ctrl *ctrl;
+	struct nvme_id_ns *ns;
+	unsigned ioccsz, fmt, nr;
+	__u64 cap, res;
+	void *buf = NULL;
+	int ret;
+
+	ret = nvmetcp_connect_queue(tdata, &c, 0, NVMF_AQ_DEPTH - 1);
+	if (ret)
+		return ret;
+	tdata->admin_fd = c.fd;
+	tdata->hdgst = c.hdgst;
+	tdata->ddgst = c.ddgst;
+	tdata->maxh2cdata = c.maxh2cdata;
+
+	ret = nvmetcp_enable_ctrl(&c, &cap);
+	if (ret)
+		goto fail;
+
+	/* io sq has one more entry than ublk queue depth */
+	if (depth > NVME_CAP_MQES(cap)) {
+		ublk_err("%s: queue depth %u is too big, MQES %llu\n",
+				__func__, depth,
+				(unsigned long long)NVME_CAP_MQES(cap));
+		ret = -EINVAL;
+		goto fail;
+	}
+
+	cmd.opcode = NVME_ADMIN_SET_FEATURES;
+	cmd.cdw10 = htole32(NVME_FEAT_NUM_QUEUES);
+	cmd.cdw11 = htole32((nr_queues - 1) | ((nr_queues - 1) << 16));
+	ret = nvmf_tcp_sync_cmd(&c, &cmd, NULL, 0, NULL, 0, &res);
+	if (ret)
+		goto fail;
+	nr = std::min(res & 0xffff, (res >> 16) & 0xffff) + 1;
+	if (nr < nr_queues) {
+		ublk_err("%s: only %u io queues are allowed\n", __func__, nr);
+		ret = -EINVAL;
+		goto fail;
+	}
+
+	buf = malloc(4096);
+	if (!buf) {
+		ret = -ENOMEM;
+		goto fail;
+	}
+
+	ret = nvmf_tcp_identify(&c, 0, NVME_ID_CNS_CTRL, buf);
+	if (ret)
+		goto fail;
+	ctrl = (struct nvme_id_ctrl *)buf;
+	tdata->vwc = ctrl->vwc;
+	tdata->mdts = ctrl->mdts;
+	tdata->oncs = le16toh(ctrl->oncs);
+	ioccsz = le32toh(ctrl->ioccsz) * 16;
+	tdata->inline_bytes = ioccsz > sizeof(struct nvme_common_command) ?
+		ioccsz - sizeof(struct nvme_common_command) : 0;
+
+	ret = nvmf_tcp_identify(&c, tdata->nsid, NVME_ID_CNS_NS, buf);
+	if (ret)
+		goto fail;
+	ns = (struct nvme_id_ns *)buf;
+	fmt = ns->flbas & 0xf;
+	if (!ns->nsze) {
+		ublk_err("%s: namespace %u isn't active\n", __func__,
+				tdata->nsid);
+		ret = -ENODEV;
+		goto fail;
+	}
+	if (le16toh(ns->lbaf[fmt].ms) || ns->lbaf[fmt].ds < 9 ||
+			ns->lbaf[fmt].ds > 12) {
+		ublk_err("%s: lba format %u(ds %u ms %u) isn't supported\n",
+				__func__, fmt, ns->lbaf[fmt].ds,
+				le16toh(ns->lbaf[fmt].ms));
+		ret = -EOPNOTSUPP;
+		goto fail;
+	}
+	tdata->lba_shift = ns->lbaf[fmt].ds;
+	tdata->nsze = le64toh(ns->nsze);
+	free(buf);
+	return 0;
+fail:
+	free(buf);
+	close(tdata->admin_fd);
+	tdata->admin_fd = -1;
+	return ret;
+}
+
+/*
+ * Queue one iovec for the next sendmsg, 'buf' has to be kept until the
+ * response of the command is received.
+ */
+static inline void nvmetcp_queue_tx(struct nvmetcp_queue_data *q_data,
+		void *buf, unsigned len)
+{
+	q_data->tx_next.push_back({ buf, len });
+}
+
+/* build command capsule of the io, and queue it for sending */
+static int nvmetcp_queue_cmd(const struct ublksrv_queue *q,
+		const struct ublk_io_data *data, struct nvmetcp_io_data *t)
+{
+	struct nvmetcp_queue_data *q_data = nvmetcp_get_queue_data(q);
+	const struct nvmetcp_tgt_data *tdata = q_data->tdata;
+	const struct ublksrv_io_desc *iod = data->iod;
+	struct nvme_common_command *c = &t->pdu.cmd;
+	struct nvme_rw_command *rw = (struct nvme_rw_command *)c;
+	unsigned shift = tdata->lba_shift - 9;
+	unsigned op = ublksrv_get_op(iod);
+	unsigned len = iod->nr_sectors << 9;
+	void *buf = (void *)iod->addr;
+	unsigned dlen = 0;	/* in-capsule data */
+
+	memset(c, 0, sizeof(*c));
+	c->cid = htole16(data->tag);
+	c->nsid = htole32(tdata->nsid);
+
+	switch (op) {
+	case UBLK_IO_OP_READ:
+	case UBLK_IO_OP_WRITE:
+		rw->opcode = op == UBLK_IO_OP_READ ? NVME_CMD_READ :
+			NVME_CMD_WRITE;
+		rw->slba = htole64(iod->start_sector >> shift);
+		rw->length = htole16((iod->nr_sectors >> shift) - 1);
+		if (ublksrv_get_flags(iod) & UBLK_IO_F_FUA)
+			rw->control = htole16(NVME_RW_FUA);
+		if (op == UBLK_IO_OP_WRITE && len <= tdata->inline_bytes)
+			dlen = len;
+		break;
+	case UBLK_IO_OP_FLUSH:
+		c->opcode = NVME_CMD_FLUSH;
+		len = 0;
+		break;
+	case UBLK_IO_OP_DISCARD:
+		t->dsm.cattr = 0;
+		t->dsm.nlb = htole32(iod->nr_sectors >> shift);
+		t->dsm.slba = htole64(iod->start_sector >> shift);
+		c->opcode = NVME_CMD_DSM;
+		c->cdw10 = 0;	/* one range */
+		c->cdw11 = htole32(NVME_DSMGMT_AD);
+		buf = &t->dsm;
+		len = dlen = sizeof(t->dsm);
+		break;
+	case UBLK_IO_OP_WRITE_ZEROES:
+		rw->opcode = NVME_CMD_WRITE_ZEROES;
+		rw->slba = htole64(iod->start_sector >> shift);
+		rw->length = htole16((iod->nr_sectors >> shift) - 1);
+		if (!(ublksrv_get_flags(iod) & UBLK_IO_F_NOUNMAP))
+			rw->control = htole16(NVME_WZ_DEAC);
+		len = 0;
+		break;
+	default:
+		return -EINVAL;
+	}
+
+	nvmf_tcp_set_sgl(c, len, dlen);
+	nvmf_tcp_init_hdr(&t->pdu.hdr, NVME_TCP_PDU_CMD, sizeof(t->pdu), dlen,
+			q_data->hdgst, q_data->ddgst);
+	nvmf_tcp_set_hdgst(&t->pdu.hdr);
+
+	nvmetcp_queue_tx(q_data, &t->pdu,
+			nvmf_tcp_hdr_size(sizeof(t->pdu), q_data->hdgst));
+	if (dlen) {
+		nvmetcp_queue_tx(q_data, buf, dlen);
+		if (q_data->ddgst) {
+			t->ddgst = htole32(ublksrv_crc32c(0, buf, dlen));
+			nvmetcp_queue_tx(q_data, &t->ddgst, sizeof(t->ddgst));
+		}
+	}
+	return 0;
+}
+
+static co_io_job __nvmetcp_handle_io_async(const struct ublksrv_queue *q,
+		const struct ublk_io_data *data, struct ublk_io_tgt *io)
+{
+	struct nvmetcp_io_data *t = io_tgt_to_nvmetcp_data(io);
+	int ret;
+
+	ret = nvmetcp_queue_cmd(q, data, t);
+	if (ret < 0)
+		goto exit;
+
+	/* resumed after response is received, or the connection is lost */
+	t->state = NVMETCP_IO_SENT;
+	co_await__suspend_always(data->tag);
+	t->state = NVMETCP_IO_IDLE;
+	ret = io->tgt_io_cqe->res;
+exit:
+	ublksrv_complete_io(q, data->tag, ret);
+	co_return;
+}
+
+static int nvmetcp_handle_io_async(const struct ublksrv_queue *q,
+		const struct ublk_io_data *data)
+{
+	struct ublk_io_tgt *io = __ublk_get_io_tgt_data(data);
+
+	/* fail fast after the connection is lost */
+	if (nvmetcp_get_queue_data(q)->dead) {
+		ublksrv_complete_io(q, data->tag, -EIO);
+		return 0;
+	}
+
+	io->co = __nvmetcp_handle_io_async(q, data, io);
+	return 0;
+}
+
+static void nvmetcp_resume_io(const struct ublksrv_queue *q, int tag,
+		int res)
+{
+	const struct ublk_io_data *data = ublksrv_queue_get_io_data(q, tag);
+	struct ublk_io_tgt *io = __ublk_get_io_tgt_data(data);
+	struct io_uring_cqe fake_cqe;
+
+	fake_cqe.res = res;
+	io->tgt_io_cqe = &fake_cqe;
+	io->co.resume();
+}
+
+/* io which the received PDU is for, NULL if it isn't in flight */
+static const struct ublk_io_data *nvmetcp_rx_io(const struct ublksrv_queue *q,
+		__u16 cid)
+{
+	const struct ublk_io_data *data;
+	unsigned tag = le16toh(cid);
+
+	if (tag >= (unsigned)q->q_depth)
+		return NULL;
+	data = ublksrv_queue_get_io_data(q, tag);
+	if (io_tgt_to_nvmetcp_data(__ublk_get_io_tgt_data(data))->state !=
+			NVMETCP_IO_SENT)
+		return NULL;
+	return data;
+}
+
+static inline void nvmetcp_rx_next(struct nvmetcp_queue_data *q_data,
+		unsigned state, unsigned len)
+{
+	q_data->rx_state = state;
+	q_data->rx_len = len;
+	q_data->rx_done = 0;
+}
+
+static int nvmetcp_rx_rsp(const struct ublksrv_queue *q,
+		struct nvmetcp_queue_data *q_data)
+{
+	const struct nvme_completion *cqe = &q_data->rx_pdu.rsp.cqe;
+	const struct ublk_io_data *data = nvmetcp_rx_io(q, cqe->command_id);
+	__u16 status = le16toh(cqe->status) >> 1;
+	unsigned op;
+	int res = 0;
+
+	if (!data) {
+		ublk_err("%s: qid %d response of unknown command %u\n",
+				__func__, q->q_id, le16toh(cqe->command_id));
+		return -EPROTO;
+	}
+
+	op = ublksrv_get_op(data->iod);
+	if (status) {
+		ublk_err("%s: qid %d tag %d op %u failed, status %x\n",
+				__func__, q->q_id, data->tag, op,
+				status & NVME_SC_MASK);
+		res = -EIO;
+	} else if (op == UBLK_IO_OP_READ || op == UBLK_IO_OP_WRITE)
+		res = data->iod->nr_sectors << 9;
+
+	nvmetcp_resume_io(q, data->tag, res);
+	return 0;
+}
+
+/* send data asked by R2T with H2CData PDUs */
+static int nvmetcp_rx_r2t(const struct ublksrv_queue *q,
+		struct nvmetcp_queue_data *q_data)
+{
+	const struct nvme_tcp_r2t_pdu *r2t = &q_data->rx_pdu.r2t;
+	const struct ublk_io_data *data = nvmetcp_rx_io(q, r2t->command_id);
+	unsigned off = le32toh(r2t->r2t_offset);
+	unsigned len = le32toh(r2t->r2t_length);
+	struct nvmetcp_h2c *h2c;
+	unsigned i;
+
+	if (!data || ublksrv_get_op(data->iod) != UBLK_IO_OP_WRITE || !len ||
+			(__u64)off + len > data->iod->nr_sectors << 9) {
+		ublk_err("%s: qid %d bad R2T of command %u, off %u len %u\n",
+				__func__, q->q_id, le16toh(r2t->command_id),
+				off, len);
+		return -EPROTO;
+	}
+
+	h2c = &q_data->h2c[data->tag * q_data->nr_h2c];
+	for (i = 0; len; i++) {
+		unsigned chunk = std::min(len, q_data->maxh2cdata);
+		char *buf = (char *)data->iod->addr + off;
+		struct nvmetcp_h2c *h = &h2c[i];
+
+		if (i >= q_data->nr_h2c)
+			return -EPROTO;
+
+		memset(&h->pdu, 0, sizeof(h->pdu));
+		nvmf_tcp_init_hdr(&h->pdu.hdr, NVME_TCP_PDU_H2C_DATA,
+				sizeof(h->pdu), chunk, q_data->hdgst,
+				q_data->ddgst);
+		if (chunk == len)
+			h->pdu.hdr.flags |= NVME_TCP_F_DATA_LAST;
+		h->pdu.command_id = r2t->command_id;
+		h->pdu.ttag = r2t->ttag;
+		h->pdu.data_offset = htole32(off);
+		h->pdu.data_length = htole32(chunk);
+		nvmf_tcp_set_hdgst(&h->pdu.hdr);
+
+		nvmetcp_queue_tx(q_data, &h->pdu,
+				nvmf_tcp_hdr_size(sizeof(h->pdu),
+					q_data->hdgst));
+		nvmetcp_queue_tx(q_data, buf, chunk);
+		if (q_data->ddgst) {
+			h->ddgst = htole32(ublksrv_crc32c(0, buf, chunk));
+			nvmetcp_queue_tx(q_data, &h->ddgst, sizeof(h->ddgst));
+		}
+		off += chunk;
+		len -= chunk;
+	}
+	return 0;
+}
+
+/* header of C2HData is received, data is copied to io buffer next */
+static int nvmetcp_rx_c2h(const struct ublksrv_queue *q,
+		struct nvmetcp_queue_data *q_data, unsigned hsize)
+{
+	const struct nvme_tcp_data_pdu *pdu = &q_data->rx_pdu.data;
+	const struct ublk_io_data *data = nvmetcp_rx_io(q, pdu->command_id);
+	unsigned off = le32toh(pdu->data_offset);
+	unsigned len = le32toh(pdu->data_length);
+	bool ddgst = pdu->hdr.flags & NVME_TCP_F_DDGST;
+
+	if (!data || ublksrv_get_op(data->iod) != UBLK_IO_OP_READ || !len ||
+			(__u64)off + len > data->iod->nr_sectors << 9 ||
+			ddgst != q_data->ddgst || pdu->hdr.pdo < hsize ||
+			le32toh(pdu->hdr.plen) != pdu->hdr.pdo + len +
+			(ddgst ? NVME_TCP_DIGEST_LEN : 0)) {
+		ublk_err("%s: qid %d bad C2HData of command %u, off %u len %u\n",
+				__func__, q->q_id, le16toh(pdu->command_id),
+				off, len);
+		return -EPROTO;
+	}
+
+	q_data->rx_tag = data->tag;
+	q_data->rx_flags = pdu->hdr.flags;
+	q_data->rx_buf = (char *)data->iod->addr + off;
+	q_data->rx_data_len = len;
+	q_data->rx_crc = 0;
+	if (pdu->hdr.pdo > hsize)
+		nvmetcp_rx_next(q_data, NVMETCP_RX_PAD, pdu->hdr.pdo - hsize);
+	else
+		nvmetcp_rx_next(q_data, NVMETCP_RX_DATA, len);
+	return 0;
+}
+
+static int nvmetcp_rx_data_done(const struct ublksrv_queue *q,
+		struct nvmetcp_queue_data *q_data)
+{
+	/* the controller completes the read without response */
+	if (q_data->rx_flags & NVME_TCP_F_DATA_SUCCESS) {
+		const struct ublk_io_data *data;
+
+		if (!(q_data->rx_flags & NVME_TCP_F_DATA_LAST))
+			return -EPROTO;
+		data = ublksrv_queue_get_io_data(q, q_data->rx_tag);
+		nvmetcp_resume_io(q, q_data->rx_tag,
+				data->iod->nr_sectors << 9);
+	}
+	nvmetcp_rx_next(q_data, NVMETCP_RX_CH, sizeof(struct nvme_tcp_hdr));
+	return 0;
+}
+
+static int nvmetcp_rx_ch(const struct ublksrv_queue *q,
+		struct nvmetcp_queue_data *q_data)
+{
+	const struct nvme_tcp_hdr *hdr = &q_data->rx_pdu.hdr;
+	bool hdgst = hdr->flags & NVME_TCP_F_HDGST;
+
+	if (hdr->type == NVME_TCP_PDU_C2H_TERM) {
+		ublk_err("%s: qid %d terminated by controller\n", __func__,
+				q->q_id);
+		return -ECONNRESET;
+	}
+	if (hdr->hlen != NVMETCP_HLEN || hdgst != q_data->hdgst) {
+		ublk_err("%s: qid %d bad PDU type %x flags %x hlen %u\n",
+				__func__, q->q_id, hdr->type, hdr->flags,
+				hdr->hlen);
+		return -EPROTO;
+	}
+
+	/* keep what is received, and wait for the whole header */
+	q_data->rx_state = NVMETCP_RX_HDR;
+	q_data->rx_len = nvmf_tcp_hdr_size(hdr->hlen, hdgst);
+	return 0;
+}
+
+static int nvmetcp_rx_hdr(const struct ublksrv_queue *q,
+		struct nvmetcp_queue_data *q_data)
+{
+	const struct nvme_tcp_hdr *hdr = &q_data->rx_pdu.hdr;
+	int ret;
+
+	if (q_data->hdgst && !nvmf_tcp_hdgst_ok(hdr)) {
+		ublk_err("%s: qid %d header digest error\n", __func__,
+				q->q_id);
+		return -EBADMSG;
+	}
+
+	switch (hdr->type) {
+	case NVME_TCP_PDU_C2H_DATA:
+		return nvmetcp_rx_c2h(q, q_data, q_data->rx_len);
+	case NVME_TCP_PDU_RSP:
+	case NVME_TCP_PDU_R2T:
+		/* both carry header only */
+		if (le32toh(hdr->plen) != q_data->rx_len || hdr->pdo) {
+			ublk_err("%s: qid %d bad PDU type %x plen %u pdo %u\n",
+					__func__, q->q_id, hdr->type,
+					le32toh(hdr->plen), hdr->pdo);
+			return -EPROTO;
+		}
+		if (hdr->type == NVME_TCP_PDU_RSP)
+			ret = nvmetcp_rx_rsp(q, q_data);
+		else
+			ret = nvmetcp_rx_r2t(q, q_data);
+		break;
+	default:
+		ublk_err("%s: qid %d unexpected PDU type %x\n", __func__,
+				q->q_id, hdr->type);
+		return -EPROTO;
+	}
+	nvmetcp_rx_next(q_data, NVMETCP_RX_CH, sizeof(struct nvme_tcp_hdr));
+	return ret;
+}
+
+/*
+ * Parse received stream, which can be cut anywhere by recv, so the
+ * state of PDU being received is kept in queue data.
+ */
+static int nvmetcp_rx(const struct ublksrv_queue *q,
+		struct nvmetcp_queue_data *q_data, const char *p, unsigned len)
+{
+	int ret = 0;
+
+	while (len) {
+		unsigned n = std::min(len, q_data->rx_len - q_data->rx_done);
+
+		switch (q_data->rx_state) {
+		case NVMETCP_RX_CH:
+		case NVMETCP_RX_HDR:
+			memcpy(q_data->rx_pdu.buf + q_data->rx_done, p, n);
+			break;
+		case NVMETCP_RX_DATA:
+			memcpy(q_data->rx_buf + q_data->rx_done, p, n);
+			if (q_data->rx_flags & NVME_TCP_F_DDGST)
+				q_data->rx_crc = ublksrv_crc32c(q_data->rx_crc,
+						p, n);
+			break;
+		case NVMETCP_RX_DDGST:
+			memcpy((char *)&q_data->rx_ddgst + q_data->rx_done,
+					p, n);
+			break;
+		}
+		p += n;
+		len -= n;
+		q_data->rx_done += n;
+		if (q_data->rx_done < q_data->rx_len)
+			continue;
+
+		switch (q_data->rx_state) {
+		case NVMETCP_RX_CH:
+			ret = nvmetcp_rx_ch(q, q_data);
+			break;
+		case NVMETCP_RX_HDR:
+			ret = nvmetcp_rx_hdr(q, q_data);
+			break;
+		case NVMETCP_RX_PAD:
+			nvmetcp_rx_next(q_data, NVMETCP_RX_DATA,
+					q_data->rx_data_len);
+			break;
+		case NVMETCP_RX_DATA:
+			if (q_data->rx_flags & NVME_TCP_F_DDGST)
+				nvmetcp_rx_next(q_data, NVMETCP_RX_DDGST,
+						NVME_TCP_DIGEST_LEN);
+			else
+				ret = nvmetcp_rx_data_done(q, q_data);
+			break;
+		case NVMETCP_RX_DDGST:
+			if (le32toh(q_data->rx_ddgst) != q_data->rx_crc) {
+				ublk_err("%s: qid %d tag %d data digest error\n",
+						__func__, q->q_id,
+						q_data->rx_tag);
+				ret = -EBADMSG;
+			} else
+				ret = nvmetcp_rx_data_done(q, q_data);
+			break;
+		}
+		if (ret)
+			return ret;
+	}
+	return 0;
+}
+
+/*
+ * The connection can't be used any more, all in-flight io is failed by
+ * nvmetcp_fail_ios() after the in-flight sendmsg is done.
+ */
+static void nvmetcp_conn_error(const struct ublksrv_queue *q,
+		struct nvmetcp_queue_data *q_data, int err)
+{
+	if (q_data->dead)
+		return;
+	ublk_err("%s: qid %d connection is lost %d, fail all io\n",
+			__func__, q->q_id, err);
+	q_data->dead = 1;
+	shutdown(q->dev->tgt.fds[q->q_id + 1], SHUT_RDWR);
+}
+
+static void nvmetcp_fail_ios(const struct ublksrv_queue *q,
+		struct nvmetcp_queue_data *q_data)
+{
+	int tag;
+
+	/* io buffers may still be referenced by sendmsg */
+	if (q_data->send_busy)
+		return;
+
+	q_data->tx_next.clear();
+	q_data->tx.clear();
+	q_data->tx_idx = 0;
+	for (tag = 0; tag < q->q_depth; tag++) {
+		const struct ublk_io_data *data =
+			ublksrv_queue_get_io_data(q, tag);
+
+		if (io_tgt_to_nvmetcp_data(__ublk_get_io_tgt_data(data))->state
+				== NVMETCP_IO_SENT)
+			nvmetcp_resume_io(q, tag, -EIO);
+	}
+}
+
+static void nvmetcp_recv_done(const struct ublksrv_queue *q,
+		struct nvmetcp_queue_data *q_data,
+		const struct io_uring_cqe *cqe)
+{
+	unsigned bid;
+	char *buf;
+	int ret;
+
+	if (!(cqe->flags & IORING_CQE_F_MORE))
+		q_data->recv_armed = 0;
+
+	/* recv is armed again by nvmetcp_handle_io_bg() if it is -ENOBUFS */
+	if (!(cqe->flags & IORING_CQE_F_BUFFER)) {
+		if (cqe->res != -ENOBUFS)
+			nvmetcp_conn_error(q, q_data, cqe->res < 0 ? cqe->res :
+					-ECONNRESET);
+		return;
+	}
+
+	bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+	buf = q_data->bufs + bid * NVMETCP_BUF_SIZE;
+	if (!q_data->dead && cqe->res > 0) {
+		ret = nvmetcp_rx(q, q_data, buf, cqe->res);
+		if (ret)
+			nvmetcp_conn_error(q, q_data, ret);
+	}
+
+	/* data is copied out, so give the buffer back immediately */
+	io_uring_buf_ring_add(q_data->br, buf, NVMETCP_BUF_SIZE, bid,
+			io_uring_buf_ring_mask(NVMETCP_NR_BUFS), 0);
+	io_uring_buf_ring_advance(q_data->br, 1);
+}
+
+static void nvmetcp_send_done(const struct ublksrv_queue *q,
+		struct nvmetcp_queue_data *q_data,
+		const struct io_uring_cqe *cqe)
+{
+	size_t done = cqe->res;
+
+	q_data->send_busy = 0;
+	if (cqe->res <= 0) {
+		nvmetcp_conn_error(q, q_data, cqe->res ? cqe->res : -EIO);
+		return;
+	}
+
+	/* short send is continued by the next sendmsg */
+	while (done && q_data->tx_idx < q_data->tx.size()) {
+		struct iovec *iov = &q_data->tx[q_data->tx_idx];
+
+		if (done < iov->iov_len) {
+			iov->iov_base = (char *)iov->iov_base + done;
+			iov->iov_len -= done;
+			break;
+		}
+		done -= iov->iov_len;
+		q_data->tx_idx++;
+	}
+}
+
+static void nvmetcp_tgt_io_done(const struct ublksrv_queue *q,
+		const struct ublk_io_data *data,
+		const struct io_uring_cqe *cqe)
+{
+	struct nvmetcp_queue_data *q_data = nvmetcp_get_queue_data(q);
+
+	if (user_data_to_op(cqe->user_data) == NVMETCP_RECV_OP)
+		nvmetcp_recv_done(q, q_data, cqe);
+	else
+		nvmetcp_send_done(q, q_data, cqe);
+}
+
+static void nvmetcp_arm_recv(const struct ublksrv_queue *q,
+		struct nvmetcp_queue_data *q_data)
+{
+	struct io_uring_sqe *sqe[1];
+
+	if (!ublk_queue_alloc_sqes(q, sqe, 1))
+		return;
+
+	io_uring_prep_recv_multishot(sqe[0], q->q_id + 1, NULL, 0, 0);
+	io_uring_sqe_set_flags(sqe[0], IOSQE_FIXED_FILE | IOSQE_BUFFER_SELECT);
+	sqe[0]->buf_group = NVMETCP_BGID;
+	sqe[0]->user_data = build_user_data(q->q_depth, NVMETCP_RECV_OP, 0, 1);
+	q_data->recv_armed = 1;
+}
+
+/*
+ * Only one sendmsg is in flight, so PDUs never interleave in the stream,
+ * and PDUs queued meantime are sent together by the next sendmsg.
+ */
+static void nvmetcp_flush_tx(const struct ublksrv_queue *q,
+		struct nvmetcp_queue_data *q_data)
+{
+	struct io_uring_sqe *sqe[1];
+
+	if (q_data->send_busy)
+		return;
+
+	if (q_data->tx_idx == q_data->tx.size()) {
+		if (q_data->tx_next.empty())
+			return;
+		q_data->tx.clear();
+		std::swap(q_data->tx, q_data->tx_next);
+		q_data->tx_idx = 0;
+	}
+
+	if (!ublk_queue_alloc_sqes(q, sqe, 1))
+		return;
+
+	q_data->tx_msg.msg_iov = &q_data->tx[q_data->tx_idx];
+	q_data->tx_msg.msg_iovlen = std::min<size_t>(q_data->tx.size() -
+			q_data->tx_idx, NVMETCP_MAX_IOV);
+	io_uring_prep_sendmsg(sqe[0], q->q_id + 1, &q_data->tx_msg,
+			MSG_NOSIGNAL | MSG_WAITALL);
+	io_uring_sqe_set_flags(sqe[0], IOSQE_FIXED_FILE);
+	sqe[0]->user_data = build_user_data(q->q_depth, NVMETCP_SEND_OP, 0, 1);
+	q_data->send_busy = 1;
+}
+
+static void nvmetcp_handle_io_bg(const struct ublksrv_queue *q,
+		int nr_queued_io)
+{
+	struct nvmetcp_queue_data *q_data = nvmetcp_get_queue_data(q);
+
+	if (q_data->dead) {
+		nvmetcp_fail_ios(q, q_data);
+		return;
+	}
+
+	if (!q_data->recv_armed)
+		nvmetcp_arm_recv(q, q_data);
+	nvmetcp_flush_tx(q, q_data);
+}
+
+static int nvmetcp_init_queue(const struct ublksrv_queue *q,
+		void **queue_data_ptr)
+{
+	const struct nvmetcp_tgt_data *tdata =
+		(const struct nvmetcp_tgt_data *)q->dev->tgt.tgt_data;
+	const struct ublksrv_ctrl_dev_info *info =
+		ublksrv_ctrl_get_dev_info(ublksrv_get_ctrl_dev(q->dev));
+	struct nvmetcp_queue_data *q_data = new nvmetcp_queue_data();
+	int i, ret;
+
+	q_data->tdata = tdata;
+	q_data->hdgst = tdata->hdgst;
+	q_data->ddgst = tdata->ddgst;
+	q_data->maxh2cdata = tdata->maxh2cdata;
+	q_data->nr_h2c = (info->max_io_buf_bytes + tdata->maxh2cdata - 1) /
+		tdata->maxh2cdata;
+	q_data->h2c = (struct nvmetcp_h2c *)calloc((size_t)q->q_depth *
+			q_data->nr_h2c, sizeof(struct nvmetcp_h2c));
+	if (!q_data->h2c)
+		goto fail;
+
+	if (posix_memalign((void **)&q_data->bufs, getpagesize(),
+				NVMETCP_NR_BUFS * NVMETCP_BUF_SIZE)) {
+		q_data->bufs = NULL;
+		goto fail;
+	}
+
+	q_data->br = io_uring_setup_buf_ring(q->ring_ptr, NVMETCP_NR_BUFS,
+			NVMETCP_BGID, 0, &ret);
+	if (!q_data->br) {
+		ublk_err("%s: qid %d buffer ring setup failed %d\n",
+				__func__, q->q_id, ret);
+		goto fail;
+	}
+	for (i = 0; i < NVMETCP_NR_BUFS; i++)
+		io_uring_buf_ring_add(q_data->br,
+				q_data->bufs + i * NVMETCP_BUF_SIZE,
+				NVMETCP_BUF_SIZE, i,
+				io_uring_buf_ring_mask(NVMETCP_NR_BUFS), i);
+	io_uring_buf_ring_advance(q_data->br, NVMETCP_NR_BUFS);
+
+	nvmetcp_rx_next(q_data, NVMETCP_RX_CH, sizeof(struct nvme_tcp_hdr));
+	ublksrv_tgt_busy_poll_queue(q, &tdata->bp);
+	*queue_data_ptr = (void *)q_data;
+	return 0;
+fail:
+	free(q_data->bufs);
+	free(q_data->h2c);
+	delete q_data;
+	return -ENOMEM;
+}
+
+static void nvmetcp_deinit_queue(const struct ublksrv_queue *q)
+{
+	struct nvmetcp_queue_data *q_data = nvmetcp_get_queue_data(q);
+
+	io_uring_free_buf_ring(q->ring_ptr, q_data->br, NVMETCP_NR_BUFS,
+			NVMETCP_BGID);
+	free(q_data->bufs);
+	free(q_data->h2c);
+	delete q_data;
+}
+
+static void nvmetcp_deinit_tgt(const struct ublksrv_dev *dev)
+{
+	const struct ublksrv_tgt_info *tgt = &dev->tgt;
+	struct nvmetcp_tgt_data *tdata = (struct nvmetcp_tgt_data *)tgt->tgt_data;
+	int i;
+
+	for (i = 0; i < tgt->nr_fds; i++) {
+		shutdown(tgt->fds[i + 1], SHUT_RDWR);
+		close(tgt->fds[i + 1]);
+	}
+
+	/* the controller is gone after admin queue is disconnected */
+	if (tdata) {
+		if (tdata->admin_fd >= 0)
+			close(tdata->admin_fd);
+		delete tdata;
+	}
+}
+
+/* host NQN of nvme-cli, or one made from random uuid */
+static void nvmetcp_default_hostnqn(char *nqn, unsigned len)
+{
+	FILE *f = fopen("/etc/nvme/hostnqn", "r");
+	__u8 u[16] = {0};
+
+	if (f) {
+		bool got = fgets(nqn, len, f) != NULL;
+
+		fclose(f);
+		if (got) {
+			nqn[strcspn(nqn, " \t\r\n")] = 0;
+			if (nqn[0])
+				return;
+		}
+	}
+
+	if (getrandom(u, sizeof(u), 0) != sizeof(u))
+		ublk_err("%s: getrandom failed\n", __func__);
+	u[6] = (u[6] & 0x0f) | 0x40;
+	u[8] = (u[8] & 0x3f) | 0x80;
+	snprintf(nqn, len, "nqn.2014-08.org.nvmexpress:uuid:"
+			"%02x%02x%02x%02x-%02x%02x-%02x%02x-%02x%02x-"
+			"%02x%02x%02x%02x%02x%02x",
+			u[0], u[1], u[2], u[3], u[4], u[5], u[6], u[7],
+			u[8], u[9], u[10], u[11], u[12], u[13], u[14], u[15]);
+}
+
+/* connect admin queue and one io queue for each ublk queue */
+static int nvmetcp_setup_tgt(struct ublksrv_dev *dev)
+{
+	struct ublksrv_tgt_info *tgt = &dev->tgt;
+	const struct ublksrv_ctrl_dev *cdev = ublksrv_get_ctrl_dev(dev);
+	const struct ublksrv_ctrl_dev_info *info =
+		ublksrv_ctrl_get_dev_info(cdev);
+	struct nvmetcp_tgt_data *tdata =
+		(struct nvmetcp_tgt_data *)tgt->tgt_data;
+	unsigned long nsid = 1, hdgst = 0, ddgst = 0;
+	int i, ret;
+
+	if (info->flags & (UBLK_F_USER_COPY | UBLK_F_SUPPORT_ZERO_COPY |
+				UBLK_F_AUTO_BUF_REG))
+		return -EINVAL;
+
+	ublk_json_read_target_str_info(cdev, "host", tdata->host);
+	ublk_json_read_target_str_info(cdev, "port", tdata->port);
+	ublk_json_read_target_str_info(cdev, "subnqn", tdata->subnqn);
+	ublk_json_read_target_str_info(cdev, "hostnqn", tdata->hostnqn);
+	ublk_json_read_target_ulong_info(cdev, "nsid", &nsid);
+	ublk_json_read_target_ulong_info(cdev, "hdr_digest", &hdgst);
+	ublk_json_read_target_ulong_info(cdev, "data_digest", &ddgst);
+	tdata->nsid = nsid;
+	tdata->hdgst = hdgst;
+	tdata->ddgst = ddgst;
+	if (getrandom(tdata->hostid, sizeof(tdata->hostid), 0) !=
+			sizeof(tdata->hostid))
+		ublk_err("%s: getrandom failed\n", __func__);
+
+	ret = nvmetcp_setup_admin(tdata, info->nr_hw_queues,
+			info->queue_depth);
+	if (ret)
+		return ret;
+
+	for (i = 0; i < info->nr_hw_queues; i++) {
+		struct nvmetcp_conn c;
+
+		ret = nvmetcp_connect_queue(tdata, &c, i + 1,
+				info->queue_depth);
+		if (!ret && (c.hdgst != tdata->hdgst ||
+					c.ddgst != tdata->ddgst ||
+					c.maxh2cdata != tdata->maxh2cdata)) {
+			close(c.fd);
+			ret = -EPROTO;
+		}
+		if (ret)
+			goto fail;
+		ublksrv_tgt_busy_poll_sock(c.fd, &tdata->bp,
+				info->queue_depth);
+		tgt->fds[i + 1] = c.fd;
+	}
+
+	tgt->dev_size = tdata->nsze << tdata->lba_shift;
+
+	/*
+	 * One sendmsg and one multishot recv are in flight, and the extra
+	 * tag is used for both
+	 */
+	tgt->tgt_ring_depth = info->queue_depth + 2;
+	tgt->nr_fds = info->nr_hw_queues;
+	tgt->extra_ios = 1;
+	tgt->io_data_size = sizeof(struct ublk_io_tgt) +
+		sizeof(struct nvmetcp_io_data);
+
+	/* multishot recv may post many cqes */
+	ublksrv_dev_set_cq_depth(dev, 2 * tgt->tgt_ring_depth);
+	return 0;
+fail:
+	while (--i >= 0)
+		close(tgt->fds[i + 1]);
+	close(tdata->admin_fd);
+	tdata->admin_fd = -1;
+	return ret;
+}
+
+static int nvmetcp_recover_tgt(struct ublksrv_dev *dev, int type)
+{
+	struct nvmetcp_tgt_data *tdata = new nvmetcp_tgt_data();
+	int ret;
+
+	tdata->admin_fd = -1;
+	dev->tgt.tgt_data = tdata;
+
+	ret = ublksrv_tgt_parse_busy_poll(ublksrv_get_ctrl_dev(dev), 0, NULL,
+			&tdata->bp);
+	if (ret)
+		return ret;
+	return nvmetcp_setup_tgt(dev);
+}
+
+static int nvmetcp_init_tgt(struct ublksrv_dev *dev, int type, int argc,
+		char *argv[])
+{
+	int hdr_digest = 0, data_digest = 0;
+	const struct option nvmetcp_longopts[] = {
+		{ "host",	required_argument, 0, 0},
+		{ "port",	required_argument, 0, 0},
+		{ "subnqn",	required_argument, 0, 0},
+		{ "hostnqn",	required_argument, 0, 0},
+		{ "nsid",	required_argument, 0, 0},
+		{ "hdr_digest",	no_argument, &hdr_digest, 1},
+		{ "data_digest", no_argument, &data_digest, 1},
+		{ NULL }
+	};
+	const struct ublksrv_ctrl_dev *cdev = ublksrv_get_ctrl_dev(dev);
+	const struct ublksrv_ctrl_dev_info *info =
+		ublksrv_ctrl_get_dev_info(cdev);
+	struct ublksrv_tgt_info *tgt = &dev->tgt;
+	struct ublksrv_tgt_base_json tgt_json = { 0 };
+	struct nvmetcp_tgt_data *tdata;
+	const char *host = NULL, *port = NVME_TCP_DEFAULT_PORT;
+	const char *subnqn = NULL, *hostnqn = NULL;
+	char def_hostnqn[NVMF_NQN_FIELD_LEN];
+	unsigned long nsid = 1;
+	unsigned max_bytes, shift;
+	int opt, option_index = 0;
+	int ret;
+
+	if (ublksrv_is_recovering(cdev))
+		return nvmetcp_recover_tgt(dev, 0);
+
+	strcpy(tgt_json.name, "nvmetcp");
+
+	while ((opt = getopt_long(argc, argv, "-:f:",
+				  nvmetcp_longopts, &option_index)) != -1) {
+		if (opt != 0)
+			continue;
+
+		if (!strcmp(nvmetcp_longopts[option_index].name, "host"))
+			host = optarg;
+		if (!strcmp(nvmetcp_longopts[option_index].name, "port"))
+			port = optarg;
+		if (!strcmp(nvmetcp_longopts[option_index].name, "subnqn"))
+			subnqn = optarg;
+		if (!strcmp(nvmetcp_longopts[option_index].name, "hostnqn"))
+			hostnqn = optarg;
+		if (!strcmp(nvmetcp_longopts[option_index].name, "nsid"))
+			nsid = strtoul(optarg, NULL, 10);
+	}
+
+	if (!host || !subnqn) {
+		ublk_err("%s: --host and --subnqn are required\n", __func__);
+		return -EINVAL;
+	}
+	if (!hostnqn) {
+		nvmetcp_default_hostnqn(def_hostnqn, sizeof(def_hostnqn));
+		hostnqn = def_hostnqn;
+	}
+	if (strlen(host) >= NI_MAXHOST || strlen(port) >= NI_MAXSERV ||
+			strlen(subnqn) > NVMF_NQN_SIZE ||
+			strlen(hostnqn) > NVMF_NQN_SIZE || !nsid ||
+			nsid == UINT_MAX) {
+		ublk_err("%s: bad host, port, nqn or nsid\n", __func__);
+		return -EINVAL;
+	}
+
+	ublk_json_write_dev_info(cdev);
+	ublk_json_write_tgt_str(cdev, "host", host);
+	ublk_json_write_tgt_str(cdev, "port", port);
+	ublk_json_write_tgt_str(cdev, "subnqn", subnqn);
+	ublk_json_write_tgt_str(cdev, "hostnqn", hostnqn);
+	ublk_json_write_tgt_long(cdev, "nsid", nsid);
+	ublk_json_write_tgt_long(cdev, "hdr_digest", hdr_digest);
+	ublk_json_write_tgt_long(cdev, "data_digest", data_digest);
+
+	tdata = new nvmetcp_tgt_data();
+	tdata->admin_fd = -1;
+	tgt->tgt_data = tdata;
+
+	ret = ublksrv_tgt_parse_busy_poll(cdev, argc, argv, &tdata->bp);
+	if (ret)
+		return ret;
+	ret = nvmetcp_setup_tgt(dev);
+	if (ret)
+		return ret;
+
+	tgt_json.dev_size = tgt->dev_size;
+	ublk_json_write_target_base(cdev, &tgt_json);
+
+	/* MDTS is in unit of 4K, and NLB of read/write is 16 bits */
+	shift = tdata->lba_shift;
+	max_bytes = std::min(info->max_io_buf_bytes, 65536U << shift);
+	if (tdata->mdts && tdata->mdts < 20)
+		max_bytes = std::min(max_bytes, 4096U << tdata->mdts);
+
+	struct ublk_params p = {
+		.types = UBLK_PARAM_TYPE_BASIC,
+		.basic = {
+			.attrs = (tdata->vwc & NVME_CTRL_VWC_PRESENT) ?
+				UBLK_ATTR_VOLATILE_CACHE | UBLK_ATTR_FUA : 0U,
+			.logical_bs_shift	= (__u8)shift,
+			.physical_bs_shift	= (__u8)shift,
+			.io_opt_shift		= (__u8)shift,
+			.io_min_shift		= (__u8)shift,
+			.max_sectors		= max_bytes >> 9,
+			.dev_sectors		= tgt->dev_size >> 9,
+		},
+	};
+
+	if (tdata->oncs & NVME_CTRL_ONCS_DSM) {
+		p.discard.discard_granularity = 1U << shift;
+		p.discard.max_discard_sectors = UINT_MAX >> 9;
+		p.discard.max_discard_segments = 1;
+		p.types |= UBLK_PARAM_TYPE_DISCARD;
+	}
+	if (tdata->oncs & NVME_CTRL_ONCS_WRITE_ZEROES) {
+		p.discard.max_write_zeroes_sectors = 65536U << (shift - 9);
+		p.types |= UBLK_PARAM_TYPE_DISCARD;
+	}
+	ublk_json_write_params(cdev, &p);
+
+	return 0;
+}
+
+static void nvmetcp_cmd_usage()
+{
+	printf("\t--host=$HOST [--port=$PORT] --subnqn=$SUBNQN [--hostnqn=$HOSTNQN]\n");
+	printf("\t\t[--nsid=$NSID] [--hdr_digest] [--data_digest]\n");
+	ublksrv_tgt_busy_poll_usage();
+}
+
+static const struct ublksrv_tgt_type nvmetcp_tgt_type = {
+	.handle_io_async = nvmetcp_handle_io_async,
+	.tgt_io_done = nvmetcp_tgt_io_done,
+	.handle_io_background = nvmetcp_handle_io_bg,
+	.usage_for_add = nvmetcp_cmd_usage,
+	.init_tgt = nvmetcp_init_tgt,
+	.deinit_tgt = nvmetcp_deinit_tgt,
+	.name	=  "nvmetcp",
+	.init_queue = nvmetcp_init_queue,
+	.deinit_queue = nvmetcp_deinit_queue,
+};
+
+int main(int argc, char *argv[])
+{
+	return ublksrv_main(&nvmetcp_tgt_type, argc, argv);
+}
@@ -3,9 +3,17 @@
 #include "config.h"
 #include "ublksrv_tgt.h"
 #include <filesystem>
+#include <fstream>
+#include <vector>
+#include <algorithm>
 #include <sys/eventfd.h>
+#include "nlohmann/json.hpp"
+
+/* how many devices are brought up concurrently by default */
+#define UBLK_BULK_JOBS	16
 
 static int list_one_dev(int number, bool log, bool verbose);
+int cmd_dev_bench(int argc, char *argv[]);
 
 template<typename cb_t>
 static void for_each_dev(cb_t && cb)
@@ -18,9 +26,13 @@ static void for_each_dev(cb_t && cb)
 }
 
 /*
+ * Fork & exec ublk.<type>. For daemon commands, the read end of the pipe
+ * which the daemon reports its device id through is returned via *rfd.
+ *
  * returns 0 on success and -errno on failure
  */
-static int ublksrv_execv_helper(const char *type, int argc, char *argv[])
+static int __ublksrv_execv_helper(const char *type, int argc, char *argv[],
+		int *rfd)
 {
 	char *cmd, *fp, **nargv, *evtfd_str;
 	char full_path[256];
@@ -29,6 +41,15 @@ static int ublksrv_execv_helper(const char *type, int argc, char *argv[])
 	int res, i;
 	int pfd[2] = { -1, -1};
 
+	/* delay layer runs inside the daemon of the inner target */
+	if (!strcmp(type, "delay")) {
+		type = ublksrv_delay_inner_type(argc, argv);
+		if (!type || !strcmp(type, "delay")) {
+			fprintf(stderr, "-t delay requires --inner TYPE\n");
+			return -EINVAL;
+		}
+	}
+
 	asprintf(&cmd, "ublk.%s", type);
 
 	for (i = 1; i < argc; i++) {
@@ -57,6 +78,8 @@ static int ublksrv_execv_helper(const char *type, int argc, char *argv[])
 			fprintf(stderr, "Failed to create pipe %s\n", strerror(errno));
 			return -errno;
 		}
+		/* don't leak it into daemons forked after us */
+		fcntl(pfd[0], F_SETFD, FD_CLOEXEC);
 		asprintf(&evtfd_str, "%d", pfd[1]);
 		nargv[argc] = strdup("--eventfd");
 		nargv[argc + 1] = evtfd_str;
@@ -81,22 +104,150 @@ exec:
 		close(STDERR_FILENO);
 		goto exec;
 	}
+	free(nargv[argc]);
+	free(nargv[argc + 1]);
+	free(nargv);
+	free(cmd);
+	free(fp);
+	close(pfd[1]);
 	if (res > 0) {
-		uint64_t id;
+		*rfd = pfd[0];
+		return 0;
+	}
+	close(pfd[0]);
+	return -errno;
+}
 
-		close(pfd[1]);
-		res = read(pfd[0], &id, sizeof(id));
-		close(pfd[0]);
+/* convert what the daemon wrote to the pipe into device id or -errno */
+static int ublksrv_helper_dev_id(int res, uint64_t id)
+{
+	if (res == 0)
+		return -EINVAL;
+	if (res < 0)
+		return res;
+	if (res != sizeof(id) || id == 0 || id - 1 > INT_MAX)
+		return -EINVAL;
+	return id - 1;
+}
 
-		if (res == 0)
-			res = -EINVAL;
-		if (res == sizeof(id))
-			return list_one_dev(id - 1, false, false);
+/*
+ * returns 0 on success and -errno on failure
+ */
+static int ublksrv_execv_helper(const char *type, int argc, char *argv[])
+{
+	uint64_t id;
+	int fd, res;
+
+	res = __ublksrv_execv_helper(type, argc, argv, &fd);
+	if (res < 0)
 		return res;
-	}
-	if (res == -1)
+
+	res = read(fd, &id, sizeof(id));
+	close(fd);
+	if (res < 0)
 		res = -errno;
-	return res;
+
+	res = ublksrv_helper_dev_id(res, id);
+	if (res < 0)
+		return res;
+	return list_one_dev(res, false, false);
+}
+
+struct ublk_helper_job {
+	std::string type;
+	std::vector<std::string> args;
+
+	int fd;
+	uint64_t id;
+	int dev_id;		/* device id or -errno */
+};
+
+/*
+ * Run many `ublk.<type>` daemons with at most `max_jobs` of them starting
+ * at the same time, and wait for their device ready notification through
+ * a single io_uring instead of one blocking read() per device.
+ *
+ * returns 0 if all devices are started, otherwise the last failure
+ */
+static int ublksrv_run_helpers(std::vector<ublk_helper_job> &jobs,
+		unsigned max_jobs)
+{
+	struct io_uring ring;
+	unsigned next = 0, inflight = 0;
+	int ret;
+
+	if (jobs.empty())
+		return 0;
+
+	max_jobs = std::clamp(max_jobs, 1U, 256U);
+	ret = io_uring_queue_init(max_jobs, &ring, 0);
+	if (ret < 0) {
+		fprintf(stderr, "queue_init: %s\n", strerror(-ret));
+		return ret;
+	}
+
+	while (next < jobs.size() || inflight) {
+		struct io_uring_cqe *cqe;
+		unsigned head, count = 0;
+
+		while (next < jobs.size() && inflight < max_jobs) {
+			struct ublk_helper_job &job = jobs[next];
+			std::vector<char *> argv;
+			struct io_uring_sqe *sqe;
+
+			for (auto &arg : job.args)
+				argv.push_back((char *)arg.c_str());
+			argv.push_back(NULL);
+
+			ret = __ublksrv_execv_helper(job.type.c_str(),
+					job.args.size(), argv.data(), &job.fd);
+			if (ret < 0) {
+				job.dev_id = ret;
+				next++;
+				continue;
+			}
+
+			sqe = io_uring_get_sqe(&ring);
+			io_uring_prep_read(sqe, job.fd, &job.id, sizeof(job.id), 0);
+			io_uring_sqe_set_data64(sqe, next);
+			next++;
+			inflight++;
+		}
+		if (!inflight)
+			break;
+
+		do {
+			ret = io_uring_submit_and_wait(&ring, 1);
+		} while (ret == -EINTR);
+		if (ret < 0) {
+			fprintf(stderr, "uring submit_and_wait ret %d\n", ret);
+			break;
+		}
+
+		io_uring_for_each_cqe(&ring, head, cqe) {
+			struct ublk_helper_job &job = jobs[cqe->user_data];
+
+			close(job.fd);
+			job.dev_id = ublksrv_helper_dev_id(cqe->res, job.id);
+			count++;
+		}
+		io_uring_cq_advance(&ring, count);
+		inflight -= count;
+	}
+	io_uring_queue_exit(&ring);
+
+	ret = 0;
+	for (auto &job : jobs) {
+		if (job.dev_id < 0) {
+			fprintf(stderr, "%s %s failed: %d\n", job.args[1].c_str(),
+					job.type.c_str(), job.dev_id);
+			ret = job.dev_id;
+		} else {
+			list_one_dev(job.dev_id, false, false);
+		}
+	}
+
+	return ret;
 }
 
 static int ublksrv_stop_io_daemon(const struct ublksrv_ctrl_dev *ctrl_dev)
@@ -411,9 +562,106 @@ static void args_parse_number_type(struct ublksrv_dev_data *data, int argc, char
 	}
 }
 
+/* options of add & recover for handling many devices at once */
+static void args_parse_bulk(int argc, char *argv[], const char **manifest,
+		unsigned *jobs, bool *all)
+{
+	static const struct option longopts[] = {
+		{ "manifest",		1,	NULL, 0 },
+		{ "jobs",		1,	NULL, 'j' },
+		{ "all",		0,	NULL, 'a' },
+		{ NULL }
+	};
+	int opt, option_index = 0;
+
+	optind = 0;
+	while ((opt = getopt_long(argc, argv, "-:j:a",
+				  longopts, &option_index)) != -1) {
+		switch (opt) {
+		case 'j':
+			*jobs = strtol(optarg, NULL, 10);
+			break;
+		case 'a':
+			*all = true;
+			break;
+		case 0:
+			if (!strcmp(longopts[option_index].name, "manifest"))
+				*manifest = optarg;
+			break;
+		}
+	}
+	optind = 0;
+}
+
+/*
+ * The manifest is either one array of devices, or an object of
+ * { "jobs": N, "devices": [ ... ] }, and each device looks like:
+ *
+ *	{ "type": "loop", "number": 3, "args": [ "-q", "2", "-f", "a.img" ] }
+ *
+ * "number" is optional, and "args" are passed to `ublk add` verbatim.
+ */
+static int ublksrv_load_manifest(const char *path,
+		std::vector<ublk_helper_job> &jobs, unsigned *max_jobs)
+{
+	std::ifstream f(path);
+	nlohmann::json j;
+
+	if (!f.is_open()) {
+		fprintf(stderr, "can't open manifest %s\n", path);
+		return -ENOENT;
+	}
+
+	try {
+		j = nlohmann::json::parse(f);
+		if (j.is_object() && j.contains("jobs"))
+			*max_jobs = j["jobs"].get<unsigned>();
+
+		for (auto &d : j.is_array() ? j : j.at("devices")) {
+			ublk_helper_job job = {};
+
+			job.type = d.at("type").get<std::string>();
+			job.args = { "ublk", "add", "-t", job.type };
+			if (d.contains("number")) {
+				job.args.push_back("-n");
+				job.args.push_back(std::to_string(
+						d["number"].get<int>()));
+			}
+			for (auto &arg : d.value("args", nlohmann::json::array()))
+				job.args.push_back(arg.is_string() ?
+						arg.get<std::string>() : arg.dump());
+			jobs.push_back(job);
+		}
+	} catch (nlohmann::json::exception &e) {
+		fprintf(stderr, "bad manifest %s: %s\n", path, e.what());
+		return -EINVAL;
+	}
+
+	return 0;
+}
+
+static int cmd_dev_add_manifest(const char *manifest, unsigned max_jobs)
+{
+	std::vector<ublk_helper_job> jobs;
+	int ret;
+
+	ret = ublksrv_load_manifest(manifest, jobs, &max_jobs);
+	if (ret)
+		return ret;
+
+	return ublksrv_run_helpers(jobs, max_jobs);
+}
+
 static int cmd_dev_add(int argc, char *argv[])
 {
 	struct ublksrv_dev_data data = {0};
+	const char *manifest = NULL;
+	unsigned jobs = UBLK_BULK_JOBS;
+	bool all = false;
+
+	args_parse_bulk(argc, argv, &manifest, &jobs, &all);
+	if (manifest)
+		return cmd_dev_add_manifest(manifest, jobs);
 
 	args_parse_number_type(&data, argc, argv);
   
@@ -440,17 +688,93 @@ static int cmd_dev_help(int argc, char *argv[])
 	return ublksrv_execv_helper(data.tgt_type, argc, argv);
 }
 
+static int ublksrv_get_tgt_type(struct ublksrv_ctrl_dev *dev,
+		char *tgt_type, int len)
+{
+	char *buf = ublksrv_tgt_get_dev_data(dev);
+	int ret;
+
+	if (!buf)
+		return -ENOENT;
+
+	ret = ublksrv_json_read_target_str_info(buf, len, "name", tgt_type);
+	free(buf);
+
+	return ret < 0 ? ret : 0;
+}
+
+/*
+ * Recover every device whose daemon is gone: device info is retrieved
+ * in batch via one io_uring, then all QUIESCED devices are recovered
+ * with at most `max_jobs` daemons starting concurrently.
+ */
+static int cmd_dev_recover_all(unsigned max_jobs)
+{
+	std::vector<struct ublksrv_ctrl_dev *> devs;
+	std::vector<ublk_helper_job> jobs;
+	std::vector<int> res;
+	int ret;
+
+	for_each_dev([&](unsigned dev_id) {
+		struct ublksrv_dev_data data = {
+			.dev_id = (int)dev_id,
+			.run_dir = ublksrv_get_pid_dir(),
+		};
+		struct ublksrv_ctrl_dev *dev = ublksrv_ctrl_init(&data);
+
+		if (dev)
+			devs.push_back(dev);
+	});
+
+	res.resize(devs.size());
+	ret = ublksrv_ctrl_get_info_batch(devs.data(), devs.size(), res.data());
+	if (ret < 0)
+		fprintf(stderr, "get dev info in batch failed %d\n", ret);
+
+	for (size_t i = 0; i < devs.size(); i++) {
+		const struct ublksrv_ctrl_dev_info *info =
+			ublksrv_ctrl_get_dev_info(devs[i]);
+		char tgt_type[32] = {0};
+
+		if (res[i] < 0 || info->state != UBLK_S_DEV_QUIESCED)
+			continue;
+
+		if (ublksrv_get_tgt_type(devs[i], tgt_type, 32)) {
+			fprintf(stderr, "can't get target type for %d\n",
+					info->dev_id);
+			continue;
+		}
+
+		ublk_helper_job job = {};
+		job.type = tgt_type;
+		job.args = { "ublk", "recover", "-n",
+			std::to_string(info->dev_id) };
+		jobs.push_back(job);
+	}
+
+	for (auto dev : devs)
+		ublksrv_ctrl_deinit(dev);
+
+	return ublksrv_run_helpers(jobs, max_jobs);
+}
+
 static int cmd_dev_recover(int argc, char *argv[])
 {
 	struct ublksrv_ctrl_dev *dev;
 	char tgt_type[32] = {0};
-	char *buf = NULL;
 	struct ublksrv_dev_data data = {
 	  .dev_id = -1,
 	  .run_dir = ublksrv_get_pid_dir(),
 	};
+	const char *manifest = NULL;
+	unsigned jobs = UBLK_BULK_JOBS;
+	bool all = false;
 	int ret;
 
+	args_parse_bulk(argc, argv, &manifest, &jobs, &all);
+	if (all)
+		return cmd_dev_recover_all(jobs);
+
 	args_parse_number_type(&data, argc, argv);
 
 	if (data.dev_id < 0) {
@@ -462,20 +786,18 @@ static int cmd_dev_recover(int argc, char *argv[])
 		fprintf(stderr, "initialize ctrl dev %d failed\n", data.dev_id);
 		return EXIT_FAILURE;
 	}
-	buf = ublksrv_tgt_get_dev_data(dev);
-	if (!buf) {
+
+	ret = ublksrv_get_tgt_type(dev, tgt_type, 32);
+	ublksrv_ctrl_deinit(dev);
+	if (ret == -ENOENT) {
 		fprintf(stderr, "get dev %d data failed\n", data.dev_id);
 		return EXIT_FAILURE;
 	}
-
-	ret = ublksrv_json_read_target_str_info(buf, 32, "name", tgt_type);
 	if (ret < 0) {
 		fprintf(stderr, "can't get target type for %d\n", data.dev_id);
 		return EXIT_FAILURE;
 	}
 
-	free(buf);
-
 	return ublksrv_execv_helper(tgt_type, argc, argv);
 }
 
@@ -514,6 +836,8 @@ int main(int argc, char *argv[])
 		ret = cmd_dev_recover(argc, argv);
 	else if (!strcmp(cmd, "features"))
 		ret = cmd_dev_get_features(argc, argv);
+	else if (!strcmp(cmd, "bench"))
+		ret = cmd_dev_bench(argc, argv);
 	else if (!strcmp(cmd, "help") || !strcmp(cmd, "-h") || !strcmp(cmd, "--help")) {
 		ret = cmd_dev_help(argc, argv);
 	} else if (!strcmp(cmd, "-v") || !strcmp(cmd, "--version")) {
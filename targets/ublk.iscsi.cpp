@@ -8,6 +8,9 @@
 
 struct iscsi_url *url;
 
+static struct ublksrv_io_timeout iscsi_tmo;
+static struct ublksrv_cache *iscsi_cache;
+
 struct iscsi_tgt_data {
 	char url[4096];
 	char initiator[256];
@@ -24,11 +27,14 @@ typedef struct iscsi_cb_data {
 	struct scsi_iovec iov;
 	ssize_t count;
 	struct unmap_list unmap;
+	unsigned int retries;
 } iscsi_cb_data_t;
 
 struct iscsi_queue_data {
 	struct iscsi_tgt_data *iscsi_data;
 	int events;
+	unsigned int inflight;
+	struct ublksrv_tick tick;
 	iscsi_cb_data_t ios[];
 };
 
@@ -49,20 +55,35 @@ static inline int cb_data_to_tag(iscsi_cb_data_t *cb)
 	return tag;
 }
 
+static int __iscsi_queue_io(const struct ublksrv_queue *q,
+		const struct ublk_io_data *data);
+
 void rw_async_cb(struct iscsi_context *iscsi, int status, void *command_data, void *private_data)
 {
 	iscsi_cb_data_t *cb_data = (iscsi_cb_data_t *)private_data;
 	struct scsi_task *task = (struct scsi_task *)command_data;
-	unsigned int tag;
+	const struct ublksrv_queue *q = cb_data->q;
+	unsigned int tag = cb_data_to_tag(cb_data);
 
-	if (status != SCSI_STATUS_GOOD) {
+	scsi_free_scsi_task(task);
+
+	if (status == SCSI_STATUS_TIMEOUT &&
+			iscsi_tmo.policy == UBLKSRV_TMO_RETRY &&
+			cb_data->retries < iscsi_tmo.retries) {
+		int ret;
+
+		cb_data->retries += 1;
+		ret = __iscsi_queue_io(q, ublksrv_queue_get_io_data(q, tag));
+		if (!ret)
+			return;
+		cb_data->count = ret;
+	} else if (status != SCSI_STATUS_GOOD) {
 		fprintf(stderr, "iscsi task failed with \"%s\"\n", iscsi_get_error(iscsi));
-		cb_data->count = -EIO;
+		cb_data->count = status == SCSI_STATUS_TIMEOUT ? -ETIMEDOUT : -EIO;
 	}
 
-	tag = cb_data_to_tag(cb_data);
-	ublksrv_complete_io(cb_data->q, tag, cb_data->count);
-	scsi_free_scsi_task(task);
+	iscsi_get_queue_data(q)->inflight -= 1;
+	ublksrv_cache_complete_io(iscsi_cache, q, tag, cb_data->count);
 }
 
 void iscsi_socket_cb(struct ublksrv_queue *q, int revents)
@@ -219,8 +240,8 @@ static int iscsi_tgt_write_zeroes(const struct ublksrv_queue *q,
 	return 0;
 }
 
-static int iscsi_handle_io_async(const struct ublksrv_queue *q,
-				 const struct ublk_io_data *data)
+static int __iscsi_queue_io(const struct ublksrv_queue *q,
+		const struct ublk_io_data *data)
 {
 	const struct ublksrv_io_desc *iod = data->iod;
 	unsigned ublk_op = ublksrv_get_op(iod);
@@ -246,12 +267,49 @@ static int iscsi_handle_io_async(const struct ublksrv_queue *q,
 		ret = -EINVAL;
 	}
 
+	return ret;
+}
+
+static int iscsi_handle_io_async(const struct ublksrv_queue *q,
+				 const struct ublk_io_data *data)
+{
+	struct iscsi_queue_data *q_data = iscsi_get_queue_data(q);
+	int ret;
+
+	if (ublksrv_cache_handle_io(iscsi_cache, q, data))
+		return 0;
+
+	q_data->ios[data->tag].retries = 0;
+	ret = __iscsi_queue_io(q, data);
 	if (ret) {
-		ublksrv_complete_io(q, data->tag, ret);
-	}
+		ublksrv_cache_complete_io(iscsi_cache, q, data->tag, ret);
+	} else
+		q_data->inflight += 1;
 	return ret;
 }
 
+/* iscsi_service() expires tasks which are older than iscsi timeout */
+static void iscsi_tgt_io_done(const struct ublksrv_queue *q,
+		const struct ublk_io_data *data,
+		const struct io_uring_cqe *cqe)
+{
+	if (ublksrv_cache_io_done(iscsi_cache, q, cqe))
+		return;
+	if (user_data_to_op(cqe->user_data) != UBLKSRV_TICK_OP)
+		return;
+
+	iscsi_get_queue_data(q)->tick.armed = false;
+	iscsi_socket_cb((struct ublksrv_queue *)q, 0);
+}
+
+static void iscsi_handle_io_bg(const struct ublksrv_queue *q, int nr_queued_io)
+{
+	struct iscsi_queue_data *q_data = iscsi_get_queue_data(q);
+
+	if (q_data->inflight)
+		ublksrv_tgt_arm_tick(q, &q_data->tick, &iscsi_tmo, 0);
+}
+
 static struct iscsi_tgt_data *iscsi_init(const char *iscsiurl,
 					 const char *initiator)
 {
@@ -349,6 +407,7 @@ static int iscsi_setup_tgt(struct ublksrv_dev *dev)
 	const struct ublksrv_ctrl_dev_info *info = ublksrv_ctrl_get_dev_info(cdev);
 	struct ublksrv_tgt_info *tgt = &dev->tgt;
 	struct ublk_params p;
+	char url[PATH_MAX];
 	int ret;
 
 	ret = ublk_json_read_params(&p, cdev);
@@ -360,8 +419,19 @@ static int iscsi_setup_tgt(struct ublksrv_dev *dev)
 
 	tgt->dev_size = p.basic.dev_sectors << 9;
 	tgt->tgt_ring_depth = info->queue_depth;
+	if (iscsi_tmo.ms)
+		tgt->tgt_ring_depth += 1;	//deadline tick
 	tgt->nr_fds = 0;
 
+	ret = ublk_json_read_target_str_info(cdev, "url", url);
+	if (ret < 0)
+		return ret;
+	ret = ublksrv_cache_open(dev, url, &iscsi_cache);
+	if (ret)
+		return ret;
+	if (iscsi_cache)
+		tgt->tgt_ring_depth += info->queue_depth;	//cache reads
+
 	return 0;
 }
 
@@ -386,6 +456,10 @@ static int iscsi_recover_tgt(struct ublksrv_dev *dev, int type)
 		return ret;
 	}
 
+	ret = ublksrv_tgt_parse_io_timeout(cdev, 0, NULL, &iscsi_tmo);
+	if (ret)
+		return ret;
+
 	return iscsi_setup_tgt(dev);
 }
 #pragma GCC diagnostic pop
@@ -410,7 +484,7 @@ static int iscsi_init_tgt(struct ublksrv_dev *dev, int type, int argc,
 		{ "initiator-name", required_argument, NULL, 1025 },
 		{ NULL }
 	};
-	int opt;
+	int opt, ret;
 	struct iscsi_tgt_data *iscsi_data = NULL;
 	const char *iscsiurl = NULL, *initiator = NULL;
 
@@ -464,14 +538,20 @@ static int iscsi_init_tgt(struct ublksrv_dev *dev, int type, int argc,
 	ublk_json_write_tgt_str(cdev, "url", iscsi_data->url);
 	ublk_json_write_tgt_str(cdev, "initiator-name", iscsi_data->initiator);
 	ublk_json_write_params(cdev, &p);
+	ret = ublksrv_tgt_parse_io_timeout(cdev, argc, argv, &iscsi_tmo);
+	if (!ret)
+		ret = ublksrv_cache_parse(cdev, argc, argv);
 
 	iscsi_exit(iscsi_data);
-	
+	if (ret)
+		return ret;
+
 	return iscsi_setup_tgt(dev);
 }
 
 static void iscsi_deinit_tgt(const struct ublksrv_dev *dev)
 {
+	ublksrv_cache_close(iscsi_cache);
 	iscsi_destroy_url(url);
 }
 
@@ -509,6 +589,8 @@ static int iscsi_init_queue(const struct ublksrv_queue *q,
 	}
 	data->iscsi_data = iscsi_init(url, initiator);
 	iscsi = data->iscsi_data->iscsi;
+	if (iscsi_tmo.ms)
+		iscsi_set_timeout(iscsi, (iscsi_tmo.ms + 999) / 1000);
 	ublksrv_epoll_add_fd((struct ublksrv_queue *)q, iscsi_get_fd(iscsi), iscsi_which_events(iscsi), iscsi_socket_cb);
 	return 0;
 }
@@ -526,10 +608,14 @@ static void iscsi_deinit_queue(const struct ublksrv_queue *q)
 static void iscsi_cmd_usage()
 {
 	printf("\t--iscsi ISCSI-URL --initiator-name=STRING\n");
+	ublksrv_tgt_io_timeout_usage();
+	ublksrv_cache_usage();
 }
 
 static const struct ublksrv_tgt_type  iscsi_tgt_type = {
 	.handle_io_async = iscsi_handle_io_async,
+	.tgt_io_done = iscsi_tgt_io_done,
+	.handle_io_background = iscsi_handle_io_bg,
 	.usage_for_add = iscsi_cmd_usage,
 	.init_tgt = iscsi_init_tgt,
 	.deinit_tgt = iscsi_deinit_tgt,
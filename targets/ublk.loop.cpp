@@ -5,15 +5,89 @@
 #include <poll.h>
 #include <sys/epoll.h>
 #include <linux/falloc.h>
+#include <linux/nvme_ioctl.h>
 
 #include "ublksrv_tgt.h"
+#include "ublksrv_pi.h"
+#include "nvme/nvme.h"
+
+/* op of integrity data io on pi file, not counted as io result */
+#define LO_PI_META_OP	0x82
+
+/* hashed locks for serializing read-modify-write of same backing block */
+#define LO_BOUNCE_LOCKS	64
+
+/* op of page cache hint on backing file, not counted as io result */
+#define LO_FADVISE_OP	0x83
+
+/* streams tracked per queue for page cache hints */
+#define LO_NR_STREAMS	8
+/* stream becomes sequential after so many contiguous io */
+#define LO_SEQ_IOS	4
+/* readahead window of sequential stream, and drop-behind lag */
+#define LO_RA_BYTES	(2U << 20)
+
+#ifndef RWF_DONTCACHE
+#define RWF_DONTCACHE	0x00000080
+#endif
+
+/* how buffered io uses page cache of backing file */
+enum {
+	LO_PAGE_CACHE_KEEP,
+	LO_PAGE_CACHE_HINT,	/* fadvise by detected streams */
+	LO_PAGE_CACHE_UNCACHED,	/* RWF_DONTCACHE, plus hints */
+};
 
 struct loop_tgt_data {
 	bool user_copy;
 	bool auto_zc;
 	bool zero_copy;
 	bool block_device;
+	bool integrity;
 	unsigned long offset;
+
+	/* PI layout, integrity data is stored in pi file(fds[2]) */
+	struct ublk_param_integrity pi;
+
+	/*
+	 * O_DIRECT alignment of backing file if it is bigger than the
+	 * exported logical block size, then unaligned io is bounced
+	 */
+	unsigned bounce_align;
+	pthread_mutex_t bounce_locks[LO_BOUNCE_LOCKS];
+
+	/*
+	 * backing is NVMe generic char device(/dev/ngXnY), io is sent as
+	 * NVMe command via uring_cmd, and lba_shift is the namespace's
+	 */
+	__u32 nvme_nsid;
+	unsigned lba_shift;
+
+	/* LO_PAGE_CACHE_*, and rw_flags applied to every backing io */
+	unsigned page_cache;
+	int rw_flags;
+};
+
+/* io stream on backing file, covers [drop_end, next) */
+struct lo_stream {
+	__u64 next;
+	__u64 ra_end;
+	__u64 drop_end;
+	unsigned seq;
+	unsigned stamp;
+	unsigned op;
+};
+
+struct loop_queue_data {
+	/* for unaligned io, allocated if bounce_align is set */
+	void *bounce;
+
+	/* NVMe: DSM range of each tag, io buffers are registered */
+	struct nvme_dsm_range *dsm;
+	bool nvme_fixed;
+
+	unsigned stamp;
+	struct lo_stream streams[LO_NR_STREAMS];
 };
 
 static bool backing_supports_discard(char *name)
@@ -41,13 +115,211 @@ static bool backing_supports_discard(char *name)
 	return false;
 }
 
+/*
+ * Each interval has one PI tuple stored in pi file, and the file is
+ * initialized with escape app tag, so unwritten blocks aren't checked
+ */
+static int loop_prep_pi_file(const char *pi_file, unsigned long long size)
+{
+	char buf[4096];
+	struct stat st;
+	unsigned long long off;
+	int fd, ret = 0;
+
+	fd = open(pi_file, O_RDWR | O_CREAT, 0644);
+	if (fd < 0) {
+		ublk_err( "%s: pi file %s can't be opened\n",
+				__func__, pi_file);
+		return -errno;
+	}
+
+	if (fstat(fd, &st) < 0) {
+		ret = -errno;
+		goto out;
+	}
+
+	memset(buf, 0xff, sizeof(buf));
+	for (off = st.st_size; off < size; off += sizeof(buf)) {
+		unsigned len = size - off < sizeof(buf) ? size - off : sizeof(buf);
+
+		if (pwrite(fd, buf, len, off) != (ssize_t)len) {
+			ret = -EIO;
+			break;
+		}
+	}
+out:
+	close(fd);
+	return ret;
+}
+
+static int loop_setup_pi(struct ublksrv_dev *dev,
+		const struct ublk_params *p)
+{
+	struct ublksrv_tgt_info *tgt = &dev->tgt;
+	const struct ublksrv_ctrl_dev *cdev = ublksrv_get_ctrl_dev(dev);
+	const struct ublksrv_ctrl_dev_info *info = ublksrv_ctrl_get_dev_info(cdev);
+	struct loop_tgt_data *tgt_data = (struct loop_tgt_data*)dev->tgt.tgt_data;
+	/* not on stack, which is inlined into loop_setup_tgt() */
+	char *pi_file = (char *)malloc(PATH_MAX);
+	int fd, ret;
+
+	if (!pi_file)
+		return -ENOMEM;
+
+	ret = ublk_json_read_target_str_info(cdev, "pi_file", pi_file);
+	if (ret < 0) {
+		ublk_err( "%s: pi file can't be retrieved from jbuf %d\n",
+				__func__, ret);
+		free(pi_file);
+		return ret;
+	}
+
+	fd = open(pi_file, O_RDWR);
+	if (fd < 0) {
+		ret = -errno;
+		ublk_err( "%s: pi file %s can't be opened\n",
+				__func__, pi_file);
+		free(pi_file);
+		return ret;
+	}
+	free(pi_file);
+
+	tgt_data->integrity = true;
+	tgt_data->pi = p->integrity;
+	tgt->nr_fds = 2;
+	tgt->fds[2] = fd;
+	tgt->integrity_buf_size = ublksrv_pi_meta_len(&p->integrity,
+			info->max_io_buf_bytes);
+	return 0;
+}
+
+static unsigned loop_file_dio_align(const char *file, unsigned blksize)
+{
+#ifdef STATX_DIOALIGN
+	struct statx stx;
+
+	if (!statx(AT_FDCWD, file, 0, STATX_DIOALIGN, &stx) &&
+			(stx.stx_mask & STATX_DIOALIGN) &&
+			stx.stx_dio_offset_align)
+		return stx.stx_dio_offset_align;
+#endif
+	return blksize;
+}
+
+static int loop_nvme_identify(int fd, __u32 nsid, __u32 cns, void *buf)
+{
+	struct nvme_passthru_cmd cmd = {
+		.opcode = NVME_ADMIN_IDENTIFY,
+		.nsid = nsid,
+		.addr = (__u64)(uintptr_t)buf,
+		.data_len = 4096,
+		.cdw10 = cns,
+	};
+
+	return ioctl(fd, NVME_IOCTL_ADMIN_CMD, &cmd);
+}
+
+/* build params from NVMe namespace behind the generic char device */
+static int loop_nvme_init_params(int fd, struct ublk_params *p, __u32 *nsid,
+		unsigned long long *bytes)
+{
+	struct nvme_id_ctrl *ctrl;
+	struct nvme_id_ns *ns;
+	struct nvme_lbaf *lbaf;
+	unsigned lba_shift, max_sectors;
+	void *buf;
+	int id, ret = -EOPNOTSUPP;
+
+	id = ioctl(fd, NVME_IOCTL_ID);
+	if (id <= 0) {
+		ublk_err("%s: not NVMe generic char device\n", __func__);
+		return -ENOTTY;
+	}
+
+	if (posix_memalign(&buf, 4096, 8192))
+		return -ENOMEM;
+	ns = (struct nvme_id_ns *)buf;
+	ctrl = (struct nvme_id_ctrl *)((char *)buf + 4096);
+	if (loop_nvme_identify(fd, id, NVME_ID_CNS_NS, ns) ||
+			loop_nvme_identify(fd, 0, NVME_ID_CNS_CTRL, ctrl)) {
+		ublk_err("%s: identify failed\n", __func__);
+		ret = -EIO;
+		goto out;
+	}
+
+	lbaf = &ns->lbaf[ns->flbas & 0xf];
+	lba_shift = lbaf->ds;
+	if (le16toh(lbaf->ms) || lba_shift < 9 || lba_shift > 12) {
+		ublk_err("%s: unsupported lba format, ds %u ms %u\n", __func__,
+				lba_shift, le16toh(lbaf->ms));
+		goto out;
+	}
+
+	*nsid = id;
+	*bytes = le64toh(ns->nsze) << lba_shift;
+	p->basic.logical_bs_shift = lba_shift;
+	p->basic.physical_bs_shift = lba_shift;
+	p->basic.io_min_shift = lba_shift;
+	if (!(ctrl->vwc & NVME_CTRL_VWC_PRESENT))
+		p->basic.attrs &= ~UBLK_ATTR_VOLATILE_CACHE;
+
+	/* NLB is 16bit, and MDTS is in unit of CAP.MPSMIN, assume 4K */
+	max_sectors = 65536U << (lba_shift - 9);
+	if (ctrl->mdts && ctrl->mdts < 20 && (4096U << ctrl->mdts) >> 9 <
+			max_sectors)
+		max_sectors = (4096U << ctrl->mdts) >> 9;
+	if (p->basic.max_sectors > max_sectors)
+		p->basic.max_sectors = max_sectors;
+
+	if (le16toh(ctrl->oncs) & NVME_CTRL_ONCS_DSM) {
+		p->discard.discard_granularity = 1U << lba_shift;
+	} else {
+		p->discard.max_discard_sectors = 0;
+		p->discard.max_discard_segments = 0;
+	}
+	if (le16toh(ctrl->oncs) & NVME_CTRL_ONCS_WRITE_ZEROES)
+		p->discard.max_write_zeroes_sectors = 65536U << (lba_shift - 9);
+	if (!p->discard.max_discard_sectors && !p->discard.max_write_zeroes_sectors)
+		p->types &= ~UBLK_PARAM_TYPE_DISCARD;
+	ret = 0;
+out:
+	free(buf);
+	return ret;
+}
+
+static const char *const lo_page_cache_names[] = {
+	"keep", "hint", "uncached",
+};
+
+static int loop_parse_page_cache(const char *name)
+{
+	for (unsigned i = 0; i < sizeof(lo_page_cache_names) /
+			sizeof(lo_page_cache_names[0]); i++)
+		if (!strcmp(name, lo_page_cache_names[i]))
+			return i;
+	return -EINVAL;
+}
+
+/* RWF_DONTCACHE needs v6.14+ kernel and support from the file system */
+static bool loop_support_dontcache(int fd)
+{
+	char buf[512];
+	struct iovec iov = {
+		.iov_base = buf,
+		.iov_len = sizeof(buf),
+	};
+
+	return preadv2(fd, &iov, 1, 0, RWF_DONTCACHE) >= 0;
+}
+
 static int loop_setup_tgt(struct ublksrv_dev *dev, int type)
 {
 	struct ublksrv_tgt_info *tgt = &dev->tgt;
 	const struct ublksrv_ctrl_dev *cdev = ublksrv_get_ctrl_dev(dev);
 	const struct ublksrv_ctrl_dev_info *info = ublksrv_ctrl_get_dev_info(cdev);
 	int fd, ret;
-	unsigned long direct_io = 0;
+	unsigned long direct_io = 0, bounce_align = 0;
+	unsigned long page_cache = LO_PAGE_CACHE_KEEP, nvme_nsid = 0;
 	struct ublk_params p;
 	char file[PATH_MAX];
 	struct loop_tgt_data *tgt_data = (struct loop_tgt_data*)dev->tgt.tgt_data;
@@ -76,6 +348,11 @@ static int loop_setup_tgt(struct ublksrv_dev *dev, int type)
 		return ret;
 	}
 
+	/* not stored by old version */
+	ublk_json_read_target_ulong_info(cdev, "dio_align", &bounce_align);
+	ublk_json_read_target_ulong_info(cdev, "page_cache", &page_cache);
+	ublk_json_read_target_ulong_info(cdev, "nvme_nsid", &nvme_nsid);
+
 	ret = ublk_json_read_params(&p, cdev);
 	if (ret) {
 		ublk_err( "%s: read ublk params failed %d\n",
@@ -97,9 +374,28 @@ static int loop_setup_tgt(struct ublksrv_dev *dev, int type)
 	}
 
 	tgt_data->block_device = S_ISBLK(sb.st_mode);
-
-	if (direct_io)
+	tgt_data->bounce_align = direct_io ? bounce_align : 0;
+	for (int i = 0; i < LO_BOUNCE_LOCKS; i++)
+		pthread_mutex_init(&tgt_data->bounce_locks[i], NULL);
+
+	if (direct_io || page_cache > LO_PAGE_CACHE_UNCACHED)
+		page_cache = LO_PAGE_CACHE_KEEP;
+	if (page_cache == LO_PAGE_CACHE_UNCACHED && !loop_support_dontcache(fd)) {
+		ublk_log("%s: uncached buffered io isn't supported, use hint\n",
+				__func__);
+		page_cache = LO_PAGE_CACHE_HINT;
+	}
+	tgt_data->page_cache = page_cache;
+	tgt_data->rw_flags = page_cache == LO_PAGE_CACHE_UNCACHED ?
+		RWF_DONTCACHE : 0;
+
+	if (nvme_nsid) {
+		tgt_data->nvme_nsid = nvme_nsid;
+		tgt_data->lba_shift = p.basic.logical_bs_shift;
+		tgt->ring_flags = IORING_SETUP_SQE128 | IORING_SETUP_CQE32;
+	} else if (direct_io) {
 		fcntl(fd, F_SETFL, O_DIRECT);
+	}
 
 	ublksrv_tgt_set_io_data_size(tgt);
 	tgt->dev_size = p.basic.dev_sectors << 9;
@@ -113,6 +409,9 @@ static int loop_setup_tgt(struct ublksrv_dev *dev, int type)
 	if (tgt_data->zero_copy || tgt_data->user_copy)
 		tgt->tgt_ring_depth *= 2;
 
+	if (info->flags & UBLK_F_INTEGRITY)
+		return loop_setup_pi(dev, &p);
+
 	return 0;
 }
 
@@ -134,12 +433,22 @@ static int loop_init_tgt(struct ublksrv_dev *dev, int type, int argc, char
 		{ "file",		1,	NULL, 'f' },
 		{ "buffered_io",	no_argument, &buffered_io, 1},
 		{ "offset",		required_argument, NULL, 'o'},
+		{ "pi_file",		required_argument, NULL, 0},
+		{ "pi_csum",		required_argument, NULL, 0},
+		{ "logical_bs",		required_argument, NULL, 0},
+		{ "page_cache",		required_argument, NULL, 0},
 		{ NULL }
 	};
 	unsigned long long bytes;
 	struct stat st;
-	int fd, opt;
-	char *file = NULL;
+	int fd, opt, option_index;
+	char *file = NULL, *pi_file = NULL;
+	unsigned pi_csum = LBMD_PI_CSUM_CRC16_T10DIF;
+	unsigned dio_align = 0, bounce_align = 0, lbs = 0;
+	int page_cache = LO_PAGE_CACHE_UNCACHED;
+	/* data is invisible to server in case of zero copy */
+	bool can_bounce = !(info->flags & (UBLK_F_SUPPORT_ZERO_COPY |
+				UBLK_F_AUTO_BUF_REG | UBLK_F_INTEGRITY));
 	struct ublksrv_tgt_base_json tgt_json = { 0 };
 	struct ublk_params p = {
 		.types = UBLK_PARAM_TYPE_BASIC | UBLK_PARAM_TYPE_DISCARD |
@@ -163,6 +472,7 @@ static int loop_init_tgt(struct ublksrv_dev *dev, int type, int argc, char
 	};
 	bool can_discard = false;
 	unsigned long offset = 0;
+	__u32 nvme_nsid = 0;
 
 	if (ublksrv_is_recovering(cdev))
 		return loop_recover_tgt(dev, 0);
@@ -170,7 +480,7 @@ static int loop_init_tgt(struct ublksrv_dev *dev, int type, int argc, char
 	strcpy(tgt_json.name, "loop");
 
 	while ((opt = getopt_long(argc, argv, "-:f:o:",
-				  lo_longopts, NULL)) != -1) {
+				  lo_longopts, &option_index)) != -1) {
 		switch (opt) {
 		case 'f':
 			file = strdup(optarg);
@@ -178,12 +488,36 @@ static int loop_init_tgt(struct ublksrv_dev *dev, int type, int argc, char
 		case 'o':
 			offset = strtoul(optarg, NULL, 10);
 			break;
+		case 0:
+			if (!strcmp(lo_longopts[option_index].name, "pi_file"))
+				pi_file = strdup(optarg);
+			if (!strcmp(lo_longopts[option_index].name, "pi_csum"))
+				pi_csum = !strcmp(optarg, "crc64") ?
+					LBMD_PI_CSUM_CRC64_NVME :
+					LBMD_PI_CSUM_CRC16_T10DIF;
+			if (!strcmp(lo_longopts[option_index].name, "logical_bs"))
+				lbs = strtoul(optarg, NULL, 10);
+			if (!strcmp(lo_longopts[option_index].name, "page_cache")) {
+				page_cache = loop_parse_page_cache(optarg);
+				if (page_cache < 0) {
+					ublk_err( "%s: invalid page_cache %s\n",
+							__func__, optarg);
+					return -EINVAL;
+				}
+			}
+			break;
 		}
 	}
 
 	if (!file)
 		return -1;
 
+	if ((info->flags & UBLK_F_INTEGRITY) && !pi_file) {
+		ublk_err( "%s: --pi_file is required for integrity\n",
+				__func__);
+		return -EINVAL;
+	}
+
 	fd = open(file, O_RDWR);
 	if (fd < 0) {
 		ublk_err( "%s: backing file %s can't be opened\n",
@@ -206,24 +540,65 @@ static int loop_init_tgt(struct ublksrv_dev *dev, int type, int argc, char
 		p.basic.logical_bs_shift = ilog2(bs);
 		p.basic.physical_bs_shift = ilog2(pbs);
 		can_discard = backing_supports_discard(file);
+		dio_align = bs;
 	} else if (S_ISREG(st.st_mode)) {
 		bytes = st.st_size;
 		can_discard = true;
 		p.basic.logical_bs_shift = ilog2(st.st_blksize);
 		p.basic.physical_bs_shift = ilog2(st.st_blksize);
+		dio_align = loop_file_dio_align(file, st.st_blksize);
+	} else if (S_ISCHR(st.st_mode)) {
+		int ret = loop_nvme_init_params(fd, &p, &nvme_nsid, &bytes);
+
+		if (ret)
+			return ret;
+		if ((info->flags & UBLK_F_INTEGRITY) ||
+				((offset << 9) & ((1U << p.basic.logical_bs_shift) - 1))) {
+			ublk_err( "%s: integrity or unaligned offset isn't "
+					"supported on NVMe char device\n", __func__);
+			return -EINVAL;
+		}
+		/* NVMe command can't be buffered */
+		buffered_io = 0;
 	} else {
 		bytes = 0;
 	}
 
+	/*
+	 * Logical block size smaller than backing's O_DIRECT alignment is
+	 * covered by bouncing unaligned io, so O_DIRECT is kept
+	 */
+	if (!nvme_nsid && lbs >= 512 && lbs <= 4096 && !(lbs & (lbs - 1)))
+		p.basic.logical_bs_shift = ilog2(lbs);
+	else if (lbs)
+		ublk_err( "%s: ignore invalid logical block size %u\n",
+				__func__, lbs);
+	if (p.basic.logical_bs_shift > 12)
+		p.basic.logical_bs_shift = 12;
+	if (p.basic.physical_bs_shift < p.basic.logical_bs_shift)
+		p.basic.physical_bs_shift = p.basic.logical_bs_shift;
+	if (dio_align > (1U << p.basic.logical_bs_shift) && !can_bounce) {
+		if (dio_align > 4096)
+			buffered_io = 1;
+		else
+			p.basic.logical_bs_shift = ilog2(dio_align);
+	}
+
 	/*
 	 * in case of buffered io, use common bs/pbs so that all FS
 	 * image can be supported
 	 */
-	if (buffered_io || !ublk_param_is_valid(&p) ||
+	if (nvme_nsid) {
+		/* block size and limits come from the namespace */
+	} else if (buffered_io || !ublk_param_is_valid(&p) ||
 			fcntl(fd, F_SETFL, O_DIRECT)) {
 		p.basic.logical_bs_shift = 9;
 		p.basic.physical_bs_shift = 12;
 		buffered_io = 1;
+	} else if (dio_align > (1U << p.basic.logical_bs_shift)) {
+		bounce_align = dio_align;
+		p.basic.io_min_shift = ilog2(dio_align);
+		p.basic.io_opt_shift = ilog2(dio_align);
 	}
 
 	if (bytes > 0) {
@@ -240,16 +615,48 @@ static int loop_init_tgt(struct ublksrv_dev *dev, int type, int argc, char
 	tgt_json.dev_size = bytes;
 	p.basic.dev_sectors = bytes >> 9;
 
-	if (st.st_blksize && can_discard)
+	if (nvme_nsid) {
+		/* discard limits come from the namespace */
+	} else if (st.st_blksize && can_discard)
 		p.discard.discard_granularity = st.st_blksize;
 	else
 		p.types &= ~UBLK_PARAM_TYPE_DISCARD;
 
+	if (info->flags & UBLK_F_INTEGRITY) {
+		int ret;
+
+		p.types |= UBLK_PARAM_TYPE_INTEGRITY;
+		p.integrity.flags = LBMD_PI_CAP_INTEGRITY | LBMD_PI_CAP_REFTAG;
+		p.integrity.interval_exp = p.basic.logical_bs_shift;
+		p.integrity.metadata_size = ublksrv_pi_tuple_size(pi_csum);
+		p.integrity.csum_type = pi_csum;
+
+		/* PI of discarded range is reset from the io's integrity buffer */
+		p.discard.max_discard_sectors = std::min(
+				p.discard.max_discard_sectors,
+				info->max_io_buf_bytes >> 9);
+		p.discard.max_write_zeroes_sectors = std::min(
+				p.discard.max_write_zeroes_sectors,
+				info->max_io_buf_bytes >> 9);
+
+		ret = loop_prep_pi_file(pi_file, (bytes >>
+					p.integrity.interval_exp) *
+				p.integrity.metadata_size);
+		if (ret)
+			return ret;
+	}
+
 	ublk_json_write_dev_info(cdev);
 	ublk_json_write_target_base(cdev, &tgt_json);
 	ublk_json_write_tgt_str(cdev, "backing_file", file);
 	ublk_json_write_tgt_long(cdev, "direct_io", !buffered_io);
 	ublk_json_write_tgt_ulong(cdev, "offset", offset);
+	ublk_json_write_tgt_ulong(cdev, "dio_align", bounce_align);
+	ublk_json_write_tgt_ulong(cdev, "nvme_nsid", nvme_nsid);
+	ublk_json_write_tgt_ulong(cdev, "page_cache", buffered_io ? page_cache :
+			LO_PAGE_CACHE_KEEP);
+	if (pi_file)
+		ublk_json_write_tgt_str(cdev, "pi_file", pi_file);
 	ublk_json_write_params(cdev, &p);
 
 	close(fd);
@@ -287,6 +694,15 @@ static inline void lo_rw_handle_fua(struct io_uring_sqe *sqe,
 		sqe->rw_flags |= RWF_DSYNC;
 }
 
+/* flags of io on backing file */
+static inline void lo_rw_handle_flags(struct io_uring_sqe *sqe,
+		const struct ublksrv_io_desc *iod,
+		const struct loop_tgt_data *tgt_data)
+{
+	sqe->rw_flags |= tgt_data->rw_flags;
+	lo_rw_handle_fua(sqe, iod);
+}
+
 static int lo_rw_user_copy(const struct ublksrv_queue *q,
 		const struct ublksrv_io_desc *iod, int tag,
 		const struct loop_tgt_data *tgt_data)
@@ -304,6 +720,7 @@ static int lo_rw_user_copy(const struct ublksrv_queue *q,
 				iod->nr_sectors << 9,
 				(iod->start_sector + tgt_data->offset) << 9);
 		io_uring_sqe_set_flags(sqe[0], IOSQE_FIXED_FILE | IOSQE_IO_LINK);
+		lo_rw_handle_flags(sqe[0], iod, tgt_data);
 		sqe[0]->user_data = build_user_data(tag, ublk_op, 0, 1);
 
 		/* copy io buffer to ublkc device */
@@ -324,7 +741,7 @@ static int lo_rw_user_copy(const struct ublksrv_queue *q,
 			buf, iod->nr_sectors << 9,
 			(iod->start_sector + tgt_data->offset) << 9);
 		io_uring_sqe_set_flags(sqe[1], IOSQE_FIXED_FILE);
-		lo_rw_handle_fua(sqe[1], iod);
+		lo_rw_handle_flags(sqe[1], iod, tgt_data);
 		/* bit63 marks us as tgt io */
 		sqe[1]->user_data = build_user_data(tag, ublk_op, 0, 1);
 	}
@@ -350,7 +767,7 @@ static int lo_rw(const struct ublksrv_queue *q,
 		sqe[0]->buf_index = tag;
 
 	io_uring_sqe_set_flags(sqe[0], IOSQE_FIXED_FILE);
-	lo_rw_handle_fua(sqe[0], iod);
+	lo_rw_handle_flags(sqe[0], iod, tgt_data);
 
 	sqe[0]->user_data = build_user_data(tag, ublksrv_get_op(iod), 0, 1);
 	return 1;
@@ -381,6 +798,7 @@ static int lo_rw_zero_copy(const struct ublksrv_queue *q,
 			(iod->start_sector + tgt_data->offset) << 9);
 	sqe[1]->buf_index = tag;
 	sqe[1]->flags |= IOSQE_FIXED_FILE | IOSQE_IO_LINK;
+	lo_rw_handle_flags(sqe[1], iod, tgt_data);
 	sqe[1]->user_data = build_user_data(tag, ublk_op, 0, 1);
 
 	io_uring_prep_buf_unregister(sqe[2], 0, tag, q->q_id, tag);
@@ -394,10 +812,194 @@ static int lo_rw_zero_copy(const struct ublksrv_queue *q,
 	return 2;
 }
 
+/*
+ * NVMe command on the generic char device, data buffer is either user
+ * address, or offset in the fixed buffer of 'tag' if 'fixed' is true
+ */
+static void lo_nvme_prep_cmd(struct io_uring_sqe *sqe,
+		const struct ublksrv_io_desc *iod, int tag,
+		const struct loop_tgt_data *tgt_data, __u8 opcode,
+		__u64 addr, __u32 len, bool fixed)
+{
+	struct nvme_uring_cmd *cmd = (struct nvme_uring_cmd *)sqe->cmd;
+	__u64 slba = ((iod->start_sector + tgt_data->offset) << 9) >>
+		tgt_data->lba_shift;
+	__u32 nlb = (iod->nr_sectors << 9) >> tgt_data->lba_shift;
+
+	io_uring_prep_rw(IORING_OP_URING_CMD, sqe, 1 /*fds[1]*/, NULL, 0, 0);
+	__set_sqe_cmd_op(sqe, NVME_URING_CMD_IO);
+	io_uring_sqe_set_flags(sqe, IOSQE_FIXED_FILE);
+	if (fixed) {
+		sqe->uring_cmd_flags = IORING_URING_CMD_FIXED;
+		sqe->buf_index = tag;
+	}
+
+	memset(cmd, 0, sizeof(*cmd));
+	cmd->opcode = opcode;
+	cmd->nsid = tgt_data->nvme_nsid;
+	cmd->addr = addr;
+	cmd->data_len = len;
+	if (opcode != NVME_CMD_FLUSH && opcode != NVME_CMD_DSM) {
+		cmd->cdw10 = slba;
+		cmd->cdw11 = slba >> 32;
+		cmd->cdw12 = nlb - 1;
+	}
+	if (opcode == NVME_CMD_WRITE && (iod->op_flags & UBLK_IO_F_FUA))
+		cmd->cdw12 |= NVME_RW_FUA << 16;
+	if (opcode == NVME_CMD_WRITE_ZEROES &&
+			!(ublksrv_get_flags(iod) & UBLK_IO_F_NOUNMAP))
+		cmd->cdw12 |= NVME_WZ_DEAC << 16;
+
+	sqe->user_data = build_user_data(tag, ublksrv_get_op(iod), 0, 1);
+}
+
+static inline __u8 lo_nvme_rw_op(const struct ublksrv_io_desc *iod)
+{
+	return ublksrv_get_op(iod) == UBLK_IO_OP_READ ? NVME_CMD_READ :
+		NVME_CMD_WRITE;
+}
+
+/* uring_cmd returns NVMe status, convert it to ublk io result */
+static inline int lo_nvme_io_res(const struct ublksrv_io_desc *iod, int res)
+{
+	unsigned ublk_op = ublksrv_get_op(iod);
+
+	if (res > 0) {
+		ublk_dbg(UBLK_DBG_IO, "%s: op %u nvme status %x\n", __func__,
+				ublk_op, res);
+		return -EIO;
+	}
+	if (!res && (ublk_op == UBLK_IO_OP_READ || ublk_op == UBLK_IO_OP_WRITE))
+		return iod->nr_sectors << 9;
+	return res;
+}
+
+static int lo_nvme_rw(const struct ublksrv_queue *q,
+		const struct ublksrv_io_desc *iod, int tag,
+		const struct loop_tgt_data *tgt_data)
+{
+	const struct loop_queue_data *qd = (struct loop_queue_data *)q->private_data;
+	struct io_uring_sqe *sqe[1];
+
+	ublk_queue_alloc_sqes(q, sqe, 1);
+	lo_nvme_prep_cmd(sqe[0], iod, tag, tgt_data, lo_nvme_rw_op(iod),
+			tgt_data->auto_zc ? 0 : iod->addr,
+			iod->nr_sectors << 9,
+			tgt_data->auto_zc || qd->nvme_fixed);
+	return 1;
+}
+
+static int lo_nvme_rw_user_copy(const struct ublksrv_queue *q,
+		const struct ublksrv_io_desc *iod, int tag,
+		const struct loop_tgt_data *tgt_data)
+{
+	const struct loop_queue_data *qd = (struct loop_queue_data *)q->private_data;
+	unsigned ublk_op = ublksrv_get_op(iod);
+	unsigned len = iod->nr_sectors << 9;
+	__u64 pos = ublk_pos(q->q_id, tag, 0);
+	void *buf = ublksrv_queue_get_io_buf(q, tag);
+	struct io_uring_sqe *sqe[2];
+
+	ublk_queue_alloc_sqes(q, sqe, 2);
+	if (ublk_op == UBLK_IO_OP_READ) {
+		lo_nvme_prep_cmd(sqe[0], iod, tag, tgt_data, NVME_CMD_READ,
+				(__u64)buf, len, qd->nvme_fixed);
+		sqe[0]->flags |= IOSQE_IO_LINK;
+
+		io_uring_prep_write(sqe[1], 0 /*fds[0]*/, buf, len, pos);
+		io_uring_sqe_set_flags(sqe[1], IOSQE_FIXED_FILE);
+		sqe[1]->user_data = build_user_data(tag, UBLK_USER_COPY_WRITE, 0, 1);
+	} else {
+		io_uring_prep_read(sqe[0], 0 /*fds[0]*/, buf, len, pos);
+		io_uring_sqe_set_flags(sqe[0], IOSQE_FIXED_FILE | IOSQE_IO_LINK);
+		sqe[0]->user_data = build_user_data(tag, UBLK_USER_COPY_READ, 0, 1);
+
+		lo_nvme_prep_cmd(sqe[1], iod, tag, tgt_data, NVME_CMD_WRITE,
+				(__u64)buf, len, qd->nvme_fixed);
+	}
+	return 2;
+}
+
+static int lo_nvme_rw_zero_copy(const struct ublksrv_queue *q,
+		const struct ublksrv_io_desc *iod, int tag,
+		const struct loop_tgt_data *tgt_data)
+{
+	struct io_uring_sqe *sqe[3];
+
+	ublk_queue_alloc_sqes(q, sqe, 3);
+
+	io_uring_prep_buf_register(sqe[0], 0, tag, q->q_id, tag);
+	sqe[0]->user_data = build_user_data(tag,
+			ublk_cmd_op_nr(UBLK_U_IO_REGISTER_IO_BUF),
+			0,
+			1);
+	sqe[0]->flags |= IOSQE_CQE_SKIP_SUCCESS | IOSQE_FIXED_FILE | IOSQE_IO_LINK;
+
+	lo_nvme_prep_cmd(sqe[1], iod, tag, tgt_data, lo_nvme_rw_op(iod),
+			0, iod->nr_sectors << 9, true);
+	sqe[1]->flags |= IOSQE_IO_LINK;
+
+	io_uring_prep_buf_unregister(sqe[2], 0, tag, q->q_id, tag);
+	sqe[2]->flags |= IOSQE_FIXED_FILE;
+	sqe[2]->user_data = build_user_data(tag,
+			ublk_cmd_op_nr(UBLK_U_IO_UNREGISTER_IO_BUF),
+			0,
+			1);
+
+	// buf register is marked as IOSQE_CQE_SKIP_SUCCESS
+	return 2;
+}
+
+/* FLUSH, DISCARD and WRITE_ZEROES on NVMe char device */
+static int lo_nvme_handle_cmd(const struct ublksrv_queue *q,
+		const struct ublksrv_io_desc *iod, int tag,
+		const struct loop_tgt_data *tgt_data)
+{
+	struct loop_queue_data *qd = (struct loop_queue_data *)q->private_data;
+	struct io_uring_sqe *sqe[1];
+	struct nvme_dsm_range *range;
+
+	ublk_queue_alloc_sqes(q, sqe, 1);
+	switch (ublksrv_get_op(iod)) {
+	case UBLK_IO_OP_FLUSH:
+		lo_nvme_prep_cmd(sqe[0], iod, tag, tgt_data, NVME_CMD_FLUSH,
+				0, 0, false);
+		break;
+	case UBLK_IO_OP_WRITE_ZEROES:
+		lo_nvme_prep_cmd(sqe[0], iod, tag, tgt_data,
+				NVME_CMD_WRITE_ZEROES, 0, 0, false);
+		break;
+	case UBLK_IO_OP_DISCARD:
+		range = &qd->dsm[tag];
+		range->cattr = 0;
+		range->nlb = htole32((iod->nr_sectors << 9) >> tgt_data->lba_shift);
+		range->slba = htole64(((iod->start_sector + tgt_data->offset)
+					<< 9) >> tgt_data->lba_shift);
+		lo_nvme_prep_cmd(sqe[0], iod, tag, tgt_data, NVME_CMD_DSM,
+				(__u64)range, sizeof(*range), false);
+		/* one range, deallocate */
+		((struct nvme_uring_cmd *)sqe[0]->cmd)->cdw11 = NVME_DSMGMT_AD;
+		break;
+	default:
+		return -EINVAL;
+	}
+	return 1;
+}
+
 static int loop_queue_tgt_rw(const struct ublksrv_queue *q,
 		const struct ublksrv_io_desc *iod, int tag,
 		const struct loop_tgt_data *data)
 {
+	if (data->nvme_nsid) {
+		if (data->auto_zc)
+			return lo_nvme_rw(q, iod, tag, data);
+		if (data->zero_copy)
+			return lo_nvme_rw_zero_copy(q, iod, tag, data);
+		if (data->user_copy)
+			return lo_nvme_rw_user_copy(q, iod, tag, data);
+		return lo_nvme_rw(q, iod, tag, data);
+	}
+
 	/* auto_zc has top priority */
 	if (data->auto_zc)
 		return lo_rw(q, iod, tag, data);
@@ -443,6 +1045,123 @@ static int loop_handle_discard(const struct ublksrv_queue *q,
 	return 1;
 }
 
+static inline __u64 lo_pi_meta_off(const struct ublksrv_io_desc *iod,
+		const struct loop_tgt_data *tgt_data)
+{
+	return (iod->start_sector >> (tgt_data->pi.interval_exp - 9)) *
+		tgt_data->pi.metadata_size;
+}
+
+/*
+ * Fill integrity buffer with escape tuples for DISCARD and WRITE_ZEROES,
+ * so stale PI of the range isn't checked by later READ
+ */
+static unsigned lo_pi_escape(const struct ublksrv_queue *q,
+		const struct ublksrv_io_desc *iod, int tag,
+		const struct loop_tgt_data *tgt_data)
+{
+	unsigned meta_len = ublksrv_pi_meta_len(&tgt_data->pi,
+			iod->nr_sectors << 9);
+
+	memset(ublksrv_queue_get_integrity_buf(q, tag), 0xff, meta_len);
+	return meta_len;
+}
+
+static int lo_pi_reset(const struct ublksrv_queue *q,
+		const struct ublksrv_io_desc *iod, int tag,
+		const struct loop_tgt_data *tgt_data)
+{
+	unsigned meta_len = lo_pi_escape(q, iod, tag, tgt_data);
+	struct io_uring_sqe *sqe[1];
+
+	ublk_queue_alloc_sqes(q, sqe, 1);
+	io_uring_prep_write(sqe[0], 2 /*fds[2]*/,
+			ublksrv_queue_get_integrity_buf(q, tag), meta_len,
+			lo_pi_meta_off(iod, tgt_data));
+	io_uring_sqe_set_flags(sqe[0], IOSQE_FIXED_FILE);
+	sqe[0]->user_data = build_user_data(tag, LO_PI_META_OP, 0, 1);
+	return 1;
+}
+
+static int lo_queue_fadvise(const struct ublksrv_queue *q, int tag,
+		__u64 start, __u64 end, int advice)
+{
+	struct io_uring_sqe *sqe[1];
+
+	if (start >= end || !ublk_queue_alloc_sqes(q, sqe, 1))
+		return 0;
+
+	io_uring_prep_fadvise(sqe[0], 1 /*fds[1]*/, start, end - start, advice);
+	io_uring_sqe_set_flags(sqe[0], IOSQE_FIXED_FILE);
+	sqe[0]->user_data = build_user_data(tag, LO_FADVISE_OP, 0, 1);
+	return 1;
+}
+
+/*
+ * Page cache of backing file mostly duplicates the cache of the fs over
+ * the ublk disk, so keep it small in buffered mode:
+ *
+ * - sequential read stream gets readahead of LO_RA_BYTES ahead of it
+ *
+ * - page cache behind any stream is dropped once the stream is LO_RA_BYTES
+ *   ahead, or when the stream is evicted by new streams, so random io is
+ *   dropped after LO_NR_STREAMS other streams show up
+ *
+ * Return how many fadvise are queued, their cqe is waited as io's cqe
+ */
+static int lo_queue_cache_hints(const struct ublksrv_queue *q,
+		const struct ublksrv_io_desc *iod, int tag,
+		const struct loop_tgt_data *tgt_data)
+{
+	struct loop_queue_data *qd = (struct loop_queue_data *)q->private_data;
+	unsigned ublk_op = ublksrv_get_op(iod);
+	__u64 pos = (iod->start_sector + tgt_data->offset) << 9;
+	__u64 end = pos + (iod->nr_sectors << 9);
+	struct lo_stream *s = NULL;
+	int i, nr = 0;
+
+	for (i = 0; i < LO_NR_STREAMS; i++) {
+		struct lo_stream *t = &qd->streams[i];
+
+		if (t->op == ublk_op && t->next == pos && t->stamp) {
+			s = t;
+			break;
+		}
+		if (!s || t->stamp < s->stamp)
+			s = t;
+	}
+
+	if (i == LO_NR_STREAMS) {
+		if (s->stamp)
+			nr += lo_queue_fadvise(q, tag, s->drop_end,
+					std::max(s->next, s->ra_end),
+					POSIX_FADV_DONTNEED);
+		s->op = ublk_op;
+		s->seq = 0;
+		s->drop_end = pos;
+		s->ra_end = end;
+	} else {
+		s->seq++;
+	}
+	s->next = end;
+	s->stamp = ++qd->stamp;
+
+	if (s->seq < LO_SEQ_IOS)
+		return nr;
+
+	if (ublk_op == UBLK_IO_OP_READ && s->ra_end < end + LO_RA_BYTES / 2) {
+		nr += lo_queue_fadvise(q, tag, std::max(s->ra_end, end),
+				end + LO_RA_BYTES, POSIX_FADV_WILLNEED);
+		s->ra_end = end + LO_RA_BYTES;
+	}
+	if (pos >= s->drop_end + LO_RA_BYTES) {
+		nr += lo_queue_fadvise(q, tag, s->drop_end,
+				pos - LO_RA_BYTES / 2, POSIX_FADV_DONTNEED);
+		s->drop_end = pos - LO_RA_BYTES / 2;
+	}
+	return nr;
+}
+
 static int loop_queue_tgt_io(const struct ublksrv_queue *q,
 		const struct ublk_io_data *data, int tag)
 {
@@ -451,6 +1170,10 @@ static int loop_queue_tgt_io(const struct ublksrv_queue *q,
 	const struct loop_tgt_data *tgt_data = (struct loop_tgt_data*) q->dev->tgt.tgt_data;
 	int ret;
 
+	if (tgt_data->nvme_nsid && ublk_op != UBLK_IO_OP_READ &&
+			ublk_op != UBLK_IO_OP_WRITE)
+		return lo_nvme_handle_cmd(q, iod, tag, tgt_data);
+
 	switch (ublk_op) {
 	case UBLK_IO_OP_FLUSH:
 		ret = loop_handle_flush(q, iod, tag);
@@ -458,10 +1181,14 @@ static int loop_queue_tgt_io(const struct ublksrv_queue *q,
 	case UBLK_IO_OP_WRITE_ZEROES:
 	case UBLK_IO_OP_DISCARD:
 		ret = loop_handle_discard(q, iod, tag, tgt_data);
+		if (ret > 0 && tgt_data->integrity)
+			ret += lo_pi_reset(q, iod, tag, tgt_data);
 		break;
 	case UBLK_IO_OP_READ:
 	case UBLK_IO_OP_WRITE:
 		ret = loop_queue_tgt_rw(q, iod, tag, tgt_data);
+		if (ret > 0 && tgt_data->page_cache != LO_PAGE_CACHE_KEEP)
+			ret += lo_queue_cache_hints(q, iod, tag, tgt_data);
 		break;
 	default:
 		ret = -EINVAL;
@@ -477,6 +1204,7 @@ static co_io_job __loop_handle_io_async(const struct ublksrv_queue *q,
 		const struct ublk_io_data *data, int tag)
 {
 	struct ublk_io_tgt *io = __ublk_get_io_tgt_data(data);
+	const struct loop_tgt_data *tgt_data = (struct loop_tgt_data*) q->dev->tgt.tgt_data;
 	int ret;
 
  again:
@@ -488,12 +1216,18 @@ static co_io_job __loop_handle_io_async(const struct ublksrv_queue *q,
 
 			co_await__suspend_always(tag);
 			res = ublksrv_tgt_process_cqe(io, &io_res);
+			/* page cache hint is best effort, don't fail io on it */
+			if (user_data_to_op(io->tgt_io_cqe->user_data) ==
+					LO_FADVISE_OP)
+				continue;
 			if (res < 0 && io_res >= 0)
 				io_res = res;
 		}
 		if (io_res == -EAGAIN)
 			goto again;
-		ublksrv_complete_io(q, tag, io_res);
+		if (tgt_data->nvme_nsid)
+			io_res = lo_nvme_io_res(data->iod, io_res);
+		ublksrv_tgt_complete_io(q, tag, io_res);
 	} else if (ret < 0) {
 		ublk_err( "fail to queue io %d, ret %d\n", tag, tag);
 	} else {
@@ -501,11 +1235,211 @@ static co_io_job __loop_handle_io_async(const struct ublksrv_queue *q,
 	}
 }
 
+/*
+ * Integrity io is handled in two stages:
+ *
+ * - load data and integrity data into io buffers: from /dev/ublkcN for
+ *   WRITE, and from backing file and pi file for READ
+ *
+ * - store them: to backing file and pi file for WRITE, and to /dev/ublkcN
+ *   for READ
+ *
+ * PI is verified between the two stages, so corruption is caught in both
+ * directions. If the request doesn't carry integrity data, PI is generated
+ * for WRITE, and only verified for READ.
+ */
+static int lo_pi_rw(const struct ublksrv_queue *q,
+		const struct ublksrv_io_desc *iod, int tag,
+		const struct loop_tgt_data *tgt_data, bool load)
+{
+	unsigned ublk_op = ublksrv_get_op(iod);
+	/* WRITE loads from /dev/ublkcN, and READ stores to it */
+	bool backing = (ublk_op == UBLK_IO_OP_WRITE) != load;
+	unsigned len = iod->nr_sectors << 9;
+	unsigned meta_len = ublksrv_pi_meta_len(&tgt_data->pi, len);
+	__u64 meta_off = lo_pi_meta_off(iod, tgt_data);
+	void *buf = ublksrv_queue_get_io_buf(q, tag);
+	void *meta = ublksrv_queue_get_integrity_buf(q, tag);
+	struct io_uring_sqe *sqe[2];
+	int nr = 1;
+
+	if (!backing) {
+		unsigned op = load ? UBLK_USER_COPY_READ : UBLK_USER_COPY_WRITE;
+
+		/* meta isn't copied if the request doesn't carry it */
+		if (iod->op_flags & UBLK_IO_F_INTEGRITY)
+			nr = 2;
+		ublk_queue_alloc_sqes(q, sqe, nr);
+		io_uring_prep_rw(load ? IORING_OP_READ : IORING_OP_WRITE,
+				sqe[0], 0 /*fds[0]*/, buf, len,
+				ublk_pos(q->q_id, tag, 0));
+		io_uring_sqe_set_flags(sqe[0], IOSQE_FIXED_FILE);
+		sqe[0]->user_data = build_user_data(tag, op, 0, 1);
+		if (nr == 2) {
+			io_uring_prep_rw(load ? IORING_OP_READ : IORING_OP_WRITE,
+					sqe[1], 0 /*fds[0]*/, meta, meta_len,
+					ublk_integrity_pos(q->q_id, tag, 0));
+			io_uring_sqe_set_flags(sqe[1], IOSQE_FIXED_FILE);
+			sqe[1]->user_data = build_user_data(tag, op, 0, 1);
+		}
+		return nr;
+	}
+
+	ublk_queue_alloc_sqes(q, sqe, 2);
+	io_uring_prep_rw(load ? IORING_OP_READ : IORING_OP_WRITE,
+			sqe[0], 1 /*fds[1]*/, buf, len,
+			(iod->start_sector + tgt_data->offset) << 9);
+	io_uring_sqe_set_flags(sqe[0], IOSQE_FIXED_FILE);
+	lo_rw_handle_flags(sqe[0], iod, tgt_data);
+	sqe[0]->user_data = build_user_data(tag, ublk_op, 0, 1);
+
+	io_uring_prep_rw(load ? IORING_OP_READ : IORING_OP_WRITE,
+			sqe[1], 2 /*fds[2]*/, meta, meta_len, meta_off);
+	io_uring_sqe_set_flags(sqe[1], IOSQE_FIXED_FILE);
+	lo_rw_handle_fua(sqe[1], iod);
+	sqe[1]->user_data = build_user_data(tag, LO_PI_META_OP, 0, 1);
+	return 2;
+}
+
+static int lo_pi_check(const struct ublksrv_queue *q,
+		const struct ublksrv_io_desc *iod, int tag,
+		const struct loop_tgt_data *tgt_data)
+{
+	unsigned len = iod->nr_sectors << 9;
+	__u64 seed = iod->start_sector >> (tgt_data->pi.interval_exp - 9);
+	void *buf = ublksrv_queue_get_io_buf(q, tag);
+	void *meta = ublksrv_queue_get_integrity_buf(q, tag);
+
+	if (ublksrv_get_op(iod) == UBLK_IO_OP_WRITE &&
+			!(iod->op_flags & UBLK_IO_F_INTEGRITY)) {
+		ublksrv_pi_generate(&tgt_data->pi, buf, meta, len, seed);
+		return 0;
+	}
+	return ublksrv_pi_verify(&tgt_data->pi, buf, meta, len, seed);
+}
+
+static co_io_job __loop_handle_pi_io_async(const struct ublksrv_queue *q,
+		const struct ublk_io_data *data, int tag)
+{
+	struct ublk_io_tgt *io = __ublk_get_io_tgt_data(data);
+	const struct loop_tgt_data *tgt_data = (struct loop_tgt_data*) q->dev->tgt.tgt_data;
+	int io_res = 0;
+
+	for (int stage = 0; stage < 2 && io_res >= 0; stage++) {
+		int ret = lo_pi_rw(q, data->iod, tag, tgt_data, stage == 0);
+
+		while (ret-- > 0) {
+			int res;
+
+			co_await__suspend_always(tag);
+			res = ublksrv_tgt_process_cqe(io, &io_res);
+			if (res < 0 && io_res >= 0)
+				io_res = res;
+		}
+
+		if (stage == 0 && io_res >= 0) {
+			int res = lo_pi_check(q, data->iod, tag, tgt_data);
+
+			if (res)
+				io_res = res;
+		}
+	}
+	ublksrv_tgt_complete_io(q, tag, io_res);
+}
+
+static inline bool lo_need_bounce(const struct ublksrv_io_desc *iod,
+		const struct loop_tgt_data *tgt_data)
+{
+	unsigned ublk_op = ublksrv_get_op(iod);
+	__u64 pos = (iod->start_sector + tgt_data->offset) << 9;
+
+	if (ublk_op != UBLK_IO_OP_READ && ublk_op != UBLK_IO_OP_WRITE)
+		return false;
+	return (pos | (iod->nr_sectors << 9)) & (tgt_data->bounce_align - 1);
+}
+
+/*
+ * Unaligned io is handled synchronously via the per-queue bounce buffer:
+ * READ reads the covering aligned range, and WRITE reads the partial head
+ * and tail blocks, merges the data and writes back the aligned range.
+ *
+ * Read-modify-write of one block is serialized by hashed block locks, which
+ * are held across pread/pwrite only, so nothing is waited on io_uring with
+ * lock held. Aligned writes don't take the lock: they overlap with the
+ * concurrent unaligned write, and the block layer doesn't order overlapping
+ * in-flight writes anyway.
+ */
+static int lo_rw_bounce(const struct ublksrv_queue *q,
+		const struct ublksrv_io_desc *iod, int tag,
+		struct loop_tgt_data *tgt_data)
+{
+	const unsigned align = tgt_data->bounce_align;
+	unsigned len = iod->nr_sectors << 9;
+	__u64 pos = (iod->start_sector + tgt_data->offset) << 9;
+	__u64 start = pos & ~((__u64)align - 1);
+	__u64 end = round_up(pos + len, (__u64)align);
+	char *bounce = (char *)((struct loop_queue_data *)q->private_data)->bounce;
+	char *buf = tgt_data->user_copy ? (char *)ublksrv_queue_get_io_buf(q, tag) :
+		(char *)iod->addr;
+	int fd = q->dev->tgt.fds[1];
+	pthread_mutex_t *locks[2];
+	int ret = len;
+
+	if (ublksrv_get_op(iod) == UBLK_IO_OP_READ) {
+		ssize_t bytes = pread(fd, bounce, end - start, start);
+
+		if (bytes < 0)
+			return -errno;
+		if ((__u64)bytes < end - start)
+			memset(bounce + bytes, 0, end - start - bytes);
+		memcpy(buf, bounce + (pos - start), len);
+		if (tgt_data->user_copy && pwrite(q->dev->tgt.fds[0], buf, len,
+					ublk_pos(q->q_id, tag, 0)) != (ssize_t)len)
+			return -EIO;
+		return len;
+	}
+
+	if (tgt_data->user_copy && pread(q->dev->tgt.fds[0], buf, len,
+				ublk_pos(q->q_id, tag, 0)) != (ssize_t)len)
+		return -EIO;
+
+	locks[0] = &tgt_data->bounce_locks[(start / align) % LO_BOUNCE_LOCKS];
+	locks[1] = &tgt_data->bounce_locks[(end / align - 1) % LO_BOUNCE_LOCKS];
+	if (locks[0] > locks[1])
+		std::swap(locks[0], locks[1]);
+	pthread_mutex_lock(locks[0]);
+	if (locks[1] != locks[0])
+		pthread_mutex_lock(locks[1]);
+
+	memset(bounce, 0, align);
+	memset(bounce + end - start - align, 0, align);
+	if ((pos != start && pread(fd, bounce, align, start) < 0) ||
+			(pos + len != end && pread(fd, bounce + end - start - align,
+						   align, end - align) < 0)) {
+		ret = -errno;
+	} else {
+		struct iovec iov = {
+			.iov_base = bounce,
+			.iov_len = end - start,
+		};
+		int flags = (iod->op_flags & UBLK_IO_F_FUA) ? RWF_DSYNC : 0;
+
+		memcpy(bounce + (pos - start), buf, len);
+		if (pwritev2(fd, &iov, 1, start, flags) != (ssize_t)(end - start))
+			ret = -EIO;
+	}
+
+	if (locks[1] != locks[0])
+		pthread_mutex_unlock(locks[1]);
+	pthread_mutex_unlock(locks[0]);
+	return ret;
+}
+
 static int loop_handle_io_async(const struct ublksrv_queue *q,
 		const struct ublk_io_data *data)
 {
 	struct ublk_io_tgt *io = __ublk_get_io_tgt_data(data);
-	const struct loop_tgt_data *tgt_data = (struct loop_tgt_data*) q->dev->tgt.tgt_data;
+	struct loop_tgt_data *tgt_data = (struct loop_tgt_data*) q->dev->tgt.tgt_data;
 
 	if (tgt_data->block_device && ublksrv_get_op(data->iod) == UBLK_IO_OP_DISCARD) {
 		__u64 r[2];
@@ -516,7 +1450,25 @@ static int loop_handle_io_async(const struct ublksrv_queue *q,
 		r[0] = (data->iod->start_sector + tgt_data->offset) << 9;
 		r[1] = data->iod->nr_sectors << 9;
 		res = ioctl(q->dev->tgt.fds[1], BLKDISCARD, &r);
-		ublksrv_complete_io(q, data->tag, res);
+		if (!res && tgt_data->integrity) {
+			unsigned len = lo_pi_escape(q, data->iod, data->tag,
+					tgt_data);
+
+			if (pwrite(q->dev->tgt.fds[2],
+					ublksrv_queue_get_integrity_buf(q, data->tag),
+					len, lo_pi_meta_off(data->iod, tgt_data)) !=
+					(ssize_t)len)
+				res = -EIO;
+		}
+		ublksrv_tgt_complete_io(q, data->tag, res);
+	} else if (tgt_data->bounce_align && lo_need_bounce(data->iod, tgt_data)) {
+		io_uring_submit(q->ring_ptr);
+		ublksrv_tgt_complete_io(q, data->tag,
+				lo_rw_bounce(q, data->iod, data->tag, tgt_data));
+	} else if (tgt_data->integrity &&
+			(ublksrv_get_op(data->iod) == UBLK_IO_OP_READ ||
+			 ublksrv_get_op(data->iod) == UBLK_IO_OP_WRITE)) {
+		io->co = __loop_handle_pi_io_async(q, data, data->tag);
 	} else {
 		io->co = __loop_handle_io_async(q, data, data->tag);
 	}
@@ -530,8 +1482,84 @@ static void loop_tgt_io_done(const struct ublksrv_queue *q,
 	ublksrv_tgt_io_done(q, data, cqe);
 }
 
+/* register io buffers, so NVMe command can use them as fixed buffer */
+static int loop_nvme_register_bufs(const struct ublksrv_queue *q)
+{
+	const struct ublksrv_ctrl_dev_info *info =
+		ublksrv_ctrl_get_dev_info(ublksrv_get_ctrl_dev(q->dev));
+	struct iovec *iov = (struct iovec *)calloc(q->q_depth, sizeof(*iov));
+	int i, ret;
+
+	if (!iov)
+		return -ENOMEM;
+	for (i = 0; i < q->q_depth; i++) {
+		iov[i].iov_base = ublksrv_queue_get_io_buf(q, i);
+		iov[i].iov_len = info->max_io_buf_bytes;
+	}
+	ret = io_uring_register_buffers(q->ring_ptr, iov, q->q_depth);
+	if (ret)
+		ublk_log("%s: queue %d register buffers failed %d, not use fixed buffer\n",
+				__func__, q->q_id, ret);
+	free(iov);
+	return ret;
+}
+
+static int loop_init_queue(const struct ublksrv_queue *q,
+		void **queue_data_ptr)
+{
+	const struct loop_tgt_data *tgt_data = (struct loop_tgt_data*)q->dev->tgt.tgt_data;
+	const struct ublksrv_ctrl_dev_info *info =
+		ublksrv_ctrl_get_dev_info(ublksrv_get_ctrl_dev(q->dev));
+	struct loop_queue_data *qd = (struct loop_queue_data *)
+		calloc(1, sizeof(*qd));
+
+	if (!qd)
+		return -ENOMEM;
+
+	/* one bounce buffer is enough since unaligned io is synchronous */
+	if (tgt_data->bounce_align && posix_memalign(&qd->bounce,
+				tgt_data->bounce_align > 4096 ?
+				tgt_data->bounce_align : 4096,
+				info->max_io_buf_bytes +
+				2 * tgt_data->bounce_align)) {
+		free(qd);
+		return -ENOMEM;
+	}
+
+	if (tgt_data->nvme_nsid) {
+		qd->dsm = (struct nvme_dsm_range *)calloc(q->q_depth,
+				sizeof(*qd->dsm));
+		if (!qd->dsm) {
+			free(qd);
+			return -ENOMEM;
+		}
+
+		/* zero copy and auto_zc use the buffer table already */
+		if (!tgt_data->zero_copy && !tgt_data->auto_zc)
+			qd->nvme_fixed = !loop_nvme_register_bufs(q);
+	}
+
+	*queue_data_ptr = qd;
+	return 0;
+}
+
+static void loop_deinit_queue(const struct ublksrv_queue *q)
+{
+	struct loop_queue_data *qd = (struct loop_queue_data *)q->private_data;
+
+	free(qd->dsm);
+	free(qd->bounce);
+	free(qd);
+}
+
 static void loop_deinit_tgt(const struct ublksrv_dev *dev)
 {
+	const struct loop_tgt_data *tgt_data = (struct loop_tgt_data*)dev->tgt.tgt_data;
+
+	if (tgt_data->integrity) {
+		fsync(dev->tgt.fds[2]);
+		close(dev->tgt.fds[2]);
+	}
 	fsync(dev->tgt.fds[1]);
 	close(dev->tgt.fds[1]);
 	free(dev->tgt.tgt_data);
@@ -540,8 +1568,15 @@ static void loop_deinit_tgt(const struct ublksrv_dev *dev)
 static void loop_cmd_usage()
 {
 	printf("\t-f backing_file [--buffered_io] [--offset NUM]\n");
-	printf("\t\tdefault is direct IO to backing file\n");
+	printf("\t\tdefault is direct IO to backing file, NVMe command is\n");
+	printf("\t\tsent via uring_cmd if it is NVMe char device(/dev/ngXnY)\n");
 	printf("\t\toffset skips first NUM sectors on backing file\n");
+	printf("\t[--logical_bs SIZE] [--pi_file FILE] [--pi_csum crc16|crc64]\n");
+	printf("\t\tlogical block size can be smaller than backing file's,\n");
+	printf("\t\tunaligned io is bounced with O_DIRECT kept\n");
+	printf("\t[--page_cache keep|hint|uncached]\n");
+	printf("\t\tpage cache use of --buffered_io, default is uncached\n");
+	printf("\t\tstore PI of --integrity device in FILE, default guard is crc16\n");
 }
 
 static const struct ublksrv_tgt_type  loop_tgt_type = {
@@ -551,9 +1586,14 @@ static const struct ublksrv_tgt_type  loop_tgt_type = {
 	.init_tgt = loop_init_tgt,
 	.deinit_tgt	=  loop_deinit_tgt,
 	.name	=  "loop",
+	.init_queue = loop_init_queue,
+	.deinit_queue = loop_deinit_queue,
+	.datapath_flags = UBLK_F_SUPPORT_ZERO_COPY | UBLK_F_AUTO_BUF_REG |
+		UBLK_F_USER_COPY | UBLK_F_BATCH_IO,
 };
 
 int main(int argc, char *argv[])
 {
+	ublksrv_stack_register_backend(&loop_tgt_type);
 	return ublksrv_main(&loop_tgt_type, argc, argv);
 }
@@ -8,6 +8,9 @@
 
 struct nfs_url *url;
 
+static struct ublksrv_io_timeout nfs_tmo;
+static struct ublksrv_cache *nfs_cache;
+
 typedef struct nfs_tgt_data {
 	char url[4096];
 	struct nfs_context *nfs;
@@ -19,11 +22,14 @@ typedef struct nfs_cb_data {
 	struct nfs_cb_data *next;
 	const struct ublksrv_queue *q;
 	ssize_t count;
+	unsigned int retries;
 } nfs_cb_data_t;
 
 struct nfs_queue_data {
 	nfs_tgt_data_t *nfs_data;
 	int events;
+	unsigned int inflight;
+	struct ublksrv_tick tick;
 	nfs_cb_data_t ios[];
 };
 
@@ -42,6 +48,18 @@ static inline int cb_data_to_tag(nfs_cb_data_t *cb)
 	return tag;
 }
 
+static int __nfs_queue_io(const struct ublksrv_queue *q,
+		const struct ublk_io_data *data);
+
+/*
+ * RPC which misses nfs timeout is failed by libnfs with -EINTR or
+ * -ETIMEDOUT, and it is sent again when retry policy is set.
+ */
+static inline bool nfs_status_timeout(int status)
+{
+	return status == -EINTR || status == -ETIMEDOUT;
+}
+
 void rw_async_cb(int status, struct nfs_context *nfs,
 		 void *data, void *private_data)
 {
@@ -51,11 +69,20 @@ void rw_async_cb(int status, struct nfs_context *nfs,
 
 	tag = cb_data_to_tag(cb_data);
 
-	if (status < 0) {
+	if (nfs_tmo.ms && nfs_status_timeout(status) &&
+			nfs_tmo.policy == UBLKSRV_TMO_RETRY &&
+			cb_data->retries < nfs_tmo.retries) {
+		cb_data->retries += 1;
+		status = __nfs_queue_io(q, ublksrv_queue_get_io_data(q, tag));
+		if (!status)
+			return;
+	} else if (status < 0) {
 		ublk_err("pread/pwrite failed with \"%s\"\n", (char *)data);
-		status = -EIO;
+		status = nfs_tmo.ms && nfs_status_timeout(status) ?
+			-ETIMEDOUT : -EIO;
 	}
-	ublksrv_complete_io(q, tag, status);
+	nfs_get_queue_data(q)->inflight -= 1;
+	ublksrv_cache_complete_io(nfs_cache, q, tag, status);
 }
 
 void nfs_socket_cb(struct ublksrv_queue *q, int revents)
@@ -138,7 +165,7 @@ static int nfs_tgt_flush(const struct ublksrv_queue *q,
 	return 0;
 }
 
-static int nfs_handle_io_async(const struct ublksrv_queue *q,
+static int __nfs_queue_io(const struct ublksrv_queue *q,
 		const struct ublk_io_data *data)
 {
 	const struct ublksrv_io_desc *iod = data->iod;
@@ -165,12 +192,49 @@ static int nfs_handle_io_async(const struct ublksrv_queue *q,
 		ret = -EINVAL;
 	}
 
+	return ret;
+}
+
+static int nfs_handle_io_async(const struct ublksrv_queue *q,
+		const struct ublk_io_data *data)
+{
+	struct nfs_queue_data *q_data = nfs_get_queue_data(q);
+	int ret;
+
+	if (ublksrv_cache_handle_io(nfs_cache, q, data))
+		return 0;
+
+	q_data->ios[data->tag].retries = 0;
+	ret = __nfs_queue_io(q, data);
 	if (ret) {
-		ublksrv_complete_io(q, data->tag, ret);
-	}
+		ublksrv_cache_complete_io(nfs_cache, q, data->tag, ret);
+	} else
+		q_data->inflight += 1;
 	return ret;
 }
 
+/* nfs_service() expires RPCs which are older than nfs timeout */
+static void nfs_tgt_io_done(const struct ublksrv_queue *q,
+		const struct ublk_io_data *data,
+		const struct io_uring_cqe *cqe)
+{
+	if (ublksrv_cache_io_done(nfs_cache, q, cqe))
+		return;
+	if (user_data_to_op(cqe->user_data) != UBLKSRV_TICK_OP)
+		return;
+
+	nfs_get_queue_data(q)->tick.armed = false;
+	nfs_socket_cb((struct ublksrv_queue *)q, 0);
+}
+
+static void nfs_handle_io_bg(const struct ublksrv_queue *q, int nr_queued_io)
+{
+	struct nfs_queue_data *q_data = nfs_get_queue_data(q);
+
+	if (q_data->inflight)
+		ublksrv_tgt_arm_tick(q, &q_data->tick, &nfs_tmo, 0);
+}
+
 static struct nfs_tgt_data *nfs_init(const char *nfsurl)
 {
 	struct nfs_tgt_data *nfs_data;
@@ -240,6 +304,7 @@ static int nfs_setup_tgt(struct ublksrv_dev *dev)
 	const struct ublksrv_ctrl_dev_info *info = ublksrv_ctrl_get_dev_info(cdev);
 	struct ublksrv_tgt_info *tgt = &dev->tgt;
 	struct ublk_params p;
+	char url[PATH_MAX];
 	int ret;
 
 	ret = ublk_json_read_params(&p, cdev);
@@ -251,8 +316,19 @@ static int nfs_setup_tgt(struct ublksrv_dev *dev)
 
 	tgt->dev_size = p.basic.dev_sectors << 9;
 	tgt->tgt_ring_depth = info->queue_depth;
+	if (nfs_tmo.ms)
+		tgt->tgt_ring_depth += 1;	//deadline tick
 	tgt->nr_fds = 0;
 
+	ret = ublk_json_read_target_str_info(cdev, "url", url);
+	if (ret < 0)
+		return ret;
+	ret = ublksrv_cache_open(dev, url, &nfs_cache);
+	if (ret)
+		return ret;
+	if (nfs_cache)
+		tgt->tgt_ring_depth += info->queue_depth;	//cache reads
+
 	return 0;
 }
 
@@ -269,6 +345,10 @@ static int nfs_recover_tgt(struct ublksrv_dev *dev, int type)
 		return ret;
 	}
 
+	ret = ublksrv_tgt_parse_io_timeout(cdev, 0, NULL, &nfs_tmo);
+	if (ret)
+		return ret;
+
 	return nfs_setup_tgt(dev);
 }
 
@@ -292,7 +372,7 @@ static int nfs_init_tgt(struct ublksrv_dev *dev, int type, int argc,
 		{ "nfs",	     1,	NULL, 1024 },
 		{ NULL }
 	};
-	int opt;
+	int opt, ret;
 	struct nfs_tgt_data *nfs_data = NULL;
 	const char *nfsurl = NULL;
 
@@ -331,13 +411,19 @@ static int nfs_init_tgt(struct ublksrv_dev *dev, int type, int argc,
 	ublk_json_write_target_base(cdev, &tgt_json);
 	ublk_json_write_tgt_str(cdev, "url", nfs_data->url);
 	ublk_json_write_params(cdev, &p);
+	ret = ublksrv_tgt_parse_io_timeout(cdev, argc, argv, &nfs_tmo);
+	if (!ret)
+		ret = ublksrv_cache_parse(cdev, argc, argv);
 
 	nfs_exit(nfs_data);
+	if (ret)
+		return ret;
 	return nfs_setup_tgt(dev);
 }
 
 static void nfs_deinit_tgt(const struct ublksrv_dev *dev)
 {
+	ublksrv_cache_close(nfs_cache);
 	if (url)
 		nfs_destroy_url(url);
 }
@@ -369,6 +455,16 @@ static int nfs_init_queue(const struct ublksrv_queue *q,
 
 	*queue_data_ptr = (void *)data;
 	nfs = data->nfs_data->nfs;
+
+	/*
+	 * Fail policy gives up a dead server right away, and retry policy
+	 * reconnects the same number of times as io is retried.
+	 */
+	if (nfs_tmo.ms) {
+		nfs_set_timeout(nfs, nfs_tmo.ms);
+		nfs_set_autoreconnect(nfs, nfs_tmo.policy == UBLKSRV_TMO_RETRY ?
+				nfs_tmo.retries : 0);
+	}
 	ublksrv_epoll_add_fd((struct ublksrv_queue *)q, nfs_get_fd(nfs), nfs_which_events(nfs), nfs_socket_cb);
 
 	return 0;
@@ -385,10 +481,14 @@ static void nfs_deinit_queue(const struct ublksrv_queue *q)
 static void nfs_cmd_usage()
 {
 	printf("\t--nfs NFS-URL\n");
+	ublksrv_tgt_io_timeout_usage();
+	ublksrv_cache_usage();
 }
 
 static const struct ublksrv_tgt_type  nfs_tgt_type = {
 	.handle_io_async = nfs_handle_io_async,
+	.tgt_io_done = nfs_tgt_io_done,
+	.handle_io_background = nfs_handle_io_bg,
 	.usage_for_add = nfs_cmd_usage,
 	.init_tgt = nfs_init_tgt,
 	.deinit_tgt = nfs_deinit_tgt,
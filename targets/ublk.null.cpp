@@ -181,6 +181,8 @@ static const struct ublksrv_tgt_type  null_tgt_type = {
 	.tgt_io_done = null_tgt_io_done,
 	.init_tgt = null_init_tgt,
 	.name	=  "null",
+	.datapath_flags = UBLK_F_SUPPORT_ZERO_COPY | UBLK_F_AUTO_BUF_REG |
+		UBLK_F_USER_COPY | UBLK_F_BATCH_IO,
 };
 
 
@@ -0,0 +1,1265 @@
+// SPDX-License-Identifier: MIT or GPL-2.0-only
+
+#include <config.h>
+
+#include <poll.h>
+#include <signal.h>
+#include <linux/fs.h>
+
+#include "ublksrv_tgt.h"
+#include "ublksrv_tgt_endian.h"
+#include "ublksrv_aio.h"
+#include "nbd/cliserv.h"
+
+/*
+ * Copy-on-read overlay: one read-only base(local file/device, or NBD
+ * export) is exposed through one local sparse overlay file.
+ *
+ * The overlay is tracked in chunks. IO covering present chunks only is
+ * handled on the queue's io_uring against the overlay. Other IO is
+ * offloaded to fetch workers via ublksrv_aio: READ is served from base
+ * and completed before the fetched chunks are written to overlay, WRITE
+ * fills the rest of partial chunks from base first and lands in overlay
+ * only. One background streamer populates remaining chunks at limited
+ * rate, then base isn't needed any more.
+ *
+ * Overlay layout: [0, dev_size) is device data, the chunk bitmap follows
+ * at round_up(dev_size, 4096), and the 4KB header is the last block. The
+ * bitmap is persisted on FLUSH after data is synced, so chunks never
+ * become present before their data is stable.
+ */
+
+#define OVL_MAGIC		"UBLKOVL1"
+#define OVL_META_ALIGN		4096U
+#define OVL_DEF_CHUNK_KB	256
+#define OVL_DEF_STREAM_RATE	32	/* MB/s, 0 disables streamer */
+#define OVL_DEF_FETCH_THREADS	4
+#define OVL_MAX_FETCH_THREADS	64
+/* how often the streamer persists the bitmap */
+#define OVL_STREAM_SYNC_NS	(1000ULL * 1000 * 1000)
+
+#define OVL_MAX_NAME		512
+
+enum {
+	OVL_BASE_FILE,
+	OVL_BASE_NBD,
+};
+
+/* chunk state */
+enum {
+	OVL_ABSENT,
+	OVL_FETCHING,	/* owned by one worker or streamer */
+	OVL_PRESENT,
+};
+
+struct ovl_header {
+	char magic[8];
+	__u32 chunk_shift;
+	__u32 complete;
+	__u64 dev_size;
+	__u64 nr_chunks;
+};
+
+/* connection to base, every thread owns one */
+struct ovl_base {
+	int fd;
+	bool nbd;
+	unsigned long long cookie;
+};
+
+struct ovl_tgt_data;
+
+struct ovl_worker {
+	struct ovl_tgt_data *d;
+	struct ublksrv_aio_ctx *ctx;
+	pthread_t thread;
+	struct ovl_base base;
+
+	/* chunk buffers, one for each chunk an io may cover */
+	char *buf;
+	unsigned long long *slots;
+};
+
+struct ovl_tgt_data {
+	char base_path[PATH_MAX];
+	char overlay_path[PATH_MAX];
+	int base_type;
+	char nbd_host[OVL_MAX_NAME];
+	char nbd_port[16];
+	char nbd_export[OVL_MAX_NAME];
+	char nbd_unix[OVL_MAX_NAME];
+
+	int ovl_fd;
+	unsigned long long dev_size;
+	unsigned chunk_shift;
+	unsigned long long nr_chunks;
+	unsigned long long meta_off;
+	unsigned map_bytes;
+	unsigned nr_slots;
+
+	/* protects chunk state, live bitmap and nr_present */
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	unsigned char *state;
+	unsigned long *map;
+	unsigned long long nr_present;
+	bool map_dirty;
+
+	/* serializes bitmap persisting, map_snap is written to overlay */
+	pthread_mutex_t map_lock;
+	unsigned long *map_snap;
+	void *hdr_buf;
+
+	unsigned nr_workers;
+	struct ovl_worker *workers;
+
+	unsigned stream_rate;
+	bool streaming;
+	volatile bool stop;
+	pthread_t streamer;
+	struct ovl_base stream_base;
+	char *stream_buf;
+};
+
+static inline unsigned long long ovl_chunk_size(const struct ovl_tgt_data *d)
+{
+	return 1ULL << d->chunk_shift;
+}
+
+/* the last chunk may be partial */
+static inline unsigned ovl_chunk_bytes(const struct ovl_tgt_data *d,
+		unsigned long long c)
+{
+	unsigned long long start = c << d->chunk_shift;
+	unsigned long long end = start + ovl_chunk_size(d);
+
+	if (end > d->dev_size)
+		end = d->dev_size;
+	return end - start;
+}
+
+static inline bool ovl_chunk_present(const struct ovl_tgt_data *d,
+		unsigned long long c)
+{
+	return __atomic_load_n(&d->state[c], __ATOMIC_ACQUIRE) == OVL_PRESENT;
+}
+
+static bool ovl_range_present(const struct ovl_tgt_data *d,
+		const struct ublksrv_io_desc *iod)
+{
+	unsigned long long off = (unsigned long long)iod->start_sector << 9;
+	unsigned long long last = (off + (iod->nr_sectors << 9) - 1) >>
+		d->chunk_shift;
+	unsigned long long c;
+
+	for (c = off >> d->chunk_shift; c <= last; c++)
+		if (!ovl_chunk_present(d, c))
+			return false;
+	return true;
+}
+
+/*
+ * Return chunk state seen by caller, and the chunk is owned by caller if
+ * OVL_ABSENT is returned. If 'wait' is true, wait until it isn't fetched
+ * by others.
+ */
+static int ovl_claim_chunk(struct ovl_tgt_data *d, unsigned long long c,
+		bool wait)
+{
+	int st;
+
+	pthread_mutex_lock(&d->lock);
+	while (wait && d->state[c] == OVL_FETCHING)
+		pthread_cond_wait(&d->cond, &d->lock);
+	st = d->state[c];
+	if (st == OVL_ABSENT)
+		d->state[c] = OVL_FETCHING;
+	pthread_mutex_unlock(&d->lock);
+
+	return st;
+}
+
+static void ovl_chunk_done(struct ovl_tgt_data *d, unsigned long long c,
+		bool populated)
+{
+	const unsigned bits = sizeof(unsigned long) * 8;
+
+	pthread_mutex_lock(&d->lock);
+	if (populated) {
+		__atomic_store_n(&d->state[c], OVL_PRESENT, __ATOMIC_RELEASE);
+		d->map[c / bits] |= 1UL << (c % bits);
+		d->nr_present++;
+		d->map_dirty = true;
+	} else {
+		d->state[c] = OVL_ABSENT;
+	}
+	pthread_cond_broadcast(&d->cond);
+	pthread_mutex_unlock(&d->lock);
+}
+
+static int ovl_pread(int fd, void *buf, size_t len, off_t off)
+{
+	while (len) {
+		ssize_t ret = pread(fd, buf, len, off);
+
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret < 0)
+			return -errno;
+		if (ret == 0)
+			return -EIO;
+		buf = (char *)buf + ret;
+		len -= ret;
+		off += ret;
+	}
+	return 0;
+}
+
+static int ovl_pwrite(int fd, const void *buf, size_t len, off_t off)
+{
+	while (len) {
+		ssize_t ret = pwrite(fd, buf, len, off);
+
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret < 0)
+			return -errno;
+		buf = (const char *)buf + ret;
+		len -= ret;
+		off += ret;
+	}
+	return 0;
+}
+
+static int ovl_sock_xfer(int fd, void *buf, size_t len, bool send_data)
+{
+	while (len) {
+		ssize_t ret = send_data ? send(fd, buf, len, MSG_NOSIGNAL) :
+			recv(fd, buf, len, MSG_WAITALL);
+
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret < 0)
+			return -errno;
+		if (ret == 0)
+			return -ECONNRESET;
+		buf = (char *)buf + ret;
+		len -= ret;
+	}
+	return 0;
+}
+
+static int ovl_nbd_send_req(struct ovl_base *b, u32 type,
+		unsigned long long off, unsigned len, u64 *handle)
+{
+	struct nbd_request req = {.magic = htonl(NBD_REQUEST_MAGIC),};
+
+	*handle = ++b->cookie;
+	req.type = htonl(type);
+	req.from = cpu_to_be64(off);
+	req.len = htonl(len);
+	memcpy(req.handle, handle, sizeof(*handle));
+
+	return ovl_sock_xfer(b->fd, &req, sizeof(req), true);
+}
+
+/* synchronous NBD READ, each thread has its own connection */
+static int ovl_nbd_read(struct ovl_base *b, void *buf, unsigned len,
+		unsigned long long off)
+{
+	struct nbd_reply reply;
+	u64 handle;
+	int ret;
+
+	ret = ovl_nbd_send_req(b, NBD_CMD_READ, off, len, &handle);
+	if (!ret)
+		ret = ovl_sock_xfer(b->fd, &reply, sizeof(reply), false);
+	if (ret)
+		return ret;
+
+	if (ntohl(reply.magic) != NBD_REPLY_MAGIC ||
+			memcmp(reply.handle, &handle, sizeof(handle))) {
+		ublk_err("%s: bad nbd reply, magic %x\n", __func__,
+				ntohl(reply.magic));
+		return -EPROTO;
+	}
+	if (reply.error)
+		return -EIO;
+
+	return ovl_sock_xfer(b->fd, buf, len, false);
+}
+
+static int ovl_base_read(struct ovl_base *b, void *buf, unsigned len,
+		unsigned long long off)
+{
+	int ret;
+
+	if (b->nbd)
+		ret = ovl_nbd_read(b, buf, len, off);
+	else
+		ret = ovl_pread(b->fd, buf, len, off);
+	if (ret)
+		ublk_err("%s: read base [%llu, %u] failed %d\n", __func__,
+				off, len, ret);
+	return ret;
+}
+
+static int ovl_base_open(const struct ovl_tgt_data *d, struct ovl_base *b,
+		unsigned long long *size)
+{
+	b->nbd = d->base_type == OVL_BASE_NBD;
+	b->cookie = 0;
+
+	if (!b->nbd) {
+		struct stat st;
+		int ret = 0;
+
+		b->fd = open(d->base_path, O_RDONLY);
+		if (b->fd < 0)
+			return -errno;
+		if (fstat(b->fd, &st) < 0)
+			ret = -errno;
+		else if (S_ISBLK(st.st_mode)) {
+			if (ioctl(b->fd, BLKGETSIZE64, size) != 0)
+				ret = -errno;
+		} else if (S_ISREG(st.st_mode)) {
+			*size = st.st_size;
+		} else {
+			ret = -EINVAL;
+		}
+		if (ret) {
+			close(b->fd);
+			b->fd = -1;
+			return ret;
+		}
+	} else {
+		uint16_t flags = 0;
+		u64 size64 = 0;
+		int sock;
+
+		if (d->nbd_unix[0])
+			sock = openunix(d->nbd_unix);
+		else
+			sock = opennet(d->nbd_host, d->nbd_port, false);
+		if (sock < 0) {
+			ublk_err("%s: open socket failed %d\n", __func__, sock);
+			return -ENOTCONN;
+		}
+
+		negotiate(&sock, &size64, &flags, (char *)d->nbd_export, 0,
+				NBD_FLAG_C_FIXED_NEWSTYLE, 0, NULL, NULL, NULL,
+				NULL, false, true, NULL, -1);
+		b->fd = sock;
+		*size = size64;
+	}
+	return 0;
+}
+
+static void ovl_base_close(struct ovl_base *b)
+{
+	u64 handle;
+
+	if (b->fd < 0)
+		return;
+	if (b->nbd)
+		ovl_nbd_send_req(b, NBD_CMD_DISC, 0, 0, &handle);
+	close(b->fd);
+	b->fd = -1;
+}
+
+/*
+ * base is one local file or block device, nbd://HOST[:PORT][/EXPORT], or
+ * nbd+unix:///[EXPORT]?socket=PATH
+ */
+static int ovl_parse_base(struct ovl_tgt_data *d)
+{
+	const char *spec = d->base_path;
+	const char *p, *q;
+
+	strcpy(d->nbd_port, NBD_DEFAULT_PORT);
+
+	if (!strncmp(spec, "nbd+unix://", 11)) {
+		p = spec + 11;
+		if (*p == '/')
+			p++;
+		q = strstr(p, "?socket=");
+		if (!q || q - p >= OVL_MAX_NAME)
+			return -EINVAL;
+		memcpy(d->nbd_export, p, q - p);
+		snprintf(d->nbd_unix, OVL_MAX_NAME, "%s", q + 8);
+		d->base_type = OVL_BASE_NBD;
+		return 0;
+	}
+
+	if (!strncmp(spec, "nbd://", 6)) {
+		char *port;
+
+		p = spec + 6;
+		q = strchr(p, '/');
+		if (!q)
+			q = p + strlen(p);
+		if (q == p || q - p >= OVL_MAX_NAME)
+			return -EINVAL;
+		memcpy(d->nbd_host, p, q - p);
+		if (*q == '/')
+			snprintf(d->nbd_export, OVL_MAX_NAME, "%s", q + 1);
+
+		port = strrchr(d->nbd_host, ':');
+		if (port) {
+			*port++ = '\0';
+			snprintf(d->nbd_port, sizeof(d->nbd_port), "%s", port);
+		}
+		d->base_type = OVL_BASE_NBD;
+		return 0;
+	}
+
+	d->base_type = OVL_BASE_FILE;
+	return 0;
+}
+
+static int ovl_write_header(struct ovl_tgt_data *d, bool complete)
+{
+	struct ovl_header *hdr = (struct ovl_header *)d->hdr_buf;
+
+	memset(hdr, 0, OVL_META_ALIGN);
+	memcpy(hdr->magic, OVL_MAGIC, sizeof(hdr->magic));
+	hdr->chunk_shift = d->chunk_shift;
+	hdr->complete = complete;
+	hdr->dev_size = d->dev_size;
+	hdr->nr_chunks = d->nr_chunks;
+
+	return ovl_pwrite(d->ovl_fd, hdr, OVL_META_ALIGN,
+			d->meta_off + d->map_bytes);
+}
+
+/*
+ * Persist the bitmap: overlay data is synced before the bitmap is
+ * written, so one present chunk always has stable data.
+ */
+static int ovl_sync_map(struct ovl_tgt_data *d)
+{
+	unsigned long long present;
+	bool dirty;
+	int ret;
+
+	pthread_mutex_lock(&d->map_lock);
+
+	pthread_mutex_lock(&d->lock);
+	dirty = d->map_dirty;
+	d->map_dirty = false;
+	if (dirty)
+		memcpy(d->map_snap, d->map, d->map_bytes);
+	present = d->nr_present;
+	pthread_mutex_unlock(&d->lock);
+
+	ret = fdatasync(d->ovl_fd) ? -errno : 0;
+	if (!ret && dirty) {
+		ret = ovl_pwrite(d->ovl_fd, d->map_snap, d->map_bytes,
+				d->meta_off);
+		if (!ret)
+			ret = ovl_write_header(d, present == d->nr_chunks);
+		if (!ret)
+			ret = fdatasync(d->ovl_fd) ? -errno : 0;
+	}
+	if (ret && dirty) {
+		pthread_mutex_lock(&d->lock);
+		d->map_dirty = true;
+		pthread_mutex_unlock(&d->lock);
+	}
+
+	pthread_mutex_unlock(&d->map_lock);
+
+	if (ret)
+		ublk_err("%s: sync overlay failed %d\n", __func__, ret);
+	return ret;
+}
+
+/*
+ * Load header and bitmap of existing overlay, return 1 if the overlay is
+ * new, or -errno if it doesn't belong to us
+ */
+static int ovl_load_overlay(struct ovl_tgt_data *d, struct ovl_header *hdr)
+{
+	unsigned long long map_bytes;
+	struct stat st;
+	int ret;
+
+	if (fstat(d->ovl_fd, &st) < 0)
+		return -errno;
+	if (!S_ISREG(st.st_mode))
+		return -EINVAL;
+	if (st.st_size == 0)
+		return 1;
+	if (st.st_size < OVL_META_ALIGN)
+		goto fail;
+
+	ret = ovl_pread(d->ovl_fd, hdr, sizeof(*hdr),
+			st.st_size - OVL_META_ALIGN);
+	if (ret)
+		return ret;
+
+	map_bytes = round_up((hdr->nr_chunks + 7) / 8, OVL_META_ALIGN);
+	if (!memcmp(hdr->magic, OVL_MAGIC, sizeof(hdr->magic)) &&
+			round_up(hdr->dev_size, OVL_META_ALIGN) + map_bytes +
+			OVL_META_ALIGN == (unsigned long long)st.st_size)
+		return 0;
+fail:
+	ublk_err("%s: %s isn't one overlay\n", __func__, d->overlay_path);
+	return -EINVAL;
+}
+
+static int ovl_init_map(struct ovl_tgt_data *d, bool new_overlay)
+{
+	const unsigned bits = sizeof(unsigned long) * 8;
+	unsigned long long c;
+	int ret;
+
+	d->nr_chunks = (d->dev_size + ovl_chunk_size(d) - 1) >> d->chunk_shift;
+	d->meta_off = round_up(d->dev_size, OVL_META_ALIGN);
+	d->map_bytes = round_up((d->nr_chunks + 7) / 8, OVL_META_ALIGN);
+
+	d->state = (unsigned char *)calloc(d->nr_chunks, 1);
+	d->map = (unsigned long *)calloc(d->map_bytes, 1);
+	if (!d->state || !d->map)
+		return -ENOMEM;
+	if (posix_memalign((void **)&d->map_snap, OVL_META_ALIGN,
+				d->map_bytes) ||
+			posix_memalign(&d->hdr_buf, OVL_META_ALIGN,
+				OVL_META_ALIGN))
+		return -ENOMEM;
+
+	if (new_overlay) {
+		if (ftruncate(d->ovl_fd, d->meta_off + d->map_bytes +
+					OVL_META_ALIGN) < 0)
+			return -errno;
+		ret = ovl_write_header(d, false);
+		if (!ret)
+			ret = fdatasync(d->ovl_fd) ? -errno : 0;
+		return ret;
+	}
+
+	ret = ovl_pread(d->ovl_fd, d->map, d->map_bytes, d->meta_off);
+	if (ret)
+		return ret;
+	for (c = 0; c < d->nr_chunks; c++) {
+		if (d->map[c / bits] & (1UL << (c % bits))) {
+			d->state[c] = OVL_PRESENT;
+			d->nr_present++;
+		}
+	}
+	return 0;
+}
+
+static void ovl_block_signals(void)
+{
+	sigset_t mask;
+
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGINT);
+	sigaddset(&mask, SIGTERM);
+	pthread_sigmask(SIG_BLOCK, &mask, NULL);
+}
+
+static void ovl_complete_req(struct ublksrv_aio_ctx *ctx,
+		struct ublksrv_aio *req, int res)
+{
+	struct aio_list done;
+
+	aio_list_init(&done);
+	req->res = res;
+	aio_list_add(&done, req);
+	ublksrv_aio_complete_worker(ctx, &done);
+}
+
+/*
+ * READ isn't blocked by others: present chunks come from overlay, chunks
+ * being fetched by others are read from base directly, and absent chunks
+ * are fetched by us and written to overlay after the io is completed.
+ */
+static int ovl_worker_read(struct ovl_worker *w, struct ublksrv_aio *req)
+{
+	struct ovl_tgt_data *d = w->d;
+	const struct ublksrv_io_desc *iod = &req->io;
+	unsigned long long off = (unsigned long long)iod->start_sector << 9;
+	unsigned long long end = off + (iod->nr_sectors << 9);
+	unsigned long long pos = off;
+	char *buf = (char *)iod->addr;
+	unsigned nr = 0, i;
+	int ret = 0;
+
+	while (pos < end && !ret) {
+		unsigned long long c = pos >> d->chunk_shift;
+		unsigned long long cstart = c << d->chunk_shift;
+		unsigned long long cend = cstart + ovl_chunk_size(d);
+		unsigned bytes = (cend < end ? cend : end) - pos;
+		char *dst = buf + (pos - off);
+		char *cbuf;
+
+		switch (ovl_claim_chunk(d, c, false)) {
+		case OVL_PRESENT:
+			ret = ovl_pread(d->ovl_fd, dst, bytes, pos);
+			break;
+		case OVL_FETCHING:
+			ret = ovl_base_read(&w->base, dst, bytes, pos);
+			break;
+		default:
+			cbuf = w->buf + ((unsigned long long)nr << d->chunk_shift);
+			w->slots[nr++] = c;
+			ret = ovl_base_read(&w->base, cbuf,
+					ovl_chunk_bytes(d, c), cstart);
+			if (!ret)
+				memcpy(dst, cbuf + (pos - cstart), bytes);
+			break;
+		}
+		pos += bytes;
+	}
+
+	if (!ret)
+		ovl_complete_req(w->ctx, req, end - off);
+
+	/* populate overlay in background of the completed read */
+	for (i = 0; i < nr; i++) {
+		unsigned long long c = w->slots[i];
+		int err = ret;
+
+		if (!err)
+			err = ovl_pwrite(d->ovl_fd,
+					w->buf + ((unsigned long long)i << d->chunk_shift),
+					ovl_chunk_bytes(d, c), c << d->chunk_shift);
+		ovl_chunk_done(d, c, !err);
+	}
+
+	return ret;
+}
+
+/*
+ * WRITE lands in overlay only, one absent chunk is completed with base
+ * data before it becomes present. Chunks are handled one by one in
+ * ascending order, and none is held while waiting for another.
+ */
+static int ovl_worker_write(struct ovl_worker *w, struct ublksrv_aio *req)
+{
+	struct ovl_tgt_data *d = w->d;
+	const struct ublksrv_io_desc *iod = &req->io;
+	unsigned long long off = (unsigned long long)iod->start_sector << 9;
+	unsigned long long end = off + (iod->nr_sectors << 9);
+	unsigned long long pos = off;
+	const char *buf = (const char *)iod->addr;
+	int ret = 0;
+
+	while (pos < end && !ret) {
+		unsigned long long c = pos >> d->chunk_shift;
+		unsigned long long cstart = c << d->chunk_shift;
+		unsigned long long cend = cstart + ovl_chunk_size(d);
+		unsigned bytes = (cend < end ? cend : end) - pos;
+		unsigned cbytes = ovl_chunk_bytes(d, c);
+		const char *src = buf + (pos - off);
+
+		if (ovl_claim_chunk(d, c, true) == OVL_PRESENT) {
+			ret = ovl_pwrite(d->ovl_fd, src, bytes, pos);
+		} else {
+			if (pos == cstart && bytes == cbytes) {
+				ret = ovl_pwrite(d->ovl_fd, src, bytes, pos);
+			} else {
+				ret = ovl_base_read(&w->base, w->buf, cbytes,
+						cstart);
+				if (!ret) {
+					memcpy(w->buf + (pos - cstart), src,
+							bytes);
+					ret = ovl_pwrite(d->ovl_fd, w->buf,
+							cbytes, cstart);
+				}
+			}
+			ovl_chunk_done(d, c, !ret);
+		}
+		pos += bytes;
+	}
+
+	return ret ? ret : end - off;
+}
+
+static int ovl_submit_io(struct ublksrv_aio_ctx *ctx, struct ublksrv_aio *req)
+{
+	struct ovl_worker *w = (struct ovl_worker *)ublksrv_aio_get_ctx_data(ctx);
+	int ret;
+
+	switch (ublksrv_get_op(&req->io)) {
+	case UBLK_IO_OP_READ:
+		/* completed inside after data is ready */
+		return ovl_worker_read(w, req);
+	case UBLK_IO_OP_WRITE:
+		ret = ovl_worker_write(w, req);
+		break;
+	case UBLK_IO_OP_FLUSH:
+		ret = ovl_sync_map(w->d);
+		break;
+	default:
+		ret = -EINVAL;
+		break;
+	}
+
+	if (ret < 0)
+		return ret;
+	ovl_complete_req(ctx, req, ret);
+	return 0;
+}
+
+static void *ovl_worker_fn(void *arg)
+{
+	struct ovl_worker *w = (struct ovl_worker *)arg;
+	struct ublksrv_aio_ctx *ctx = w->ctx;
+	struct pollfd pfd = {
+		.fd = ublksrv_aio_get_efd(ctx),
+		.events = POLLIN,
+	};
+
+	ovl_block_signals();
+
+	while (!ublksrv_aio_ctx_dead(ctx)) {
+		struct aio_list done;
+
+		aio_list_init(&done);
+		ublksrv_aio_submit_worker(ctx, ovl_submit_io, &done);
+		ublksrv_aio_complete_worker(ctx, &done);
+
+		poll(&pfd, 1, -1);
+	}
+
+	return NULL;
+}
+
+/* sleep until 'bytes' streamed since 'start' is within stream_rate */
+static void ovl_stream_pace(const struct ovl_tgt_data *d,
+		unsigned long long start, unsigned long long bytes)
+{
+	unsigned long long due = start + bytes * 1000000000ULL /
+		((unsigned long long)d->stream_rate << 20);
+
+	while (!d->stop) {
+		unsigned long long now = ublksrv_tgt_now_ns();
+		unsigned long long ns;
+
+		if (now >= due)
+			break;
+		ns = due - now;
+		if (ns > 100000000ULL)
+			ns = 100000000ULL;
+		usleep(ns / 1000);
+	}
+}
+
+static void *ovl_streamer_fn(void *arg)
+{
+	struct ovl_tgt_data *d = (struct ovl_tgt_data *)arg;
+	unsigned long long start = ublksrv_tgt_now_ns();
+	unsigned long long last_sync = start;
+	unsigned long long bytes = 0;
+	unsigned long long c;
+	int ret = 0;
+
+	ovl_block_signals();
+
+	for (c = 0; c < d->nr_chunks && !d->stop; c++) {
+		unsigned long long now;
+		unsigned len;
+
+		if (ovl_claim_chunk(d, c, false) != OVL_ABSENT)
+			continue;
+
+		len = ovl_chunk_bytes(d, c);
+		ret = ovl_base_read(&d->stream_base, d->stream_buf, len,
+				c << d->chunk_shift);
+		if (!ret)
+			ret = ovl_pwrite(d->ovl_fd, d->stream_buf, len,
+					c << d->chunk_shift);
+		ovl_chunk_done(d, c, !ret);
+		if (ret)
+			break;
+
+		bytes += len;
+		ovl_stream_pace(d, start, bytes);
+
+		now = ublksrv_tgt_now_ns();
+		if (now - last_sync >= OVL_STREAM_SYNC_NS) {
+			ovl_sync_map(d);
+			last_sync = now;
+		}
+	}
+
+	ovl_sync_map(d);
+	if (!ret && c == d->nr_chunks)
+		ublk_log("%s: overlay %s is populated, %llu MB streamed\n",
+				__func__, d->overlay_path, bytes >> 20);
+	else if (ret)
+		ublk_err("%s: streaming stopped at chunk %llu: %d\n",
+				__func__, c, ret);
+
+	return NULL;
+}
+
+static void ovl_stop_threads(struct ovl_tgt_data *d)
+{
+	unsigned i;
+
+	d->stop = true;
+	if (d->streaming) {
+		pthread_join(d->streamer, NULL);
+		d->streaming = false;
+	}
+
+	for (i = 0; d->workers && i < d->nr_workers; i++) {
+		struct ovl_worker *w = &d->workers[i];
+
+		if (!w->ctx)
+			continue;
+		ublksrv_aio_ctx_shutdown(w->ctx);
+		pthread_join(w->thread, NULL);
+		ublksrv_aio_ctx_deinit(w->ctx);
+		w->ctx = NULL;
+	}
+}
+
+static int ovl_start_threads(const struct ublksrv_dev *dev,
+		struct ovl_tgt_data *d)
+{
+	unsigned i;
+
+	for (i = 0; i < d->nr_workers; i++) {
+		struct ovl_worker *w = &d->workers[i];
+
+		w->d = d;
+		if (posix_memalign((void **)&w->buf, OVL_META_ALIGN,
+					(unsigned long long)d->nr_slots <<
+					d->chunk_shift))
+			return -ENOMEM;
+		w->slots = (unsigned long long *)calloc(d->nr_slots,
+				sizeof(unsigned long long));
+		if (!w->slots)
+			return -ENOMEM;
+
+		w->ctx = ublksrv_aio_ctx_init(dev, 0);
+		if (!w->ctx)
+			return -ENOMEM;
+		ublksrv_aio_set_ctx_data(w->ctx, w);
+		pthread_create(&w->thread, NULL, ovl_worker_fn, w);
+	}
+
+	if (d->stream_base.fd >= 0) {
+		if (posix_memalign((void **)&d->stream_buf, OVL_META_ALIGN,
+					ovl_chunk_size(d)))
+			return -ENOMEM;
+		pthread_create(&d->streamer, NULL, ovl_streamer_fn, d);
+		d->streaming = true;
+	}
+	return 0;
+}
+
+static void ovl_free_tgt_data(struct ovl_tgt_data *d)
+{
+	unsigned i;
+
+	if (!d)
+		return;
+
+	ovl_stop_threads(d);
+	if (d->ovl_fd >= 0 && d->map_snap)
+		ovl_sync_map(d);
+
+	for (i = 0; d->workers && i < d->nr_workers; i++) {
+		ovl_base_close(&d->workers[i].base);
+		free(d->workers[i].buf);
+		free(d->workers[i].slots);
+	}
+	ovl_base_close(&d->stream_base);
+	if (d->ovl_fd >= 0)
+		close(d->ovl_fd);
+
+	free(d->workers);
+	free(d->stream_buf);
+	free(d->state);
+	free(d->map);
+	free(d->map_snap);
+	free(d->hdr_buf);
+	pthread_mutex_destroy(&d->lock);
+	pthread_mutex_destroy(&d->map_lock);
+	pthread_cond_destroy(&d->cond);
+	free(d);
+}
+
+/* open base connections for workers and streamer, unless overlay is full */
+static int ovl_open_bases(struct ovl_tgt_data *d, bool need_base,
+		unsigned long long *base_size)
+{
+	unsigned i;
+	int ret;
+
+	for (i = 0; i < d->nr_workers; i++)
+		d->workers[i].base.fd = -1;
+	d->stream_base.fd = -1;
+
+	if (!need_base)
+		return 0;
+
+	for (i = 0; i < d->nr_workers; i++) {
+		ret = ovl_base_open(d, &d->workers[i].base, base_size);
+		if (ret) {
+			ublk_err("%s: open base %s failed %d\n", __func__,
+					d->base_path, ret);
+			return ret;
+		}
+	}
+
+	if (d->stream_rate)
+		return ovl_base_open(d, &d->stream_base, base_size);
+	return 0;
+}
+
+static int ovl_setup_tgt(struct ublksrv_dev *dev)
+{
+	const struct ublksrv_ctrl_dev *cdev = ublksrv_get_ctrl_dev(dev);
+	const struct ublksrv_ctrl_dev_info *info = ublksrv_ctrl_get_dev_info(cdev);
+	struct ublksrv_tgt_info *tgt = &dev->tgt;
+	struct ovl_tgt_data *d;
+	struct ovl_header hdr;
+	unsigned long chunk_kb = OVL_DEF_CHUNK_KB;
+	unsigned long stream_rate = OVL_DEF_STREAM_RATE;
+	unsigned long fetch_threads = OVL_DEF_FETCH_THREADS;
+	unsigned long long base_size = 0;
+	int new_overlay;
+	int ret;
+
+	if (info->flags & (UBLK_F_USER_COPY | UBLK_F_SUPPORT_ZERO_COPY |
+				UBLK_F_AUTO_BUF_REG))
+		return -EINVAL;
+
+	d = (struct ovl_tgt_data *)calloc(1, sizeof(*d));
+	if (!d)
+		return -ENOMEM;
+	d->ovl_fd = -1;
+	d->stream_base.fd = -1;
+	pthread_mutex_init(&d->lock, NULL);
+	pthread_mutex_init(&d->map_lock, NULL);
+	pthread_cond_init(&d->cond, NULL);
+	tgt->tgt_data = d;
+
+	ublk_json_read_target_str_info(cdev, "base", d->base_path);
+	ublk_json_read_target_str_info(cdev, "overlay", d->overlay_path);
+	ublk_json_read_target_ulong_info(cdev, "chunk_kb", &chunk_kb);
+	ublk_json_read_target_ulong_info(cdev, "stream_rate", &stream_rate);
+	ublk_json_read_target_ulong_info(cdev, "fetch_threads", &fetch_threads);
+
+	ret = -EINVAL;
+	if (!d->base_path[0] || !d->overlay_path[0])
+		goto fail;
+	if (chunk_kb < 4 || chunk_kb > 4096 || (chunk_kb & (chunk_kb - 1)))
+		goto fail;
+	if (!fetch_threads || fetch_threads > OVL_MAX_FETCH_THREADS)
+		goto fail;
+	ret = ovl_parse_base(d);
+	if (ret)
+		goto fail;
+
+	d->chunk_shift = ilog2(chunk_kb) + 10;
+	d->stream_rate = stream_rate;
+	d->nr_workers = fetch_threads;
+	d->workers = (struct ovl_worker *)calloc(d->nr_workers,
+			sizeof(struct ovl_worker));
+	if (!d->workers) {
+		ret = -ENOMEM;
+		goto fail;
+	}
+	for (unsigned i = 0; i < d->nr_workers; i++)
+		d->workers[i].base.fd = -1;
+
+	d->ovl_fd = open(d->overlay_path, O_RDWR | O_CREAT, 0644);
+	if (d->ovl_fd < 0) {
+		ret = -errno;
+		goto fail;
+	}
+
+	new_overlay = ovl_load_overlay(d, &hdr);
+	if (new_overlay < 0) {
+		ret = new_overlay;
+		goto fail;
+	}
+
+	/* populated overlay doesn't need base any more */
+	ret = ovl_open_bases(d, new_overlay || !hdr.complete, &base_size);
+	if (ret)
+		goto fail;
+
+	if (new_overlay) {
+		d->dev_size = base_size & ~511ULL;
+	} else {
+		if (hdr.chunk_shift != d->chunk_shift)
+			ublk_log("%s: use chunk size %uKB of overlay\n",
+					__func__, 1U << (hdr.chunk_shift - 10));
+		d->chunk_shift = hdr.chunk_shift;
+		d->dev_size = hdr.dev_size;
+		if (!hdr.complete && (base_size & ~511ULL) != d->dev_size) {
+			ublk_err("%s: base size %llu doesn't match overlay %llu\n",
+					__func__, base_size, d->dev_size);
+			ret = -EINVAL;
+			goto fail;
+		}
+	}
+	ret = -EINVAL;
+	if (!d->dev_size)
+		goto fail;
+
+	ret = ovl_init_map(d, new_overlay);
+	if (ret)
+		goto fail;
+
+	d->nr_slots = (info->max_io_buf_bytes >> d->chunk_shift) + 2;
+
+	tgt->dev_size = d->dev_size;
+	tgt->tgt_ring_depth = info->queue_depth;
+	tgt->nr_fds = 1;
+	tgt->fds[1] = d->ovl_fd;
+	ublksrv_tgt_set_io_data_size(tgt);
+
+	ublk_log("%s: base %s overlay %s: %llu/%llu chunks present\n",
+			__func__, d->base_path, d->overlay_path,
+			d->nr_present, d->nr_chunks);
+
+	ret = ovl_start_threads(dev, d);
+	if (ret)
+		goto fail;
+	return 0;
+fail:
+	/* ->deinit_tgt() isn't called if setup fails */
+	ovl_free_tgt_data(d);
+	tgt->tgt_data = NULL;
+	return ret;
+}
+
+static int ovl_recover_tgt(struct ublksrv_dev *dev, int type)
+{
+	return ovl_setup_tgt(dev);
+}
+
+static int ovl_init_tgt(struct ublksrv_dev *dev, int type, int argc,
+		char *argv[])
+{
+	static const struct option ovl_longopts[] = {
+		{ "base",		1,	NULL, 0 },
+		{ "overlay",		1,	NULL, 0 },
+		{ "chunk_kb",		1,	NULL, 0 },
+		{ "stream_rate",	1,	NULL, 0 },
+		{ "fetch_threads",	1,	NULL, 0 },
+		{ NULL }
+	};
+	const struct ublksrv_ctrl_dev *cdev = ublksrv_get_ctrl_dev(dev);
+	const struct ublksrv_ctrl_dev_info *info = ublksrv_ctrl_get_dev_info(cdev);
+	struct ublksrv_tgt_info *tgt = &dev->tgt;
+	struct ublksrv_tgt_base_json tgt_json = { 0 };
+	const char *base = NULL, *overlay = NULL;
+	unsigned long chunk_kb = OVL_DEF_CHUNK_KB;
+	unsigned long stream_rate = OVL_DEF_STREAM_RATE;
+	unsigned long fetch_threads = OVL_DEF_FETCH_THREADS;
+	int opt, option_index = 0;
+	int ret;
+
+	if (ublksrv_is_recovering(cdev))
+		return ovl_recover_tgt(dev, 0);
+
+	strcpy(tgt_json.name, "overlay");
+
+	while ((opt = getopt_long(argc, argv, "-:",
+				  ovl_longopts, &option_index)) != -1) {
+		const char *name;
+
+		if (opt != 0)
+			continue;
+
+		name = ovl_longopts[option_index].name;
+		if (!strcmp(name, "base"))
+			base = optarg;
+		else if (!strcmp(name, "overlay"))
+			overlay = optarg;
+		else if (!strcmp(name, "chunk_kb"))
+			chunk_kb = strtoul(optarg, NULL, 10);
+		else if (!strcmp(name, "stream_rate"))
+			stream_rate = strtoul(optarg, NULL, 10);
+		else if (!strcmp(name, "fetch_threads"))
+			fetch_threads = strtoul(optarg, NULL, 10);
+	}
+
+	if (!base || !overlay || strlen(base) >= PATH_MAX ||
+			strlen(overlay) >= PATH_MAX) {
+		ublk_err("%s: --base and --overlay are required\n", __func__);
+		return -EINVAL;
+	}
+
+	ublk_json_write_dev_info(cdev);
+	ublk_json_write_tgt_str(cdev, "base", base);
+	ublk_json_write_tgt_str(cdev, "overlay", overlay);
+	ublk_json_write_tgt_ulong(cdev, "chunk_kb", chunk_kb);
+	ublk_json_write_tgt_ulong(cdev, "stream_rate", stream_rate);
+	ublk_json_write_tgt_ulong(cdev, "fetch_threads", fetch_threads);
+
+	ret = ovl_setup_tgt(dev);
+	if (ret)
+		return ret;
+
+	tgt_json.dev_size = tgt->dev_size;
+	ublk_json_write_target_base(cdev, &tgt_json);
+
+	struct ublk_params p = {
+		.types = UBLK_PARAM_TYPE_BASIC,
+		.basic = {
+			.attrs			= UBLK_ATTR_VOLATILE_CACHE,
+			.logical_bs_shift	= 9,
+			.physical_bs_shift	= 12,
+			.io_opt_shift		= (__u8)(((struct ovl_tgt_data *)
+						tgt->tgt_data)->chunk_shift),
+			.io_min_shift		= 9,
+			.max_sectors		= info->max_io_buf_bytes >> 9,
+			.dev_sectors		= tgt->dev_size >> 9,
+		},
+	};
+	ublk_json_write_params(cdev, &p);
+
+	return 0;
+}
+
+static void ovl_deinit_tgt(const struct ublksrv_dev *dev)
+{
+	ovl_free_tgt_data((struct ovl_tgt_data *)dev->tgt.tgt_data);
+}
+
+static co_io_job __ovl_handle_io_async(const struct ublksrv_queue *q,
+		const struct ublk_io_data *data, int tag)
+{
+	struct ublk_io_tgt *io = __ublk_get_io_tgt_data(data);
+	const struct ublksrv_io_desc *iod = data->iod;
+	unsigned ublk_op = ublksrv_get_op(iod);
+	struct io_uring_sqe *sqe[1];
+	int ret;
+
+again:
+	ublk_queue_alloc_sqes(q, sqe, 1);
+	if (ublk_op == UBLK_IO_OP_READ)
+		io_uring_prep_read(sqe[0], 1 /*fds[1]*/, (void *)iod->addr,
+				iod->nr_sectors << 9, iod->start_sector << 9);
+	else
+		io_uring_prep_write(sqe[0], 1 /*fds[1]*/, (void *)iod->addr,
+				iod->nr_sectors << 9, iod->start_sector << 9);
+	io_uring_sqe_set_flags(sqe[0], IOSQE_FIXED_FILE);
+	sqe[0]->user_data = build_user_data(tag, ublk_op, 0, 1);
+
+	co_await__suspend_always(tag);
+
+	ret = io->tgt_io_cqe->res;
+	if (ret == -EAGAIN)
+		goto again;
+	ublksrv_complete_io(q, tag, ret);
+}
+
+/*
+ * The fetch worker is picked by the io's first chunk. One io spanning
+ * several chunks is handled by that worker alone, so the same chunk may
+ * be wanted by two workers at once, and ovl_claim_chunk() serializes
+ * them by chunk state.
+ */
+static void ovl_offload_io(const struct ublksrv_queue *q,
+		const struct ublk_io_data *data)
+{
+	struct ovl_tgt_data *d = (struct ovl_tgt_data *)q->dev->tgt.tgt_data;
+	const struct ublksrv_io_desc *iod = data->iod;
+	unsigned long long c = ((unsigned long long)iod->start_sector << 9) >>
+		d->chunk_shift;
+	struct ovl_worker *w = &d->workers[c % d->nr_workers];
+	struct ublksrv_aio *req = ublksrv_aio_alloc_req(w->ctx, 0);
+
+	if (!req) {
+		ublksrv_complete_io(q, data->tag, -ENOMEM);
+		return;
+	}
+
+	req->io = *iod;
+	req->id = ublksrv_aio_pid_tag(q->q_id, data->tag);
+	ublksrv_aio_submit_req(w->ctx, q, req);
+}
+
+static int ovl_handle_io_async(const struct ublksrv_queue *q,
+		const struct ublk_io_data *data)
+{
+	const struct ovl_tgt_data *d = (struct ovl_tgt_data *)q->dev->tgt.tgt_data;
+	struct ublk_io_tgt *io = __ublk_get_io_tgt_data(data);
+
+	switch (ublksrv_get_op(data->iod)) {
+	case UBLK_IO_OP_READ:
+	case UBLK_IO_OP_WRITE:
+		if (ovl_range_present(d, data->iod)) {
+			io->co = __ovl_handle_io_async(q, data, data->tag);
+			break;
+		}
+		ovl_offload_io(q, data);
+		break;
+	case UBLK_IO_OP_FLUSH:
+		ovl_offload_io(q, data);
+		break;
+	default:
+		ublksrv_complete_io(q, data->tag, -EINVAL);
+		break;
+	}
+	return 0;
+}
+
+static void ovl_tgt_io_done(const struct ublksrv_queue *q,
+		const struct ublk_io_data *data,
+		const struct io_uring_cqe *cqe)
+{
+	ublksrv_tgt_io_done(q, data, cqe);
+}
+
+/*
+ * Every worker has its own aio context. The queue eventfd is re-armed by
+ * the first one, and completions added to others after they are drained
+ * here send one new event.
+ */
+static void ovl_handle_event(const struct ublksrv_queue *q)
+{
+	const struct ovl_tgt_data *d = (struct ovl_tgt_data *)q->dev->tgt.tgt_data;
+	unsigned i;
+
+	ublksrv_aio_handle_event(d->workers[0].ctx, q);
+
+	for (i = 1; i < d->nr_workers; i++) {
+		struct ublksrv_aio_ctx *ctx = d->workers[i].ctx;
+		struct ublksrv_aio *req;
+		struct aio_list done;
+
+		aio_list_init(&done);
+		ublksrv_aio_get_completed_reqs(ctx, q, &done);
+		while ((req = aio_list_pop(&done))) {
+			ublksrv_complete_io(q, ublksrv_aio_tag(req->id),
+					req->res);
+			ublksrv_aio_free_req(ctx, req);
+		}
+	}
+}
+
+static void ovl_cmd_usage()
+{
+	printf("\t--base {FILE | nbd://HOST[:PORT][/EXPORT] | nbd+unix:///[EXPORT]?socket=PATH}\n");
+	printf("\t--overlay FILE [--chunk_kb KB] [--stream_rate MB] [--fetch_threads N]\n");
+}
+
+static const struct ublksrv_tgt_type  ovl_tgt_type = {
+	.handle_io_async = ovl_handle_io_async,
+	.tgt_io_done = ovl_tgt_io_done,
+	.handle_event = ovl_handle_event,
+	.usage_for_add = ovl_cmd_usage,
+	.init_tgt = ovl_init_tgt,
+	.deinit_tgt = ovl_deinit_tgt,
+	.ublksrv_flags = UBLKSRV_F_NEED_EVENTFD,
+	.name	=  "overlay",
+};
+
+int main(int argc, char *argv[])
+{
+	return ublksrv_main(&ovl_tgt_type, argc, argv);
+}
@@ -0,0 +1,1107 @@
+// SPDX-License-Identifier: MIT or GPL-2.0-only
+
+/*
+ * Zoned target
+ *
+ * Exports one host managed zoned device(UBLK_F_ZONED) over a regular file
+ * or block device, and every zone is sequential write required.
+ *
+ * Write pointer and condition of each zone are kept in memory, writes and
+ * zone appends reserve space by advancing the write pointer with one CAS,
+ * so appends to same zone from all queues are sequenced without lock. The
+ * device lock is only grabbed for zone condition change, which has to
+ * respect the open/active zone limits.
+ *
+ * The zone table is checkpointed to one metadata area following the last
+ * zone when handling FLUSH and at exit, and loaded when the device is
+ * added again or recovered.
+ *
+ * If the backing device is zoned, its zone layout is exported, and zone
+ * management is passed through to it.
+ */
+
+#include <config.h>
+
+#include <atomic>
+#include <mutex>
+#include <sys/sysmacros.h>
+#include <linux/falloc.h>
+#include <linux/blkzoned.h>
+
+#include "ublksrv_tgt.h"
+
+#define ZONED_META_MAGIC	0x64656e6f7a6b6c75ULL	/* "ublkzoned" */
+#define ZONED_DEF_ZONE_MB	256
+
+struct zoned_zone {
+	/* only changed with ->lock held, read locklessly for report zones */
+	std::atomic<__u64> wp;
+	/* BLK_ZONE_COND_*, only changed with zoned_tgt_data->lock held */
+	std::atomic<__u8> cond;
+	__u8 type;
+
+	__u64 start;
+	__u64 cap;
+
+	/*
+	 * serialize write pointer advance against zone close, finish and
+	 * reset, nested in zoned_tgt_data->lock
+	 */
+	std::mutex lock;
+
+	/* serialize zone append on zoned backing device */
+	std::mutex append_lock;
+};
+
+struct zoned_meta_zone {
+	__u64 wp;
+	__u32 cond;
+	__u32 pad;
+};
+
+struct zoned_meta {
+	__u64 magic;
+	__u64 zone_sectors;
+	__u64 zone_cap;
+	__u32 nr_zones;
+	__u32 pad;
+	struct zoned_meta_zone zones[];
+};
+
+struct zoned_tgt_data {
+	bool passthrough;
+	bool block_device;
+
+	/* buffered fd for storing zone table, unused for passthrough */
+	int meta_fd;
+	__u64 meta_off;
+
+	__u64 zone_sectors;
+	__u64 zone_cap;
+	unsigned zone_shift;
+	unsigned nr_zones;
+	unsigned max_open;
+	unsigned max_active;
+
+	/* protects zone condition change and nr_open/nr_active */
+	std::mutex lock;
+	unsigned nr_open;
+	unsigned nr_active;
+
+	/* serialize checkpoint from all queues */
+	std::mutex meta_lock;
+
+	struct zoned_zone *zones;
+};
+
+static inline unsigned long long zoned_meta_bytes(unsigned nr_zones)
+{
+	return round_up(sizeof(struct zoned_meta) +
+			nr_zones * sizeof(struct zoned_meta_zone), 4096);
+}
+
+static inline bool zoned_is_seq(const struct zoned_zone *z)
+{
+	return z->type == BLK_ZONE_TYPE_SEQWRITE_REQ;
+}
+
+static inline bool zoned_is_open(__u8 cond)
+{
+	return cond == BLK_ZONE_COND_IMP_OPEN || cond == BLK_ZONE_COND_EXP_OPEN;
+}
+
+static inline struct zoned_zone *zoned_get_zone(const struct zoned_tgt_data *td,
+		__u64 sector)
+{
+	__u64 idx = sector >> td->zone_shift;
+
+	if (idx >= td->nr_zones)
+		return NULL;
+	return &td->zones[idx];
+}
+
+static int zoned_read_sysfs_limit(dev_t devt, const char *name)
+{
+	char buf[128], val[32];
+	int fd, ret;
+
+	snprintf(buf, sizeof(buf), "/sys/dev/block/%u:%u/queue/%s",
+			major(devt), minor(devt), name);
+	fd = open(buf, O_RDONLY);
+	if (fd < 0)
+		return 0;
+	ret = pread(fd, val, sizeof(val) - 1, 0);
+	close(fd);
+	if (ret <= 0)
+		return 0;
+	val[ret] = 0;
+	return strtol(val, NULL, 10);
+}
+
+/*
+ * Zone condition change, called with td->lock held
+ */
+static void zoned_close_zone_locked(struct zoned_tgt_data *td,
+		struct zoned_zone *z)
+{
+	std::lock_guard<std::mutex> zlock(z->lock);
+	__u8 cond = z->cond.load();
+
+	if (!zoned_is_open(cond))
+		return;
+
+	td->nr_open--;
+	if (z->wp.load() == z->start) {
+		td->nr_active--;
+		z->cond.store(BLK_ZONE_COND_EMPTY);
+	} else {
+		z->cond.store(BLK_ZONE_COND_CLOSED);
+	}
+}
+
+/* close one implicitly opened zone for making room of new open */
+static bool zoned_close_imp_open_locked(struct zoned_tgt_data *td)
+{
+	for (unsigned i = 0; i < td->nr_zones; i++) {
+		struct zoned_zone *z = &td->zones[i];
+
+		if (z->cond.load() == BLK_ZONE_COND_IMP_OPEN) {
+			zoned_close_zone_locked(td, z);
+			return true;
+		}
+	}
+	return false;
+}
+
+static int zoned_open_zone_locked(struct zoned_tgt_data *td,
+		struct zoned_zone *z, bool explicit_open)
+{
+	__u8 cond = z->cond.load();
+
+	switch (cond) {
+	case BLK_ZONE_COND_EXP_OPEN:
+		return 0;
+	case BLK_ZONE_COND_IMP_OPEN:
+		if (explicit_open)
+			z->cond.store(BLK_ZONE_COND_EXP_OPEN);
+		return 0;
+	case BLK_ZONE_COND_FULL:
+		return explicit_open ? 0 : -EIO;
+	case BLK_ZONE_COND_EMPTY:
+		if (td->max_active && td->nr_active >= td->max_active)
+			return -EOVERFLOW;
+		break;
+	case BLK_ZONE_COND_CLOSED:
+		break;
+	default:
+		return -EIO;
+	}
+
+	if (td->max_open && td->nr_open >= td->max_open &&
+			!zoned_close_imp_open_locked(td))
+		return -ETOOMANYREFS;
+
+	if (cond == BLK_ZONE_COND_EMPTY)
+		td->nr_active++;
+	td->nr_open++;
+	z->cond.store(explicit_open ? BLK_ZONE_COND_EXP_OPEN :
+			BLK_ZONE_COND_IMP_OPEN);
+	return 0;
+}
+
+static void zoned_finish_zone_locked(struct zoned_tgt_data *td,
+		struct zoned_zone *z)
+{
+	std::lock_guard<std::mutex> zlock(z->lock);
+	__u8 cond = z->cond.load();
+
+	if (zoned_is_open(cond)) {
+		td->nr_open--;
+		td->nr_active--;
+	} else if (cond == BLK_ZONE_COND_CLOSED) {
+		td->nr_active--;
+	}
+	z->wp.store(z->start + z->cap);
+	z->cond.store(BLK_ZONE_COND_FULL);
+}
+
+static void zoned_reset_zone_locked(struct zoned_tgt_data *td,
+		struct zoned_zone *z)
+{
+	std::lock_guard<std::mutex> zlock(z->lock);
+	__u8 cond = z->cond.load();
+
+	if (zoned_is_open(cond)) {
+		td->nr_open--;
+		td->nr_active--;
+	} else if (cond == BLK_ZONE_COND_CLOSED) {
+		td->nr_active--;
+	}
+	z->wp.store(z->start);
+	z->cond.store(BLK_ZONE_COND_EMPTY);
+}
+
+/*
+ * Reserve space for WRITE or ZONE_APPEND, return the start sector in
+ * '*sector' for zone append. The io has to be ended by zoned_commit().
+ */
+static int zoned_reserve(struct zoned_tgt_data *td, struct zoned_zone *z,
+		__u64 *sector, unsigned nr_sectors, bool append)
+{
+	__u64 end = z->start + z->cap;
+
+	if (!zoned_is_seq(z))
+		return append ? -EIO : 0;
+
+	/*
+	 * The zone may be closed, finished or reset after it is opened,
+	 * so check it again with zone lock held, which can't be nested
+	 * in td->lock here.
+	 */
+	for (;;) {
+		int ret;
+
+		{
+			std::lock_guard<std::mutex> zlock(z->lock);
+			__u64 wp = z->wp.load();
+			__u64 pos = append ? wp : *sector;
+
+			if (zoned_is_open(z->cond.load())) {
+				if (pos != wp || pos + nr_sectors > end)
+					return -EIO;
+				z->wp.store(pos + nr_sectors);
+				*sector = pos;
+				return 0;
+			}
+		}
+
+		std::lock_guard<std::mutex> lock(td->lock);
+		ret = zoned_open_zone_locked(td, z, false);
+		if (ret)
+			return ret;
+	}
+}
+
+/*
+ * End WRITE or ZONE_APPEND reserved by zoned_reserve(): the zone becomes
+ * full if the io succeeds and reaches zone capacity, and the write
+ * pointer is rolled back if the io fails. Rollback isn't possible after
+ * space following this io is reserved, then the failed range is left
+ * as written, like one device which doesn't roll back write pointer.
+ */
+static void zoned_commit(struct zoned_tgt_data *td, struct zoned_zone *z,
+		__u64 sector, unsigned nr_sectors, int res)
+{
+	__u64 wp = sector + nr_sectors;
+
+	if (!zoned_is_seq(z))
+		return;
+
+	if (res < 0) {
+		std::lock_guard<std::mutex> zlock(z->lock);
+
+		if (z->wp.load() == wp)
+			z->wp.store(sector);
+		else
+			ublk_err("%s: zone %llu write pointer can't be rolled back\n",
+					__func__, z->start >> td->zone_shift);
+		return;
+	}
+
+	if (wp == z->start + z->cap) {
+		std::lock_guard<std::mutex> lock(td->lock);
+
+		if (zoned_is_open(z->cond.load()))
+			zoned_finish_zone_locked(td, z);
+	}
+}
+
+static int zoned_store_meta(struct zoned_tgt_data *td)
+{
+	unsigned long long len = zoned_meta_bytes(td->nr_zones);
+	struct zoned_meta *m;
+	int ret;
+
+	if (td->passthrough)
+		return 0;
+
+	m = (struct zoned_meta *)calloc(1, len);
+	if (!m)
+		return -ENOMEM;
+
+	m->magic = ZONED_META_MAGIC;
+	m->zone_sectors = td->zone_sectors;
+	m->zone_cap = td->zone_cap;
+	m->nr_zones = td->nr_zones;
+
+	std::lock_guard<std::mutex> meta_lock(td->meta_lock);
+	{
+		std::lock_guard<std::mutex> lock(td->lock);
+
+		for (unsigned i = 0; i < td->nr_zones; i++) {
+			m->zones[i].wp = td->zones[i].wp.load();
+			m->zones[i].cond = td->zones[i].cond.load();
+		}
+	}
+	ret = pwrite(td->meta_fd, m, len, td->meta_off);
+	free(m);
+
+	return ret == (int)len ? 0 : -EIO;
+}
+
+static void zoned_load_meta(struct zoned_tgt_data *td)
+{
+	unsigned long long len = zoned_meta_bytes(td->nr_zones);
+	struct zoned_meta *m = (struct zoned_meta *)malloc(len);
+	int ret;
+
+	if (!m)
+		return;
+
+	ret = pread(td->meta_fd, m, len, td->meta_off);
+	if (ret != (int)len || m->magic != ZONED_META_MAGIC ||
+			m->zone_sectors != td->zone_sectors ||
+			m->zone_cap != td->zone_cap ||
+			m->nr_zones != td->nr_zones) {
+		ublk_log("%s: no valid zone table, start with empty zones\n",
+				__func__);
+		goto out;
+	}
+
+	for (unsigned i = 0; i < td->nr_zones; i++) {
+		struct zoned_zone *z = &td->zones[i];
+		__u64 wp = m->zones[i].wp;
+		__u8 cond = m->zones[i].cond;
+
+		if (wp < z->start || wp > z->start + z->cap)
+			continue;
+
+		/* open zones become closed after restart, like power cycle */
+		if (cond == BLK_ZONE_COND_FULL || wp == z->start + z->cap) {
+			z->wp = z->start + z->cap;
+			z->cond = BLK_ZONE_COND_FULL;
+		} else if (wp > z->start) {
+			z->wp = wp;
+			z->cond = BLK_ZONE_COND_CLOSED;
+			td->nr_active++;
+		}
+	}
+out:
+	free(m);
+}
+
+static int zoned_load_backing_zones(struct zoned_tgt_data *td, int fd)
+{
+	const unsigned nr = 256;
+	size_t len = sizeof(struct blk_zone_report) + nr * sizeof(struct blk_zone);
+	struct blk_zone_report *rep = (struct blk_zone_report *)malloc(len);
+	unsigned idx = 0;
+	int ret = 0;
+
+	if (!rep)
+		return -ENOMEM;
+
+	while (idx < td->nr_zones) {
+		memset(rep, 0, len);
+		rep->sector = (__u64)idx << td->zone_shift;
+		rep->nr_zones = nr;
+		if (ioctl(fd, BLKREPORTZONE, rep)) {
+			ret = -errno;
+			break;
+		}
+		if (!rep->nr_zones)
+			break;
+
+		for (unsigned i = 0; i < rep->nr_zones && idx < td->nr_zones;
+				i++, idx++) {
+			const struct blk_zone *bz = &rep->zones[i];
+			struct zoned_zone *z = &td->zones[idx];
+
+			z->type = bz->type;
+			z->cap = (rep->flags & BLK_ZONE_REP_CAPACITY) ?
+				bz->capacity : bz->len;
+			z->wp = bz->wp;
+			z->cond = bz->cond;
+			if (zoned_is_open(bz->cond)) {
+				td->nr_open++;
+				td->nr_active++;
+			} else if (bz->cond == BLK_ZONE_COND_CLOSED) {
+				td->nr_active++;
+			}
+		}
+	}
+	free(rep);
+	return ret;
+}
+
+static int zoned_setup_tgt(struct ublksrv_dev *dev, int type)
+{
+	struct ublksrv_tgt_info *tgt = &dev->tgt;
+	const struct ublksrv_ctrl_dev *cdev = ublksrv_get_ctrl_dev(dev);
+	const struct ublksrv_ctrl_dev_info *info = ublksrv_ctrl_get_dev_info(cdev);
+	struct zoned_tgt_data *td = (struct zoned_tgt_data *)dev->tgt.tgt_data;
+	unsigned long direct_io = 0, zone_cap = 0, passthrough = 0;
+	char file[PATH_MAX];
+	struct ublk_params p;
+	struct stat sb;
+	int fd = -1, ret;
+
+	ret = ublk_json_read_target_str_info(cdev, "backing_file", file);
+	if (ret < 0) {
+		ublk_err( "%s: backing file can't be retrieved from jbuf %d\n",
+				__func__, ret);
+		goto fail;
+	}
+
+	ret = ublk_json_read_target_ulong_info(cdev, "direct_io", &direct_io);
+	if (!ret)
+		ret = ublk_json_read_target_ulong_info(cdev, "zone_capacity",
+				&zone_cap);
+	if (!ret)
+		ret = ublk_json_read_target_ulong_info(cdev, "passthrough",
+				&passthrough);
+	if (ret) {
+		ublk_err( "%s: read target info failed %d\n", __func__, ret);
+		goto fail;
+	}
+
+	ret = ublk_json_read_params(&p, cdev);
+	if (ret) {
+		ublk_err( "%s: read ublk params failed %d\n",
+				__func__, ret);
+		goto fail;
+	}
+
+	fd = open(file, O_RDWR);
+	if (fd < 0) {
+		ublk_err( "%s: backing file %s can't be opened\n",
+				__func__, file);
+		ret = -errno;
+		goto fail;
+	}
+
+	if (fstat(fd, &sb) < 0) {
+		ublk_err( "%s: unable to stat %s\n",
+				  __func__, file);
+		ret = -errno;
+		goto fail;
+	}
+
+	td->block_device = S_ISBLK(sb.st_mode);
+	td->passthrough = passthrough;
+	td->zone_sectors = p.basic.chunk_sectors;
+	td->zone_cap = zone_cap;
+	td->zone_shift = ilog2(p.basic.chunk_sectors);
+	td->nr_zones = p.basic.dev_sectors >> td->zone_shift;
+	td->max_open = p.zoned.max_open_zones;
+	td->max_active = p.zoned.max_active_zones;
+	td->meta_off = p.basic.dev_sectors << 9;
+	td->meta_fd = -1;
+
+	td->zones = new zoned_zone[td->nr_zones];
+	for (unsigned i = 0; i < td->nr_zones; i++) {
+		struct zoned_zone *z = &td->zones[i];
+
+		z->type = BLK_ZONE_TYPE_SEQWRITE_REQ;
+		z->start = (__u64)i << td->zone_shift;
+		z->cap = td->zone_cap;
+		z->wp = z->start;
+		z->cond = BLK_ZONE_COND_EMPTY;
+	}
+
+	if (td->passthrough) {
+		ret = zoned_load_backing_zones(td, fd);
+		if (ret) {
+			ublk_err( "%s: report zones of %s failed %d\n",
+					__func__, file, ret);
+			goto fail;
+		}
+	} else {
+		td->meta_fd = open(file, O_RDWR);
+		if (td->meta_fd < 0) {
+			ret = -errno;
+			ublk_err( "%s: open %s for zone table failed\n",
+					__func__, file);
+			goto fail;
+		}
+		zoned_load_meta(td);
+	}
+
+	if (direct_io)
+		fcntl(fd, F_SETFL, O_DIRECT);
+
+	ublksrv_tgt_set_io_data_size(tgt);
+	tgt->dev_size = p.basic.dev_sectors << 9;
+	/* user copy needs two linked sqes for each io */
+	tgt->tgt_ring_depth = info->queue_depth * 2;
+	tgt->nr_fds = 1;
+	tgt->fds[1] = fd;
+
+	return 0;
+fail:
+	/* ->deinit_tgt() isn't called if setup fails */
+	if (fd >= 0)
+		close(fd);
+	delete[] td->zones;
+	delete td;
+	tgt->tgt_data = NULL;
+	return ret;
+}
+
+static int zoned_recover_tgt(struct ublksrv_dev *dev, int type)
+{
+	dev->tgt.tgt_data = new zoned_tgt_data();
+
+	return zoned_setup_tgt(dev, type);
+}
+
+static int zoned_init_tgt(struct ublksrv_dev *dev, int type, int argc, char
+		*argv[])
+{
+	const struct ublksrv_ctrl_dev *cdev = ublksrv_get_ctrl_dev(dev);
+	const struct ublksrv_ctrl_dev_info *info =
+		ublksrv_ctrl_get_dev_info(cdev);
+	int buffered_io = 0;
+	static const struct option zoned_longopts[] = {
+		{ "file",		1,	NULL, 'f' },
+		{ "buffered_io",	no_argument, &buffered_io, 1},
+		{ "zone_size",		required_argument, NULL, 0},
+		{ "zone_capacity",	required_argument, NULL, 0},
+		{ "max_open_zones",	required_argument, NULL, 0},
+		{ "max_active_zones",	required_argument, NULL, 0},
+		{ NULL }
+	};
+	unsigned long long bytes, zone_bytes, zone_cap_bytes = 0;
+	unsigned long zone_mb = ZONED_DEF_ZONE_MB, zone_cap_mb = 0;
+	unsigned max_open = 0, max_active = 0, nr_zones;
+	struct stat st;
+	int fd, opt, option_index;
+	char *file = NULL;
+	bool passthrough = false;
+	struct ublksrv_tgt_base_json tgt_json = { 0 };
+	struct ublk_params p = {
+		.types = UBLK_PARAM_TYPE_BASIC | UBLK_PARAM_TYPE_ZONED,
+		.basic = {
+			.attrs                  = UBLK_ATTR_VOLATILE_CACHE,
+			.logical_bs_shift	= 9,
+			.physical_bs_shift	= 12,
+			.io_opt_shift	= 12,
+			.io_min_shift	= 9,
+			.max_sectors		= info->max_io_buf_bytes >> 9,
+		},
+	};
+
+	if (ublksrv_is_recovering(cdev))
+		return zoned_recover_tgt(dev, 0);
+
+	strcpy(tgt_json.name, "zoned");
+
+	while ((opt = getopt_long(argc, argv, "-:f:",
+				  zoned_longopts, &option_index)) != -1) {
+		switch (opt) {
+		case 'f':
+			file = strdup(optarg);
+			break;
+		case 0:
+			if (!strcmp(zoned_longopts[option_index].name, "zone_size"))
+				zone_mb = strtoul(optarg, NULL, 10);
+			if (!strcmp(zoned_longopts[option_index].name, "zone_capacity"))
+				zone_cap_mb = strtoul(optarg, NULL, 10);
+			if (!strcmp(zoned_longopts[option_index].name, "max_open_zones"))
+				max_open = strtoul(optarg, NULL, 10);
+			if (!strcmp(zoned_longopts[option_index].name, "max_active_zones"))
+				max_active = strtoul(optarg, NULL, 10);
+			break;
+		}
+	}
+
+	if (!file)
+		return -1;
+
+	fd = open(file, O_RDWR);
+	if (fd < 0) {
+		ublk_err( "%s: backing file %s can't be opened\n",
+				__func__, file);
+		return -2;
+	}
+
+	if (fstat(fd, &st) < 0)
+		return -2;
+
+	if (S_ISBLK(st.st_mode)) {
+		unsigned int bs, pbs, zone_sectors = 0;
+
+		if (ioctl(fd, BLKGETSIZE64, &bytes) != 0)
+			return -1;
+		if (ioctl(fd, BLKSSZGET, &bs) != 0)
+			return -1;
+		if (ioctl(fd, BLKPBSZGET, &pbs) != 0)
+			return -1;
+		p.basic.logical_bs_shift = ilog2(bs);
+		p.basic.physical_bs_shift = ilog2(pbs);
+
+		if (!ioctl(fd, BLKGETZONESZ, &zone_sectors) && zone_sectors) {
+			passthrough = true;
+			zone_bytes = (unsigned long long)zone_sectors << 9;
+			if (ioctl(fd, BLKGETNRZONES, &nr_zones) != 0)
+				return -1;
+			/* the last smaller zone isn't exported */
+			if (nr_zones > bytes / zone_bytes)
+				nr_zones = bytes / zone_bytes;
+			max_open = zoned_read_sysfs_limit(st.st_rdev,
+					"max_open_zones");
+			max_active = zoned_read_sysfs_limit(st.st_rdev,
+					"max_active_zones");
+		}
+	} else if (S_ISREG(st.st_mode)) {
+		bytes = st.st_size;
+		p.basic.logical_bs_shift = ilog2(st.st_blksize);
+		p.basic.physical_bs_shift = ilog2(st.st_blksize);
+	} else {
+		ublk_err( "%s: %s isn't regular file or block device\n",
+				__func__, file);
+		return -2;
+	}
+
+	if (!passthrough) {
+		zone_bytes = (unsigned long long)zone_mb << 20;
+		zone_cap_bytes = (unsigned long long)zone_cap_mb << 20;
+		if (!zone_mb || (zone_mb & (zone_mb - 1)) ||
+				zone_bytes > (1ULL << 41)) {
+			ublk_err( "%s: zone size %lu MB isn't power of 2\n",
+					__func__, zone_mb);
+			return -EINVAL;
+		}
+		if (!zone_cap_bytes)
+			zone_cap_bytes = zone_bytes;
+		if (zone_cap_bytes > zone_bytes) {
+			ublk_err( "%s: zone capacity is bigger than zone size\n",
+					__func__);
+			return -EINVAL;
+		}
+
+		/* zone table is stored after the last zone */
+		nr_zones = bytes / zone_bytes;
+		while (nr_zones && nr_zones * zone_bytes +
+				zoned_meta_bytes(nr_zones) > bytes)
+			nr_zones--;
+	}
+
+	if (!nr_zones) {
+		ublk_err( "%s: %s is too small for one zone\n",
+				__func__, file);
+		return -EINVAL;
+	}
+
+	if (max_open > nr_zones)
+		max_open = nr_zones;
+	if (max_active > nr_zones)
+		max_active = nr_zones;
+	if (max_active && max_open > max_active)
+		max_open = max_active;
+
+	/*
+	 * in case of buffered io, use common bs/pbs so that all FS
+	 * image can be supported
+	 */
+	if (buffered_io || !ublk_param_is_valid(&p) ||
+			fcntl(fd, F_SETFL, O_DIRECT)) {
+		p.basic.logical_bs_shift = 9;
+		p.basic.physical_bs_shift = 12;
+		buffered_io = 1;
+	}
+
+	bytes = nr_zones * zone_bytes;
+	tgt_json.dev_size = bytes;
+	p.basic.dev_sectors = bytes >> 9;
+	p.basic.chunk_sectors = zone_bytes >> 9;
+	p.zoned.max_open_zones = max_open;
+	p.zoned.max_active_zones = max_active;
+	p.zoned.max_zone_append_sectors = p.basic.max_sectors;
+
+	ublk_json_write_dev_info(cdev);
+	ublk_json_write_target_base(cdev, &tgt_json);
+	ublk_json_write_tgt_str(cdev, "backing_file", file);
+	ublk_json_write_tgt_long(cdev, "direct_io", !buffered_io);
+	ublk_json_write_tgt_ulong(cdev, "zone_capacity", zone_cap_bytes >> 9);
+	ublk_json_write_tgt_long(cdev, "passthrough", passthrough);
+	ublk_json_write_params(cdev, &p);
+
+	close(fd);
+
+	dev->tgt.tgt_data = new zoned_tgt_data();
+
+	return zoned_setup_tgt(dev, type);
+}
+
+static inline void zoned_handle_fua(struct io_uring_sqe *sqe,
+		const struct ublksrv_io_desc *iod)
+{
+	if (iod->op_flags & UBLK_IO_F_FUA)
+		sqe->rw_flags |= RWF_DSYNC;
+}
+
+/* copy data between ublk request and backing file, see lo_rw_user_copy() */
+static int zoned_queue_rw(const struct ublksrv_queue *q,
+		const struct ublksrv_io_desc *iod, int tag, __u64 sector)
+{
+	unsigned ublk_op = ublksrv_get_op(iod);
+	struct io_uring_sqe *sqe[2];
+	__u64 pos = ublk_pos(q->q_id, tag, 0);
+	void *buf = ublksrv_queue_get_io_buf(q, tag);
+
+	ublk_queue_alloc_sqes(q, sqe, 2);
+	if (ublk_op == UBLK_IO_OP_READ) {
+		io_uring_prep_read(sqe[0], 1 /*fds[1]*/,
+				buf, iod->nr_sectors << 9, sector << 9);
+		io_uring_sqe_set_flags(sqe[0], IOSQE_FIXED_FILE | IOSQE_IO_LINK);
+		sqe[0]->user_data = build_user_data(tag, ublk_op, 0, 1);
+
+		io_uring_prep_write(sqe[1], 0 /*fds[0]*/,
+				buf, iod->nr_sectors << 9, pos);
+		io_uring_sqe_set_flags(sqe[1], IOSQE_FIXED_FILE);
+		sqe[1]->user_data = build_user_data(tag, UBLK_USER_COPY_WRITE, 0, 1);
+	} else {
+		io_uring_prep_read(sqe[0], 0 /*fds[0]*/,
+				buf, iod->nr_sectors << 9, pos);
+		io_uring_sqe_set_flags(sqe[0], IOSQE_FIXED_FILE | IOSQE_IO_LINK);
+		sqe[0]->user_data = build_user_data(tag, UBLK_USER_COPY_READ, 0, 1);
+
+		io_uring_prep_write(sqe[1], 1 /*fds[1]*/,
+				buf, iod->nr_sectors << 9, sector << 9);
+		io_uring_sqe_set_flags(sqe[1], IOSQE_FIXED_FILE);
+		zoned_handle_fua(sqe[1], iod);
+		sqe[1]->user_data = build_user_data(tag, ublk_op, 0, 1);
+	}
+	return 2;
+}
+
+static int zoned_handle_flush(const struct ublksrv_queue *q,
+		const struct ublksrv_io_desc *iod, int tag,
+		struct zoned_tgt_data *td)
+{
+	struct io_uring_sqe *sqe[1];
+	int ret;
+
+	/* zone table shares inode with data, so covered by the fsync */
+	ret = zoned_store_meta(td);
+	if (ret)
+		return ret;
+
+	ublk_queue_alloc_sqes(q, sqe, 1);
+	io_uring_prep_fsync(sqe[0], 1 /*fds[1]*/, IORING_FSYNC_DATASYNC);
+	io_uring_sqe_set_flags(sqe[0], IOSQE_FIXED_FILE);
+	sqe[0]->user_data = build_user_data(tag, ublksrv_get_op(iod), 0, 1);
+	return 1;
+}
+
+/*
+ * Zone append on zoned backing device has to be issued in order of
+ * the reserved sector, so do it synchronously with zone lock held.
+ */
+static int zoned_passthrough_append(const struct ublksrv_queue *q,
+		const struct ublksrv_io_desc *iod, int tag,
+		struct zoned_tgt_data *td, struct zoned_zone *z, __u64 *sector)
+{
+	unsigned len = iod->nr_sectors << 9;
+	void *buf = ublksrv_queue_get_io_buf(q, tag);
+	int ret;
+
+	if (pread(q->dev->tgt.fds[0], buf, len,
+				ublk_pos(q->q_id, tag, 0)) != (ssize_t)len)
+		return -EIO;
+
+	std::lock_guard<std::mutex> lock(z->append_lock);
+	ret = zoned_reserve(td, z, sector, iod->nr_sectors, true);
+	if (ret)
+		return ret;
+	if (pwrite(q->dev->tgt.fds[1], buf, len, *sector << 9) != (ssize_t)len)
+		ret = -EIO;
+	zoned_commit(td, z, *sector, iod->nr_sectors, ret);
+	if (ret)
+		return ret;
+	if ((iod->op_flags & UBLK_IO_F_FUA) && fdatasync(q->dev->tgt.fds[1]))
+		return -errno;
+	return len;
+}
+
+static int zoned_report_zones(const struct ublksrv_queue *q,
+		const struct ublksrv_io_desc *iod, int tag,
+		struct zoned_tgt_data *td)
+{
+	unsigned first = iod->start_sector >> td->zone_shift;
+	unsigned nr = iod->nr_zones;
+	size_t len = nr * sizeof(struct blk_zone);
+	struct blk_zone *zones;
+	int ret;
+
+	if (first >= td->nr_zones)
+		return -EINVAL;
+	if (nr > td->nr_zones - first)
+		nr = td->nr_zones - first;
+
+	/* zeroed entry tells driver that there isn't more zones */
+	zones = (struct blk_zone *)calloc(1, len);
+	if (!zones)
+		return -ENOMEM;
+
+	for (unsigned i = 0; i < nr; i++) {
+		const struct zoned_zone *z = &td->zones[first + i];
+
+		zones[i].start = z->start;
+		zones[i].len = td->zone_sectors;
+		zones[i].capacity = z->cap;
+		zones[i].type = z->type;
+		if (zoned_is_seq(z)) {
+			zones[i].wp = z->wp.load();
+			zones[i].cond = z->cond.load();
+		} else {
+			zones[i].wp = ~0ULL;
+			zones[i].cond = BLK_ZONE_COND_NOT_WP;
+		}
+	}
+
+	ret = pwrite(q->dev->tgt.fds[0], zones, len, ublk_pos(q->q_id, tag, 0));
+	free(zones);
+
+	return ret < 0 ? -errno : ret;
+}
+
+static int zoned_mgmt_backing(struct zoned_tgt_data *td, int fd,
+		unsigned long cmd, struct zoned_zone *z)
+{
+	struct blk_zone_range range = {
+		.sector = z ? z->start : 0,
+		.nr_sectors = z ? td->zone_sectors :
+			(__u64)td->nr_zones << td->zone_shift,
+	};
+
+	if (ioctl(fd, cmd, &range))
+		return -errno;
+	return 0;
+}
+
+static int zoned_handle_mgmt(const struct ublksrv_queue *q,
+		const struct ublksrv_io_desc *iod,
+		struct zoned_tgt_data *td)
+{
+	unsigned ublk_op = ublksrv_get_op(iod);
+	int fd = q->dev->tgt.fds[1];
+	struct zoned_zone *z = NULL;
+	int ret = 0;
+
+	if (ublk_op != UBLK_IO_OP_ZONE_RESET_ALL) {
+		z = zoned_get_zone(td, iod->start_sector);
+		if (!z || !zoned_is_seq(z))
+			return -EIO;
+	}
+
+	std::lock_guard<std::mutex> lock(td->lock);
+	switch (ublk_op) {
+	case UBLK_IO_OP_ZONE_OPEN:
+		if (td->passthrough)
+			ret = zoned_mgmt_backing(td, fd, BLKOPENZONE, z);
+		if (!ret)
+			ret = zoned_open_zone_locked(td, z, true);
+		break;
+	case UBLK_IO_OP_ZONE_CLOSE:
+		if (td->passthrough)
+			ret = zoned_mgmt_backing(td, fd, BLKCLOSEZONE, z);
+		if (!ret)
+			zoned_close_zone_locked(td, z);
+		break;
+	case UBLK_IO_OP_ZONE_FINISH:
+		if (td->passthrough)
+			ret = zoned_mgmt_backing(td, fd, BLKFINISHZONE, z);
+		if (!ret)
+			zoned_finish_zone_locked(td, z);
+		break;
+	case UBLK_IO_OP_ZONE_RESET:
+	case UBLK_IO_OP_ZONE_RESET_ALL:
+		if (td->passthrough)
+			ret = zoned_mgmt_backing(td, fd, BLKRESETZONE, z);
+		else if (td->block_device)
+			/* stale data may be read back, as real device does */
+			ret = 0;
+		else if (fallocate(fd, FALLOC_FL_PUNCH_HOLE |
+					FALLOC_FL_KEEP_SIZE,
+					(z ? z->start : 0) << 9,
+					(z ? td->zone_sectors :
+					 (__u64)td->nr_zones << td->zone_shift) << 9))
+			ret = -errno;
+		if (ret)
+			break;
+		if (z) {
+			zoned_reset_zone_locked(td, z);
+		} else {
+			for (unsigned i = 0; i < td->nr_zones; i++)
+				if (zoned_is_seq(&td->zones[i]))
+					zoned_reset_zone_locked(td,
+							&td->zones[i]);
+		}
+		break;
+	default:
+		ret = -EINVAL;
+	}
+	return ret;
+}
+
+static int zoned_queue_tgt_io(const struct ublksrv_queue *q,
+		const struct ublksrv_io_desc *iod, int tag,
+		struct zoned_tgt_data *td, __u64 *sector)
+{
+	unsigned ublk_op = ublksrv_get_op(iod);
+	struct zoned_zone *z;
+	int ret;
+
+	switch (ublk_op) {
+	case UBLK_IO_OP_FLUSH:
+		return zoned_handle_flush(q, iod, tag, td);
+	case UBLK_IO_OP_READ:
+		*sector = iod->start_sector;
+		return zoned_queue_rw(q, iod, tag, *sector);
+	case UBLK_IO_OP_WRITE:
+	case UBLK_IO_OP_ZONE_APPEND:
+		z = zoned_get_zone(td, iod->start_sector);
+		if (!z)
+			return -EIO;
+		*sector = iod->start_sector;
+		ret = zoned_reserve(td, z, sector, iod->nr_sectors,
+				ublk_op == UBLK_IO_OP_ZONE_APPEND);
+		if (ret)
+			return ret;
+		return zoned_queue_rw(q, iod, tag, *sector);
+	default:
+		return -EINVAL;
+	}
+}
+
+static co_io_job __zoned_handle_io_async(const struct ublksrv_queue *q,
+		const struct ublk_io_data *data, int tag)
+{
+	struct ublk_io_tgt *io = __ublk_get_io_tgt_data(data);
+	struct zoned_tgt_data *td = (struct zoned_tgt_data *)q->dev->tgt.tgt_data;
+	const struct ublksrv_io_desc *iod = data->iod;
+	__u64 sector = 0;
+	int ret, io_res = 0;
+
+	ret = zoned_queue_tgt_io(q, iod, tag, td, &sector);
+	if (ret < 0) {
+		io_res = ret;
+	} else {
+		while (ret-- > 0) {
+			int res;
+
+			co_await__suspend_always(tag);
+			res = ublksrv_tgt_process_cqe(io, &io_res);
+			if (res < 0 && io_res >= 0)
+				io_res = res;
+		}
+
+		/* space is reserved only if WRITE or ZONE_APPEND is queued */
+		if (ublksrv_get_op(iod) == UBLK_IO_OP_WRITE ||
+				ublksrv_get_op(iod) == UBLK_IO_OP_ZONE_APPEND)
+			zoned_commit(td, zoned_get_zone(td, iod->start_sector),
+					sector, iod->nr_sectors, io_res);
+	}
+
+	ublk_dbg(UBLK_DBG_IO, "%s: tag %d ublk io %x %llx %u res %d\n",
+			__func__, tag, iod->op_flags, iod->start_sector,
+			iod->nr_sectors << 9, io_res);
+
+	if (ublksrv_get_op(iod) == UBLK_IO_OP_ZONE_APPEND)
+		ublksrv_complete_zone_append(q, tag, io_res, sector);
+	else
+		ublksrv_complete_io(q, tag, io_res);
+}
+
+static int zoned_handle_io_async(const struct ublksrv_queue *q,
+		const struct ublk_io_data *data)
+{
+	struct ublk_io_tgt *io = __ublk_get_io_tgt_data(data);
+	struct zoned_tgt_data *td = (struct zoned_tgt_data *)q->dev->tgt.tgt_data;
+	const struct ublksrv_io_desc *iod = data->iod;
+	unsigned ublk_op = ublksrv_get_op(iod);
+	__u64 sector = 0;
+	int res;
+
+	switch (ublk_op) {
+	case UBLK_IO_OP_ZONE_OPEN:
+	case UBLK_IO_OP_ZONE_CLOSE:
+	case UBLK_IO_OP_ZONE_FINISH:
+	case UBLK_IO_OP_ZONE_RESET:
+	case UBLK_IO_OP_ZONE_RESET_ALL:
+		ublksrv_complete_io(q, data->tag, zoned_handle_mgmt(q, iod, td));
+		break;
+	case UBLK_IO_OP_REPORT_ZONES:
+		ublksrv_complete_io(q, data->tag,
+				zoned_report_zones(q, iod, data->tag, td));
+		break;
+	case UBLK_IO_OP_ZONE_APPEND:
+		if (td->passthrough) {
+			struct zoned_zone *z = zoned_get_zone(td, iod->start_sector);
+
+			res = z ? zoned_passthrough_append(q, iod, data->tag,
+					td, z, &sector) : -EIO;
+			ublksrv_complete_zone_append(q, data->tag, res, sector);
+			break;
+		}
+		/* fall through */
+	case UBLK_IO_OP_READ:
+	case UBLK_IO_OP_WRITE:
+	case UBLK_IO_OP_FLUSH:
+		io->co = __zoned_handle_io_async(q, data, data->tag);
+		break;
+	default:
+		/* DISCARD and WRITE_ZEROES aren't supported by zoned device */
+		ublksrv_complete_io(q, data->tag, -EOPNOTSUPP);
+		break;
+	}
+	return 0;
+}
+
+static void zoned_tgt_io_done(const struct ublksrv_queue *q,
+		const struct ublk_io_data *data,
+		const struct io_uring_cqe *cqe)
+{
+	ublksrv_tgt_io_done(q, data, cqe);
+}
+
+static void zoned_deinit_tgt(const struct ublksrv_dev *dev)
+{
+	struct zoned_tgt_data *td = (struct zoned_tgt_data *)dev->tgt.tgt_data;
+
+	if (td->zones && zoned_store_meta(td))
+		ublk_err("%s: store zone table failed\n", __func__);
+	fsync(dev->tgt.fds[1]);
+	close(dev->tgt.fds[1]);
+	if (td->meta_fd >= 0)
+		close(td->meta_fd);
+	delete[] td->zones;
+	delete td;
+}
+
+static void zoned_cmd_usage()
+{
+	printf("\t-f backing_file [--buffered_io] [--zone_size MB]\n");
+	printf("\t\t[--zone_capacity MB] [--max_open_zones NUM] [--max_active_zones NUM]\n");
+	printf("\t\tzone size is power of 2, default is %d MB, capacity defaults to zone size\n",
+			ZONED_DEF_ZONE_MB);
+	printf("\t\tzoned backing device is passed through with its own zone layout\n");
+}
+
+static const struct ublksrv_tgt_type  zoned_tgt_type = {
+	.handle_io_async = zoned_handle_io_async,
+	.tgt_io_done = zoned_tgt_io_done,
+	.usage_for_add = zoned_cmd_usage,
+	.init_tgt = zoned_init_tgt,
+	.deinit_tgt	=  zoned_deinit_tgt,
+	.ublk_flags = UBLK_F_ZONED | UBLK_F_USER_COPY,
+	.name	=  "zoned",
+	.datapath_flags = UBLK_F_USER_COPY,
+};
+
+int main(int argc, char *argv[])
+{
+	return ublksrv_main(&zoned_tgt_type, argc, argv);
+}
@@ -0,0 +1,558 @@
+// SPDX-License-Identifier: MIT or GPL-2.0-only
+
+/*
+ * `ublk bench`: in-tree io_uring load generator, so that ublk devices can
+ * be measured without fio and numbers don't depend on fio versions.
+ *
+ * Each job is one pthread with its own io_uring, registered buffers and
+ * registered file. Latency of every IO is recorded into one HDR-style
+ * log-linear histogram, which has 2^BENCH_HIST_SUB_BITS sub-buckets per
+ * power of two, so the relative error is bounded by ~3% for any value.
+ */
+
+#include "config.h"
+#include "ublksrv_tgt.h"
+#include <linux/fs.h>
+#include <sys/resource.h>
+#include <vector>
+#include <string>
+#include "nlohmann/json.hpp"
+
+#define BENCH_HIST_SUB_BITS	5
+#define BENCH_HIST_SUB		(1U << BENCH_HIST_SUB_BITS)
+#define BENCH_HIST_BUCKETS	((64 - BENCH_HIST_SUB_BITS + 1) * BENCH_HIST_SUB)
+
+struct bench_hist {
+	unsigned long long cnt[BENCH_HIST_BUCKETS];
+	unsigned long long nr, sum, min, max;
+};
+
+struct bench_opts {
+	char path[64];
+	int dev_id;
+	unsigned bs;
+	unsigned qd;
+	unsigned jobs;
+	unsigned runtime;
+	unsigned rwmixread;
+	/* IOPS per job, 0 means no limit */
+	unsigned long long rate;
+	bool rand;
+	bool fixed;
+	bool json;
+};
+
+struct bench_job {
+	const struct bench_opts *o;
+	int idx;
+	pthread_t thread;
+	unsigned long long size;
+	unsigned long long reads, writes, errors;
+	struct bench_hist hist;
+};
+
+/* counters of /sys/block/ublkbN/stat, see Documentation/block/stat.rst */
+struct bench_blk_stat {
+	unsigned long long v[11];
+};
+
+static inline unsigned long long bench_now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static inline unsigned bench_hist_idx(unsigned long long v)
+{
+	unsigned msb;
+
+	if (v < BENCH_HIST_SUB)
+		return v;
+	msb = 63 - __builtin_clzll(v);
+	return ((msb - BENCH_HIST_SUB_BITS + 1) << BENCH_HIST_SUB_BITS) +
+		((v >> (msb - BENCH_HIST_SUB_BITS)) & (BENCH_HIST_SUB - 1));
+}
+
+/* the lowest value which is recorded in bucket `idx` */
+static unsigned long long bench_hist_val(unsigned idx)
+{
+	unsigned grp = idx >> BENCH_HIST_SUB_BITS;
+	unsigned sub = idx & (BENCH_HIST_SUB - 1);
+
+	if (!grp)
+		return sub;
+	return (unsigned long long)(BENCH_HIST_SUB + sub) << (grp - 1);
+}
+
+static inline void bench_hist_add(struct bench_hist *h, unsigned long long v)
+{
+	h->cnt[bench_hist_idx(v)]++;
+	h->nr++;
+	h->sum += v;
+	if (v < h->min)
+		h->min = v;
+	if (v > h->max)
+		h->max = v;
+}
+
+static void bench_hist_merge(struct bench_hist *dst, const struct bench_hist *src)
+{
+	for (unsigned i = 0; i < BENCH_HIST_BUCKETS; i++)
+		dst->cnt[i] += src->cnt[i];
+	dst->nr += src->nr;
+	dst->sum += src->sum;
+	dst->min = std::min(dst->min, src->min);
+	dst->max = std::max(dst->max, src->max);
+}
+
+static unsigned long long bench_hist_pct(const struct bench_hist *h, double pct)
+{
+	unsigned long long target = h->nr * pct / 100, sum = 0;
+
+	for (unsigned i = 0; i < BENCH_HIST_BUCKETS; i++) {
+		sum += h->cnt[i];
+		if (sum > target)
+			return std::min(bench_hist_val(i), h->max);
+	}
+	return h->max;
+}
+
+static inline unsigned long long bench_rand(unsigned long long *s)
+{
+	/* xorshift64 */
+	*s ^= *s << 13;
+	*s ^= *s >> 7;
+	*s ^= *s << 17;
+	return *s;
+}
+
+static int bench_read_blk_stat(const struct bench_opts *o,
+		struct bench_blk_stat *st)
+{
+	char path[64];
+	FILE *f;
+	int ret;
+
+	if (o->dev_id < 0)
+		return -ENOENT;
+
+	snprintf(path, sizeof(path), "/sys/block/ublkb%d/stat", o->dev_id);
+	f = fopen(path, "r");
+	if (!f)
+		return -errno;
+	ret = fscanf(f, "%llu %llu %llu %llu %llu %llu %llu %llu %llu %llu %llu",
+			&st->v[0], &st->v[1], &st->v[2], &st->v[3],
+			&st->v[4], &st->v[5], &st->v[6], &st->v[7],
+			&st->v[8], &st->v[9], &st->v[10]);
+	fclose(f);
+
+	return ret == 11 ? 0 : -EINVAL;
+}
+
+static void bench_prep_io(struct bench_job *job, struct io_uring_sqe *sqe,
+		int fd, const struct iovec *iov, int slot, unsigned long long off,
+		bool read)
+{
+	const struct bench_opts *o = job->o;
+
+	if (o->fixed) {
+		if (read)
+			io_uring_prep_read_fixed(sqe, 0, iov->iov_base, o->bs,
+					off, slot);
+		else
+			io_uring_prep_write_fixed(sqe, 0, iov->iov_base, o->bs,
+					off, slot);
+		io_uring_sqe_set_flags(sqe, IOSQE_FIXED_FILE);
+	} else {
+		if (read)
+			io_uring_prep_read(sqe, fd, iov->iov_base, o->bs, off);
+		else
+			io_uring_prep_write(sqe, fd, iov->iov_base, o->bs, off);
+	}
+	io_uring_sqe_set_data64(sqe, slot);
+
+	if (read)
+		job->reads++;
+	else
+		job->writes++;
+}
+
+static void *bench_job_fn(void *data)
+{
+	struct bench_job *job = (struct bench_job *)data;
+	const struct bench_opts *o = job->o;
+	unsigned long long nr_blks = job->size / o->bs;
+	unsigned long long seq_blk = nr_blks / o->jobs * job->idx;
+	unsigned long long seed = 0x9e3779b97f4a7c15ULL * (job->idx + 1);
+	unsigned long long start_ns, end_ns, issued = 0;
+	std::vector<struct iovec> iov(o->qd);
+	std::vector<unsigned long long> submit_ns(o->qd);
+	std::vector<int> free_slots;
+	struct io_uring ring;
+	unsigned inflight = 0;
+	int fd, ret;
+
+	job->hist.min = ~0ULL;
+
+	fd = open(o->path, O_RDWR | O_DIRECT);
+	if (fd < 0) {
+		fprintf(stderr, "job %d: open %s failed: %m\n", job->idx, o->path);
+		return NULL;
+	}
+
+	ret = io_uring_queue_init(o->qd, &ring, IORING_SETUP_SINGLE_ISSUER);
+	if (ret < 0) {
+		fprintf(stderr, "job %d: queue_init: %s\n", job->idx, strerror(-ret));
+		goto close_fd;
+	}
+
+	for (unsigned i = 0; i < o->qd; i++) {
+		if (posix_memalign(&iov[i].iov_base, getpagesize(), o->bs))
+			goto free_bufs;
+		memset(iov[i].iov_base, 0x5a, o->bs);
+		iov[i].iov_len = o->bs;
+		free_slots.push_back(i);
+	}
+
+	if (o->fixed) {
+		ret = io_uring_register_buffers(&ring, iov.data(), o->qd);
+		if (!ret)
+			ret = io_uring_register_files(&ring, &fd, 1);
+		if (ret) {
+			fprintf(stderr, "job %d: register buffers/files: %s\n",
+					job->idx, strerror(-ret));
+			goto free_bufs;
+		}
+	}
+
+	start_ns = bench_now_ns();
+	end_ns = start_ns + o->runtime * 1000000000ULL;
+	while (true) {
+		unsigned long long now = bench_now_ns();
+		unsigned long long wait_ns = end_ns > now ? end_ns - now : 0;
+		struct __kernel_timespec ts;
+		struct io_uring_cqe *cqe;
+		unsigned head, count = 0;
+
+		while (!free_slots.empty() && now < end_ns) {
+			unsigned long long blk;
+			struct io_uring_sqe *sqe;
+			int slot;
+
+			if (o->rate) {
+				unsigned long long due = start_ns +
+					issued * 1000000000ULL / o->rate;
+
+				if (due > now) {
+					wait_ns = std::min(wait_ns, due - now);
+					break;
+				}
+			}
+
+			if (o->rand) {
+				blk = bench_rand(&seed) % nr_blks;
+			} else {
+				blk = seq_blk;
+				if (++seq_blk >= nr_blks)
+					seq_blk = 0;
+			}
+
+			slot = free_slots.back();
+			free_slots.pop_back();
+			sqe = io_uring_get_sqe(&ring);
+			bench_prep_io(job, sqe, fd, &iov[slot], slot, blk * o->bs,
+					bench_rand(&seed) % 100 < o->rwmixread);
+			submit_ns[slot] = now;
+			inflight++;
+			issued++;
+		}
+
+		if (!inflight && now >= end_ns)
+			break;
+
+		ts.tv_sec = wait_ns / 1000000000ULL;
+		ts.tv_nsec = wait_ns % 1000000000ULL;
+		ret = io_uring_submit_and_wait_timeout(&ring, &cqe, 1,
+				wait_ns ? &ts : NULL, NULL);
+		if (ret < 0 && ret != -ETIME && ret != -EINTR) {
+			fprintf(stderr, "job %d: submit_and_wait: %s\n",
+					job->idx, strerror(-ret));
+			break;
+		}
+
+		now = bench_now_ns();
+		io_uring_for_each_cqe(&ring, head, cqe) {
+			int slot = cqe->user_data;
+
+			bench_hist_add(&job->hist, now - submit_ns[slot]);
+			if (cqe->res != (int)o->bs)
+				job->errors++;
+			free_slots.push_back(slot);
+			count++;
+		}
+		io_uring_cq_advance(&ring, count);
+		inflight -= count;
+	}
+
+free_bufs:
+	/* the kernel may still DMA into buffers of in-flight io */
+	while (inflight) {
+		struct io_uring_cqe *cqe;
+		unsigned head, count = 0;
+
+		ret = io_uring_submit_and_wait(&ring, 1);
+		if (ret < 0 && ret != -EINTR)
+			break;
+		io_uring_for_each_cqe(&ring, head, cqe)
+			count++;
+		io_uring_cq_advance(&ring, count);
+		inflight -= count;
+	}
+	io_uring_queue_exit(&ring);
+	/* leak buffers if in-flight io can't be reaped */
+	for (unsigned i = 0; i < o->qd && !inflight; i++)
+		free(iov[i].iov_base);
+close_fd:
+	close(fd);
+	return NULL;
+}
+
+static void bench_report(const struct bench_opts *o,
+		const std::vector<bench_job> &jobs, double secs,
+		const struct rusage *ru, const struct bench_blk_stat *blk)
+{
+	static const double pcts[] = { 50, 90, 99, 99.9, 99.99 };
+	struct bench_hist *h = (struct bench_hist *)calloc(1, sizeof(*h));
+	unsigned long long reads = 0, writes = 0, errors = 0;
+	double usr = ru->ru_utime.tv_sec + ru->ru_utime.tv_usec / 1e6;
+	double sys = ru->ru_stime.tv_sec + ru->ru_stime.tv_usec / 1e6;
+	nlohmann::json j;
+
+	if (!h)
+		return;
+
+	h->min = ~0ULL;
+	for (auto &job : jobs) {
+		bench_hist_merge(h, &job.hist);
+		reads += job.reads;
+		writes += job.writes;
+		errors += job.errors;
+	}
+	if (!h->nr)
+		h->min = 0;
+
+	j["dev"] = o->path;
+	j["bs"] = o->bs;
+	j["qd"] = o->qd;
+	j["jobs"] = o->jobs;
+	j["rand"] = o->rand;
+	j["rwmixread"] = o->rwmixread;
+	j["fixed"] = o->fixed;
+	j["runtime"] = secs;
+	j["reads"] = reads;
+	j["writes"] = writes;
+	j["errors"] = errors;
+	j["iops"] = h->nr / secs;
+	j["bw_mb"] = h->nr * o->bs / secs / (1 << 20);
+	j["cpu_usr"] = usr * 100 / secs;
+	j["cpu_sys"] = sys * 100 / secs;
+	j["lat_ns"]["min"] = h->min;
+	j["lat_ns"]["max"] = h->max;
+	j["lat_ns"]["mean"] = h->nr ? h->sum / h->nr : 0;
+	for (auto pct : pcts) {
+		char name[16];
+
+		snprintf(name, sizeof(name), "p%g", pct);
+		j["lat_ns"][name] = bench_hist_pct(h, pct);
+	}
+	j["lat_ns"]["hist"] = nlohmann::json::array();
+	for (unsigned i = 0; i < BENCH_HIST_BUCKETS; i++)
+		if (h->cnt[i])
+			j["lat_ns"]["hist"].push_back({ bench_hist_val(i), h->cnt[i] });
+
+	/* what the block layer sees, so the daemon side can be told apart */
+	if (blk) {
+		unsigned long long rd_ios = blk->v[0], wr_ios = blk->v[4];
+
+		j["blk"]["read_ios"] = rd_ios;
+		j["blk"]["write_ios"] = wr_ios;
+		j["blk"]["read_lat_us"] = rd_ios ? blk->v[3] * 1000.0 / rd_ios : 0;
+		j["blk"]["write_lat_us"] = wr_ios ? blk->v[7] * 1000.0 / wr_ios : 0;
+		j["blk"]["util"] = blk->v[9] / (secs * 10);
+	}
+
+	if (o->json) {
+		std::cout << j.dump(1, '\t') << std::endl;
+		free(h);
+		return;
+	}
+
+	printf("%s: %s bs %u qd %u jobs %u%s, %.1fs\n", o->path,
+			o->rand ? "rand" : "seq", o->bs, o->qd, o->jobs,
+			o->fixed ? " fixed" : "", secs);
+	printf("\tiops %.0f (read %llu write %llu errors %llu) bw %.1fMB/s\n",
+			h->nr / secs, reads, writes, errors,
+			h->nr * o->bs / secs / (1 << 20));
+	printf("\tlat(us) min %.1f mean %.1f max %.1f\n", h->min / 1e3,
+			h->nr ? h->sum / h->nr / 1e3 : 0, h->max / 1e3);
+	printf("\tlat(us)");
+	for (auto pct : pcts)
+		printf(" p%g %.1f", pct, bench_hist_pct(h, pct) / 1e3);
+	printf("\n");
+	printf("\tcpu usr %.1f%% sys %.1f%%\n", usr * 100 / secs, sys * 100 / secs);
+	if (blk)
+		printf("\tblk read lat %.1fus write lat %.1fus util %.1f%%\n",
+				(double)j["blk"]["read_lat_us"],
+				(double)j["blk"]["write_lat_us"],
+				(double)j["blk"]["util"]);
+	free(h);
+}
+
+static void bench_usage(void)
+{
+	printf("ublk bench {-n DEV_ID | --file PATH} [--rw RW] [--rwmixread PCT]\n");
+	printf("\t[--bs BYTES] [--qd DEPTH] [--jobs JOBS] [--runtime SECS]\n");
+	printf("\t[--rate IOPS] [--no_fixed] [--json]\n");
+	printf("\tRW: read, write, randread(default), randwrite, rw, randrw\n");
+}
+
+int cmd_dev_bench(int argc, char *argv[])
+{
+	static const struct option longopts[] = {
+		{ "number",		1,	NULL, 'n' },
+		{ "file",		1,	NULL, 'f' },
+		{ "rw",			1,	NULL, 0 },
+		{ "rwmixread",		1,	NULL, 0 },
+		{ "bs",			1,	NULL, 0 },
+		{ "qd",			1,	NULL, 0 },
+		{ "jobs",		1,	NULL, 'j' },
+		{ "runtime",		1,	NULL, 0 },
+		{ "rate",		1,	NULL, 0 },
+		{ "no_fixed",		0,	NULL, 0 },
+		{ "json",		0,	NULL, 0 },
+		{ NULL }
+	};
+	struct bench_opts o = {
+		.dev_id = -1,
+		.bs = 4096,
+		.qd = 64,
+		.jobs = 1,
+		.runtime = 10,
+		.rwmixread = 100,
+		.rate = 0,
+		.rand = true,
+		.fixed = true,
+		.json = false,
+	};
+	struct bench_blk_stat st0, st1;
+	const char *rw = "randread";
+	int mix = -1;
+	bool has_stat;
+	unsigned long long size = 0, start_ns;
+	struct rusage ru;
+	int opt, fd, option_index = 0;
+
+	while ((opt = getopt_long(argc, argv, "n:f:j:",
+				  longopts, &option_index)) != -1) {
+		const char *name = longopts[option_index].name;
+
+		switch (opt) {
+		case 'n':
+			o.dev_id = strtol(optarg, NULL, 10);
+			snprintf(o.path, sizeof(o.path), "/dev/ublkb%d", o.dev_id);
+			break;
+		case 'f':
+			snprintf(o.path, sizeof(o.path), "%s", optarg);
+			break;
+		case 'j':
+			o.jobs = strtol(optarg, NULL, 10);
+			break;
+		case 0:
+			if (!strcmp(name, "rw"))
+				rw = optarg;
+			else if (!strcmp(name, "rwmixread"))
+				mix = strtol(optarg, NULL, 10);
+			else if (!strcmp(name, "bs"))
+				o.bs = strtol(optarg, NULL, 10);
+			else if (!strcmp(name, "qd"))
+				o.qd = strtol(optarg, NULL, 10);
+			else if (!strcmp(name, "runtime"))
+				o.runtime = strtol(optarg, NULL, 10);
+			else if (!strcmp(name, "rate"))
+				o.rate = strtoull(optarg, NULL, 10);
+			else if (!strcmp(name, "no_fixed"))
+				o.fixed = false;
+			else if (!strcmp(name, "json"))
+				o.json = true;
+			break;
+		default:
+			bench_usage();
+			return -EINVAL;
+		}
+	}
+
+	if (!o.path[0] || !o.bs || (o.bs & 511) || !o.qd || !o.jobs ||
+			!o.runtime) {
+		bench_usage();
+		return -EINVAL;
+	}
+
+	o.rand = !strncmp(rw, "rand", 4);
+	if (o.rand)
+		rw += 4;
+	if (!strcmp(rw, "read"))
+		o.rwmixread = 100;
+	else if (!strcmp(rw, "write"))
+		o.rwmixread = 0;
+	else if (!strcmp(rw, "rw"))
+		o.rwmixread = mix >= 0 ? std::min(mix, 100) : 50;
+	else {
+		bench_usage();
+		return -EINVAL;
+	}
+
+	fd = open(o.path, O_RDONLY);
+	if (fd < 0) {
+		fprintf(stderr, "open %s failed: %m\n", o.path);
+		return -errno;
+	}
+	if (ioctl(fd, BLKGETSIZE64, &size) < 0) {
+		struct stat sb;
+
+		if (!fstat(fd, &sb))
+			size = sb.st_size;
+	}
+	close(fd);
+	if (size < (unsigned long long)o.bs * o.jobs) {
+		fprintf(stderr, "%s is too small\n", o.path);
+		return -EINVAL;
+	}
+
+	std::vector<bench_job> jobs(o.jobs);
+
+	has_stat = !bench_read_blk_stat(&o, &st0);
+	start_ns = bench_now_ns();
+	for (unsigned i = 0; i < o.jobs; i++) {
+		jobs[i].o = &o;
+		jobs[i].idx = i;
+		jobs[i].size = size;
+		pthread_create(&jobs[i].thread, NULL, bench_job_fn, &jobs[i]);
+	}
+	for (auto &job : jobs)
+		pthread_join(job.thread, NULL);
+
+	getrusage(RUSAGE_SELF, &ru);
+	if (has_stat && !bench_read_blk_stat(&o, &st1)) {
+		for (int i = 0; i < 11; i++)
+			st1.v[i] -= st0.v[i];
+	} else {
+		has_stat = false;
+	}
+
+	bench_report(&o, jobs, (bench_now_ns() - start_ns) / 1e9, &ru,
+			has_stat ? &st1 : NULL);
+
+	return 0;
+}
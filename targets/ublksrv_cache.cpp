@@ -0,0 +1,1298 @@
+// SPDX-License-Identifier: MIT or GPL-2.0-only
+
+#include <config.h>
+
+#include <fcntl.h>
+#include <signal.h>
+#include <linux/fs.h>
+
+#include <deque>
+#include <list>
+#include <unordered_map>
+#include <vector>
+
+#include "ublksrv_tgt.h"
+#include "ublksrv_pi.h"
+
+/*
+ * Persistent read cache of network targets on one local file or block
+ * device.
+ *
+ * Device space is cached in chunks, and each chunk is put in one slot
+ * of the cache and tracked by one valid mask of 4KB blocks. READ which
+ * is covered by valid blocks is served from the cache on the queue's
+ * io_uring; data of other READ is copied after the target completes it,
+ * and written to the cache by one writer thread. WRITE, DISCARD and
+ * WRITE_ZEROES invalidate the covered blocks before the io is sent to
+ * backend, and write-through mode fills cached chunks with the written
+ * data after the io is done.
+ *
+ * Fills are ordered against writes by one sequence number: one fill is
+ * dropped if any write to its chunk has started after the data is read,
+ * or is still in flight.
+ *
+ * Layout: superblock, two slot tables, the log and slots. Slot updates
+ * are appended to the log in 4KB blocks, and the log is checkpointed to
+ * the inactive table when it becomes full. The log is replayed when the
+ * daemon is recovered or the device is added again with the same cache
+ * and backend. The cache isn't synced before the device is removed, so
+ * it is dropped if the host is rebooted without clean shutdown.
+ */
+
+#define CACHE_MAGIC		"UBLKCCH1"
+#define CACHE_LOG_MAGIC		0x55434c47
+#define CACHE_BLK_SHIFT		12
+#define CACHE_BLK_SIZE		(1U << CACHE_BLK_SHIFT)
+#define CACHE_DEF_CHUNK_KB	64
+#define CACHE_MAX_CHUNK_KB	256	/* valid mask of one chunk is __u64 */
+#define CACHE_NR_BUCKETS	65536
+#define CACHE_MAX_STAGED	(64U << 20)	/* bytes of pending fills */
+#define CACHE_MIN_SLOTS		16
+#define CACHE_NO_CHUNK		(~0ULL)
+#define CACHE_MAX_NAME		256
+
+enum {
+	CACHE_MODE_WT,		/* write-through */
+	CACHE_MODE_WI,		/* write-invalidate */
+};
+
+enum {
+	CACHE_POLICY_LRU,
+	CACHE_POLICY_ARC,
+};
+
+/* which list one slot or one ghost chunk is in */
+enum {
+	CACHE_FREE,
+	CACHE_T1,
+	CACHE_T2,
+	CACHE_B1,
+	CACHE_B2,
+};
+
+struct cache_sb {
+	char magic[8];
+	__u32 chunk_shift;
+	__u32 log_blocks;
+	__u64 nr_slots;
+	__u64 dev_size;
+	__u64 epoch;
+	__u32 table;		/* active slot table, 0 or 1 */
+	__u32 clean;
+	char boot_id[40];
+	char id[CACHE_MAX_NAME];
+	__u64 crc;
+};
+
+/* entry of slot table, mask 0 means the slot is free */
+struct cache_ent {
+	__u64 chunk;
+	__u64 mask;
+};
+
+struct cache_rec {
+	struct cache_ent ent;
+	__u64 slot;
+	__u64 pad;
+};
+
+struct cache_log_hdr {
+	__u32 magic;
+	__u32 idx;
+	__u64 epoch;
+	__u32 nr;
+	__u32 pad;
+	__u64 crc;
+};
+
+#define CACHE_RECS_PER_BLK	((CACHE_BLK_SIZE - \
+			sizeof(struct cache_log_hdr)) / sizeof(struct cache_rec))
+
+struct cache_slot {
+	unsigned long long chunk;
+	unsigned long long mask;
+	unsigned int pins;	/* cache reads and fills in flight */
+	unsigned char list;
+	std::list<unsigned>::iterator it;
+};
+
+struct cache_ghost {
+	unsigned char list;
+	std::list<unsigned long long>::iterator it;
+};
+
+/* writes in flight and the last write of chunks hashed to one bucket */
+struct cache_bucket {
+	unsigned long long last_seq;
+	unsigned int inflight;
+};
+
+/* state of each ublk io */
+struct cache_io {
+	unsigned long long seq;
+	unsigned short pending;		/* cache reads in flight */
+	unsigned short nr_pins;
+	bool nofill;
+	bool counted;		/* counted in bucket inflight */
+	bool bypass;		/* handled by target after cache read fails */
+	int res;
+	unsigned int bytes;
+};
+
+/* data to be written to cache */
+struct cache_job {
+	unsigned long long off;
+	unsigned int len;
+	bool write;		/* write-through, don't allocate slot */
+	unsigned long long seq;
+	char *buf;
+};
+
+struct ublksrv_cache {
+	int fd;
+	unsigned int mode;
+	unsigned int policy;
+	unsigned int chunk_shift;
+	unsigned long long dev_size;
+	unsigned long long nr_slots;
+	unsigned long long table_off[2];
+	unsigned long long log_off;
+	unsigned long long data_off;
+	unsigned int depth;
+	unsigned int max_pins;
+
+	pthread_mutex_t lock;
+	bool broken;
+	unsigned long long seq;
+	std::vector<struct cache_bucket> buckets;
+
+	std::vector<struct cache_slot> slots;
+	std::unordered_map<unsigned long long, unsigned> map;
+	std::vector<unsigned> free_slots;
+	/* MRU is at front, LRU policy uses t1 only */
+	std::list<unsigned> t1, t2;
+	std::list<unsigned long long> b1, b2;
+	std::unordered_map<unsigned long long, struct cache_ghost> ghosts;
+	unsigned long long p;	/* ARC target size of t1 */
+
+	struct cache_sb *sb;
+	void *log_buf;
+	unsigned int log_pos;
+
+	std::vector<struct cache_io> ios;
+	std::vector<unsigned> pins;
+
+	pthread_t writer;
+	pthread_cond_t cond;
+	bool stop;
+	std::deque<struct cache_job> jobs;
+	unsigned long long staged;
+
+	unsigned long long hits, misses, fills, evicts;
+};
+
+static const char *const cache_mode_names[] = {
+	"wt",		/* CACHE_MODE_WT */
+	"wi",		/* CACHE_MODE_WI */
+};
+
+static const char *const cache_policy_names[] = {
+	"lru",		/* CACHE_POLICY_LRU */
+	"arc",		/* CACHE_POLICY_ARC */
+};
+
+static int cache_name_to_idx(const char *const names[], int nr,
+		const char *name)
+{
+	int i;
+
+	for (i = 0; i < nr; i++)
+		if (!strcmp(names[i], name))
+			return i;
+	return -1;
+}
+
+int ublksrv_cache_parse(const struct ublksrv_ctrl_dev *cdev,
+		int argc, char *argv[])
+{
+	static const struct option longopts[] = {
+		{ "cache",		1,	NULL, 0 },
+		{ "cache_size",		1,	NULL, 0 },
+		{ "cache_chunk_kb",	1,	NULL, 0 },
+		{ "cache_mode",		1,	NULL, 0 },
+		{ "cache_policy",	1,	NULL, 0 },
+		{ NULL }
+	};
+	const char *path = NULL, *mode = "wt", *policy = "arc";
+	unsigned long size_mb = 0, chunk_kb = CACHE_DEF_CHUNK_KB;
+	int opt, option_index = 0;
+
+	if (ublksrv_is_recovering(cdev))
+		return 0;
+
+	optind = 0;
+	while ((opt = getopt_long(argc, argv, "-:", longopts,
+					&option_index)) != -1) {
+		const char *name = longopts[option_index].name;
+
+		if (opt != 0)
+			continue;
+		if (!strcmp(name, "cache"))
+			path = optarg;
+		else if (!strcmp(name, "cache_size"))
+			size_mb = strtoul(optarg, NULL, 10);
+		else if (!strcmp(name, "cache_chunk_kb"))
+			chunk_kb = strtoul(optarg, NULL, 10);
+		else if (!strcmp(name, "cache_mode"))
+			mode = optarg;
+		else
+			policy = optarg;
+	}
+	optind = 0;
+
+	if (!path)
+		return 0;
+
+	if (chunk_kb < 4 || chunk_kb > CACHE_MAX_CHUNK_KB ||
+			(chunk_kb & (chunk_kb - 1))) {
+		fprintf(stderr, "cache_chunk_kb has to be power of 2 in [4, %u]\n",
+				CACHE_MAX_CHUNK_KB);
+		return -EINVAL;
+	}
+	if (cache_name_to_idx(cache_mode_names, 2, mode) < 0) {
+		fprintf(stderr, "unknown cache mode %s\n", mode);
+		return -EINVAL;
+	}
+	if (cache_name_to_idx(cache_policy_names, 2, policy) < 0) {
+		fprintf(stderr, "unknown cache policy %s\n", policy);
+		return -EINVAL;
+	}
+
+	ublk_json_write_tgt_str(cdev, "cache", path);
+	ublk_json_write_tgt_ulong(cdev, "cache_size", size_mb);
+	ublk_json_write_tgt_ulong(cdev, "cache_chunk_kb", chunk_kb);
+	ublk_json_write_tgt_str(cdev, "cache_mode", mode);
+	ublk_json_write_tgt_str(cdev, "cache_policy", policy);
+	return 0;
+}
+
+void ublksrv_cache_usage(void)
+{
+	printf("\t[--cache FILE|BLKDEV [--cache_size MB] [--cache_chunk_kb KB]\n");
+	printf("\t\t[--cache_mode wt|wi] [--cache_policy lru|arc]]\n");
+}
+
+static inline struct cache_bucket *cache_bucket(struct ublksrv_cache *c,
+		unsigned long long chunk)
+{
+	return &c->buckets[chunk & (CACHE_NR_BUCKETS - 1)];
+}
+
+static inline struct cache_io *cache_get_io(struct ublksrv_cache *c,
+		const struct ublksrv_queue *q, int tag)
+{
+	return &c->ios[q->q_id * c->depth + tag];
+}
+
+static inline unsigned *cache_get_pins(struct ublksrv_cache *c,
+		const struct ublksrv_queue *q, int tag)
+{
+	return &c->pins[(q->q_id * c->depth + tag) * c->max_pins];
+}
+
+static inline unsigned long long cache_slot_off(const struct ublksrv_cache *c,
+		unsigned slot)
+{
+	return c->data_off + ((unsigned long long)slot << c->chunk_shift);
+}
+
+/* mask of blocks in chunk touched by [start, end) */
+static unsigned long long cache_blk_mask(const struct ublksrv_cache *c,
+		unsigned long long chunk, unsigned long long start,
+		unsigned long long end, bool inner)
+{
+	unsigned long long cs = chunk << c->chunk_shift;
+	unsigned long long ce = cs + (1ULL << c->chunk_shift);
+	unsigned long long first, last;
+
+	if (start < cs)
+		start = cs;
+	if (end > ce)
+		end = ce;
+	if (inner) {
+		first = (start - cs + CACHE_BLK_SIZE - 1) >> CACHE_BLK_SHIFT;
+		last = (end - cs) >> CACHE_BLK_SHIFT;
+	} else {
+		first = (start - cs) >> CACHE_BLK_SHIFT;
+		last = (end - cs + CACHE_BLK_SIZE - 1) >> CACHE_BLK_SHIFT;
+	}
+	if (first >= last)
+		return 0;
+	if (last - first == 64)
+		return ~0ULL;
+	return ((1ULL << (last - first)) - 1) << first;
+}
+
+static int cache_read_boot_id(char *buf, int len)
+{
+	int fd = open("/proc/sys/kernel/random/boot_id", O_RDONLY);
+	int ret;
+
+	memset(buf, 0, len);
+	if (fd < 0)
+		return -errno;
+	ret = read(fd, buf, len - 1);
+	close(fd);
+	if (ret <= 0)
+		return -EIO;
+	buf[strcspn(buf, "\n")] = 0;
+	return 0;
+}
+
+static void cache_sb_crc(struct cache_sb *sb)
+{
+	sb->crc = 0;
+	sb->crc = ublksrv_crc64_nvme(0, sb, sizeof(*sb));
+}
+
+static int cache_write_sb(struct ublksrv_cache *c)
+{
+	cache_sb_crc(c->sb);
+	if (pwrite(c->fd, c->sb, CACHE_BLK_SIZE, 0) != CACHE_BLK_SIZE)
+		return -EIO;
+	return 0;
+}
+
+/*
+ * Slots can't be trusted any more after one cache io fails, so make the
+ * cache cold for the next start and stop using it.
+ */
+static void cache_poison(struct ublksrv_cache *c)
+{
+	if (c->broken)
+		return;
+	ublk_err("%s: cache io failed, cache is disabled\n", __func__);
+	c->broken = true;
+	memset(c->sb->magic, 0, sizeof(c->sb->magic));
+	if (cache_write_sb(c) || fdatasync(c->fd))
+		ublk_err("%s: failed to clear cache superblock\n", __func__);
+}
+
+static void cache_log_reset(struct ublksrv_cache *c)
+{
+	struct cache_log_hdr *hdr = (struct cache_log_hdr *)c->log_buf;
+
+	memset(c->log_buf, 0, CACHE_BLK_SIZE);
+	hdr->magic = CACHE_LOG_MAGIC;
+	hdr->idx = c->log_pos;
+	hdr->epoch = c->sb->epoch;
+}
+
+/* write all slots to the inactive table and start one new log epoch */
+static int cache_checkpoint(struct ublksrv_cache *c)
+{
+	std::vector<struct cache_ent> table(c->nr_slots);
+	unsigned long long i;
+	size_t len = c->nr_slots * sizeof(struct cache_ent);
+	unsigned next = c->sb->table ^ 1;
+
+	for (i = 0; i < c->nr_slots; i++) {
+		table[i].chunk = c->slots[i].chunk;
+		table[i].mask = c->slots[i].mask;
+	}
+	if (pwrite(c->fd, table.data(), len, c->table_off[next]) != (ssize_t)len)
+		return -EIO;
+
+	c->sb->table = next;
+	c->sb->epoch += 1;
+	if (cache_write_sb(c))
+		return -EIO;
+
+	c->log_pos = 0;
+	cache_log_reset(c);
+	return 0;
+}
+
+/* append state of one slot to the log, called with lock held */
+static void cache_log(struct ublksrv_cache *c, unsigned slot)
+{
+	struct cache_log_hdr *hdr = (struct cache_log_hdr *)c->log_buf;
+	struct cache_rec *rec = (struct cache_rec *)(hdr + 1) + hdr->nr;
+	unsigned long long off = c->log_off +
+		((unsigned long long)c->log_pos << CACHE_BLK_SHIFT);
+
+	if (c->broken)
+		return;
+
+	rec->ent.chunk = c->slots[slot].chunk;
+	rec->ent.mask = c->slots[slot].mask;
+	rec->slot = slot;
+	hdr->nr += 1;
+	hdr->crc = 0;
+	hdr->crc = ublksrv_crc64_nvme(0, c->log_buf, CACHE_BLK_SIZE);
+
+	if (pwrite(c->fd, c->log_buf, CACHE_BLK_SIZE, off) != CACHE_BLK_SIZE) {
+		cache_poison(c);
+		return;
+	}
+
+	if (hdr->nr < CACHE_RECS_PER_BLK)
+		return;
+	if (++c->log_pos < c->sb->log_blocks)
+		cache_log_reset(c);
+	else if (cache_checkpoint(c))
+		cache_poison(c);
+}
+
+/* mark one hit slot as recently used */
+static void cache_touch(struct ublksrv_cache *c, unsigned slot)
+{
+	struct cache_slot *s = &c->slots[slot];
+
+	if (c->policy == CACHE_POLICY_LRU) {
+		c->t1.splice(c->t1.begin(), c->t1, s->it);
+		return;
+	}
+
+	if (s->list == CACHE_T1)
+		c->t2.splice(c->t2.begin(), c->t1, s->it);
+	else
+		c->t2.splice(c->t2.begin(), c->t2, s->it);
+	s->list = CACHE_T2;
+}
+
+static void cache_add_ghost(struct ublksrv_cache *c, unsigned char list,
+		unsigned long long chunk)
+{
+	std::list<unsigned long long> &l = list == CACHE_B1 ? c->b1 : c->b2;
+
+	l.push_front(chunk);
+	c->ghosts[chunk] = { list, l.begin() };
+}
+
+static void cache_drop_ghost(struct ublksrv_cache *c, unsigned char list)
+{
+	std::list<unsigned long long> &l = list == CACHE_B1 ? c->b1 : c->b2;
+
+	c->ghosts.erase(l.back());
+	l.pop_back();
+}
+
+/* evict the least recently used slot of t1 or t2 which isn't pinned */
+static int cache_evict(struct ublksrv_cache *c, unsigned char list)
+{
+	std::list<unsigned> &l = list == CACHE_T1 ? c->t1 : c->t2;
+
+	for (auto it = l.rbegin(); it != l.rend(); ++it) {
+		unsigned slot = *it;
+		struct cache_slot *s = &c->slots[slot];
+		bool valid = !!s->mask;
+
+		if (s->pins)
+			continue;
+
+		l.erase(s->it);
+		c->map.erase(s->chunk);
+		if (c->policy == CACHE_POLICY_ARC)
+			cache_add_ghost(c, list == CACHE_T1 ? CACHE_B1 :
+					CACHE_B2, s->chunk);
+		s->chunk = CACHE_NO_CHUNK;
+		s->mask = 0;
+		s->list = CACHE_FREE;
+		/* slot has to be seen as free before it is overwritten */
+		if (valid)
+			cache_log(c, slot);
+		c->evicts += 1;
+		return slot;
+	}
+	return -1;
+}
+
+/* ARC REPLACE(), fall back to the other list if all slots are pinned */
+static int cache_replace(struct ublksrv_cache *c, bool in_b2)
+{
+	unsigned long long t1 = c->t1.size();
+	int slot;
+
+	if (t1 && (t1 > c->p || (in_b2 && t1 == c->p))) {
+		slot = cache_evict(c, CACHE_T1);
+		if (slot < 0)
+			slot = cache_evict(c, CACHE_T2);
+	} else {
+		slot = cache_evict(c, CACHE_T2);
+		if (slot < 0)
+			slot = cache_evict(c, CACHE_T1);
+	}
+	return slot;
+}
+
+static int cache_get_free(struct ublksrv_cache *c)
+{
+	unsigned slot;
+
+	if (c->free_slots.empty())
+		return -1;
+	slot = c->free_slots.back();
+	c->free_slots.pop_back();
+	return slot;
+}
+
+/* allocate one slot for chunk, called with lock held */
+static int cache_alloc(struct ublksrv_cache *c, unsigned long long chunk)
+{
+	unsigned long long cap = c->nr_slots;
+	unsigned char list = CACHE_T1;
+	struct cache_slot *s;
+	int slot;
+
+	if (c->policy == CACHE_POLICY_LRU) {
+		slot = cache_get_free(c);
+		if (slot < 0)
+			slot = cache_evict(c, CACHE_T1);
+	} else {
+		auto g = c->ghosts.find(chunk);
+		unsigned long long b1 = c->b1.size(), b2 = c->b2.size();
+
+		if (g != c->ghosts.end()) {
+			bool in_b2 = g->second.list == CACHE_B2;
+
+			if (!in_b2)
+				c->p = std::min(cap, c->p +
+						std::max(b2 / b1, 1ULL));
+			else
+				c->p -= std::min(c->p,
+						std::max(b1 / b2, 1ULL));
+			(in_b2 ? c->b2 : c->b1).erase(g->second.it);
+			c->ghosts.erase(g);
+			list = CACHE_T2;
+			slot = cache_get_free(c);
+			if (slot < 0)
+				slot = cache_replace(c, in_b2);
+		} else {
+			if (c->t1.size() + b1 >= cap && b1)
+				cache_drop_ghost(c, CACHE_B1);
+			else if (c->t1.size() + c->t2.size() + b1 + b2 >=
+					2 * cap && b2)
+				cache_drop_ghost(c, CACHE_B2);
+			slot = cache_get_free(c);
+			if (slot < 0)
+				slot = cache_replace(c, false);
+		}
+	}
+	if (slot < 0)
+		return slot;
+
+	s = &c->slots[slot];
+	s->chunk = chunk;
+	s->mask = 0;
+	s->list = list;
+	if (list == CACHE_T1) {
+		c->t1.push_front(slot);
+		s->it = c->t1.begin();
+	} else {
+		c->t2.push_front(slot);
+		s->it = c->t2.begin();
+	}
+	c->map[chunk] = slot;
+	return slot;
+}
+
+static inline bool cache_admit(struct ublksrv_cache *c,
+		unsigned long long chunk, unsigned long long seq)
+{
+	const struct cache_bucket *b = cache_bucket(c, chunk);
+
+	return !c->broken && !b->inflight && b->last_seq <= seq;
+}
+
+/* write one chunk piece of job to cache */
+static void cache_fill_chunk(struct ublksrv_cache *c,
+		const struct cache_job *job, unsigned long long chunk)
+{
+	unsigned long long cs = chunk << c->chunk_shift;
+	unsigned long long start = std::max(cs, job->off);
+	unsigned long long end = std::min(cs + (1ULL << c->chunk_shift),
+			job->off + job->len);
+	unsigned long long mask = cache_blk_mask(c, chunk, start, end, true);
+	unsigned long long blk;
+	unsigned slot;
+	bool ok = true;
+
+	pthread_mutex_lock(&c->lock);
+	if (!cache_admit(c, chunk, job->seq))
+		goto unlock;
+	{
+		auto it = c->map.find(chunk);
+		int ret;
+
+		if (it != c->map.end())
+			slot = it->second;
+		else if (job->write)
+			goto unlock;
+		else if ((ret = cache_alloc(c, chunk)) < 0)
+			goto unlock;
+		else
+			slot = ret;
+	}
+	mask &= ~c->slots[slot].mask;
+	if (!mask)
+		goto unlock;
+	c->slots[slot].pins += 1;
+	pthread_mutex_unlock(&c->lock);
+
+	/* the mask is contiguous */
+	blk = __builtin_ctzll(mask);
+	start = cs + (blk << CACHE_BLK_SHIFT);
+	end = start + ((unsigned long long)__builtin_popcountll(mask) <<
+			CACHE_BLK_SHIFT);
+	if (pwrite(c->fd, job->buf + (start - job->off), end - start,
+				cache_slot_off(c, slot) + (start - cs)) !=
+			(ssize_t)(end - start))
+		ok = false;
+
+	pthread_mutex_lock(&c->lock);
+	c->slots[slot].pins -= 1;
+	if (!ok)
+		cache_poison(c);
+	else if (cache_admit(c, chunk, job->seq) &&
+			c->slots[slot].chunk == chunk) {
+		c->slots[slot].mask |= mask;
+		cache_log(c, slot);
+		c->fills += 1;
+	}
+unlock:
+	pthread_mutex_unlock(&c->lock);
+}
+
+static void *cache_writer_fn(void *data)
+{
+	struct ublksrv_cache *c = (struct ublksrv_cache *)data;
+	sigset_t mask;
+
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGINT);
+	sigaddset(&mask, SIGTERM);
+	pthread_sigmask(SIG_BLOCK, &mask, NULL);
+
+	pthread_mutex_lock(&c->lock);
+	while (!c->stop) {
+		struct cache_job job;
+		unsigned long long chunk;
+
+		if (c->jobs.empty()) {
+			pthread_cond_wait(&c->cond, &c->lock);
+			continue;
+		}
+		job = c->jobs.front();
+		c->jobs.pop_front();
+
+		/* checkpoint early, so queues rarely wait for it */
+		if (!c->broken && c->log_pos >= c->sb->log_blocks * 3 / 4 &&
+				cache_checkpoint(c))
+			cache_poison(c);
+		pthread_mutex_unlock(&c->lock);
+
+		for (chunk = job.off >> c->chunk_shift;
+				chunk << c->chunk_shift < job.off + job.len;
+				chunk++)
+			cache_fill_chunk(c, &job, chunk);
+		free(job.buf);
+
+		pthread_mutex_lock(&c->lock);
+		c->staged -= job.len;
+	}
+	pthread_mutex_unlock(&c->lock);
+	return NULL;
+}
+
+/* copy data of [off, off + len) which covers whole blocks */
+static void cache_queue_fill(struct ublksrv_cache *c,
+		const struct ublksrv_io_desc *iod, unsigned long long seq,
+		bool write)
+{
+	unsigned long long off = iod->start_sector << 9;
+	unsigned long long end = off + ((unsigned long long)iod->nr_sectors << 9);
+	unsigned long long start = (off + CACHE_BLK_SIZE - 1) &
+		~(unsigned long long)(CACHE_BLK_SIZE - 1);
+	struct cache_job job;
+
+	end &= ~(unsigned long long)(CACHE_BLK_SIZE - 1);
+	if (start >= end)
+		return;
+
+	pthread_mutex_lock(&c->lock);
+	if (c->broken || c->staged + (end - start) > CACHE_MAX_STAGED)
+		goto unlock;
+	/* write-through fills chunks which are cached already */
+	if (write) {
+		unsigned long long chunk;
+
+		for (chunk = start >> c->chunk_shift;
+				chunk << c->chunk_shift < end; chunk++)
+			if (c->map.count(chunk))
+				break;
+		if (chunk << c->chunk_shift >= end)
+			goto unlock;
+	}
+	job.buf = (char *)malloc(end - start);
+	if (!job.buf)
+		goto unlock;
+	memcpy(job.buf, (char *)iod->addr + (start - off), end - start);
+	job.off = start;
+	job.len = end - start;
+	job.seq = seq;
+	job.write = write;
+	c->staged += job.len;
+	c->jobs.push_back(job);
+	pthread_cond_signal(&c->cond);
+unlock:
+	pthread_mutex_unlock(&c->lock);
+}
+
+/* serve READ from cache if all blocks are valid, lock is held */
+static bool cache_lookup(struct ublksrv_cache *c,
+		const struct ublksrv_queue *q, int tag,
+		unsigned long long off, unsigned long long end)
+{
+	struct cache_io *io = cache_get_io(c, q, tag);
+	unsigned *pins = cache_get_pins(c, q, tag);
+	unsigned long long chunk;
+	unsigned i;
+
+	io->nr_pins = 0;
+	for (chunk = off >> c->chunk_shift; chunk << c->chunk_shift < end;
+			chunk++) {
+		unsigned long long mask = cache_blk_mask(c, chunk, off, end,
+				false);
+		auto it = c->map.find(chunk);
+
+		if (it == c->map.end() ||
+				(c->slots[it->second].mask & mask) != mask)
+			goto miss;
+		pins[io->nr_pins++] = it->second;
+	}
+
+	for (i = 0; i < io->nr_pins; i++) {
+		c->slots[pins[i]].pins += 1;
+		cache_touch(c, pins[i]);
+	}
+	c->hits += 1;
+	return true;
+miss:
+	io->nr_pins = 0;
+	c->misses += 1;
+	return false;
+}
+
+static void cache_submit_read(struct ublksrv_cache *c,
+		const struct ublksrv_queue *q, const struct ublk_io_data *data)
+{
+	const struct ublksrv_io_desc *iod = data->iod;
+	struct cache_io *io = cache_get_io(c, q, data->tag);
+	unsigned *pins = cache_get_pins(c, q, data->tag);
+	unsigned long long off = iod->start_sector << 9;
+	unsigned long long end = off + ((unsigned long long)iod->nr_sectors << 9);
+	char *buf = (char *)iod->addr;
+	struct io_uring_sqe *sqe[1];
+	unsigned i;
+
+	io->res = 0;
+	io->bytes = 0;
+	io->pending = 0;
+	for (i = 0; i < io->nr_pins; i++) {
+		unsigned long long cs = (off >> c->chunk_shift) + i;
+		unsigned long long start, len;
+
+		cs <<= c->chunk_shift;
+		start = std::max(cs, off);
+		len = std::min(cs + (1ULL << c->chunk_shift), end) - start;
+
+		if (!ublk_queue_alloc_sqes(q, sqe, 1)) {
+			io->res = -ENOMEM;
+			break;
+		}
+		io_uring_prep_read(sqe[0], c->fd, buf + (start - off), len,
+				cache_slot_off(c, pins[i]) + (start - cs));
+		sqe[0]->user_data = build_user_data(data->tag,
+				UBLKSRV_CACHE_OP, 0, 1);
+		io->pending += 1;
+	}
+}
+
+static void cache_unpin(struct ublksrv_cache *c,
+		const struct ublksrv_queue *q, int tag)
+{
+	struct cache_io *io = cache_get_io(c, q, tag);
+	unsigned *pins = cache_get_pins(c, q, tag);
+	unsigned i;
+
+	pthread_mutex_lock(&c->lock);
+	for (i = 0; i < io->nr_pins; i++)
+		c->slots[pins[i]].pins -= 1;
+	pthread_mutex_unlock(&c->lock);
+	io->nr_pins = 0;
+}
+
+/*
+ * The cache read failed, or isn't submitted, let target handle it. Read
+ * may be canceled by one failed link of target sqes, which is fine.
+ */
+static void cache_read_fallback(struct ublksrv_cache *c,
+		const struct ublksrv_queue *q, const struct ublk_io_data *data)
+{
+	struct cache_io *io = cache_get_io(c, q, data->tag);
+
+	cache_unpin(c, q, data->tag);
+	if (io->res != -ENOMEM && io->res != -ECANCELED) {
+		pthread_mutex_lock(&c->lock);
+		cache_poison(c);
+		pthread_mutex_unlock(&c->lock);
+	}
+	io->seq = c->seq;
+	io->nofill = true;
+	io->bypass = true;
+	q->dev->tgt.ops->handle_io_async(q, data);
+}
+
+bool ublksrv_cache_handle_io(struct ublksrv_cache *c,
+		const struct ublksrv_queue *q, const struct ublk_io_data *data)
+{
+	const struct ublksrv_io_desc *iod = data->iod;
+	struct cache_io *io;
+	unsigned long long off, end, chunk;
+	unsigned op;
+	bool hit = false;
+
+	if (!c)
+		return false;
+
+	io = cache_get_io(c, q, data->tag);
+	if (io->bypass) {
+		io->bypass = false;
+		return false;
+	}
+	off = iod->start_sector << 9;
+	end = off + ((unsigned long long)iod->nr_sectors << 9);
+	op = ublksrv_get_op(iod);
+
+	pthread_mutex_lock(&c->lock);
+	if (c->broken)
+		goto unlock;
+	switch (op) {
+	case UBLK_IO_OP_READ:
+		hit = cache_lookup(c, q, data->tag, off, end);
+		if (hit)
+			break;
+		io->seq = c->seq;
+		io->nofill = false;
+		for (chunk = off >> c->chunk_shift;
+				chunk << c->chunk_shift < end; chunk++)
+			if (cache_bucket(c, chunk)->inflight)
+				io->nofill = true;
+		break;
+	case UBLK_IO_OP_WRITE:
+	case UBLK_IO_OP_DISCARD:
+	case UBLK_IO_OP_WRITE_ZEROES:
+		io->seq = ++c->seq;
+		io->counted = true;
+		for (chunk = off >> c->chunk_shift;
+				chunk << c->chunk_shift < end; chunk++) {
+			struct cache_bucket *b = cache_bucket(c, chunk);
+			auto it = c->map.find(chunk);
+
+			b->inflight += 1;
+			b->last_seq = io->seq;
+			if (it != c->map.end()) {
+				struct cache_slot *s = &c->slots[it->second];
+				unsigned long long mask = cache_blk_mask(c,
+						chunk, off, end, false);
+
+				/* logged before the io is sent to backend */
+				if (s->mask & mask) {
+					s->mask &= ~mask;
+					cache_log(c, it->second);
+				}
+			}
+		}
+		break;
+	}
+unlock:
+	pthread_mutex_unlock(&c->lock);
+
+	if (hit) {
+		cache_submit_read(c, q, data);
+		if (!io->pending) {
+			cache_read_fallback(c, q, data);
+			return true;
+		}
+	}
+	return hit;
+}
+
+bool ublksrv_cache_io_done(struct ublksrv_cache *c,
+		const struct ublksrv_queue *q, const struct io_uring_cqe *cqe)
+{
+	int tag = user_data_to_tag(cqe->user_data);
+	const struct ublk_io_data *data;
+	struct cache_io *io;
+
+	if (!c || user_data_to_op(cqe->user_data) != UBLKSRV_CACHE_OP)
+		return false;
+
+	data = ublksrv_tgt_get_io_data(q, tag);
+	io = cache_get_io(c, q, tag);
+	if (cqe->res < 0)
+		io->res = cqe->res;
+	else
+		io->bytes += cqe->res;
+	if (--io->pending)
+		return true;
+
+	if (!io->res && io->bytes == data->iod->nr_sectors << 9) {
+		cache_unpin(c, q, tag);
+		ublksrv_tgt_complete_io(q, tag, io->bytes);
+	} else {
+		if (!io->res)
+			io->res = -EIO;
+		cache_read_fallback(c, q, data);
+	}
+	return true;
+}
+
+void ublksrv_cache_complete_io(struct ublksrv_cache *c,
+		const struct ublksrv_queue *q, int tag, int res)
+{
+	const struct ublksrv_io_desc *iod;
+	struct cache_io *io;
+	unsigned long long off, end, chunk;
+
+	if (!c) {
+		ublksrv_tgt_complete_io(q, tag, res);
+		return;
+	}
+
+	iod = ublksrv_tgt_get_io_data(q, tag)->iod;
+	io = cache_get_io(c, q, tag);
+	off = iod->start_sector << 9;
+	end = off + ((unsigned long long)iod->nr_sectors << 9);
+
+	switch (ublksrv_get_op(iod)) {
+	case UBLK_IO_OP_READ:
+		if (res == (int)(end - off) && !io->nofill)
+			cache_queue_fill(c, iod, io->seq, false);
+		break;
+	case UBLK_IO_OP_WRITE:
+	case UBLK_IO_OP_DISCARD:
+	case UBLK_IO_OP_WRITE_ZEROES:
+		if (!io->counted)
+			break;
+		io->counted = false;
+		pthread_mutex_lock(&c->lock);
+		for (chunk = off >> c->chunk_shift;
+				chunk << c->chunk_shift < end; chunk++)
+			cache_bucket(c, chunk)->inflight -= 1;
+		pthread_mutex_unlock(&c->lock);
+		if (c->mode == CACHE_MODE_WT && res == (int)(end - off) &&
+				ublksrv_get_op(iod) == UBLK_IO_OP_WRITE)
+			cache_queue_fill(c, iod, io->seq, true);
+		break;
+	}
+	ublksrv_tgt_complete_io(q, tag, res);
+}
+
+/* slot table, data area and log are laid out by size of cache */
+static int cache_layout(struct ublksrv_cache *c, unsigned long long size)
+{
+	unsigned long long chunk = 1ULL << c->chunk_shift;
+	unsigned long long nr = size >> c->chunk_shift;
+	unsigned long long table_len;
+	unsigned int log_blocks;
+
+	log_blocks = std::min(std::max(nr / 16, 64ULL), 8192ULL);
+	table_len = (nr * sizeof(struct cache_ent) + CACHE_BLK_SIZE - 1) &
+		~(unsigned long long)(CACHE_BLK_SIZE - 1);
+	c->table_off[0] = CACHE_BLK_SIZE;
+	c->table_off[1] = c->table_off[0] + table_len;
+	c->log_off = c->table_off[1] + table_len;
+	c->data_off = (c->log_off + ((unsigned long long)log_blocks <<
+				CACHE_BLK_SHIFT) + chunk - 1) & ~(chunk - 1);
+	if (c->data_off >= size)
+		return -ENOSPC;
+	c->nr_slots = (size - c->data_off) >> c->chunk_shift;
+	if (c->nr_slots < CACHE_MIN_SLOTS)
+		return -ENOSPC;
+	c->sb->log_blocks = log_blocks;
+	return 0;
+}
+
+/* rebuild slots from the active table and log, false if cache is cold */
+static bool cache_load(struct ublksrv_cache *c, const struct cache_sb *want)
+{
+	struct cache_sb *sb = c->sb;
+	struct cache_log_hdr *hdr = (struct cache_log_hdr *)c->log_buf;
+	std::vector<struct cache_ent> table(c->nr_slots);
+	size_t len = c->nr_slots * sizeof(struct cache_ent);
+	unsigned long long nr_chunks = (c->dev_size +
+			(1ULL << c->chunk_shift) - 1) >> c->chunk_shift;
+	unsigned long long i;
+	__u64 crc;
+
+	if (pread(c->fd, sb, CACHE_BLK_SIZE, 0) != CACHE_BLK_SIZE)
+		return false;
+	crc = sb->crc;
+	cache_sb_crc(sb);
+	if (crc != sb->crc || memcmp(sb->magic, CACHE_MAGIC, 8) ||
+			sb->chunk_shift != want->chunk_shift ||
+			sb->nr_slots != c->nr_slots ||
+			sb->log_blocks != want->log_blocks ||
+			sb->dev_size != c->dev_size || sb->table > 1 ||
+			strncmp(sb->id, want->id, sizeof(sb->id)))
+		return false;
+	/* records which aren't synced may be lost after reboot */
+	if (!sb->clean && strncmp(sb->boot_id, want->boot_id,
+				sizeof(sb->boot_id)))
+		return false;
+
+	if (pread(c->fd, table.data(), len, c->table_off[sb->table]) !=
+			(ssize_t)len)
+		return false;
+	for (i = 0; i < c->nr_slots; i++) {
+		c->slots[i].chunk = table[i].chunk;
+		c->slots[i].mask = table[i].mask;
+	}
+
+	for (i = 0; i < sb->log_blocks; i++) {
+		struct cache_rec *rec = (struct cache_rec *)(hdr + 1);
+		unsigned j;
+
+		if (pread(c->fd, c->log_buf, CACHE_BLK_SIZE, c->log_off +
+					(i << CACHE_BLK_SHIFT)) != CACHE_BLK_SIZE)
+			break;
+		crc = hdr->crc;
+		hdr->crc = 0;
+		if (hdr->magic != CACHE_LOG_MAGIC || hdr->idx != i ||
+				hdr->epoch != sb->epoch ||
+				hdr->nr > CACHE_RECS_PER_BLK ||
+				crc != ublksrv_crc64_nvme(0, c->log_buf,
+					CACHE_BLK_SIZE))
+			break;
+		for (j = 0; j < hdr->nr; j++) {
+			if (rec[j].slot >= c->nr_slots)
+				continue;
+			c->slots[rec[j].slot].chunk = rec[j].ent.chunk;
+			c->slots[rec[j].slot].mask = rec[j].ent.mask;
+		}
+		/* only the last block isn't full */
+		if (hdr->nr < CACHE_RECS_PER_BLK)
+			break;
+	}
+
+	for (i = 0; i < c->nr_slots; i++) {
+		struct cache_slot *s = &c->slots[i];
+
+		if (!s->mask || s->chunk >= nr_chunks || c->map.count(s->chunk)) {
+			s->chunk = CACHE_NO_CHUNK;
+			s->mask = 0;
+			continue;
+		}
+		c->map[s->chunk] = i;
+		s->list = CACHE_T1;
+		c->t1.push_back(i);
+		s->it = std::prev(c->t1.end());
+	}
+	return true;
+}
+
+static int cache_open_fd(struct ublksrv_cache *c, const char *path,
+		unsigned long long size_mb, unsigned long long *size)
+{
+	struct stat st;
+
+	c->fd = open(path, O_RDWR | O_CREAT, 0600);
+	if (c->fd < 0)
+		return -errno;
+	if (fstat(c->fd, &st) < 0)
+		return -errno;
+
+	if (S_ISBLK(st.st_mode)) {
+		if (ioctl(c->fd, BLKGETSIZE64, size) < 0)
+			return -errno;
+		return 0;
+	}
+	if (!S_ISREG(st.st_mode))
+		return -EINVAL;
+	if (!size_mb) {
+		*size = st.st_size;
+		return *size ? 0 : -EINVAL;
+	}
+	*size = size_mb << 20;
+	if ((unsigned long long)st.st_size != *size &&
+			ftruncate(c->fd, *size) < 0)
+		return -errno;
+	return 0;
+}
+
+static void cache_free(struct ublksrv_cache *c)
+{
+	if (c->fd >= 0)
+		close(c->fd);
+	free(c->sb);
+	free(c->log_buf);
+	pthread_mutex_destroy(&c->lock);
+	pthread_cond_destroy(&c->cond);
+	delete c;
+}
+
+int ublksrv_cache_open(struct ublksrv_dev *dev, const char *id,
+		struct ublksrv_cache **cachep)
+{
+	const struct ublksrv_ctrl_dev *cdev = ublksrv_get_ctrl_dev(dev);
+	const struct ublksrv_ctrl_dev_info *info =
+		ublksrv_ctrl_get_dev_info(cdev);
+	struct ublksrv_cache *c;
+	struct cache_sb want = {};
+	char path[PATH_MAX], buf[32];
+	unsigned long size_mb = 0, chunk_kb = CACHE_DEF_CHUNK_KB;
+	unsigned long long size, i;
+	bool warm;
+	int ret;
+
+	*cachep = NULL;
+	if (ublk_json_read_target_str_info(cdev, "cache", path) < 0)
+		return 0;
+
+	if (info->flags & (UBLK_F_USER_COPY | UBLK_F_SUPPORT_ZERO_COPY |
+				UBLK_F_AUTO_BUF_REG)) {
+		ublk_err("%s: cache needs io buffer in daemon\n", __func__);
+		return -EINVAL;
+	}
+
+	ublk_json_read_target_ulong_info(cdev, "cache_size", &size_mb);
+	ublk_json_read_target_ulong_info(cdev, "cache_chunk_kb", &chunk_kb);
+
+	c = new ublksrv_cache();
+	c->fd = -1;
+	pthread_mutex_init(&c->lock, NULL);
+	pthread_cond_init(&c->cond, NULL);
+	if (ublk_json_read_target_str_info(cdev, "cache_mode", buf) >= 0 &&
+			!strcmp(buf, "wi"))
+		c->mode = CACHE_MODE_WI;
+	if (ublk_json_read_target_str_info(cdev, "cache_policy", buf) >= 0 &&
+			!strcmp(buf, "lru"))
+		c->policy = CACHE_POLICY_LRU;
+	else
+		c->policy = CACHE_POLICY_ARC;
+	c->chunk_shift = ilog2(chunk_kb << 10);
+	c->dev_size = dev->tgt.dev_size;
+	c->depth = info->queue_depth;
+	c->max_pins = (info->max_io_buf_bytes >> c->chunk_shift) + 2;
+	c->buckets.resize(CACHE_NR_BUCKETS);
+	c->ios.resize(info->nr_hw_queues * c->depth);
+	c->pins.resize(info->nr_hw_queues * c->depth * c->max_pins);
+
+	ret = -ENOMEM;
+	if (posix_memalign((void **)&c->sb, CACHE_BLK_SIZE, CACHE_BLK_SIZE) ||
+			posix_memalign(&c->log_buf, CACHE_BLK_SIZE,
+				CACHE_BLK_SIZE))
+		goto fail;
+
+	ret = cache_open_fd(c, path, size_mb, &size);
+	if (ret) {
+		ublk_err("%s: open cache %s failed %d\n", __func__, path, ret);
+		goto fail;
+	}
+	ret = cache_layout(c, size);
+	if (ret) {
+		ublk_err("%s: cache %s is too small\n", __func__, path);
+		goto fail;
+	}
+
+	want.chunk_shift = c->chunk_shift;
+	want.log_blocks = c->sb->log_blocks;
+	snprintf(want.id, sizeof(want.id), "%s", id);
+	cache_read_boot_id(want.boot_id, sizeof(want.boot_id));
+
+	c->slots.resize(c->nr_slots);
+	for (i = 0; i < c->nr_slots; i++) {
+		c->slots[i].chunk = CACHE_NO_CHUNK;
+		c->slots[i].list = CACHE_FREE;
+	}
+	warm = cache_load(c, &want);
+	if (!warm) {
+		c->map.clear();
+		c->t1.clear();
+		for (i = 0; i < c->nr_slots; i++) {
+			c->slots[i].chunk = CACHE_NO_CHUNK;
+			c->slots[i].mask = 0;
+			c->slots[i].list = CACHE_FREE;
+		}
+		memset(c->sb, 0, CACHE_BLK_SIZE);
+		memcpy(c->sb->magic, CACHE_MAGIC, 8);
+		c->sb->chunk_shift = c->chunk_shift;
+		c->sb->log_blocks = want.log_blocks;
+		c->sb->nr_slots = c->nr_slots;
+		c->sb->dev_size = c->dev_size;
+		memcpy(c->sb->id, want.id, sizeof(want.id));
+	}
+	for (i = c->nr_slots; i-- > 0; )
+		if (c->slots[i].list == CACHE_FREE)
+			c->free_slots.push_back(i);
+
+	/* cache is dirty from now on */
+	c->sb->clean = 0;
+	memcpy(c->sb->boot_id, want.boot_id, sizeof(want.boot_id));
+	ret = cache_checkpoint(c);
+	if (!ret && fdatasync(c->fd))
+		ret = -errno;
+	if (ret) {
+		ublk_err("%s: init cache %s failed %d\n", __func__, path, ret);
+		goto fail;
+	}
+
+	ret = pthread_create(&c->writer, NULL, cache_writer_fn, c);
+	if (ret) {
+		ret = -ret;
+		goto fail;
+	}
+
+	ublk_log("%s: %s cache %s: %llu slots of %uKB, %zu cached, %s %s\n",
+			__func__, warm ? "warm" : "cold", path, c->nr_slots,
+			1U << (c->chunk_shift - 10), c->map.size(),
+			cache_mode_names[c->mode],
+			cache_policy_names[c->policy]);
+	*cachep = c;
+	return 0;
+fail:
+	cache_free(c);
+	return ret;
+}
+
+void ublksrv_cache_close(struct ublksrv_cache *c)
+{
+	if (!c)
+		return;
+
+	pthread_mutex_lock(&c->lock);
+	c->stop = true;
+	pthread_cond_signal(&c->cond);
+	pthread_mutex_unlock(&c->lock);
+	pthread_join(c->writer, NULL);
+
+	for (auto &job : c->jobs)
+		free(job.buf);
+
+	if (!c->broken) {
+		if (cache_checkpoint(c) || fdatasync(c->fd))
+			cache_poison(c);
+		else {
+			c->sb->clean = 1;
+			if (cache_write_sb(c) || fdatasync(c->fd))
+				ublk_err("%s: failed to mark cache clean\n",
+						__func__);
+		}
+	}
+
+	ublk_log("%s: hits %llu misses %llu fills %llu evicts %llu\n",
+			__func__, c->hits, c->misses, c->fills, c->evicts);
+	cache_free(c);
+}
@@ -0,0 +1,515 @@
+// SPDX-License-Identifier: MIT or GPL-2.0-only
+
+/*
+ * Latency & fault injection layer: `ublk add -t delay --inner TYPE ...`,
+ * or `--stack delay` over any target, see ublksrv_stack.cpp
+ *
+ * Every io is held by IORING_OP_TIMEOUT on the queue ring before it is
+ * passed to the lower layer or target, so the queue thread never sleeps.
+ * Delay of one io is the sum of:
+ *
+ * - latency sampled from the distribution of its op
+ * - wait until the end of the periodic stall window it arrives in
+ * - wait for its turn under the bandwidth cap
+ *
+ * io matching one fault rule is failed with the rule's errno after the
+ * delay, and never reaches the lower layer or target.
+ *
+ * Random numbers come from one seeded generator per queue, so one run can
+ * be repeated exactly with the same --seed and io order.
+ */
+
+#include "config.h"
+#include <math.h>
+#include <time.h>
+#include <string>
+#include <algorithm>
+#include <vector>
+#include "ublksrv_tgt.h"
+
+/* op of the delay timeout, don't overlap with ops used by targets */
+#define DELAY_TIMEOUT_OP	0xfe
+
+#define DELAY_MAX_FAULTS	16
+
+enum {
+	DELAY_DIST_NONE,
+	DELAY_DIST_FIXED,
+	DELAY_DIST_LOGNORMAL,
+	DELAY_DIST_BIMODAL,
+	DELAY_DIST_HIST,
+};
+
+/* latency distribution, all time is in nanoseconds */
+struct delay_dist {
+	int type;
+
+	/*
+	 * fixed: lat[0]
+	 * lognormal: median lat[0], sigma
+	 * bimodal: lat[0], or lat[1] with probability 'pct'
+	 */
+	double lat[2];
+	double sigma;
+	double pct;
+
+	/* histogram: latency and cumulative count of each bucket */
+	std::vector<double> hist_lat;
+	std::vector<unsigned long long> hist_cdf;
+};
+
+/* op slot of distribution and fault */
+enum {
+	DELAY_OP_READ,
+	DELAY_OP_WRITE,
+	DELAY_OP_FLUSH,
+	DELAY_OP_DISCARD,	/* discard & write zeroes */
+	DELAY_OP_OTHER,
+	DELAY_OP_NR,
+	DELAY_OP_ANY = DELAY_OP_NR,
+};
+
+struct delay_fault {
+	int op;
+	/* [start, end) in sectors */
+	unsigned long long start, end;
+	int err;
+	double pct;
+};
+
+struct delay_queue {
+	unsigned long long rnd;
+
+	/* when the bandwidth of this queue becomes free */
+	unsigned long long bw_next;
+
+	struct __kernel_timespec *ts;
+	int *res;
+};
+
+static struct {
+	struct delay_dist dist[DELAY_OP_NR];
+
+	unsigned long long stall_period, stall_len;
+	unsigned long long start;
+
+	/* bytes per second of each queue, 0 means no limit */
+	unsigned long long queue_bw;
+
+	struct delay_fault faults[DELAY_MAX_FAULTS];
+	int nr_faults;
+
+	unsigned long long seed;
+
+	struct delay_queue *queues[MAX_NR_HW_QUEUES];
+} delay_dev;
+
+static const char *const delay_op_names[] = {
+	"read", "write", "flush", "discard", "other", "any",
+};
+
+/* xorshift64*, uniform in [0, 1) */
+static inline double delay_rand(struct delay_queue *dq)
+{
+	dq->rnd ^= dq->rnd >> 12;
+	dq->rnd ^= dq->rnd << 25;
+	dq->rnd ^= dq->rnd >> 27;
+	return ((dq->rnd * 0x2545F4914F6CDD1DULL) >> 11) * (1.0 / (1ULL << 53));
+}
+
+static inline int delay_op_slot(unsigned ublk_op)
+{
+	switch (ublk_op) {
+	case UBLK_IO_OP_READ:
+		return DELAY_OP_READ;
+	case UBLK_IO_OP_WRITE:
+		return DELAY_OP_WRITE;
+	case UBLK_IO_OP_FLUSH:
+		return DELAY_OP_FLUSH;
+	case UBLK_IO_OP_DISCARD:
+	case UBLK_IO_OP_WRITE_ZEROES:
+		return DELAY_OP_DISCARD;
+	default:
+		return DELAY_OP_OTHER;
+	}
+}
+
+static unsigned long long delay_sample(struct delay_queue *dq,
+		const struct delay_dist *d)
+{
+	double u, lat;
+
+	switch (d->type) {
+	case DELAY_DIST_FIXED:
+		return d->lat[0];
+	case DELAY_DIST_LOGNORMAL:
+		/* Box-Muller */
+		u = delay_rand(dq);
+		lat = d->lat[0] * exp(d->sigma * sqrt(-2 * log(1 - u)) *
+				cos(2 * M_PI * delay_rand(dq)));
+		return lat;
+	case DELAY_DIST_BIMODAL:
+		return d->lat[delay_rand(dq) < d->pct];
+	case DELAY_DIST_HIST: {
+		unsigned long long r = delay_rand(dq) * d->hist_cdf.back();
+		auto it = std::upper_bound(d->hist_cdf.begin(),
+				d->hist_cdf.end(), r);
+
+		return d->hist_lat[it - d->hist_cdf.begin()];
+	}
+	default:
+		return 0;
+	}
+}
+
+static int delay_match_fault(struct delay_queue *dq,
+		const struct ublksrv_io_desc *iod)
+{
+	int slot = delay_op_slot(ublksrv_get_op(iod));
+	unsigned long long start = iod->start_sector;
+	unsigned long long end = start + iod->nr_sectors;
+
+	for (int i = 0; i < delay_dev.nr_faults; i++) {
+		const struct delay_fault *f = &delay_dev.faults[i];
+
+		if (f->op != DELAY_OP_ANY && f->op != slot)
+			continue;
+		/* flush covers the whole device */
+		if (slot != DELAY_OP_FLUSH && (end <= f->start || start >= f->end))
+			continue;
+		if (f->pct >= 1 || delay_rand(dq) < f->pct)
+			return -f->err;
+	}
+	return 0;
+}
+
+static unsigned long long delay_io_ns(struct delay_queue *dq,
+		const struct ublksrv_io_desc *iod)
+{
+	unsigned ublk_op = ublksrv_get_op(iod);
+	unsigned long long now = ublksrv_tgt_now_ns();
+	unsigned long long ns = delay_sample(dq,
+			&delay_dev.dist[delay_op_slot(ublk_op)]);
+
+	if (delay_dev.stall_period) {
+		unsigned long long phase = (now - delay_dev.start) %
+			delay_dev.stall_period;
+
+		if (phase < delay_dev.stall_len)
+			ns += delay_dev.stall_len - phase;
+	}
+
+	if (delay_dev.queue_bw && (ublk_op == UBLK_IO_OP_READ ||
+				ublk_op == UBLK_IO_OP_WRITE)) {
+		unsigned long long xfer = (iod->nr_sectors << 9) *
+			1000000000ULL / delay_dev.queue_bw;
+
+		dq->bw_next = std::max(dq->bw_next, now) + xfer;
+		ns += dq->bw_next - now;
+	}
+
+	return ns;
+}
+
+static void delay_handle_io(const struct ublksrv_queue *q,
+		const struct ublk_io_data *data)
+{
+	struct delay_queue *dq = delay_dev.queues[q->q_id];
+	unsigned long long ns = delay_io_ns(dq, data->iod);
+	int res = delay_match_fault(dq, data->iod);
+	struct io_uring_sqe *sqe[1];
+
+	if (!ns || !ublk_queue_alloc_sqes(q, sqe, 1)) {
+		if (res)
+			ublksrv_tgt_complete_io(q, data->tag, res);
+		else
+			ublksrv_stack_submit(q, data);
+		return;
+	}
+
+	dq->res[data->tag] = res;
+	dq->ts[data->tag].tv_sec = ns / 1000000000ULL;
+	dq->ts[data->tag].tv_nsec = ns % 1000000000ULL;
+	io_uring_prep_timeout(sqe[0], &dq->ts[data->tag], 0, 0);
+	sqe[0]->user_data = build_user_data(data->tag, DELAY_TIMEOUT_OP, 0, 1);
+}
+
+static void delay_io_done(const struct ublksrv_queue *q, int tag,
+		const struct io_uring_cqe *cqe)
+{
+	int res = delay_dev.queues[q->q_id]->res[tag];
+
+	if (res)
+		ublksrv_tgt_complete_io(q, tag, res);
+	else
+		ublksrv_stack_submit(q, ublksrv_tgt_get_io_data(q, tag));
+}
+
+/* "usec count" per line, such as the buckets of one latency histogram */
+static int delay_load_hist(struct delay_dist *d, const char *path)
+{
+	FILE *f = fopen(path, "r");
+	unsigned long long cnt, sum = 0;
+	double us;
+
+	if (!f)
+		return -errno;
+	while (fscanf(f, "%lf %llu", &us, &cnt) == 2) {
+		if (!cnt)
+			continue;
+		sum += cnt;
+		d->hist_lat.push_back(us * 1000);
+		d->hist_cdf.push_back(sum);
+	}
+	fclose(f);
+
+	return sum ? 0 : -EINVAL;
+}
+
+/*
+ * fixed:US, lognormal:MEDIAN_US:SIGMA, bimodal:US1:US2:PCT or hist:FILE
+ */
+static int delay_parse_dist(struct delay_dist *d, const char *str)
+{
+	double a = 0, b = 0, c = 0;
+
+	d->hist_lat.clear();
+	d->hist_cdf.clear();
+	if (sscanf(str, "fixed:%lf", &a) == 1) {
+		d->type = DELAY_DIST_FIXED;
+	} else if (sscanf(str, "lognormal:%lf:%lf", &a, &b) == 2) {
+		d->type = DELAY_DIST_LOGNORMAL;
+		d->sigma = b;
+	} else if (sscanf(str, "bimodal:%lf:%lf:%lf", &a, &b, &c) == 3) {
+		d->type = DELAY_DIST_BIMODAL;
+		d->pct = c / 100;
+	} else if (!strncmp(str, "hist:", 5)) {
+		d->type = DELAY_DIST_HIST;
+		return delay_load_hist(d, str + 5);
+	} else {
+		return -EINVAL;
+	}
+	d->lat[0] = a * 1000;
+	d->lat[1] = b * 1000;
+	return 0;
+}
+
+static int delay_parse_errno(const char *str)
+{
+	static const struct {
+		const char *name;
+		int err;
+	} errs[] = {
+		{ "EIO", EIO },
+		{ "ENOSPC", ENOSPC },
+		{ "ETIMEDOUT", ETIMEDOUT },
+		{ "ENOLINK", ENOLINK },
+		{ "EILSEQ", EILSEQ },
+		{ "ENODATA", ENODATA },
+		{ "EREMOTEIO", EREMOTEIO },
+	};
+
+	for (unsigned i = 0; i < sizeof(errs) / sizeof(errs[0]); i++)
+		if (!strcmp(str, errs[i].name))
+			return errs[i].err;
+	return strtol(str, NULL, 10);
+}
+
+/* OP:START-END:ERRNO[:PCT], START/END are in sectors */
+static int delay_parse_fault(struct delay_fault *f, const char *str)
+{
+	char op[16], err[16];
+	double pct = 100;
+	int op_idx;
+
+	if (sscanf(str, "%15[^:]:%llu-%llu:%15[^:]:%lf", op, &f->start,
+				&f->end, err, &pct) < 4 || f->start >= f->end)
+		return -EINVAL;
+
+	for (op_idx = 0; op_idx <= DELAY_OP_ANY; op_idx++)
+		if (!strcmp(op, delay_op_names[op_idx]))
+			break;
+	if (op_idx > DELAY_OP_ANY)
+		return -EINVAL;
+
+	f->op = op_idx;
+	f->err = delay_parse_errno(err);
+	f->pct = pct / 100;
+	return f->err > 0 ? 0 : -EINVAL;
+}
+
+/*
+ * Parse delay options, and append the parsed ones to 'spec', which is
+ * stored in json for recovery.
+ */
+static int delay_parse_opts(int argc, char *argv[], std::string &spec,
+		unsigned long long *bw)
+{
+	static const struct option longopts[] = {
+		{ "lat",		1,	NULL, 0 },
+		{ "read_lat",		1,	NULL, 0 },
+		{ "write_lat",		1,	NULL, 0 },
+		{ "flush_lat",		1,	NULL, 0 },
+		{ "discard_lat",	1,	NULL, 0 },
+		{ "stall",		1,	NULL, 0 },
+		{ "bw_limit",		1,	NULL, 0 },
+		{ "fault",		1,	NULL, 0 },
+		{ "seed",		1,	NULL, 0 },
+		{ NULL }
+	};
+	int opt, option_index = 0, ret = 0;
+
+	optind = 0;
+	while ((opt = getopt_long(argc, argv, "-:",
+				  longopts, &option_index)) != -1) {
+		const char *name = longopts[option_index].name;
+		char path[PATH_MAX];
+
+		if (opt != 0)
+			continue;
+
+		if (!strcmp(name, "lat")) {
+			for (int i = 0; i < DELAY_OP_NR && !ret; i++)
+				ret = delay_parse_dist(&delay_dev.dist[i], optarg);
+		} else if (!strcmp(name, "read_lat")) {
+			ret = delay_parse_dist(&delay_dev.dist[DELAY_OP_READ], optarg);
+		} else if (!strcmp(name, "write_lat")) {
+			ret = delay_parse_dist(&delay_dev.dist[DELAY_OP_WRITE], optarg);
+		} else if (!strcmp(name, "flush_lat")) {
+			ret = delay_parse_dist(&delay_dev.dist[DELAY_OP_FLUSH], optarg);
+		} else if (!strcmp(name, "discard_lat")) {
+			ret = delay_parse_dist(&delay_dev.dist[DELAY_OP_DISCARD], optarg);
+		} else if (!strcmp(name, "stall")) {
+			if (sscanf(optarg, "%llu:%llu", &delay_dev.stall_period,
+					&delay_dev.stall_len) != 2 ||
+					delay_dev.stall_len >= delay_dev.stall_period)
+				ret = -EINVAL;
+			delay_dev.stall_period *= 1000000;
+			delay_dev.stall_len *= 1000000;
+		} else if (!strcmp(name, "bw_limit")) {
+			*bw = strtoull(optarg, NULL, 10) << 20;
+		} else if (!strcmp(name, "fault")) {
+			if (delay_dev.nr_faults >= DELAY_MAX_FAULTS)
+				ret = -E2BIG;
+			else
+				ret = delay_parse_fault(&delay_dev.faults[
+						delay_dev.nr_faults++], optarg);
+		} else if (!strcmp(name, "seed")) {
+			delay_dev.seed = strtoull(optarg, NULL, 10);
+		}
+
+		if (ret) {
+			ublk_err("%s: invalid --%s %s\n", __func__, name, optarg);
+			break;
+		}
+
+		/* histogram file is opened again in recovery */
+		if (!strncmp(optarg, "hist:", 5) && realpath(optarg + 5, path))
+			spec += std::string(" --") + name + " hist:" + path;
+		else
+			spec += std::string(" --") + name + " " + optarg;
+	}
+	optind = 0;
+
+	return ret;
+}
+
+static int delay_setup(struct ublksrv_dev *dev, int argc, char *argv[])
+{
+	const struct ublksrv_ctrl_dev *cdev = ublksrv_get_ctrl_dev(dev);
+	const struct ublksrv_ctrl_dev_info *info = ublksrv_ctrl_get_dev_info(cdev);
+	unsigned long long bw = 0;
+	std::string spec;
+	int ret;
+
+	if (ublksrv_is_recovering(cdev)) {
+		char buf[4096];
+		std::vector<char *> av = { (char *)"delay" };
+
+		if (ublk_json_read_target_str_info(cdev, "delay", buf) < 0)
+			buf[0] = 0;
+		for (char *tok = strtok(buf, " "); tok; tok = strtok(NULL, " "))
+			av.push_back(tok);
+		ret = delay_parse_opts(av.size(), av.data(), spec, &bw);
+		if (ret < 0)
+			return ret;
+	} else {
+		ret = delay_parse_opts(argc, argv, spec, &bw);
+		if (ret < 0)
+			return ret;
+		if (spec.size() >= 4096)
+			return -E2BIG;
+		ublk_json_write_tgt_str(cdev, "delay", spec.c_str());
+	}
+
+	/* the cap is shared by all queues */
+	delay_dev.queue_bw = bw / info->nr_hw_queues;
+	delay_dev.start = ublksrv_tgt_now_ns();
+	ublk_log("%s: dev %d delay%s\n", __func__, info->dev_id, spec.c_str());
+	return 0;
+}
+
+static int delay_init_queue(const struct ublksrv_queue *q)
+{
+	struct delay_queue *dq = (struct delay_queue *)calloc(1, sizeof(*dq));
+
+	if (!dq)
+		return -ENOMEM;
+	dq->ts = (struct __kernel_timespec *)calloc(q->q_depth,
+			sizeof(*dq->ts));
+	dq->res = (int *)calloc(q->q_depth, sizeof(*dq->res));
+	if (!dq->ts || !dq->res) {
+		free(dq->ts);
+		free(dq->res);
+		free(dq);
+		return -ENOMEM;
+	}
+	/* xorshift state can't be zero */
+	dq->rnd = (delay_dev.seed + q->q_id + 1) * 0x9E3779B97F4A7C15ULL;
+	delay_dev.queues[q->q_id] = dq;
+	return 0;
+}
+
+static void delay_deinit_queue(const struct ublksrv_queue *q)
+{
+	struct delay_queue *dq = delay_dev.queues[q->q_id];
+
+	free(dq->ts);
+	free(dq->res);
+	free(dq);
+	delay_dev.queues[q->q_id] = NULL;
+}
+
+static void delay_usage(void)
+{
+	printf("\t--stack delay, or -t delay --inner TYPE: delay & fault injection\n");
+	printf("\t\t[--lat|--read_lat|--write_lat|--flush_lat|--discard_lat DIST]\n");
+	printf("\t\t\tDIST: fixed:US lognormal:MEDIAN_US:SIGMA\n");
+	printf("\t\t\t      bimodal:US1:US2:PCT_OF_US2 hist:FILE(\"US COUNT\" lines)\n");
+	printf("\t\t[--stall PERIOD_MS:STALL_MS] [--bw_limit MB/s]\n");
+	printf("\t\t[--fault OP:START-END:ERRNO[:PCT]]... [--seed N]\n");
+	printf("\t\t\tOP: read|write|flush|discard|other|any, sectors in [START, END)\n");
+}
+
+const char *ublksrv_delay_inner_type(int argc, char *argv[])
+{
+	for (int i = 1; i < argc; i++) {
+		if (!strcmp(argv[i], "--inner") && i + 1 < argc)
+			return argv[i + 1];
+		if (!strncmp(argv[i], "--inner=", 8))
+			return argv[i] + 8;
+	}
+	return NULL;
+}
+
+const struct ublksrv_stack_layer ublksrv_delay_layer = {
+	.name		= "delay",
+	.op		= DELAY_TIMEOUT_OP,
+	.sqes_per_io	= 1,
+	.setup		= delay_setup,
+	.init_queue	= delay_init_queue,
+	.deinit_queue	= delay_deinit_queue,
+	.handle_io	= delay_handle_io,
+	.io_done	= delay_io_done,
+	.usage		= delay_usage,
+};
@@ -0,0 +1,415 @@
+// SPDX-License-Identifier: MIT or GPL-2.0-only
+
+/*
+ * In-process target stacking: `ublk add -t TYPE ... --stack LAYER[,LAYER]`
+ *
+ * Layers run in the daemon of the target: ublk.<TYPE> wraps its
+ * ublksrv_tgt_type, and one io is passed from the top layer down to the
+ * target by function call on the queue thread, and sqes of all layers and
+ * the target are issued on the queue ring. So io crosses the kernel only
+ * once, instead of once for every ublk disk when disks are stacked.
+ *
+ * The io keeps its tag in all layers, and the level which owns the io
+ * is tracked for every tag. One layer passes io down by
+ * ublksrv_stack_submit(), and whoever finishes the io calls
+ * ublksrv_tgt_complete_io(), then the io is returned to ->lower_done() of
+ * layers above in reverse order, and to ublk driver at last.
+ *
+ * Target has to be registered by ublksrv_stack_register_backend() for
+ * layers with ->lower_done(). Layers without it, such as delay, can be
+ * stacked over any target.
+ */
+
+#include "config.h"
+#include <string>
+#include "ublksrv_tgt.h"
+
+struct stack_queue {
+	/* level of the layer or target which owns the io, per tag */
+	unsigned char *level;
+
+	/* io data passed to each level, [level * q_depth + tag] */
+	const struct ublk_io_data **data;
+};
+
+static struct {
+	const struct ublksrv_tgt_type *inner;
+
+	/* target which lets layers see io completion */
+	const struct ublksrv_tgt_type *backend;
+
+	/* top layer first, and the target is at level 'nr_layers' */
+	const struct ublksrv_stack_layer *layers[UBLKSRV_STACK_MAX_LAYERS];
+	int nr_layers;
+
+	struct stack_queue *queues[MAX_NR_HW_QUEUES];
+} stack_dev;
+
+static struct ublksrv_tgt_type stack_tgt_type;
+
+static const struct ublksrv_stack_layer *const stack_all_layers[] = {
+	&ublksrv_delay_layer,
+	&ublksrv_verify_layer,
+};
+
+#define STACK_NR_ALL_LAYERS \
+	(sizeof(stack_all_layers) / sizeof(stack_all_layers[0]))
+
+static int stack_add_layer(const char *name, size_t len)
+{
+	const struct ublksrv_stack_layer *l = NULL;
+
+	for (unsigned i = 0; i < STACK_NR_ALL_LAYERS; i++) {
+		if (strlen(stack_all_layers[i]->name) == len &&
+				!strncmp(stack_all_layers[i]->name, name, len))
+			l = stack_all_layers[i];
+	}
+	if (!l) {
+		ublk_err("%s: unknown layer %.*s\n", __func__, (int)len, name);
+		return -EINVAL;
+	}
+
+	for (int i = 0; i < stack_dev.nr_layers; i++) {
+		if (stack_dev.layers[i] == l) {
+			ublk_err("%s: layer %s is stacked twice\n", __func__,
+					l->name);
+			return -EINVAL;
+		}
+	}
+	if (stack_dev.nr_layers >= UBLKSRV_STACK_MAX_LAYERS)
+		return -E2BIG;
+
+	stack_dev.layers[stack_dev.nr_layers++] = l;
+	return 0;
+}
+
+/* LAYER[,LAYER]..., top layer first */
+static int stack_parse_layers(const char *str)
+{
+	int ret = 0;
+
+	stack_dev.nr_layers = 0;
+	while (*str && !ret) {
+		size_t len = strcspn(str, ",");
+
+		ret = stack_add_layer(str, len);
+		str += len;
+		if (*str)
+			str++;
+	}
+	return ret;
+}
+
+/* '-t delay' puts delay layer on the top if it isn't in --stack */
+static int stack_parse_opts(int argc, char *argv[], std::string &spec)
+{
+	static const struct option longopts[] = {
+		{ "type",	1,	NULL, 't' },
+		{ "stack",	1,	NULL, 0 },
+		{ NULL }
+	};
+	int opt, option_index = 0, ret;
+	bool delay = false;
+
+	optind = 0;
+	while ((opt = getopt_long(argc, argv, "-:t:",
+				  longopts, &option_index)) != -1) {
+		if (opt == 't')
+			delay = !strcmp(optarg, "delay");
+		else if (opt == 0 && !strcmp(longopts[option_index].name,
+					"stack"))
+			spec = optarg;
+	}
+	optind = 0;
+
+	ret = stack_parse_layers(spec.c_str());
+	if (ret || !delay)
+		return ret;
+
+	for (int i = 0; i < stack_dev.nr_layers; i++)
+		if (stack_dev.layers[i] == &ublksrv_delay_layer)
+			return 0;
+	spec = spec.empty() ? "delay" : "delay," + spec;
+	return stack_parse_layers(spec.c_str());
+}
+
+static void stack_cleanup(const struct ublksrv_dev *dev, int nr)
+{
+	while (nr-- > 0) {
+		if (stack_dev.layers[nr]->cleanup)
+			stack_dev.layers[nr]->cleanup(dev);
+	}
+}
+
+static int stack_setup(struct ublksrv_dev *dev, int argc, char *argv[])
+{
+	const struct ublksrv_ctrl_dev *cdev = ublksrv_get_ctrl_dev(dev);
+	const struct ublksrv_ctrl_dev_info *info = ublksrv_ctrl_get_dev_info(cdev);
+	std::string spec;
+	int ret, i;
+
+	if (ublksrv_is_recovering(cdev)) {
+		char buf[256];
+
+		if (ublk_json_read_target_str_info(cdev, "stack", buf) < 0)
+			buf[0] = 0;
+		spec = buf;
+		ret = stack_parse_layers(buf);
+	} else {
+		ret = stack_parse_opts(argc, argv, spec);
+		if (!ret && stack_dev.nr_layers)
+			ublk_json_write_tgt_str(cdev, "stack", spec.c_str());
+	}
+	if (ret)
+		return ret;
+
+	if (!stack_dev.nr_layers) {
+		/* no layer, so target runs alone */
+		dev->tgt.ops = stack_dev.inner;
+		return 0;
+	}
+
+	for (i = 0; i < stack_dev.nr_layers; i++) {
+		const struct ublksrv_stack_layer *l = stack_dev.layers[i];
+
+		if (l->lower_done && stack_dev.backend != stack_dev.inner) {
+			ublk_err("%s: layer %s can't be stacked over %s\n",
+					__func__, l->name, stack_dev.inner->name);
+			ret = -EINVAL;
+		} else {
+			ret = l->setup ? l->setup(dev, argc, argv) : 0;
+		}
+		if (ret) {
+			stack_cleanup(dev, i);
+			return ret;
+		}
+		dev->tgt.tgt_ring_depth += l->sqes_per_io * info->queue_depth;
+	}
+
+	ublk_log("%s: dev %d %s over %s\n", __func__, info->dev_id,
+			spec.c_str(), stack_dev.inner->name);
+	return 0;
+}
+
+static int stack_init_tgt(struct ublksrv_dev *dev, int type, int argc,
+		char *argv[])
+{
+	int ret = stack_dev.inner->init_tgt ?
+		stack_dev.inner->init_tgt(dev, type, argc, argv) : 0;
+
+	if (ret)
+		return ret;
+	ret = stack_setup(dev, argc, argv);
+	if (ret && stack_dev.inner->deinit_tgt)
+		stack_dev.inner->deinit_tgt(dev);
+	return ret;
+}
+
+static int stack_recovery_tgt(struct ublksrv_dev *dev, int type)
+{
+	int ret = stack_dev.inner->recovery_tgt(dev, type);
+
+	if (ret)
+		return ret;
+	ret = stack_setup(dev, 0, NULL);
+	if (ret && stack_dev.inner->deinit_tgt)
+		stack_dev.inner->deinit_tgt(dev);
+	return ret;
+}
+
+static void stack_deinit_tgt(const struct ublksrv_dev *dev)
+{
+	stack_cleanup(dev, stack_dev.nr_layers);
+	if (stack_dev.inner->deinit_tgt)
+		stack_dev.inner->deinit_tgt(dev);
+}
+
+static void stack_free_queue(const struct ublksrv_queue *q, int nr)
+{
+	struct stack_queue *sq = stack_dev.queues[q->q_id];
+
+	while (nr-- > 0) {
+		if (stack_dev.layers[nr]->deinit_queue)
+			stack_dev.layers[nr]->deinit_queue(q);
+	}
+	if (sq) {
+		free(sq->level);
+		free(sq->data);
+		free(sq);
+		stack_dev.queues[q->q_id] = NULL;
+	}
+}
+
+static int stack_init_queue(const struct ublksrv_queue *q,
+		void **queue_data_ptr)
+{
+	struct stack_queue *sq;
+	int i, ret = 0;
+
+	/* ops is switched to the target's when there isn't any layer */
+	if (!stack_dev.nr_layers)
+		goto init_inner;
+
+	sq = (struct stack_queue *)calloc(1, sizeof(*sq));
+	if (!sq)
+		return -ENOMEM;
+	stack_dev.queues[q->q_id] = sq;
+	sq->level = (unsigned char *)calloc(q->q_depth, sizeof(*sq->level));
+	sq->data = (const struct ublk_io_data **)calloc(q->q_depth *
+			(stack_dev.nr_layers + 1), sizeof(*sq->data));
+	if (!sq->level || !sq->data) {
+		stack_free_queue(q, 0);
+		return -ENOMEM;
+	}
+	/* so io data of one tag is always valid, even before its first io */
+	for (i = 0; i < q->q_depth * (stack_dev.nr_layers + 1); i++)
+		sq->data[i] = ublksrv_queue_get_io_data(q, i % q->q_depth);
+
+	for (i = 0; i < stack_dev.nr_layers; i++) {
+		if (stack_dev.layers[i]->init_queue)
+			ret = stack_dev.layers[i]->init_queue(q);
+		if (ret) {
+			stack_free_queue(q, i);
+			return ret;
+		}
+	}
+
+init_inner:
+	if (stack_dev.inner->init_queue)
+		ret = stack_dev.inner->init_queue(q, queue_data_ptr);
+	if (ret)
+		stack_free_queue(q, stack_dev.nr_layers);
+	return ret;
+}
+
+static void stack_deinit_queue(const struct ublksrv_queue *q)
+{
+	if (stack_dev.inner->deinit_queue)
+		stack_dev.inner->deinit_queue(q);
+	stack_free_queue(q, stack_dev.nr_layers);
+}
+
+static inline void stack_pass_io(const struct ublksrv_queue *q,
+		struct stack_queue *sq, int level,
+		const struct ublk_io_data *data)
+{
+	sq->level[data->tag] = level;
+	sq->data[level * q->q_depth + data->tag] = data;
+
+	if (level == stack_dev.nr_layers)
+		stack_dev.inner->handle_io_async(q, data);
+	else
+		stack_dev.layers[level]->handle_io(q, data);
+}
+
+void ublksrv_stack_submit(const struct ublksrv_queue *q,
+		const struct ublk_io_data *data)
+{
+	struct stack_queue *sq = stack_dev.queues[q->q_id];
+
+	stack_pass_io(q, sq, sq->level[data->tag] + 1, data);
+}
+
+void ublksrv_tgt_complete_io(const struct ublksrv_queue *q, int tag, int res)
+{
+	struct stack_queue *sq;
+	int level;
+
+	if (!stack_dev.nr_layers) {
+		ublksrv_complete_io(q, tag, res);
+		return;
+	}
+
+	sq = stack_dev.queues[q->q_id];
+	level = sq->level[tag];
+	while (level-- > 0) {
+		const struct ublksrv_stack_layer *l = stack_dev.layers[level];
+
+		sq->level[tag] = level;
+		if (l->lower_done) {
+			l->lower_done(q, tag, res);
+			return;
+		}
+	}
+	ublksrv_complete_io(q, tag, res);
+}
+
+const struct ublk_io_data *ublksrv_tgt_get_io_data(
+		const struct ublksrv_queue *q, int tag)
+{
+	struct stack_queue *sq;
+
+	if (!stack_dev.nr_layers)
+		return ublksrv_queue_get_io_data(q, tag);
+
+	sq = stack_dev.queues[q->q_id];
+	return sq->data[sq->level[tag] * q->q_depth + tag];
+}
+
+static int stack_handle_io_async(const struct ublksrv_queue *q,
+		const struct ublk_io_data *data)
+{
+	stack_pass_io(q, stack_dev.queues[q->q_id], 0, data);
+	return 0;
+}
+
+static void stack_tgt_io_done(const struct ublksrv_queue *q,
+		const struct ublk_io_data *data,
+		const struct io_uring_cqe *cqe)
+{
+	struct stack_queue *sq = stack_dev.queues[q->q_id];
+	unsigned op = user_data_to_op(cqe->user_data);
+
+	for (int i = 0; i < stack_dev.nr_layers; i++) {
+		const struct ublksrv_stack_layer *l = stack_dev.layers[i];
+
+		if (l->op && l->op == op) {
+			l->io_done(q, data->tag, cqe);
+			return;
+		}
+	}
+
+	/* target sees the io data passed to it, same as ->handle_io_async() */
+	if (stack_dev.inner->tgt_io_done)
+		stack_dev.inner->tgt_io_done(q, sq->data[stack_dev.nr_layers *
+				q->q_depth + data->tag], cqe);
+}
+
+static void stack_usage(void)
+{
+	if (stack_dev.inner->usage_for_add)
+		stack_dev.inner->usage_for_add();
+	printf("\t[--stack LAYER[,LAYER]...]: layers over %s in its daemon, top first\n",
+			stack_dev.inner->name);
+	printf("\t\tLAYER:");
+	for (unsigned i = 0; i < STACK_NR_ALL_LAYERS; i++)
+		printf(" %s", stack_all_layers[i]->name);
+	printf("\n");
+	for (unsigned i = 0; i < STACK_NR_ALL_LAYERS; i++)
+		if (stack_all_layers[i]->usage)
+			stack_all_layers[i]->usage();
+}
+
+void ublksrv_stack_register_backend(const struct ublksrv_tgt_type *tgt_type)
+{
+	stack_dev.backend = tgt_type;
+}
+
+const struct ublksrv_tgt_type *ublksrv_stack_wrap(
+		const struct ublksrv_tgt_type *inner)
+{
+	stack_dev.inner = inner;
+
+	stack_tgt_type = *inner;
+	stack_tgt_type.handle_io_async = stack_handle_io_async;
+	stack_tgt_type.tgt_io_done = stack_tgt_io_done;
+	stack_tgt_type.usage_for_add = stack_usage;
+	stack_tgt_type.init_tgt = stack_init_tgt;
+	stack_tgt_type.deinit_tgt = stack_deinit_tgt;
+	stack_tgt_type.recovery_tgt = inner->recovery_tgt ? stack_recovery_tgt :
+		NULL;
+	stack_tgt_type.init_queue = stack_init_queue;
+	stack_tgt_type.deinit_queue = stack_deinit_queue;
+
+	return &stack_tgt_type;
+}
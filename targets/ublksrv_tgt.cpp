@@ -2,8 +2,17 @@
 
 #include "config.h"
 #include <semaphore.h>
+#include <sys/socket.h>
 #include "ublksrv_tgt.h"
 
+/* added in linux 5.11, may be missed in old libc headers */
+#ifndef SO_PREFER_BUSY_POLL
+#define SO_PREFER_BUSY_POLL	69
+#endif
+#ifndef SO_BUSY_POLL_BUDGET
+#define SO_BUSY_POLL_BUDGET	70
+#endif
+
 #define ERROR_EVTFD_DEVID   0xfffffffffffffffe
 
 struct ublksrv_queue_info {
@@ -101,6 +110,23 @@ static void setup_pthread_sigmask(bool fg)
 	pthread_sigmask(SIG_BLOCK, &signal_mask, NULL);
 }
 
+/* publish cycles accounting of all queues, so `ublk list` can show it */
+static void ublksrv_tgt_store_prof(const struct ublksrv_dev *dev)
+{
+	const struct ublksrv_ctrl_dev *cdev = ublksrv_get_ctrl_dev(dev);
+	const struct ublksrv_ctrl_dev_info *dinfo =
+		ublksrv_ctrl_get_dev_info(cdev);
+	struct ublksrv_queue_prof prof;
+	int i;
+
+	for (i = 0; i < dinfo->nr_hw_queues; i++) {
+		if (ublksrv_dev_get_queue_prof(dev, i, &prof))
+			return;
+		ublk_json_write_queue_prof(cdev, i, &prof);
+	}
+	ublk_tgt_store_dev_data(dev);
+}
+
 /*
  * Now STOP DEV ctrl command has been sent to /dev/ublk-control,
  * and wait until all pending fetch commands are canceled
@@ -114,8 +140,24 @@ static void ublksrv_drain_fetch_commands(const struct ublksrv_dev *dev,
 	unsigned i;
 	void *ret;
 
-	for (i = 0; i < nr_queues; i++)
-		pthread_join(info[i].thread, &ret);
+	for (i = 0; i < nr_queues; i++) {
+		struct timespec ts;
+
+		if (!(dinfo->ublksrv_flags & UBLKSRV_F_CPU_PROF)) {
+			pthread_join(info[i].thread, &ret);
+			continue;
+		}
+
+		/* refresh cycles accounting every second until queue exits */
+		do {
+			clock_gettime(CLOCK_REALTIME, &ts);
+			ts.tv_sec += 1;
+			if (pthread_timedjoin_np(info[i].thread, &ret,
+						&ts) != ETIMEDOUT)
+				break;
+			ublksrv_tgt_store_prof(dev);
+		} while (1);
+	}
 }
 
 static int ublksrv_tgt_send_dev_event(int evtfd, int dev_id)
@@ -156,6 +198,48 @@ static void ublk_tgt_set_params(struct ublksrv_ctrl_dev *cdev)
 	}
 }
 
+#define UBLK_DATAPATH_FLAGS	(UBLK_F_SUPPORT_ZERO_COPY | UBLK_F_AUTO_BUF_REG | \
+		UBLK_F_USER_COPY | UBLK_F_BATCH_IO)
+
+/* name of data path, recorded in device json */
+static const char *ublksrv_tgt_datapath_name(__u64 flags)
+{
+	bool batch = flags & UBLK_F_BATCH_IO;
+
+	if (flags & UBLK_F_AUTO_BUF_REG)
+		return batch ? "auto_zc+batch" : "auto_zc";
+	if (flags & UBLK_F_SUPPORT_ZERO_COPY)
+		return batch ? "zero_copy+batch" : "zero_copy";
+	if (flags & UBLK_F_USER_COPY)
+		return batch ? "user_copy+batch" : "user_copy";
+	return batch ? "copy+batch" : "copy";
+}
+
+/*
+ * Pick the fastest data path supported by both kernel and target:
+ * auto buffer register is preferred over zero copy, which is preferred
+ * over copy. User copy is never picked since it costs one extra syscall
+ * per IO. Batch IO is added whenever it is available.
+ */
+static __u64 ublksrv_tgt_auto_datapath(const struct ublksrv_tgt_type *tgt_type,
+		__u64 dev_flags, __u64 features)
+{
+	__u64 avail = tgt_type->datapath_flags & features;
+	__u64 flags = 0;
+
+	/* zero copy isn't allowed for unprivileged device */
+	if (dev_flags & (UBLK_F_UNPRIVILEGED_DEV | UBLK_F_NEED_GET_DATA))
+		avail &= ~(UBLK_F_SUPPORT_ZERO_COPY | UBLK_F_AUTO_BUF_REG);
+
+	if (avail & UBLK_F_SUPPORT_ZERO_COPY) {
+		flags |= UBLK_F_SUPPORT_ZERO_COPY;
+		flags |= avail & UBLK_F_AUTO_BUF_REG;
+	}
+	flags |= avail & UBLK_F_BATCH_IO;
+
+	return flags;
+}
+
 static int ublksrv_tgt_start_dev(struct ublksrv_ctrl_dev *cdev,
 		const struct ublksrv_dev *dev, int evtfd)
 {
@@ -164,6 +248,8 @@ static int ublksrv_tgt_start_dev(struct ublksrv_ctrl_dev *cdev,
 	int dev_id = dinfo->dev_id;
 	int ret;
 
+	ublk_json_write_tgt_str(cdev, "datapath",
+			ublksrv_tgt_datapath_name(dinfo->flags));
 	ublk_tgt_store_dev_data(dev);
 
 	if (ublksrv_is_recovering(cdev))
@@ -336,7 +422,8 @@ static int mkpath(const char *dir)
  * This function parses all the standard options that all targets support
  * and populates ublksrv_dev_data.
  */
-static int ublksrv_parse_add_opts(struct ublksrv_dev_data *data, int *efd, int argc, char *argv[])
+static int ublksrv_parse_add_opts(struct ublksrv_dev_data *data, int *efd,
+		bool *auto_datapath, int argc, char *argv[])
 {
 	int opt;
 	int uring_comp = 0;
@@ -347,6 +434,7 @@ static int ublksrv_parse_add_opts(struct ublksrv_dev_data *data, int *efd, int a
 	int unprivileged = 0;
 	int zero_copy = 0;
 	int batch_io = 0;
+	int no_auto_buf_reg = 0;
 	int option_index = 0;
 	unsigned int debug_mask = 0;
 	static const struct option longopts[] = {
@@ -366,6 +454,11 @@ static int ublksrv_parse_add_opts(struct ublksrv_dev_data *data, int *efd, int a
 		{ "max_io_buf_bytes",	1,	NULL, 0},
 		{ "zerocopy",	0,	NULL, 'z'},
 		{ "batch-io",	0,	NULL, 'b'},
+		{ "no_auto_buf_reg",	0,	NULL, 0},
+		{ "cpu_prof",	0,	NULL, 0},
+		{ "wait_batch",	0,	NULL, 0},
+		{ "datapath",	1,	NULL, 0},
+		{ "integrity",	0,	NULL, 0},
 		{ NULL }
 	};
 
@@ -424,6 +517,24 @@ static int ublksrv_parse_add_opts(struct ublksrv_dev_data *data, int *efd, int a
 				*efd = strtol(optarg, NULL, 10);
 			if (!strcmp(longopts[option_index].name, "max_io_buf_bytes"))
 				data->max_io_buf_bytes = strtol(optarg, NULL, 10);
+			if (!strcmp(longopts[option_index].name, "no_auto_buf_reg"))
+				no_auto_buf_reg = 1;
+			if (!strcmp(longopts[option_index].name, "cpu_prof"))
+				data->ublksrv_flags |= UBLKSRV_F_CPU_PROF;
+			if (!strcmp(longopts[option_index].name, "wait_batch"))
+				data->ublksrv_flags |= UBLKSRV_F_WAIT_BATCH;
+			/* integrity data can only be copied via user copy */
+			if (!strcmp(longopts[option_index].name, "integrity"))
+				data->flags |= UBLK_F_INTEGRITY | UBLK_F_USER_COPY;
+			if (!strcmp(longopts[option_index].name, "datapath")) {
+				if (!strcmp(optarg, "auto") && auto_datapath)
+					*auto_datapath = true;
+				else if (strcmp(optarg, "copy")) {
+					fprintf(stderr, "unknown datapath %s\n",
+							optarg);
+					return -EINVAL;
+				}
+			}
 			break;
 		}
 	}
@@ -444,8 +555,10 @@ static int ublksrv_parse_add_opts(struct ublksrv_dev_data *data, int *efd, int a
 		data->flags |= UBLK_F_USER_RECOVERY | UBLK_F_USER_RECOVERY_REISSUE;
 	if (unprivileged)
 		data->flags |= UBLK_F_UNPRIVILEGED_DEV;
+	/* try UBLK_F_AUTO_BUF_REG at default */
 	if (zero_copy)
-		data->flags |= UBLK_F_SUPPORT_ZERO_COPY;
+		data->flags |= UBLK_F_SUPPORT_ZERO_COPY |
+			(no_auto_buf_reg ? 0 : UBLK_F_AUTO_BUF_REG);
 	if (batch_io)
 		data->flags |= UBLK_F_BATCH_IO;
 
@@ -460,18 +573,199 @@ static void ublksrv_print_std_opts(void)
 	printf("\t-u URING_COMP -g NEED_GET_DATA -r USER_RECOVERY\n");
 	printf("\t-i USER_RECOVERY_REISSUE -e USER_RECOVERY_FAIL_IO\n");
 	printf("\t-b | --batch-io (enable batch IO mode)\n");
+	printf("\t-z | --zerocopy [--no_auto_buf_reg]\n");
 	printf("\t--debug_mask=0x{DBG_MASK} --unprivileged\n");
+	printf("\t--cpu_prof (sample cycles per io of each phase)\n");
+	printf("\t--wait_batch (wait a bit for more completions under load)\n");
+	printf("\t--datapath=auto|copy (auto: pick fastest data path supported)\n");
+	printf("\t--integrity (enable integrity data, implies --usercopy)\n");
+}
+
+static const char *const ublksrv_tmo_policy_names[] = {
+	"fail",		/* UBLKSRV_TMO_FAIL */
+	"retry",	/* UBLKSRV_TMO_RETRY */
+};
+
+int ublksrv_tgt_parse_io_timeout(const struct ublksrv_ctrl_dev *cdev,
+		int argc, char *argv[], struct ublksrv_io_timeout *tmo)
+{
+	static const struct option longopts[] = {
+		{ "io_timeout",		1,	NULL, 0 },
+		{ "timeout_policy",	1,	NULL, 0 },
+		{ "io_retries",		1,	NULL, 0 },
+		{ NULL }
+	};
+	const char *policy = ublksrv_tmo_policy_names[UBLKSRV_TMO_FAIL];
+	unsigned long val;
+	char buf[32];
+	int opt, option_index = 0;
+
+	tmo->ms = 0;
+	tmo->policy = UBLKSRV_TMO_FAIL;
+	tmo->retries = 2;
+
+	if (ublksrv_is_recovering(cdev)) {
+		if (!ublk_json_read_target_ulong_info(cdev, "io_timeout", &val))
+			tmo->ms = val;
+		if (!ublk_json_read_target_ulong_info(cdev, "io_retries", &val))
+			tmo->retries = val;
+		if (ublk_json_read_target_str_info(cdev, "timeout_policy",
+					buf) >= 0 && !strcmp(buf, "retry"))
+			tmo->policy = UBLKSRV_TMO_RETRY;
+		return 0;
+	}
+
+	optind = 0;
+	while ((opt = getopt_long(argc, argv, "-:", longopts,
+					&option_index)) != -1) {
+		const char *name = longopts[option_index].name;
+
+		if (opt != 0)
+			continue;
+		if (!strcmp(name, "io_timeout"))
+			tmo->ms = strtoul(optarg, NULL, 10);
+		else if (!strcmp(name, "io_retries"))
+			tmo->retries = strtoul(optarg, NULL, 10);
+		else
+			policy = optarg;
+	}
+	optind = 0;
+
+	if (!strcmp(policy, "retry"))
+		tmo->policy = UBLKSRV_TMO_RETRY;
+	else if (strcmp(policy, "fail")) {
+		fprintf(stderr, "unknown timeout policy %s\n", policy);
+		return -EINVAL;
+	}
+
+	if (tmo->ms) {
+		ublk_json_write_tgt_ulong(cdev, "io_timeout", tmo->ms);
+		ublk_json_write_tgt_str(cdev, "timeout_policy",
+				ublksrv_tmo_policy_names[tmo->policy]);
+		ublk_json_write_tgt_ulong(cdev, "io_retries", tmo->retries);
+	}
+	return 0;
+}
+
+void ublksrv_tgt_io_timeout_usage(void)
+{
+	printf("\t[--io_timeout MS] [--timeout_policy fail|retry] [--io_retries N]\n");
+}
+
+int ublksrv_tgt_parse_busy_poll(const struct ublksrv_ctrl_dev *cdev,
+		int argc, char *argv[], struct ublksrv_busy_poll *bp)
+{
+	static const struct option longopts[] = {
+		{ "busy_poll",		1,	NULL, 0 },
+		{ "busy_poll_budget",	1,	NULL, 0 },
+		{ NULL }
+	};
+	unsigned long val;
+	int opt, option_index = 0;
+
+	bp->usecs = 0;
+	bp->budget = 0;
+
+	if (ublksrv_is_recovering(cdev)) {
+		if (!ublk_json_read_target_ulong_info(cdev, "busy_poll", &val))
+			bp->usecs = val;
+		if (!ublk_json_read_target_ulong_info(cdev,
+					"busy_poll_budget", &val))
+			bp->budget = val;
+		return 0;
+	}
+
+	optind = 0;
+	while ((opt = getopt_long(argc, argv, "-:", longopts,
+					&option_index)) != -1) {
+		if (opt != 0)
+			continue;
+		if (!strcmp(longopts[option_index].name, "busy_poll"))
+			bp->usecs = strtoul(optarg, NULL, 10);
+		else
+			bp->budget = strtoul(optarg, NULL, 10);
+	}
+	optind = 0;
+
+	if (bp->budget > USHRT_MAX) {
+		fprintf(stderr, "busy poll budget %u is too big\n", bp->budget);
+		return -EINVAL;
+	}
+
+	if (bp->usecs) {
+		ublk_json_write_tgt_ulong(cdev, "busy_poll", bp->usecs);
+		ublk_json_write_tgt_ulong(cdev, "busy_poll_budget",
+				bp->budget);
+	}
+	return 0;
+}
+
+void ublksrv_tgt_busy_poll_usage(void)
+{
+	printf("\t[--busy_poll USECS] [--busy_poll_budget NR_PACKETS]\n");
+}
+
+void ublksrv_tgt_busy_poll_sock(int fd, const struct ublksrv_busy_poll *bp,
+		unsigned int depth)
+{
+	int usecs = bp->usecs, prefer = 1, budget = bp->budget;
+
+	if (!bp->usecs)
+		return;
+
+	/*
+	 * Each inflight io gets at least one reply packet, so one poll
+	 * should reap replies of the whole queue, and not more than that
+	 * to bound time spent in one poll. Kernel default is 8.
+	 */
+	if (!budget)
+		budget = std::min(std::max(depth, 8U), 256U);
+
+	if (setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL, &usecs, sizeof(usecs)) ||
+			setsockopt(fd, SOL_SOCKET, SO_PREFER_BUSY_POLL,
+				&prefer, sizeof(prefer)) ||
+			setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL_BUDGET,
+				&budget, sizeof(budget)))
+		ublk_log("%s: fd %d busy poll setup failed: %s\n", __func__,
+				fd, strerror(errno));
+}
+
+void ublksrv_tgt_busy_poll_queue(const struct ublksrv_queue *q,
+		const struct ublksrv_busy_poll *bp)
+{
+	if (!bp->usecs)
+		return;
+#ifdef HAVE_LIBURING_NAPI
+	struct io_uring_napi napi = {
+		.busy_poll_to = bp->usecs,
+		.prefer_busy_poll = 1,
+	};
+	int ret = io_uring_register_napi(q->ring_ptr, &napi);
+
+	/* socket busy poll still works without NAPI of io_uring */
+	if (ret)
+		ublk_log("%s: qid %d register napi failed %d\n", __func__,
+				q->q_id, ret);
+#else
+	ublk_log("%s: qid %d NAPI of io_uring isn't supported by liburing\n",
+			__func__, q->q_id);
+#endif
 }
 
 static int ublksrv_cmd_dev_add(const struct ublksrv_tgt_type *tgt_type, int argc, char *argv[])
 {
 	struct ublksrv_dev_data data = {0};
 	struct ublksrv_ctrl_dev *dev;
+	bool auto_datapath = false;
 	int ret, evtfd = -1;
 
-	ublksrv_parse_add_opts(&data, &evtfd, argc, argv);
+	ret = ublksrv_parse_add_opts(&data, &evtfd, &auto_datapath, argc, argv);
+	if (ret)
+		return ret;
 
-	if (data.tgt_type && strcmp(data.tgt_type, tgt_type->name)) {
+	/* '-t delay' is served by the wrapper of the inner target */
+	if (data.tgt_type && strcmp(data.tgt_type, tgt_type->name) &&
+			strcmp(data.tgt_type, "delay")) {
 		fprintf(stderr, "Wrong tgt_type specified\n");
 		return -EINVAL;
 	}
@@ -485,10 +779,6 @@ static int ublksrv_cmd_dev_add(const struct ublksrv_tgt_type *tgt_type, int argc
 	data.tgt_argc = argc;
 	data.tgt_argv = argv;
 
-	/* try UBLK_F_AUTO_BUF_REG at default */
-	if (data.flags & UBLK_F_SUPPORT_ZERO_COPY)
-		data.flags |= UBLK_F_AUTO_BUF_REG;
-
 	dev = ublksrv_ctrl_init(&data);
 	if (!dev) {
 		fprintf(stderr, "can't init dev %d\n", data.dev_id);
@@ -496,6 +786,28 @@ static int ublksrv_cmd_dev_add(const struct ublksrv_tgt_type *tgt_type, int argc
 		goto fail_send_event;
 	}
 
+	/* data path specified explicitly is respected */
+	if (auto_datapath && !(data.flags & UBLK_DATAPATH_FLAGS)) {
+		__u64 features = 0;
+
+		ret = ublksrv_ctrl_get_features(dev, &features);
+		if (ret)
+			goto fail;
+
+		data.flags |= ublksrv_tgt_auto_datapath(tgt_type, data.flags,
+				features);
+		if (data.flags & UBLK_DATAPATH_FLAGS) {
+			ublksrv_ctrl_deinit(dev);
+			dev = ublksrv_ctrl_init(&data);
+			if (!dev) {
+				ret = -EOPNOTSUPP;
+				goto fail_send_event;
+			}
+		}
+		ublk_log("%s: pick datapath %s\n", tgt_type->name,
+				ublksrv_tgt_datapath_name(data.flags));
+	}
+
 	if (data.flags & (UBLK_F_SUPPORT_ZERO_COPY | UBLK_F_BATCH_IO)) {
 		__u64 features = 0;
 
@@ -635,6 +947,20 @@ static int __cmd_dev_user_recover(const struct ublksrv_tgt_type *tgt_type,
 		goto fail;
 	}
 
+	/* data path is decided by device flags, which can't be changed */
+	{
+		const struct ublksrv_ctrl_dev_info *info =
+			ublksrv_ctrl_get_dev_info(dev);
+		const char *name = ublksrv_tgt_datapath_name(info->flags);
+		char datapath[32];
+
+		if (!ublksrv_json_read_target_str_info(buf, sizeof(datapath),
+					"datapath", datapath) &&
+				strcmp(datapath, name))
+			fprintf(stderr, "dev %d datapath %s recorded, %s used\n",
+					number, datapath, name);
+	}
+
 	ret = ublksrv_start_daemon(dev, evtfd);
 	if (ret < 0) {
 		fprintf(stderr, "start daemon %d failed\n", number);
@@ -693,12 +1019,17 @@ static void cmd_usage(const struct ublksrv_tgt_type *tgt_type)
 		printf("\tFor additional arguments specific to %s, run:\n", type);
 		printf("\t\tublk help -t %s\n", type);
 	}
+	printf("ublk add --manifest FILE [-j JOBS]\n");
 	printf("ublk[.%s] recover -n DEV_ID\n", type);
+	printf("ublk recover -a | --all [-j JOBS]\n");
 	printf("ublk[.%s] help -t %s\n", type, type);
+	printf("ublk.%s vhost --socket PATH [-q NR_QUEUES] [-d DEPTH] "
+			"[--max_io_buf_bytes BYTES] [target options]\n", type);
 	printf("ublk del -n DEV_ID [ -a | --all]\n");
 	printf("ublk list -n DEV_ID -v\n");
 	printf("ublk set_affinity -n DEV_ID -q QID --cpuset SET\n");
 	printf("ublk features\n");
+	printf("ublk bench -n DEV_ID [--rw RW] [--bs BYTES] [--qd DEPTH] [-j JOBS] [--json]\n");
 	printf("ublk -v | --version\n");
 }
 
@@ -709,6 +1040,9 @@ int ublksrv_main(const struct ublksrv_tgt_type *tgt_type, int argc, char *argv[]
 
 	setvbuf(stdout, NULL, _IOLBF, 0);
 
+	if (tgt_type)
+		tgt_type = ublksrv_stack_wrap(tgt_type);
+
 	cmd = ublksrv_pop_cmd(&argc, argv);
 	if (cmd == NULL) {
 		printf("%s: missing command\n", argv[0]);
@@ -720,6 +1054,8 @@ int ublksrv_main(const struct ublksrv_tgt_type *tgt_type, int argc, char *argv[]
 		ret = ublksrv_cmd_dev_add(tgt_type, argc, argv);
 	else if (!strcmp(cmd, "recover"))
 		ret = ublksrv_cmd_dev_user_recover(tgt_type, argc, argv);
+	else if (!strcmp(cmd, "vhost") && tgt_type)
+		ret = ublksrv_cmd_vhost(tgt_type, argc, argv);
 	else if (!strcmp(cmd, "help") || !strcmp(cmd, "-h") || !strcmp(cmd, "--help")) {
 		cmd_usage(tgt_type);
 		ret = EXIT_SUCCESS;
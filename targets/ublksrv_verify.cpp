@@ -0,0 +1,258 @@
+// SPDX-License-Identifier: MIT or GPL-2.0-only
+
+/*
+ * Data verify layer: `--stack verify`, see ublksrv_stack.cpp
+ *
+ * CRC32C of every 4KB block written through the layer is kept in memory,
+ * and READ returning data which doesn't match the checksum is failed with
+ * -EIO, so lost, misdirected or corrupted io of the lower layers and the
+ * target is caught when it is read back. Blocks partially written,
+ * discarded or zeroed lose their checksums, and so do blocks written by
+ * overlapped WRITEs, since which one lands last isn't known.
+ *
+ * Checksums of blocks covered by one READ are taken when it is submitted,
+ * and one block isn't verified if it is written meanwhile. Checksums
+ * aren't persistent, and the layer is for testing targets. Data has to be
+ * in the daemon's io buffer, so user copy and zero copy aren't supported.
+ */
+
+#include "config.h"
+#include <algorithm>
+#include "ublksrv_tgt.h"
+#include "ublksrv_pi.h"
+
+#define VERIFY_BLK_SHIFT	12
+#define VERIFY_BLK_SIZE		(1U << VERIFY_BLK_SHIFT)
+
+/*
+ * State of one block: checksum in low 32 bits, which is valid only if
+ * VERIFY_VALID is set, and nr of WRITEs in flight in the top 16 bits.
+ */
+#define VERIFY_VALID		(1ULL << 32)
+#define VERIFY_OVERLAP		(1ULL << 33)	/* WRITEs overlapped */
+#define VERIFY_WRITE_SHIFT	48
+#define VERIFY_WRITE_ONE	(1ULL << VERIFY_WRITE_SHIFT)
+#define VERIFY_WRITE_MASK	(0xffffULL << VERIFY_WRITE_SHIFT)
+
+struct verify_queue {
+	/* block state covered by each READ, [tag * blks_per_io] */
+	__u64 *snap;
+};
+
+static struct {
+	__u64 *blks;
+	unsigned long long nr_blks;
+	unsigned blks_per_io;
+
+	struct verify_queue *queues[MAX_NR_HW_QUEUES];
+} verify_dev;
+
+/*
+ * Blocks touched by the io are [*start, *end), and the ones fully
+ * covered are [*full_start, *full_end)
+ */
+static inline void verify_io_blks(const struct ublksrv_io_desc *iod,
+		unsigned long long *start, unsigned long long *end,
+		unsigned long long *full_start, unsigned long long *full_end)
+{
+	unsigned long long pos = iod->start_sector << 9;
+	unsigned long long last = pos + ((unsigned long long)iod->nr_sectors << 9);
+
+	*start = pos >> VERIFY_BLK_SHIFT;
+	*end = std::min((last + VERIFY_BLK_SIZE - 1) >> VERIFY_BLK_SHIFT,
+			verify_dev.nr_blks);
+	*full_start = (pos + VERIFY_BLK_SIZE - 1) >> VERIFY_BLK_SHIFT;
+	*full_end = std::min(last >> VERIFY_BLK_SHIFT, verify_dev.nr_blks);
+	if (*full_end < *full_start)
+		*full_end = *full_start;
+}
+
+static inline __u64 verify_load(unsigned long long blk)
+{
+	return __atomic_load_n(&verify_dev.blks[blk], __ATOMIC_RELAXED);
+}
+
+static void verify_write_start(unsigned long long blk)
+{
+	__u64 old = verify_load(blk), state;
+
+	do {
+		state = (old & (VERIFY_WRITE_MASK | VERIFY_OVERLAP)) +
+			VERIFY_WRITE_ONE;
+		if (old & VERIFY_WRITE_MASK)
+			state |= VERIFY_OVERLAP;
+	} while (!__atomic_compare_exchange_n(&verify_dev.blks[blk], &old,
+				state, false, __ATOMIC_RELAXED,
+				__ATOMIC_RELAXED));
+}
+
+/* 'sum' is 0 if data of the block isn't known after this WRITE */
+static void verify_write_end(unsigned long long blk, __u64 sum)
+{
+	__u64 old = verify_load(blk), state;
+
+	do {
+		state = (old & (VERIFY_WRITE_MASK | VERIFY_OVERLAP)) -
+			VERIFY_WRITE_ONE;
+		if (!(state & VERIFY_WRITE_MASK))
+			state = (state & VERIFY_OVERLAP) ? 0 : sum;
+	} while (!__atomic_compare_exchange_n(&verify_dev.blks[blk], &old,
+				state, false, __ATOMIC_RELAXED,
+				__ATOMIC_RELAXED));
+}
+
+static void verify_handle_io(const struct ublksrv_queue *q,
+		const struct ublk_io_data *data)
+{
+	const struct ublksrv_io_desc *iod = data->iod;
+	unsigned long long start, end, full_start, full_end, blk;
+	__u64 *snap;
+
+	verify_io_blks(iod, &start, &end, &full_start, &full_end);
+	switch (ublksrv_get_op(iod)) {
+	case UBLK_IO_OP_READ:
+		snap = &verify_dev.queues[q->q_id]->snap[data->tag *
+			verify_dev.blks_per_io];
+		for (blk = full_start; blk < full_end; blk++)
+			snap[blk - full_start] = verify_load(blk);
+		break;
+	case UBLK_IO_OP_WRITE:
+	case UBLK_IO_OP_DISCARD:
+	case UBLK_IO_OP_WRITE_ZEROES:
+		for (blk = start; blk < end; blk++)
+			verify_write_start(blk);
+		break;
+	}
+	ublksrv_stack_submit(q, data);
+}
+
+static int verify_check_read(const struct ublksrv_queue *q, int tag,
+		const struct ublksrv_io_desc *iod)
+{
+	const __u64 *snap = &verify_dev.queues[q->q_id]->snap[tag *
+		verify_dev.blks_per_io];
+	unsigned long long start, end, full_start, full_end, blk;
+	const char *buf = (const char *)iod->addr;
+
+	verify_io_blks(iod, &start, &end, &full_start, &full_end);
+	buf += (full_start << VERIFY_BLK_SHIFT) - (iod->start_sector << 9);
+	for (blk = full_start; blk < full_end; blk++, buf += VERIFY_BLK_SIZE) {
+		__u64 state = snap[blk - full_start];
+
+		/* unknown, or written after the READ is submitted */
+		if (!(state & VERIFY_VALID) || verify_load(blk) != state)
+			continue;
+		if (ublksrv_crc32c(0, buf, VERIFY_BLK_SIZE) != (__u32)state) {
+			ublk_err("%s: queue %d tag %d: checksum of sector %llu mismatch\n",
+					__func__, q->q_id, tag,
+					blk << (VERIFY_BLK_SHIFT - 9));
+			return -EIO;
+		}
+	}
+	return 0;
+}
+
+static void verify_lower_done(const struct ublksrv_queue *q, int tag,
+		int res)
+{
+	const struct ublksrv_io_desc *iod = ublksrv_tgt_get_io_data(q, tag)->iod;
+	unsigned ublk_op = ublksrv_get_op(iod);
+	bool done = res == (int)(iod->nr_sectors << 9);
+	unsigned long long start, end, full_start, full_end, blk;
+	const char *buf = (const char *)iod->addr;
+
+	verify_io_blks(iod, &start, &end, &full_start, &full_end);
+	switch (ublk_op) {
+	case UBLK_IO_OP_READ:
+		if (done && verify_check_read(q, tag, iod))
+			res = -EIO;
+		break;
+	case UBLK_IO_OP_WRITE:
+	case UBLK_IO_OP_DISCARD:
+	case UBLK_IO_OP_WRITE_ZEROES:
+		for (blk = start; blk < end; blk++) {
+			__u64 sum = 0;
+
+			if (done && ublk_op == UBLK_IO_OP_WRITE &&
+					blk >= full_start && blk < full_end)
+				sum = VERIFY_VALID | ublksrv_crc32c(0,
+						buf + (blk << VERIFY_BLK_SHIFT) -
+						(iod->start_sector << 9),
+						VERIFY_BLK_SIZE);
+			verify_write_end(blk, sum);
+		}
+		break;
+	}
+	ublksrv_tgt_complete_io(q, tag, res);
+}
+
+static int verify_setup(struct ublksrv_dev *dev, int argc, char *argv[])
+{
+	const struct ublksrv_ctrl_dev *cdev = ublksrv_get_ctrl_dev(dev);
+	const struct ublksrv_ctrl_dev_info *info = ublksrv_ctrl_get_dev_info(cdev);
+
+	if (info->flags & (UBLK_F_USER_COPY | UBLK_F_SUPPORT_ZERO_COPY |
+				UBLK_F_AUTO_BUF_REG)) {
+		ublk_err("%s: io data isn't in daemon with user copy or zero copy\n",
+				__func__);
+		return -EINVAL;
+	}
+
+	verify_dev.nr_blks = dev->tgt.dev_size >> VERIFY_BLK_SHIFT;
+	verify_dev.blks_per_io = info->max_io_buf_bytes >> VERIFY_BLK_SHIFT;
+	verify_dev.blks = (__u64 *)calloc(verify_dev.nr_blks,
+			sizeof(*verify_dev.blks));
+	if (!verify_dev.blks)
+		return -ENOMEM;
+
+	ublk_log("%s: dev %d verify %llu blocks\n", __func__, info->dev_id,
+			verify_dev.nr_blks);
+	return 0;
+}
+
+static void verify_cleanup(const struct ublksrv_dev *dev)
+{
+	free(verify_dev.blks);
+	verify_dev.blks = NULL;
+}
+
+static int verify_init_queue(const struct ublksrv_queue *q)
+{
+	struct verify_queue *vq = (struct verify_queue *)calloc(1, sizeof(*vq));
+
+	if (!vq)
+		return -ENOMEM;
+	vq->snap = (__u64 *)calloc((size_t)q->q_depth * verify_dev.blks_per_io,
+			sizeof(*vq->snap));
+	if (!vq->snap) {
+		free(vq);
+		return -ENOMEM;
+	}
+	verify_dev.queues[q->q_id] = vq;
+	return 0;
+}
+
+static void verify_deinit_queue(const struct ublksrv_queue *q)
+{
+	struct verify_queue *vq = verify_dev.queues[q->q_id];
+
+	free(vq->snap);
+	free(vq);
+	verify_dev.queues[q->q_id] = NULL;
+}
+
+static void verify_usage(void)
+{
+	printf("\t--stack verify: fail READ whose data doesn't match checksum of last WRITE\n");
+}
+
+const struct ublksrv_stack_layer ublksrv_verify_layer = {
+	.name		= "verify",
+	.setup		= verify_setup,
+	.cleanup	= verify_cleanup,
+	.init_queue	= verify_init_queue,
+	.deinit_queue	= verify_deinit_queue,
+	.handle_io	= verify_handle_io,
+	.lower_done	= verify_lower_done,
+	.usage		= verify_usage,
+};
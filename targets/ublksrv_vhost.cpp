@@ -0,0 +1,1266 @@
+// SPDX-License-Identifier: MIT or GPL-2.0-only
+
+/*
+ * vhost-user-blk server mode
+ *
+ * 'ublk.TYPE vhost --socket PATH' exports the target over vhost-user-blk
+ * instead of adding one ublk disk, so VMs reach the target backend
+ * without crossing the host block layer twice.
+ *
+ * ublk_drv is replaced with ublksrv_emu, so target code and the per-queue
+ * io_uring threads run unchanged. One vhost thread maps guest memory
+ * from fds passed by the frontend, pops requests from split virtqueues
+ * and queues them to ublksrv_emu with iovecs pointing to guest memory,
+ * so data is copied once between guest memory and the target io buffer.
+ *
+ * virtqueue N is served by ublk queue N % nr_hw_queues, completions are
+ * pushed to used ring and the guest is notified once per batch.
+ */
+
+#include "config.h"
+#include <signal.h>
+#include <endian.h>
+#include <poll.h>
+#include <sys/un.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/signalfd.h>
+#include <linux/virtio_config.h>
+#include <linux/virtio_blk.h>
+#include "ublksrv_tgt.h"
+#include "ublksrv_emu.h"
+#include "vhost_user.h"
+
+#define VHOST_MAX_VRING_NUM	32768
+#define VHOST_SEG_SIZE		4096
+#define VHOST_MAX_IOV_EXTRA	2	/* outhdr & status */
+
+/* epoll data of fds except for kick fds, which use vring index */
+#define VHOST_EV_LISTEN		(1ULL << 32)
+#define VHOST_EV_CONN		(2ULL << 32)
+#define VHOST_EV_EMU		(3ULL << 32)
+#define VHOST_EV_SIGNAL		(4ULL << 32)
+
+#define VHOST_PROTOCOL_FEATURES	((1ULL << VHOST_USER_PROTOCOL_F_MQ) | \
+		(1ULL << VHOST_USER_PROTOCOL_F_REPLY_ACK) | \
+		(1ULL << VHOST_USER_PROTOCOL_F_CONFIG))
+
+struct vhost_dev;
+struct vhost_vq;
+
+struct vhost_region {
+	__u64 gpa;
+	__u64 uva;
+	__u64 size;
+	char *hva;
+	void *mmap_addr;
+	size_t mmap_size;
+};
+
+struct vhost_req {
+	struct vhost_vq *vq;
+	__u16 head;
+	bool busy;
+	__u8 *status;
+	unsigned in_len;	/* length of device writable buffers */
+	unsigned out_len;	/* length of device readable buffers */
+	int nr_iov;
+	struct iovec *iov;
+};
+
+struct vhost_vq {
+	struct vhost_dev *vdev;
+	unsigned idx;
+	unsigned num;
+	struct vhost_user_vring_addr addr;
+	struct vhost_vring_desc *desc;
+	struct vhost_vring_avail *avail;
+	struct vhost_vring_used *used;
+	__u16 last_avail_idx;
+	__u16 used_idx;
+	int kick_fd;
+	int call_fd;
+	bool started;
+	bool enabled;
+	bool blocked;		/* ran out of ublk tags */
+	bool need_call;
+	unsigned inflight;
+	unsigned nr_reqs;
+	struct vhost_req *reqs;
+	struct iovec *iovs;
+};
+
+struct vhost_dev {
+	struct ublksrv_emu *emu;
+	const struct ublksrv_ctrl_dev_info *info;
+	const char *path;
+	int listen_fd;
+	int conn_fd;
+	int epoll_fd;
+	int sig_fd;
+
+	__u64 avail_features;
+	__u64 features;
+	__u64 protocol_features;
+
+	unsigned nr_regions;
+	struct vhost_region regions[VHOST_USER_MAX_RAM_SLOTS];
+
+	unsigned nr_vqs;
+	struct vhost_vq *vqs;
+	unsigned inflight;
+
+	unsigned max_iov;
+	__u64 capacity;
+	struct virtio_blk_config config;
+	bool stop;
+};
+
+struct vhost_queue_info {
+	const struct ublksrv_dev *dev;
+	int qid;
+	pthread_t thread;
+};
+
+static void *vhost_queue_fn(void *data)
+{
+	struct vhost_queue_info *info = (struct vhost_queue_info *)data;
+	const struct ublksrv_queue *q;
+
+	q = ublksrv_queue_init(info->dev, info->qid, NULL);
+	if (!q) {
+		ublk_err("vhost: queue %d init failed\n", info->qid);
+		return NULL;
+	}
+
+	while (ublksrv_process_io(q) >= 0)
+		;
+
+	ublksrv_queue_deinit(q);
+	return NULL;
+}
+
+static void *vhost_gpa_to_va(struct vhost_dev *vdev, __u64 gpa, __u64 len)
+{
+	unsigned i;
+
+	for (i = 0; i < vdev->nr_regions; i++) {
+		struct vhost_region *r = &vdev->regions[i];
+
+		if (gpa >= r->gpa && gpa - r->gpa < r->size &&
+				len <= r->size - (gpa - r->gpa))
+			return r->hva + (gpa - r->gpa);
+	}
+	return NULL;
+}
+
+/* vring addresses are virtual addresses of the frontend */
+static void *vhost_uva_to_va(struct vhost_dev *vdev, __u64 uva, __u64 len)
+{
+	unsigned i;
+
+	for (i = 0; i < vdev->nr_regions; i++) {
+		struct vhost_region *r = &vdev->regions[i];
+
+		if (uva >= r->uva && uva - r->uva < r->size &&
+				len <= r->size - (uva - r->uva))
+			return r->hva + (uva - r->uva);
+	}
+	return NULL;
+}
+
+static void vhost_unmap_mem(struct vhost_dev *vdev)
+{
+	unsigned i;
+
+	for (i = 0; i < vdev->nr_regions; i++)
+		munmap(vdev->regions[i].mmap_addr, vdev->regions[i].mmap_size);
+	vdev->nr_regions = 0;
+}
+
+/* copy 'len' bytes from the front of iovec into 'dst', and consume them */
+static int vhost_iov_pull(struct iovec **iovp, int *nr, void *dst, size_t len)
+{
+	char *p = (char *)dst;
+
+	while (len) {
+		struct iovec *iov = *iovp;
+		size_t n;
+
+		if (!*nr)
+			return -EINVAL;
+		n = std::min(len, iov->iov_len);
+		if (p) {
+			memcpy(p, iov->iov_base, n);
+			p += n;
+		}
+		iov->iov_base = (char *)iov->iov_base + n;
+		iov->iov_len -= n;
+		len -= n;
+		if (!iov->iov_len) {
+			(*iovp)++;
+			(*nr)--;
+		}
+	}
+	return 0;
+}
+
+static void vhost_iov_push(const struct iovec *iov, int nr, const void *src,
+		size_t len)
+{
+	const char *p = (const char *)src;
+	int i;
+
+	for (i = 0; i < nr && len; i++) {
+		size_t n = std::min(len, iov[i].iov_len);
+
+		memcpy(iov[i].iov_base, p, n);
+		p += n;
+		len -= n;
+	}
+}
+
+static size_t vhost_iov_length(const struct iovec *iov, int nr)
+{
+	size_t len = 0;
+	int i;
+
+	for (i = 0; i < nr; i++)
+		len += iov[i].iov_len;
+	return len;
+}
+
+/*
+ * Collect buffers of the descriptor chain starting from req->head, device
+ * readable buffers have to come before device writable ones.
+ */
+static int vhost_map_chain(struct vhost_dev *vdev, struct vhost_vq *vq,
+		struct vhost_req *req)
+{
+	struct vhost_vring_desc *table = vq->desc;
+	unsigned num = vq->num, idx = req->head, hops = 0;
+	bool indirect = false;
+
+	req->nr_iov = 0;
+	req->in_len = 0;
+	req->out_len = 0;
+	while (true) {
+		struct vhost_vring_desc *d;
+		__u16 flags;
+		__u64 addr;
+		__u32 len;
+		void *va;
+
+		if (idx >= num || ++hops > num)
+			return -EINVAL;
+		d = &table[idx];
+		flags = le16toh(d->flags);
+		addr = le64toh(d->addr);
+		len = le32toh(d->len);
+
+		if (flags & VHOST_VRING_DESC_F_INDIRECT) {
+			if (indirect || !len || len % sizeof(*d))
+				return -EINVAL;
+			table = (struct vhost_vring_desc *)vhost_gpa_to_va(vdev,
+					addr, len);
+			if (!table)
+				return -EFAULT;
+			num = len / sizeof(*d);
+			idx = 0;
+			hops = 0;
+			indirect = true;
+			continue;
+		}
+
+		if (req->nr_iov >= (int)vdev->max_iov)
+			return -E2BIG;
+		va = vhost_gpa_to_va(vdev, addr, len);
+		if (!va && len)
+			return -EFAULT;
+		req->iov[req->nr_iov].iov_base = va;
+		req->iov[req->nr_iov++].iov_len = len;
+		if (flags & VHOST_VRING_DESC_F_WRITE)
+			req->in_len += len;
+		else if (req->in_len)
+			return -EINVAL;
+		else
+			req->out_len += len;
+
+		if (!(flags & VHOST_VRING_DESC_F_NEXT))
+			break;
+		idx = le16toh(d->next);
+	}
+	return 0;
+}
+
+static void vhost_req_done(struct vhost_vq *vq, struct vhost_req *req,
+		__u8 status)
+{
+	struct vhost_vring_used_elem *e = &vq->used->ring[vq->used_idx % vq->num];
+	unsigned len = 0;
+
+	if (req->status) {
+		*req->status = status;
+		len = status == VIRTIO_BLK_S_OK ? req->in_len : 1;
+	}
+	e->id = htole32(req->head);
+	e->len = htole32(len);
+	vq->used_idx++;
+
+	/* publish the used element before the index */
+	__atomic_store_n(&vq->used->idx, htole16(vq->used_idx),
+			__ATOMIC_RELEASE);
+	vq->need_call = true;
+}
+
+static void vhost_emu_done(struct ublksrv_emu *emu, int q_id, int tag,
+		int res, void *rq_data)
+{
+	struct vhost_req *req = (struct vhost_req *)rq_data;
+	struct vhost_vq *vq = req->vq;
+	__u8 status = VIRTIO_BLK_S_OK;
+
+	if (res == -EOPNOTSUPP)
+		status = VIRTIO_BLK_S_UNSUPP;
+	else if (res < 0)
+		status = VIRTIO_BLK_S_IOERR;
+
+	req->busy = false;
+	vq->inflight--;
+	vq->vdev->inflight--;
+	vhost_req_done(vq, req, status);
+}
+
+/*
+ * Start the request, which is completed here if it can't be queued to
+ * ublk server. Return -EBUSY if no ublk tag is available, and -EINVAL
+ * if the vring is broken by the guest.
+ */
+static int vhost_req_start(struct vhost_dev *vdev, struct vhost_vq *vq,
+		__u16 head)
+{
+	static const char serial[VIRTIO_BLK_ID_BYTES] = "ublk-vhost";
+	struct vhost_req *req = &vq->reqs[head];
+	int q_id = vq->idx % vdev->info->nr_hw_queues;
+	struct virtio_blk_discard_write_zeroes dwz;
+	struct virtio_blk_outhdr hdr;
+	unsigned long long sector;
+	unsigned op, nr_sectors;
+	struct iovec *iov, *last;
+	int nr, ret;
+	size_t len;
+
+	/* the guest can't reuse one head before it is completed */
+	if (req->busy) {
+		ublk_err("vhost: vring %u head %u is in use\n", vq->idx, head);
+		return -EINVAL;
+	}
+
+	req->head = head;
+	req->status = NULL;
+	if (vhost_map_chain(vdev, vq, req))
+		goto ioerr;
+
+	/* outhdr is device readable, and status is device writable */
+	if (req->out_len < sizeof(hdr) || !req->in_len)
+		goto bad_flags;
+
+	/* outhdr comes first, and status is the last byte */
+	iov = req->iov;
+	nr = req->nr_iov;
+	if (vhost_iov_pull(&iov, &nr, &hdr, sizeof(hdr)))
+		goto ioerr;
+	while (nr && !iov[nr - 1].iov_len)
+		nr--;
+	if (!nr)
+		goto ioerr;
+	last = &iov[nr - 1];
+	req->status = (__u8 *)last->iov_base + last->iov_len - 1;
+	if (!--last->iov_len)
+		nr--;
+
+	len = vhost_iov_length(iov, nr);
+	sector = le64toh(hdr.sector);
+
+	switch (le32toh(hdr.type)) {
+	case VIRTIO_BLK_T_IN:
+	case VIRTIO_BLK_T_OUT:
+		op = le32toh(hdr.type) == VIRTIO_BLK_T_IN ? UBLK_IO_OP_READ :
+			UBLK_IO_OP_WRITE;
+		if (op == UBLK_IO_OP_READ ? req->out_len != sizeof(hdr) :
+				req->in_len != 1)
+			goto bad_flags;
+		if (op == UBLK_IO_OP_WRITE &&
+				(vdev->features & (1ULL << VIRTIO_BLK_F_RO)))
+			goto ioerr;
+		if ((len & 511) || len > vdev->info->max_io_buf_bytes ||
+				sector > vdev->capacity ||
+				(len >> 9) > vdev->capacity - sector)
+			goto ioerr;
+		if (!len)
+			break;
+		ret = ublksrv_emu_queue_rq_iov(vdev->emu, q_id, op, sector,
+				len >> 9, iov, nr, req);
+		goto queued;
+	case VIRTIO_BLK_T_FLUSH:
+		ret = ublksrv_emu_queue_rq(vdev->emu, q_id, UBLK_IO_OP_FLUSH,
+				0, 0, NULL, req);
+		goto queued;
+	case VIRTIO_BLK_T_GET_ID:
+		if (req->out_len != sizeof(hdr))
+			goto bad_flags;
+		vhost_iov_push(iov, nr, serial, sizeof(serial));
+		break;
+	case VIRTIO_BLK_T_DISCARD:
+	case VIRTIO_BLK_T_WRITE_ZEROES:
+		if (le32toh(hdr.type) == VIRTIO_BLK_T_DISCARD) {
+			if (!(vdev->features & (1ULL << VIRTIO_BLK_F_DISCARD)))
+				goto unsupp;
+			op = UBLK_IO_OP_DISCARD;
+		} else {
+			if (!(vdev->features &
+					(1ULL << VIRTIO_BLK_F_WRITE_ZEROES)))
+				goto unsupp;
+			op = UBLK_IO_OP_WRITE_ZEROES;
+		}
+		/* max_discard_seg and max_write_zeroes_seg are 1 */
+		if (req->in_len != 1)
+			goto bad_flags;
+		if (len != sizeof(dwz) ||
+				vhost_iov_pull(&iov, &nr, &dwz, sizeof(dwz)))
+			goto ioerr;
+		sector = le64toh(dwz.sector);
+		nr_sectors = le32toh(dwz.num_sectors);
+		if (sector > vdev->capacity ||
+				nr_sectors > vdev->capacity - sector)
+			goto ioerr;
+		ret = ublksrv_emu_queue_rq(vdev->emu, q_id, op, sector,
+				nr_sectors, NULL, req);
+		goto queued;
+	default:
+		goto unsupp;
+	}
+	vhost_req_done(vq, req, VIRTIO_BLK_S_OK);
+	return 0;
+
+queued:
+	if (ret == -EBUSY)
+		return ret;
+	if (ret < 0)
+		goto ioerr;
+	req->busy = true;
+	vq->inflight++;
+	vdev->inflight++;
+	return 0;
+unsupp:
+	vhost_req_done(vq, req, VIRTIO_BLK_S_UNSUPP);
+	return 0;
+bad_flags:
+	ublk_err("vhost: vring %u head %u has wrong buffer direction\n",
+			vq->idx, head);
+ioerr:
+	vhost_req_done(vq, req, VIRTIO_BLK_S_IOERR);
+	return 0;
+}
+
+static void vhost_vq_process(struct vhost_dev *vdev, struct vhost_vq *vq)
+{
+	vq->blocked = false;
+	while (vq->started && vq->enabled) {
+		__u16 avail_idx = le16toh(__atomic_load_n(&vq->avail->idx,
+					__ATOMIC_ACQUIRE));
+		__u16 head;
+		int ret;
+
+		if (vq->last_avail_idx == avail_idx)
+			break;
+
+		head = le16toh(vq->avail->ring[vq->last_avail_idx % vq->num]);
+		if (head >= vq->num) {
+			ublk_err("vhost: vring %u head %u is out of range\n",
+					vq->idx, head);
+			vq->started = false;
+			break;
+		}
+		ret = vhost_req_start(vdev, vq, head);
+		if (ret == -EBUSY) {
+			vq->blocked = true;
+			break;
+		}
+		if (ret) {
+			vq->started = false;
+			break;
+		}
+		vq->last_avail_idx++;
+	}
+}
+
+/* notify the guest once for all completions of this batch */
+static void vhost_notify(struct vhost_dev *vdev)
+{
+	unsigned i;
+
+	/* order used->idx store with avail->flags load */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+	for (i = 0; i < vdev->nr_vqs; i++) {
+		struct vhost_vq *vq = &vdev->vqs[i];
+
+		if (!vq->need_call)
+			continue;
+		vq->need_call = false;
+		if (le16toh(vq->avail->flags) & VHOST_VRING_AVAIL_F_NO_INTERRUPT)
+			continue;
+		if (vq->call_fd >= 0)
+			eventfd_write(vq->call_fd, 1);
+	}
+}
+
+static void vhost_handle_emu(struct vhost_dev *vdev)
+{
+	unsigned i;
+
+	ublksrv_emu_reap(vdev->emu, 0);
+
+	/* tags are freed, so retry vrings which ran out of tags */
+	for (i = 0; i < vdev->nr_vqs; i++)
+		if (vdev->vqs[i].blocked)
+			vhost_vq_process(vdev, &vdev->vqs[i]);
+	ublksrv_emu_submit(vdev->emu);
+	vhost_notify(vdev);
+}
+
+static void vhost_handle_kick(struct vhost_dev *vdev, struct vhost_vq *vq)
+{
+	eventfd_t v;
+
+	if (eventfd_read(vq->kick_fd, &v) < 0)
+		return;
+	vhost_vq_process(vdev, vq);
+	ublksrv_emu_submit(vdev->emu);
+	vhost_notify(vdev);
+}
+
+/* wait until all requests of 'vq' are completed, or all if vq is NULL */
+static void vhost_drain(struct vhost_dev *vdev, struct vhost_vq *vq)
+{
+	ublksrv_emu_submit(vdev->emu);
+	while (vq ? vq->inflight : vdev->inflight)
+		if (ublksrv_emu_reap(vdev->emu, 100) < 0)
+			break;
+	vhost_notify(vdev);
+}
+
+static int vhost_vq_map(struct vhost_dev *vdev, struct vhost_vq *vq)
+{
+	unsigned num = vq->num;
+
+	vq->desc = (struct vhost_vring_desc *)vhost_uva_to_va(vdev,
+			vq->addr.desc_user_addr, sizeof(struct vhost_vring_desc) * num);
+	vq->avail = (struct vhost_vring_avail *)vhost_uva_to_va(vdev,
+			vq->addr.avail_user_addr,
+			sizeof(struct vhost_vring_avail) + sizeof(__u16) * num);
+	vq->used = (struct vhost_vring_used *)vhost_uva_to_va(vdev,
+			vq->addr.used_user_addr, sizeof(struct vhost_vring_used) +
+			sizeof(struct vhost_vring_used_elem) * num);
+
+	if (!vq->desc || !vq->avail || !vq->used) {
+		ublk_err("vhost: vring %u address isn't mapped\n", vq->idx);
+		return -EFAULT;
+	}
+	return 0;
+}
+
+static int vhost_vq_alloc_reqs(struct vhost_dev *vdev, struct vhost_vq *vq)
+{
+	unsigned i;
+
+	if (vq->nr_reqs == vq->num)
+		return 0;
+
+	free(vq->reqs);
+	free(vq->iovs);
+	vq->nr_reqs = 0;
+	vq->reqs = (struct vhost_req *)calloc(vq->num, sizeof(*vq->reqs));
+	vq->iovs = (struct iovec *)calloc((size_t)vq->num * vdev->max_iov,
+			sizeof(*vq->iovs));
+	if (!vq->reqs || !vq->iovs)
+		return -ENOMEM;
+
+	for (i = 0; i < vq->num; i++) {
+		vq->reqs[i].vq = vq;
+		vq->reqs[i].iov = &vq->iovs[(size_t)i * vdev->max_iov];
+	}
+	vq->nr_reqs = vq->num;
+	return 0;
+}
+
+/* the vring is started when its kick fd is received */
+static int vhost_vq_start(struct vhost_dev *vdev, struct vhost_vq *vq)
+{
+	struct epoll_event ev = {
+		.events = EPOLLIN,
+		.data = { .u64 = vq->idx },
+	};
+	int ret;
+
+	if (!vq->num || vq->kick_fd < 0)
+		return -EINVAL;
+
+	ret = vhost_vq_map(vdev, vq);
+	if (!ret)
+		ret = vhost_vq_alloc_reqs(vdev, vq);
+	if (ret)
+		return ret;
+
+	if (epoll_ctl(vdev->epoll_fd, EPOLL_CTL_ADD, vq->kick_fd, &ev) < 0)
+		return -errno;
+
+	vq->used_idx = le16toh(vq->used->idx);
+	vq->started = true;
+	vhost_vq_process(vdev, vq);
+	ublksrv_emu_submit(vdev->emu);
+	return 0;
+}
+
+static void vhost_vq_stop(struct vhost_dev *vdev, struct vhost_vq *vq)
+{
+	if (vq->kick_fd >= 0) {
+		epoll_ctl(vdev->epoll_fd, EPOLL_CTL_DEL, vq->kick_fd, NULL);
+		close(vq->kick_fd);
+		vq->kick_fd = -1;
+	}
+	if (!vq->started)
+		return;
+
+	vq->started = false;
+	vq->blocked = false;
+	vhost_drain(vdev, vq);
+}
+
+static void vhost_vq_reset(struct vhost_dev *vdev, struct vhost_vq *vq)
+{
+	unsigned idx = vq->idx;
+
+	vhost_vq_stop(vdev, vq);
+	if (vq->call_fd >= 0)
+		close(vq->call_fd);
+	free(vq->reqs);
+	free(vq->iovs);
+
+	memset(vq, 0, sizeof(*vq));
+	vq->vdev = vdev;
+	vq->idx = idx;
+	vq->kick_fd = -1;
+	vq->call_fd = -1;
+	vq->enabled = true;
+}
+
+/* called when the frontend is gone, so the next one starts clean */
+static void vhost_reset(struct vhost_dev *vdev)
+{
+	unsigned i;
+
+	for (i = 0; i < vdev->nr_vqs; i++)
+		vhost_vq_stop(vdev, &vdev->vqs[i]);
+	vhost_drain(vdev, NULL);
+	for (i = 0; i < vdev->nr_vqs; i++)
+		vhost_vq_reset(vdev, &vdev->vqs[i]);
+	vhost_unmap_mem(vdev);
+	vdev->features = 0;
+	vdev->protocol_features = 0;
+}
+
+static int vhost_set_mem_table(struct vhost_dev *vdev,
+		const struct vhost_user_memory *mem, int *fds, int nr_fds)
+{
+	unsigned i;
+	int ret = 0;
+
+	if (mem->nregions > VHOST_USER_MAX_RAM_SLOTS ||
+			mem->nregions != (unsigned)nr_fds)
+		return -EINVAL;
+
+	/* in-flight requests point to the old mapping */
+	vhost_drain(vdev, NULL);
+	vhost_unmap_mem(vdev);
+
+	for (i = 0; i < mem->nregions; i++) {
+		const struct vhost_user_mem_region *m = &mem->regions[i];
+		struct vhost_region *r = &vdev->regions[vdev->nr_regions];
+		size_t size = m->memory_size + m->mmap_offset;
+		void *addr;
+
+		addr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED,
+				fds[i], 0);
+		close(fds[i]);
+		fds[i] = -1;
+		if (addr == MAP_FAILED) {
+			ret = -errno;
+			ublk_err("vhost: mmap region %u failed %s\n", i,
+					strerror(-ret));
+			/*
+			 * fail the whole table, the rest fds are closed by
+			 * caller, and vrings can't be mapped any more
+			 */
+			vhost_unmap_mem(vdev);
+			break;
+		}
+		r->gpa = m->guest_phys_addr;
+		r->uva = m->userspace_addr;
+		r->size = m->memory_size;
+		r->mmap_addr = addr;
+		r->mmap_size = size;
+		r->hva = (char *)addr + m->mmap_offset;
+		vdev->nr_regions++;
+	}
+
+	/* vrings may live in regions which are just remapped */
+	for (i = 0; i < vdev->nr_vqs; i++) {
+		struct vhost_vq *vq = &vdev->vqs[i];
+
+		if (vq->started && vhost_vq_map(vdev, vq))
+			vq->started = false;
+	}
+	return ret;
+}
+
+static struct vhost_vq *vhost_get_vq(struct vhost_dev *vdev, unsigned idx)
+{
+	if (idx >= vdev->nr_vqs) {
+		ublk_err("vhost: vring %u doesn't exist\n", idx);
+		return NULL;
+	}
+	return &vdev->vqs[idx];
+}
+
+static void vhost_set_features(struct vhost_dev *vdev, __u64 features)
+{
+	unsigned i;
+
+	vdev->features = features;
+
+	/* vrings start disabled if protocol features are negotiated */
+	for (i = 0; i < vdev->nr_vqs; i++)
+		vdev->vqs[i].enabled = !(features &
+				(1ULL << VHOST_USER_F_PROTOCOL_FEATURES));
+}
+
+static int vhost_handle_vring_fd(struct vhost_dev *vdev,
+		struct vhost_user_msg *msg, int *fds, int nr_fds)
+{
+	struct vhost_vq *vq;
+	int fd = -1;
+
+	vq = vhost_get_vq(vdev, msg->payload.u64 & VHOST_USER_VRING_IDX_MASK);
+	if (!vq)
+		return -EINVAL;
+
+	if (!(msg->payload.u64 & VHOST_USER_VRING_NOFD_MASK)) {
+		if (nr_fds != 1)
+			return -EINVAL;
+		fd = fds[0];
+		fds[0] = -1;
+	}
+
+	switch (msg->request) {
+	case VHOST_USER_SET_VRING_KICK:
+		vhost_vq_stop(vdev, vq);
+		vq->kick_fd = fd;
+		if (fd < 0) {
+			ublk_err("vhost: polling vring %u isn't supported\n",
+					vq->idx);
+			return -EOPNOTSUPP;
+		}
+		return vhost_vq_start(vdev, vq);
+	case VHOST_USER_SET_VRING_CALL:
+		if (vq->call_fd >= 0)
+			close(vq->call_fd);
+		vq->call_fd = fd;
+		break;
+	default:
+		/* vring errors aren't reported */
+		if (fd >= 0)
+			close(fd);
+	}
+	return 0;
+}
+
+/*
+ * Handle one message, 'msg' is reused for reply. fds taken by handler
+ * are set as -1, and the others are closed by caller.
+ */
+static int vhost_handle_msg(struct vhost_dev *vdev, struct vhost_user_msg *msg,
+		int *fds, int nr_fds)
+{
+	struct vhost_user_config *cfg = &msg->payload.config;
+	struct vhost_vq *vq;
+	bool reply = false;
+	int ret = 0;
+
+	switch (msg->request) {
+	case VHOST_USER_GET_FEATURES:
+		msg->payload.u64 = vdev->avail_features;
+		msg->size = sizeof(msg->payload.u64);
+		reply = true;
+		break;
+	case VHOST_USER_SET_FEATURES:
+		if (msg->payload.u64 & ~vdev->avail_features)
+			ret = -EINVAL;
+		else
+			vhost_set_features(vdev, msg->payload.u64);
+		break;
+	case VHOST_USER_SET_OWNER:
+		break;
+	case VHOST_USER_RESET_OWNER:
+		vhost_reset(vdev);
+		break;
+	case VHOST_USER_SET_MEM_TABLE:
+		ret = vhost_set_mem_table(vdev, &msg->payload.memory, fds,
+				nr_fds);
+		break;
+	case VHOST_USER_GET_PROTOCOL_FEATURES:
+		msg->payload.u64 = VHOST_PROTOCOL_FEATURES;
+		msg->size = sizeof(msg->payload.u64);
+		reply = true;
+		break;
+	case VHOST_USER_SET_PROTOCOL_FEATURES:
+		vdev->protocol_features = msg->payload.u64 &
+			VHOST_PROTOCOL_FEATURES;
+		break;
+	case VHOST_USER_GET_QUEUE_NUM:
+		msg->payload.u64 = vdev->nr_vqs;
+		msg->size = sizeof(msg->payload.u64);
+		reply = true;
+		break;
+	case VHOST_USER_SET_VRING_NUM:
+		vq = vhost_get_vq(vdev, msg->payload.state.index);
+		if (!vq || vq->started || !msg->payload.state.num ||
+				msg->payload.state.num > VHOST_MAX_VRING_NUM ||
+				(msg->payload.state.num &
+				 (msg->payload.state.num - 1)))
+			ret = -EINVAL;
+		else
+			vq->num = msg->payload.state.num;
+		break;
+	case VHOST_USER_SET_VRING_ADDR:
+		vq = vhost_get_vq(vdev, msg->payload.addr.index);
+		if (!vq)
+			ret = -EINVAL;
+		else {
+			vq->addr = msg->payload.addr;
+			if (vq->started)
+				ret = vhost_vq_map(vdev, vq);
+		}
+		break;
+	case VHOST_USER_SET_VRING_BASE:
+		vq = vhost_get_vq(vdev, msg->payload.state.index);
+		if (!vq || vq->started)
+			ret = -EINVAL;
+		else
+			vq->last_avail_idx = msg->payload.state.num;
+		break;
+	case VHOST_USER_GET_VRING_BASE:
+		vq = vhost_get_vq(vdev, msg->payload.state.index);
+		if (vq) {
+			vhost_vq_stop(vdev, vq);
+			msg->payload.state.num = vq->last_avail_idx;
+		} else
+			msg->payload.state.num = 0;
+		msg->size = sizeof(msg->payload.state);
+		reply = true;
+		break;
+	case VHOST_USER_SET_VRING_KICK:
+	case VHOST_USER_SET_VRING_CALL:
+	case VHOST_USER_SET_VRING_ERR:
+		ret = vhost_handle_vring_fd(vdev, msg, fds, nr_fds);
+		break;
+	case VHOST_USER_SET_VRING_ENABLE:
+		vq = vhost_get_vq(vdev, msg->payload.state.index);
+		if (!vq)
+			ret = -EINVAL;
+		else {
+			vq->enabled = msg->payload.state.num;
+			vhost_vq_process(vdev, vq);
+			ublksrv_emu_submit(vdev->emu);
+		}
+		break;
+	case VHOST_USER_GET_CONFIG:
+		if (cfg->size > VHOST_USER_MAX_CONFIG_SIZE ||
+				cfg->offset > sizeof(vdev->config) ||
+				cfg->size > sizeof(vdev->config) - cfg->offset) {
+			cfg->size = 0;
+		} else
+			memcpy(cfg->region, (char *)&vdev->config + cfg->offset,
+					cfg->size);
+		msg->size = offsetof(struct vhost_user_config, region) +
+			cfg->size;
+		reply = true;
+		break;
+	case VHOST_USER_SET_CONFIG:
+		/* nothing in config space is writable */
+		break;
+	default:
+		ublk_err("vhost: request %u isn't supported\n", msg->request);
+		ret = -EOPNOTSUPP;
+	}
+
+	if (!reply) {
+		if (!(msg->flags & VHOST_USER_NEED_REPLY_MASK) ||
+				!(vdev->protocol_features &
+				  (1ULL << VHOST_USER_PROTOCOL_F_REPLY_ACK)))
+			return 0;
+		msg->payload.u64 = ret ? 1 : 0;
+		msg->size = sizeof(msg->payload.u64);
+	}
+	msg->flags = VHOST_USER_VERSION | VHOST_USER_REPLY_MASK;
+	return vhost_user_send(vdev->conn_fd, msg, NULL, 0);
+}
+
+static void vhost_disconnect(struct vhost_dev *vdev)
+{
+	ublk_log("vhost: frontend disconnected\n");
+
+	vhost_reset(vdev);
+	epoll_ctl(vdev->epoll_fd, EPOLL_CTL_DEL, vdev->conn_fd, NULL);
+	close(vdev->conn_fd);
+	vdev->conn_fd = -1;
+}
+
+static void vhost_handle_conn(struct vhost_dev *vdev)
+{
+	struct vhost_user_msg msg;
+	int fds[VHOST_USER_MAX_RAM_SLOTS];
+	int nr_fds = VHOST_USER_MAX_RAM_SLOTS;
+	int i, ret;
+
+	ret = vhost_user_recv(vdev->conn_fd, &msg, fds, &nr_fds);
+	if (!ret)
+		ret = vhost_handle_msg(vdev, &msg, fds, nr_fds);
+
+	for (i = 0; i < nr_fds; i++)
+		if (fds[i] >= 0)
+			close(fds[i]);
+
+	if (ret)
+		vhost_disconnect(vdev);
+}
+
+static void vhost_handle_accept(struct vhost_dev *vdev)
+{
+	struct epoll_event ev = {
+		.events = EPOLLIN,
+		.data = { .u64 = VHOST_EV_CONN },
+	};
+	int fd = accept4(vdev->listen_fd, NULL, NULL, SOCK_CLOEXEC);
+
+	if (fd < 0)
+		return;
+
+	/* one frontend is served at a time */
+	if (vdev->conn_fd >= 0) {
+		close(fd);
+		return;
+	}
+
+	vdev->conn_fd = fd;
+	if (epoll_ctl(vdev->epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+		close(fd);
+		vdev->conn_fd = -1;
+		return;
+	}
+	ublk_log("vhost: frontend connected on %s\n", vdev->path);
+}
+
+static int vhost_add_fd(struct vhost_dev *vdev, int fd, __u64 data)
+{
+	struct epoll_event ev = {
+		.events = EPOLLIN,
+		.data = { .u64 = data },
+	};
+
+	if (epoll_ctl(vdev->epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0)
+		return -errno;
+	return 0;
+}
+
+static int vhost_listen(struct vhost_dev *vdev)
+{
+	struct sockaddr_un addr = {
+		.sun_family = AF_UNIX,
+	};
+
+	if (strlen(vdev->path) >= sizeof(addr.sun_path))
+		return -ENAMETOOLONG;
+	strcpy(addr.sun_path, vdev->path);
+
+	vdev->listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (vdev->listen_fd < 0)
+		return -errno;
+
+	unlink(vdev->path);
+	if (bind(vdev->listen_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+			listen(vdev->listen_fd, 1) < 0)
+		return -errno;
+	return 0;
+}
+
+static void vhost_run(struct vhost_dev *vdev)
+{
+	struct epoll_event evs[16];
+	int i, n;
+
+	while (!vdev->stop) {
+		n = epoll_wait(vdev->epoll_fd, evs, 16, -1);
+		if (n < 0 && errno != EINTR)
+			break;
+
+		for (i = 0; i < n; i++) {
+			__u64 data = evs[i].data.u64;
+
+			if (data == VHOST_EV_LISTEN)
+				vhost_handle_accept(vdev);
+			else if (data == VHOST_EV_CONN)
+				vhost_handle_conn(vdev);
+			else if (data == VHOST_EV_EMU)
+				vhost_handle_emu(vdev);
+			else if (data == VHOST_EV_SIGNAL)
+				vdev->stop = true;
+			else if (data < vdev->nr_vqs &&
+					vdev->vqs[data].kick_fd >= 0)
+				vhost_handle_kick(vdev, &vdev->vqs[data]);
+		}
+	}
+}
+
+/* virtio-blk features and config space follow ublk params of the target */
+static int vhost_setup_blk(struct vhost_dev *vdev, const struct ublksrv_dev *dev)
+{
+	const struct ublksrv_ctrl_dev *cdev = ublksrv_get_ctrl_dev(dev);
+	struct virtio_blk_config *c = &vdev->config;
+	unsigned seg_max = vdev->info->max_io_buf_bytes / VHOST_SEG_SIZE;
+	struct ublk_params p = {0};
+	unsigned lbs_shift = 9;
+
+	vdev->capacity = dev->tgt.dev_size >> 9;
+	vdev->max_iov = seg_max + VHOST_MAX_IOV_EXTRA;
+	vdev->avail_features = (1ULL << VIRTIO_F_VERSION_1) |
+		(1ULL << VHOST_USER_F_PROTOCOL_FEATURES) |
+		(1ULL << VHOST_RING_F_INDIRECT_DESC) |
+		(1ULL << VIRTIO_BLK_F_SIZE_MAX) |
+		(1ULL << VIRTIO_BLK_F_SEG_MAX) |
+		(1ULL << VIRTIO_BLK_F_BLK_SIZE) |
+		(1ULL << VIRTIO_BLK_F_TOPOLOGY) |
+		(1ULL << VIRTIO_BLK_F_MQ);
+
+	if (ublk_json_read_params(&p, cdev) < 0)
+		p.types = 0;
+
+	if (p.types & UBLK_PARAM_TYPE_BASIC) {
+		lbs_shift = p.basic.logical_bs_shift;
+		if (p.basic.attrs & UBLK_ATTR_READ_ONLY)
+			vdev->avail_features |= 1ULL << VIRTIO_BLK_F_RO;
+		if (p.basic.attrs & UBLK_ATTR_VOLATILE_CACHE)
+			vdev->avail_features |= 1ULL << VIRTIO_BLK_F_FLUSH;
+		if (p.basic.physical_bs_shift > lbs_shift)
+			c->physical_block_exp = p.basic.physical_bs_shift -
+				lbs_shift;
+	}
+	if ((p.types & UBLK_PARAM_TYPE_DISCARD) &&
+			p.discard.max_discard_sectors) {
+		vdev->avail_features |= 1ULL << VIRTIO_BLK_F_DISCARD;
+		c->max_discard_sectors = htole32(p.discard.max_discard_sectors);
+		c->max_discard_seg = htole32(1);
+		c->discard_sector_alignment =
+			htole32(p.discard.discard_granularity >> 9);
+	}
+	if ((p.types & UBLK_PARAM_TYPE_DISCARD) &&
+			p.discard.max_write_zeroes_sectors) {
+		vdev->avail_features |= 1ULL << VIRTIO_BLK_F_WRITE_ZEROES;
+		c->max_write_zeroes_sectors =
+			htole32(p.discard.max_write_zeroes_sectors);
+		c->max_write_zeroes_seg = htole32(1);
+	}
+
+	/* one request never exceeds the io buffer of ublk */
+	c->capacity = htole64(vdev->capacity);
+	c->size_max = htole32(VHOST_SEG_SIZE);
+	c->seg_max = htole32(seg_max);
+	c->blk_size = htole32(1U << lbs_shift);
+	c->min_io_size = htole16(1);
+	c->num_queues = htole16(vdev->nr_vqs);
+
+	vdev->vqs = (struct vhost_vq *)calloc(vdev->nr_vqs, sizeof(*vdev->vqs));
+	if (!vdev->vqs)
+		return -ENOMEM;
+	for (unsigned i = 0; i < vdev->nr_vqs; i++) {
+		vdev->vqs[i].idx = i;
+		vdev->vqs[i].vdev = vdev;
+		vdev->vqs[i].kick_fd = -1;
+		vdev->vqs[i].call_fd = -1;
+		vdev->vqs[i].enabled = true;
+	}
+	return 0;
+}
+
+int ublksrv_cmd_vhost(const struct ublksrv_tgt_type *tgt_type, int argc,
+		char *argv[])
+{
+	static const struct option longopts[] = {
+		{ "type",		1,	NULL, 't' },
+		{ "queues",		1,	NULL, 'q' },
+		{ "depth",		1,	NULL, 'd' },
+		{ "socket",		1,	NULL, 's' },
+		{ "max_io_buf_bytes",	1,	NULL, 'm' },
+		{ NULL }
+	};
+	struct ublksrv_dev_data data = {0};
+	struct vhost_dev vdev = {0};
+	struct vhost_queue_info *info_array = NULL;
+	const struct ublksrv_dev *dev = NULL;
+	sigset_t mask;
+	int opt, i, ret;
+
+	data.dev_id = -1;
+	data.nr_hw_queues = DEF_NR_HW_QUEUES;
+	data.queue_depth = DEF_QD;
+	data.max_io_buf_bytes = DEF_BUF_SIZE;
+
+	optind = 0;
+	while ((opt = getopt_long(argc, argv, "-:t:q:d:",
+				  longopts, NULL)) != -1) {
+		switch (opt) {
+		case 't':
+			data.tgt_type = optarg;
+			break;
+		case 'q':
+			data.nr_hw_queues = strtol(optarg, NULL, 10);
+			break;
+		case 'd':
+			data.queue_depth = strtol(optarg, NULL, 10);
+			break;
+		case 's':
+			vdev.path = optarg;
+			break;
+		case 'm':
+			data.max_io_buf_bytes = strtoul(optarg, NULL, 10);
+			break;
+		}
+	}
+	optind = 0;
+
+	if (!vdev.path) {
+		fprintf(stderr, "vhost: --socket PATH is required\n");
+		return -EINVAL;
+	}
+	if (data.tgt_type && strcmp(data.tgt_type, tgt_type->name) &&
+			strcmp(data.tgt_type, "delay")) {
+		fprintf(stderr, "Wrong tgt_type specified\n");
+		return -EINVAL;
+	}
+	if (data.max_io_buf_bytes < VHOST_SEG_SIZE) {
+		fprintf(stderr, "max_io_buf_bytes is too small\n");
+		return -EINVAL;
+	}
+
+	data.tgt_type = tgt_type->name;
+	data.tgt_ops = tgt_type;
+	/* guest memory is copied by the emulated driver */
+	data.flags = tgt_type->ublk_flags & ~(UBLK_F_SUPPORT_ZERO_COPY |
+			UBLK_F_AUTO_BUF_REG);
+	data.ublksrv_flags = tgt_type->ublksrv_flags;
+	data.tgt_argc = argc;
+	data.tgt_argv = argv;
+
+	vdev.listen_fd = vdev.conn_fd = vdev.epoll_fd = vdev.sig_fd = -1;
+	vdev.nr_vqs = data.nr_hw_queues;
+
+	/* queue threads inherit the mask, so signals are handled here */
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGINT);
+	sigaddset(&mask, SIGTERM);
+	pthread_sigmask(SIG_BLOCK, &mask, NULL);
+
+	vdev.emu = ublksrv_emu_init(&data, vhost_emu_done);
+	if (!vdev.emu) {
+		fprintf(stderr, "can't create emulated ublk device\n");
+		return -ENODEV;
+	}
+	vdev.info = ublksrv_ctrl_get_dev_info(ublksrv_emu_get_ctrl_dev(vdev.emu));
+
+	dev = ublksrv_dev_init(ublksrv_emu_get_ctrl_dev(vdev.emu));
+	if (!dev) {
+		fprintf(stderr, "can't init %s target\n", tgt_type->name);
+		ret = -ENODEV;
+		goto out_emu;
+	}
+
+	ret = vhost_setup_blk(&vdev, dev);
+	if (ret)
+		goto out_dev;
+
+	info_array = (struct vhost_queue_info *)calloc(data.nr_hw_queues,
+			sizeof(*info_array));
+	if (!info_array) {
+		ret = -ENOMEM;
+		goto out_dev;
+	}
+	for (i = 0; i < data.nr_hw_queues; i++) {
+		info_array[i].dev = dev;
+		info_array[i].qid = i;
+		pthread_create(&info_array[i].thread, NULL, vhost_queue_fn,
+				&info_array[i]);
+	}
+
+	vdev.epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	vdev.sig_fd = signalfd(-1, &mask, SFD_CLOEXEC);
+	ret = vhost_listen(&vdev);
+	if (!ret && (vdev.epoll_fd < 0 || vdev.sig_fd < 0))
+		ret = -errno;
+	if (!ret)
+		ret = vhost_add_fd(&vdev, vdev.listen_fd, VHOST_EV_LISTEN);
+	if (!ret)
+		ret = vhost_add_fd(&vdev, vdev.sig_fd, VHOST_EV_SIGNAL);
+	if (!ret)
+		ret = vhost_add_fd(&vdev, ublksrv_emu_get_fd(vdev.emu),
+				VHOST_EV_EMU);
+
+	if (ret)
+		fprintf(stderr, "vhost: can't listen on %s: %s\n", vdev.path,
+				strerror(-ret));
+	else {
+		ublk_log("vhost: %s %llu sectors on %s\n", tgt_type->name,
+				vdev.capacity, vdev.path);
+		vhost_run(&vdev);
+	}
+
+	if (vdev.conn_fd >= 0)
+		vhost_disconnect(&vdev);
+	else
+		vhost_reset(&vdev);
+
+	/* abort fetched commands, and wait until all queues are gone */
+	ublksrv_emu_stop(vdev.emu);
+	while (ublksrv_emu_reap(vdev.emu, 100) != -ENODEV)
+		;
+	for (i = 0; i < data.nr_hw_queues; i++)
+		pthread_join(info_array[i].thread, NULL);
+
+	if (vdev.listen_fd >= 0) {
+		close(vdev.listen_fd);
+		unlink(vdev.path);
+	}
+	if (vdev.sig_fd >= 0)
+		close(vdev.sig_fd);
+	if (vdev.epoll_fd >= 0)
+		close(vdev.epoll_fd);
+	free(info_array);
+out_dev:
+	free(vdev.vqs);
+	ublksrv_dev_deinit(dev);
+out_emu:
+	ublksrv_emu_deinit(vdev.emu);
+	return ret;
+}
@@ -0,0 +1,79 @@
+#!/usr/bin/env python3
+# SPDX-License-Identifier: MIT or GPL-2.0-only
+
+# Compare perf matrix result(written by common/perf_common) with baseline.
+#
+# One point is reported as regression only if the drop of mean iops is
+# beyond both the relative threshold and the noise band, which is
+# SIGMA times the standard error of the difference of the two means, so
+# noisy points don't fail the run while stable points are checked tightly.
+
+import argparse
+import json
+import math
+import sys
+
+KEY = ("target", "mode", "queues", "depth", "bs", "rw", "jobs")
+
+
+def load(path):
+    with open(path) as f:
+        data = json.load(f)
+    return {tuple(r[k] for k in KEY): r for r in data["results"]
+            if r["status"] == "ok"}
+
+
+def std_err(r):
+    n = max(len(r["iops"]), 1)
+    return r["stddev"] / math.sqrt(n)
+
+
+def main():
+    parser = argparse.ArgumentParser(description="compare ublk perf matrix")
+    parser.add_argument("baseline")
+    parser.add_argument("result")
+    parser.add_argument("--min-delta", type=float, default=0.05,
+                        help="relative drop always tolerated (default 0.05)")
+    parser.add_argument("--sigma", type=float, default=3.0,
+                        help="noise band in standard errors (default 3)")
+    args = parser.parse_args()
+
+    base = load(args.baseline)
+    new = load(args.result)
+    nr_regress = 0
+
+    for key in sorted(new.keys(), key=str):
+        name = "{}/{} q{} d{} {}({}) jobs {}".format(*key)
+        if key not in base:
+            print("{}: {:.0f} iops, no baseline".format(name, new[key]["mean"]))
+            continue
+
+        b, n = base[key], new[key]
+        if not b["mean"]:
+            continue
+
+        delta = n["mean"] - b["mean"]
+        noise = args.sigma * math.hypot(std_err(b), std_err(n))
+        limit = max(args.min_delta * b["mean"], noise)
+
+        if delta < -limit:
+            verdict = "REGRESSION"
+            nr_regress += 1
+        elif delta > limit:
+            verdict = "improved"
+        else:
+            verdict = "ok"
+
+        print("{}: {:.0f} -> {:.0f} iops ({:+.1f}%, noise {:.1f}%) {}".format(
+            name, b["mean"], n["mean"], 100.0 * delta / b["mean"],
+            100.0 * limit / b["mean"], verdict))
+
+    for key in sorted(set(base.keys()) - set(new.keys()), key=str):
+        print("{}/{} q{} d{} {}({}) jobs {}: missing in result".format(*key))
+
+    print("{} regression(s) in {} points".format(nr_regress, len(new)))
+    return 1 if nr_regress else 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())